@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains cache of .laz metadata which speeds up getattr() and
+ * avoids re-reading of LAS headers.
+ */
+
+#include "attrcache.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#define ATTRCACHE_BUCKETS 4096
+
+typedef struct attr_entry attr_entry_t;
+struct attr_entry {
+	char *path; /* Full path of the .laz file */
+	ino_t ino;
+	off_t lazsize;
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t size; /* Decompressed size */
+	char hashdr; /* Non-zero if hdr is valid */
+	lasheader_t hdr;
+
+	LIST_ENTRY(attr_entry) link; /* Hash bucket */
+	TAILQ_ENTRY(attr_entry) lru;
+};
+
+struct lazfs_attrcache {
+	pthread_mutex_t lock;
+	unsigned int nentries;
+	unsigned int maxentries;
+	LIST_HEAD(attr_bucket, attr_entry) buckets[ATTRCACHE_BUCKETS];
+	TAILQ_HEAD(attr_lru, attr_entry) lru; /* Most recently used first */
+};
+
+static unsigned int
+attr_hash(const char *path)
+{
+	uint32_t h = 2166136261U; /* FNV-1a */
+
+	while (*path != '\0') {
+		h ^= (unsigned char) *path++;
+		h *= 16777619U;
+	}
+
+	return h % ATTRCACHE_BUCKETS;
+}
+
+static inline int
+attr_tseq(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static inline int
+attr_valid(const attr_entry_t *entry, const struct stat *st)
+{
+	return entry->ino == st->st_ino && entry->lazsize == st->st_size &&
+	       attr_tseq(&entry->mtime, &st->st_mtim) &&
+	       attr_tseq(&entry->ctime, &st->st_ctim);
+}
+
+static void
+attr_entry_destroy(lazfs_attrcache_t *ac, attr_entry_t *entry)
+{
+	LIST_REMOVE(entry, link);
+	TAILQ_REMOVE(&ac->lru, entry, lru);
+	ac->nentries--;
+	free(entry->path);
+	free(entry);
+}
+
+/* Must be called with cache locked */
+static attr_entry_t *
+attr_find(lazfs_attrcache_t *ac, const char *path)
+{
+	attr_entry_t *entry;
+
+	LIST_FOREACH(entry, &ac->buckets[attr_hash(path)], link) {
+		if (strcmp(entry->path, path) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Must be called with cache locked. Returns valid entry or NULL. */
+static attr_entry_t *
+attr_lookup(lazfs_attrcache_t *ac, const char *path, const struct stat *st)
+{
+	attr_entry_t *entry;
+
+	entry = attr_find(ac, path);
+	if (entry == NULL)
+		return NULL;
+
+	if (!attr_valid(entry, st)) {
+		attr_entry_destroy(ac, entry);
+		return NULL;
+	}
+
+	TAILQ_REMOVE(&ac->lru, entry, lru);
+	TAILQ_INSERT_HEAD(&ac->lru, entry, lru);
+
+	return entry;
+}
+
+int
+attrcache_create(lazfs_attrcache_t **acp, unsigned int maxentries)
+{
+	lazfs_attrcache_t *ac;
+	int i, ret;
+
+	assert(acp != NULL && *acp == NULL);
+	assert(maxentries > 0);
+
+	ac = malloc(sizeof(*ac));
+	if (ac == NULL)
+		return -errno;
+
+	memset(ac, 0, sizeof(*ac));
+	ac->maxentries = maxentries;
+	for (i = 0; i < ATTRCACHE_BUCKETS; i++)
+		LIST_INIT(&ac->buckets[i]);
+	TAILQ_INIT(&ac->lru);
+
+	ret = pthread_mutex_init(&ac->lock, NULL);
+	assert(ret == 0); /* This shouldn't fail */
+
+	*acp = ac;
+
+	return 0;
+}
+
+void
+attrcache_destroy(lazfs_attrcache_t **acp)
+{
+	lazfs_attrcache_t *ac;
+	int ret;
+
+	assert(acp != NULL && *acp != NULL);
+
+	ac = *acp;
+	while (!TAILQ_EMPTY(&ac->lru))
+		attr_entry_destroy(ac, TAILQ_FIRST(&ac->lru));
+
+	ret = pthread_mutex_destroy(&ac->lock);
+	assert(ret == 0); /* This shouldn't fail */
+
+	free(ac);
+	*acp = NULL;
+}
+
+int
+attrcache_getsize(lazfs_attrcache_t *ac, const char *path,
+		  const struct stat *st, off_t *size)
+{
+	attr_entry_t *entry;
+
+	assert(ac != NULL);
+	assert(path != NULL);
+	assert(st != NULL);
+	assert(size != NULL);
+
+	LOCK(ac->lock);
+	entry = attr_lookup(ac, path, st);
+	if (entry != NULL)
+		*size = entry->size;
+	UNLOCK(ac->lock);
+
+	return (entry != NULL) ? 0 : -ENOENT;
+}
+
+int
+attrcache_getheader(lazfs_attrcache_t *ac, const char *path,
+		    const struct stat *st, lasheader_t *hdr)
+{
+	attr_entry_t *entry;
+	int ret = -ENOENT;
+
+	assert(ac != NULL);
+	assert(path != NULL);
+	assert(st != NULL);
+	assert(hdr != NULL);
+
+	LOCK(ac->lock);
+	entry = attr_lookup(ac, path, st);
+	if (entry != NULL && entry->hashdr) {
+		*hdr = entry->hdr;
+		ret = 0;
+	}
+	UNLOCK(ac->lock);
+
+	return ret;
+}
+
+void
+attrcache_store(lazfs_attrcache_t *ac, const char *path, const struct stat *st,
+		off_t size, const lasheader_t *hdr)
+{
+	attr_entry_t *entry;
+
+	assert(ac != NULL);
+	assert(path != NULL);
+	assert(st != NULL);
+
+	LOCK(ac->lock);
+
+	entry = attr_find(ac, path);
+	if (entry != NULL) {
+		if (!attr_valid(entry, st))
+			entry->hashdr = 0;
+		TAILQ_REMOVE(&ac->lru, entry, lru);
+	} else {
+		entry = malloc(sizeof(*entry));
+		if (entry == NULL)
+			goto unlock; /* It's only a cache */
+		memset(entry, 0, sizeof(*entry));
+
+		entry->path = strdup(path);
+		if (entry->path == NULL) {
+			free(entry);
+			goto unlock;
+		}
+
+		LIST_INSERT_HEAD(&ac->buckets[attr_hash(path)], entry, link);
+		ac->nentries++;
+	}
+	TAILQ_INSERT_HEAD(&ac->lru, entry, lru);
+
+	entry->ino = st->st_ino;
+	entry->lazsize = st->st_size;
+	entry->mtime = st->st_mtim;
+	entry->ctime = st->st_ctim;
+	entry->size = size;
+	if (hdr != NULL) {
+		entry->hdr = *hdr;
+		entry->hashdr = 1;
+	}
+
+	while (ac->nentries > ac->maxentries)
+		attr_entry_destroy(ac, TAILQ_LAST(&ac->lru, attr_lru));
+
+unlock:
+	UNLOCK(ac->lock);
+}
+
+void
+attrcache_remove(lazfs_attrcache_t *ac, const char *path)
+{
+	attr_entry_t *entry;
+
+	assert(ac != NULL);
+	assert(path != NULL);
+
+	LOCK(ac->lock);
+	entry = attr_find(ac, path);
+	if (entry != NULL)
+		attr_entry_destroy(ac, entry);
+	UNLOCK(ac->lock);
+}
+
+void
+attrcache_clear(lazfs_attrcache_t *ac)
+{
+	assert(ac != NULL);
+
+	LOCK(ac->lock);
+	while (!TAILQ_EMPTY(&ac->lru))
+		attr_entry_destroy(ac, TAILQ_FIRST(&ac->lru));
+	UNLOCK(ac->lock);
+}
+
+unsigned int
+attrcache_count(lazfs_attrcache_t *ac)
+{
+	unsigned int n;
+
+	assert(ac != NULL);
+
+	LOCK(ac->lock);
+	n = ac->nentries;
+	UNLOCK(ac->lock);
+
+	return n;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _ATTRCACHE_H_
+#define _ATTRCACHE_H_
+
+#include "lasheader.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * Cache of metadata of compressed .laz files - decompressed size and LAS
+ * header. Entries are keyed by full backend path and are valid only while
+ * inode, size, mtime and ctime of the .laz file match the cached ones so
+ * caller must always pass fresh lstat() of the file.
+ *
+ * All attrcache_* functions are thread safe and return -errno as errors.
+ */
+
+typedef struct lazfs_attrcache lazfs_attrcache_t;
+
+/* Creates attribute cache holding at most maxentries files */
+int
+attrcache_create(lazfs_attrcache_t **acp, unsigned int maxentries);
+
+/* Destroys attribute cache */
+void
+attrcache_destroy(lazfs_attrcache_t **acp);
+
+/* Looks up decompressed size of path. Returns zero if found. */
+int
+attrcache_getsize(lazfs_attrcache_t *ac, const char *path,
+		  const struct stat *st, off_t *size);
+
+/* Looks up LAS header of path. Returns zero if found. */
+int
+attrcache_getheader(lazfs_attrcache_t *ac, const char *path,
+		    const struct stat *st, lasheader_t *hdr);
+
+/*
+ * Stores decompressed size and optionally header (hdr can be NULL) of path.
+ * Header of unchanged file stored previously is kept when hdr is NULL.
+ */
+void
+attrcache_store(lazfs_attrcache_t *ac, const char *path, const struct stat *st,
+		off_t size, const lasheader_t *hdr);
+
+/* Removes path from the cache */
+void
+attrcache_remove(lazfs_attrcache_t *ac, const char *path);
+
+/* Removes all entries */
+void
+attrcache_clear(lazfs_attrcache_t *ac);
+
+/* Returns number of cached files */
+unsigned int
+attrcache_count(lazfs_attrcache_t *ac);
+
+#endif
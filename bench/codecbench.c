@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains benchmark of the codecs without FUSE. The input .las
+ * file is compressed and decompressed repeatedly by one or more threads,
+ * every thread works with own copy. Results are written as one JSON object
+ * per codec and direction.
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "codec.h"
+#include "lasheader.h"
+#include "stats.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Phases of the codec recorded by compress_laz.c and reorder.c */
+static const lazfs_hist_t phases[] = {
+	STATS_CODEC_HEADER,
+	STATS_CODEC_POINTS,
+	STATS_CODEC_FLUSH,
+	STATS_REORDER,
+};
+
+#define CODECBENCH_NPHASES (sizeof(phases) / sizeof(phases[0]))
+
+typedef enum {
+	CODECBENCH_FILE,	/* Unlinked files in a directory */
+	CODECBENCH_MEMFD	/* Anonymous memory files */
+} codecbench_target_t;
+
+struct codecbench;
+
+typedef struct codecbench_thread {
+	struct codecbench *cb;
+	pthread_t tid;
+	int lasfd;	/* Copy of the input */
+	int lazfd;	/* Compressed copy */
+	int outfd;	/* Decompressed copy */
+	int ret;
+} codecbench_thread_t;
+
+#define CODECBENCH_MAXOPTS 16
+
+typedef struct codecbench {
+	const codec_t *codec;
+	codec_rule_t rule;	/* Options of the codec */
+	codecbench_target_t target;
+	const char *dir;
+	int nthreads;
+	int iterations;
+	char compress;	/* Direction of the current run */
+	pthread_barrier_t barrier;
+	codecbench_thread_t *threads;
+} codecbench_t;
+
+/* Creates empty file on the target, returns fd or -errno */
+static int
+codecbench_open(codecbench_t *cb)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (cb->target == CODECBENCH_MEMFD) {
+#ifdef HAVE_MEMFD_CREATE
+		fd = memfd_create("lazfs-codecbench", 0);
+		return (fd == -1) ? -errno : fd;
+#else
+		return -ENOSYS;
+#endif
+	}
+
+	snprintf(path, sizeof(path), "%s/lazfs-codecbench.XXXXXX", cb->dir);
+	fd = mkstemp(path);
+	if (fd == -1)
+		return -errno;
+	unlink(path);
+
+	return fd;
+}
+
+static void *
+codecbench_thread(void *arg)
+{
+	codecbench_thread_t *t = arg;
+	codecbench_t *cb = t->cb;
+	int i, sfd, dfd;
+
+	sfd = cb->compress ? t->lasfd : t->lazfd;
+	dfd = cb->compress ? t->lazfd : t->outfd;
+
+	pthread_barrier_wait(&cb->barrier);
+
+	for (i = 0; i < cb->iterations && t->ret == 0; i++) {
+		if (lseek(sfd, 0, SEEK_SET) == -1 || ftruncate(dfd, 0) != 0 ||
+		    lseek(dfd, 0, SEEK_SET) == -1) {
+			t->ret = -errno;
+			break;
+		}
+
+		if (cb->compress)
+			t->ret = cb->codec->compress(&cb->rule, sfd, dfd);
+		else
+			t->ret = cb->codec->decompress(&cb->rule, sfd, dfd);
+	}
+
+	pthread_barrier_wait(&cb->barrier);
+
+	return NULL;
+}
+
+/* Runs all threads in one direction, returns wall time in ns or -errno */
+static int64_t
+codecbench_run(codecbench_t *cb, char compress)
+{
+	uint64_t start = 0;
+	int i, err = 0;
+
+	cb->compress = compress;
+
+	pthread_barrier_init(&cb->barrier, NULL, cb->nthreads + 1);
+	for (i = 0; i < cb->nthreads; i++) {
+		cb->threads[i].cb = cb;
+		cb->threads[i].ret = 0;
+		err = pthread_create(&cb->threads[i].tid, NULL,
+				     codecbench_thread, &cb->threads[i]);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	/* Threads wait for the barrier so they start at the same time */
+	pthread_barrier_wait(&cb->barrier);
+	start = stats_now();
+	pthread_barrier_wait(&cb->barrier);
+	start = stats_now() - start;
+
+	for (i = 0; i < cb->nthreads; i++) {
+		pthread_join(cb->threads[i].tid, NULL);
+		if (cb->threads[i].ret != 0)
+			err = cb->threads[i].ret;
+	}
+	pthread_barrier_destroy(&cb->barrier);
+
+	return err ? err : (int64_t) start;
+}
+
+static void
+codecbench_report(codecbench_t *cb, const char *op, uint64_t elapsed,
+		  const lasheader_t *hdr, off_t lassize, off_t lazsize,
+		  const stats_histogram_t *before)
+{
+	stats_histogram_t after;
+	double secs = elapsed / 1e9;
+	double runs = (double) cb->nthreads * cb->iterations;
+	double ms[CODECBENCH_NPHASES];
+	unsigned int i;
+
+	for (i = 0; i < CODECBENCH_NPHASES; i++) {
+		stats_gethist(phases[i], &after);
+		ms[i] = (after.count > before[i].count) ?
+			(after.sum - before[i].sum) / 1e6 /
+			(after.count - before[i].count) : 0;
+	}
+
+	printf("{\"codec\": \"%s\", \"op\": \"%s\", \"target\": \"%s\", "
+	       "\"threads\": %d, \"iterations\": %d, \"points\": %llu, "
+	       "\"las_bytes\": %lld, \"laz_bytes\": %lld, \"seconds\": %.6f, "
+	       "\"points_per_sec\": %.0f, \"mb_per_sec\": %.2f, "
+	       "\"header_ms\": %.3f, \"points_ms\": %.3f, \"flush_ms\": %.3f, "
+	       "\"reorder_ms\": %.3f}\n",
+	       cb->codec->name, op,
+	       cb->target == CODECBENCH_MEMFD ? "memfd" : "file",
+	       cb->nthreads, cb->iterations, (unsigned long long) hdr->npoints,
+	       (long long) lassize, (long long) lazsize, secs,
+	       hdr->npoints * runs / secs,
+	       lassize * runs / secs / (1024 * 1024), ms[0], ms[1], ms[2],
+	       ms[3]);
+	fflush(stdout);
+
+	fprintf(stderr, "%-6s %-10s %12.0f points/s %10.2f MB/s  header %8.3f "
+		"ms  points %10.3f ms  flush %8.3f ms\n", cb->codec->name, op,
+		hdr->npoints * runs / secs, lassize * runs / secs / (1024 * 1024),
+		ms[0], ms[1], ms[2]);
+}
+
+/* Snapshot of the phase histograms before a run */
+static void
+codecbench_snapshot(stats_histogram_t *before)
+{
+	unsigned int i;
+
+	for (i = 0; i < CODECBENCH_NPHASES; i++)
+		stats_gethist(phases[i], &before[i]);
+}
+
+static int
+codecbench_codec(codecbench_t *cb, int infd, const lasheader_t *hdr)
+{
+	stats_histogram_t before[CODECBENCH_NPHASES];
+	struct stat st;
+	off_t lassize;
+	int64_t elapsed;
+	int i, ret = 0;
+
+	lassize = lasheader_lassize(hdr);
+
+	for (i = 0; i < cb->nthreads; i++) {
+		cb->threads[i].lasfd = -1;
+		cb->threads[i].lazfd = -1;
+		cb->threads[i].outfd = -1;
+	}
+
+	for (i = 0; i < cb->nthreads && ret == 0; i++) {
+		codecbench_thread_t *t = &cb->threads[i];
+
+		if ((t->lasfd = codecbench_open(cb)) < 0)
+			ret = t->lasfd;
+		else if ((t->lazfd = codecbench_open(cb)) < 0)
+			ret = t->lazfd;
+		else if ((t->outfd = codecbench_open(cb)) < 0)
+			ret = t->outfd;
+		else
+			ret = lazfs_copyrange(infd, 0, t->lasfd, 0, lassize);
+	}
+	if (ret != 0) {
+		fprintf(stderr, "Can't prepare input: %s\n", strerror(-ret));
+		goto cleanup;
+	}
+
+	codecbench_snapshot(before);
+	elapsed = codecbench_run(cb, 1);
+	if (elapsed < 0) {
+		ret = elapsed;
+		fprintf(stderr, "%s compression failed: %s\n", cb->codec->name,
+			strerror(-ret));
+		goto cleanup;
+	}
+
+	if (fstat(cb->threads[0].lazfd, &st) != 0) {
+		ret = -errno;
+		perror("fstat");
+		goto cleanup;
+	}
+	codecbench_report(cb, "compress", elapsed, hdr, lassize, st.st_size,
+			  before);
+
+	codecbench_snapshot(before);
+	elapsed = codecbench_run(cb, 0);
+	if (elapsed < 0) {
+		ret = elapsed;
+		fprintf(stderr, "%s decompression failed: %s\n",
+			cb->codec->name, strerror(-ret));
+		goto cleanup;
+	}
+	codecbench_report(cb, "decompress", elapsed, hdr, lassize, st.st_size,
+			  before);
+
+	ret = lazfs_cmpfile(cb->threads[0].lasfd, cb->threads[0].outfd);
+	if (ret != 0)
+		fprintf(stderr, "%s: decompressed file differs from input\n",
+			cb->codec->name);
+
+cleanup:
+	for (i = 0; i < cb->nthreads; i++) {
+		if (cb->threads[i].lasfd >= 0)
+			close(cb->threads[i].lasfd);
+		if (cb->threads[i].lazfd >= 0)
+			close(cb->threads[i].lazfd);
+		if (cb->threads[i].outfd >= 0)
+			close(cb->threads[i].outfd);
+	}
+
+	return ret ? -1 : 0;
+}
+
+static void
+codecbench_usage(const char *argv0)
+{
+	const codec_t *codec;
+	unsigned int i;
+
+	fprintf(stderr, "usage: %s [-c codec] [-O name=value] [-j threads] "
+		"[-n iterations] [-t file|memfd] [-d dir] input.las\n"
+		"    -c     codec to run, all by default:", argv0);
+	for (i = 0; (codec = codec_get(i)) != NULL; i++)
+		fprintf(stderr, " %s", codec->name);
+	fprintf(stderr, "\n"
+		"    -O     codec option as in rules file, can be repeated\n"
+		"    -j     number of threads running at once (default 1)\n"
+		"    -n     iterations of every thread (default 3)\n"
+		"    -t     where copies are stored (default file)\n"
+		"    -d     directory of file target (default /tmp)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	codecbench_t cb;
+	lasheader_t hdr;
+	const char *codec = NULL;
+	char *opts[CODECBENCH_MAXOPTS], *value;
+	unsigned int i, j, nopts = 0;
+	int opt, infd, ret, err = 0;
+
+	memset(&cb, 0, sizeof(cb));
+	cb.target = CODECBENCH_FILE;
+	cb.dir = "/tmp";
+	cb.nthreads = 1;
+	cb.iterations = 3;
+
+	while ((opt = getopt(argc, argv, "c:O:j:n:t:d:")) != -1) {
+		switch (opt) {
+		case 'c':
+			codec = optarg;
+			break;
+		case 'O':
+			if (nopts == CODECBENCH_MAXOPTS ||
+			    strchr(optarg, '=') == NULL) {
+				codecbench_usage(argv[0]);
+				return 1;
+			}
+			opts[nopts++] = optarg;
+			break;
+		case 'j':
+			cb.nthreads = atoi(optarg);
+			break;
+		case 'n':
+			cb.iterations = atoi(optarg);
+			break;
+		case 't':
+			if (strcmp(optarg, "file") == 0)
+				cb.target = CODECBENCH_FILE;
+			else if (strcmp(optarg, "memfd") == 0)
+				cb.target = CODECBENCH_MEMFD;
+			else {
+				codecbench_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'd':
+			cb.dir = optarg;
+			break;
+		default:
+			codecbench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc || cb.nthreads < 1 || cb.iterations < 1) {
+		codecbench_usage(argv[0]);
+		return 1;
+	}
+
+	infd = open(argv[optind], O_RDONLY);
+	if (infd == -1) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	ret = lasheader_read(infd, &hdr);
+	if (ret != 0 || hdr.compressed) {
+		fprintf(stderr, "%s: not an uncompressed LAS file\n",
+			argv[optind]);
+		return 1;
+	}
+
+	cb.threads = calloc(cb.nthreads, sizeof(*cb.threads));
+	if (cb.threads == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; codec_get(i) != NULL; i++) {
+		if (codec != NULL && strcmp(codec, codec_get(i)->name) != 0)
+			continue;
+
+		cb.codec = codec_get(i);
+		memset(&cb.rule, 0, sizeof(cb.rule));
+		cb.rule.codec = cb.codec;
+
+		for (j = 0, ret = 0; j < nopts && ret == 0; j++) {
+			value = strchr(opts[j], '=');
+			*value = '\0';
+			ret = (cb.codec->setopt != NULL) ?
+			      cb.codec->setopt(&cb.rule, opts[j], value + 1) :
+			      -EINVAL;
+			if (ret != 0)
+				fprintf(stderr, "%s: option %s: %s\n",
+					cb.codec->name, opts[j], strerror(-ret));
+			*value = '=';
+		}
+
+		if (ret != 0 || codecbench_codec(&cb, infd, &hdr) != 0)
+			err = 1;
+
+		if (cb.rule.opts != NULL)
+			cb.codec->freeopts(cb.rule.opts);
+	}
+
+	if (cb.codec == NULL) {
+		fprintf(stderr, "Unknown codec %s\n", codec);
+		err = 1;
+	}
+
+	free(cb.threads);
+	close(infd);
+
+	return err;
+}
@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains generator of synthetic LAS 1.2 files used by the
+ * benchmark. Points are reproducible for the given seed.
+ */
+
+#include "lasheader.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Tile covers LASGEN_SIZE x LASGEN_SIZE meters, heights are 0 - 100 m */
+#define LASGEN_SIZE 1000.0
+#define LASGEN_HEIGHT 100.0
+#define LASGEN_SCALE 0.01
+#define LASGEN_CLUSTERS 16
+
+/* Points are written in batches of this many */
+#define LASGEN_BATCH 4096
+
+typedef enum {
+	LASGEN_UNIFORM,	/* Uniformly random in the tile */
+	LASGEN_GRID,	/* Regular grid in scan line order */
+	LASGEN_CLUSTER	/* Around a few random centers */
+} lasgen_dist_t;
+
+static const uint16_t reclens[4] = { 20, 28, 26, 34 };
+
+static uint64_t rngstate;
+
+/* xorshift64*, returns number in [0, 1) */
+static double
+lasgen_rand(void)
+{
+	rngstate ^= rngstate >> 12;
+	rngstate ^= rngstate << 25;
+	rngstate ^= rngstate >> 27;
+
+	return (rngstate * 2685821657736338717ULL >> 11) *
+	       (1.0 / 9007199254740992.0);
+}
+
+/* Approximately normally distributed number with mean 0 and deviation 1 */
+static double
+lasgen_gauss(void)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < 12; i++)
+		sum += lasgen_rand();
+
+	return sum - 6;
+}
+
+static void
+setledouble(unsigned char *p, double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof(u));
+	setle64(p, u);
+}
+
+static void
+lasgen_header(unsigned char *buf, uint8_t format, uint64_t npoints,
+	      const double min[3], const double max[3])
+{
+	int i;
+
+	memset(buf, 0, LASHEADER_MINSIZE);
+	memcpy(buf, "LASF", 4);
+	buf[24] = 1;
+	buf[25] = 2;
+	strcpy((char *) buf + 26, "lazfs benchmark");
+	strcpy((char *) buf + 58, "lasgen");
+	setle16(buf + 90, 1);
+	setle16(buf + 92, 2013);
+	setle16(buf + 94, LASHEADER_MINSIZE);
+	setle32(buf + 96, LASHEADER_MINSIZE);
+	buf[104] = format;
+	setle16(buf + 105, reclens[format]);
+	setle32(buf + 107, npoints);
+	/* All points are first returns */
+	setle32(buf + 111, npoints);
+
+	for (i = 0; i < 3; i++) {
+		setledouble(buf + 131 + 8 * i, LASGEN_SCALE);
+		setledouble(buf + 155 + 8 * i, 0);
+		setledouble(buf + 179 + 16 * i, max[i]);
+		setledouble(buf + 187 + 16 * i, min[i]);
+	}
+}
+
+static void
+lasgen_point(unsigned char *p, uint8_t format, uint64_t i, uint64_t side,
+	     lasgen_dist_t dist, const double centers[][2], double pos[3])
+{
+	int32_t ix, iy, iz;
+	double x, y, z;
+	int c;
+
+	switch (dist) {
+	case LASGEN_GRID:
+		x = (i % side + 0.5) * LASGEN_SIZE / side;
+		y = (i / side + 0.5) * LASGEN_SIZE / side;
+		break;
+	case LASGEN_CLUSTER:
+		c = lasgen_rand() * LASGEN_CLUSTERS;
+		x = centers[c][0] + lasgen_gauss() * LASGEN_SIZE / 20;
+		y = centers[c][1] + lasgen_gauss() * LASGEN_SIZE / 20;
+		break;
+	default:
+		x = lasgen_rand() * LASGEN_SIZE;
+		y = lasgen_rand() * LASGEN_SIZE;
+		break;
+	}
+
+	if (x < 0)
+		x = 0;
+	if (x > LASGEN_SIZE)
+		x = LASGEN_SIZE;
+	if (y < 0)
+		y = 0;
+	if (y > LASGEN_SIZE)
+		y = LASGEN_SIZE;
+
+	/* Gently sloped terrain with some noise */
+	z = (x + y) / (2 * LASGEN_SIZE) * LASGEN_HEIGHT * 0.9 +
+	    lasgen_rand() * LASGEN_HEIGHT * 0.1;
+
+	ix = x / LASGEN_SCALE;
+	iy = y / LASGEN_SCALE;
+	iz = z / LASGEN_SCALE;
+	pos[0] = ix * LASGEN_SCALE;
+	pos[1] = iy * LASGEN_SCALE;
+	pos[2] = iz * LASGEN_SCALE;
+
+	memset(p, 0, reclens[format]);
+	setle32(p, ix);
+	setle32(p + 4, iy);
+	setle32(p + 8, iz);
+	setle16(p + 12, 100 + lasgen_rand() * 900);
+	p[14] = 1 | (1 << 3);			/* Return 1 of 1 */
+	p[15] = (lasgen_rand() < 0.7) ? 2 : 5;	/* Ground or high vegetation */
+	p[16] = (int8_t) (lasgen_rand() * 40 - 20);
+	setle16(p + 18, 1);
+
+	if (format == 1 || format == 3)
+		setledouble(p + 20, 1e5 + i * 1e-5);
+	if (format == 2 || format == 3) {
+		p += (format == 2) ? 20 : 28;
+		setle16(p, z / LASGEN_HEIGHT * 65535);
+		setle16(p + 2, x / LASGEN_SIZE * 65535);
+		setle16(p + 4, y / LASGEN_SIZE * 65535);
+	}
+}
+
+static void
+lasgen_usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-f format] [-n points] "
+		"[-d uniform|grid|cluster] [-s seed] output.las\n"
+		"    format is LAS point data format 0 - 3 (default 1)\n"
+		"    points defaults to 1000000\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned char hdr[LASHEADER_MINSIZE];
+	unsigned char *buf;
+	double centers[LASGEN_CLUSTERS][2];
+	double min[3], max[3], pos[3];
+	uint64_t npoints = 1000000, side, i, n;
+	lasgen_dist_t dist = LASGEN_UNIFORM;
+	uint8_t format = 1;
+	FILE *out;
+	int opt, c, k;
+
+	rngstate = 88172645463325252ULL;
+
+	while ((opt = getopt(argc, argv, "f:n:d:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			format = atoi(optarg);
+			if (format > 3) {
+				lasgen_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			npoints = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			if (strcmp(optarg, "uniform") == 0)
+				dist = LASGEN_UNIFORM;
+			else if (strcmp(optarg, "grid") == 0)
+				dist = LASGEN_GRID;
+			else if (strcmp(optarg, "cluster") == 0)
+				dist = LASGEN_CLUSTER;
+			else {
+				lasgen_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			rngstate = strtoull(optarg, NULL, 10) * 2 + 1;
+			break;
+		default:
+			lasgen_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* LAS 1.2 point count is 32bit */
+	if (optind + 1 != argc || npoints > UINT32_MAX) {
+		lasgen_usage(argv[0]);
+		return 1;
+	}
+
+	out = fopen(argv[optind], "w");
+	if (out == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	buf = malloc((size_t) LASGEN_BATCH * reclens[format]);
+	if (buf == NULL) {
+		perror("malloc");
+		fclose(out);
+		return 1;
+	}
+
+	/* Grid has side x side cells, the last rows might be incomplete */
+	for (side = 1; side * side < npoints; side++)
+		;
+
+	for (c = 0; c < LASGEN_CLUSTERS; c++) {
+		centers[c][0] = lasgen_rand() * LASGEN_SIZE;
+		centers[c][1] = lasgen_rand() * LASGEN_SIZE;
+	}
+
+	/* Header is rewritten with the real extent when points are written */
+	for (k = 0; k < 3; k++) {
+		min[k] = 0;
+		max[k] = 0;
+	}
+	lasgen_header(hdr, format, npoints, min, max);
+	if (fwrite(hdr, sizeof(hdr), 1, out) != 1)
+		goto error;
+
+	for (i = 0; i < npoints; i += n) {
+		n = npoints - i;
+		if (n > LASGEN_BATCH)
+			n = LASGEN_BATCH;
+
+		for (c = 0; c < (int) n; c++) {
+			lasgen_point(buf + (size_t) c * reclens[format], format,
+				     i + c, side, dist,
+				     (const double (*)[2]) centers, pos);
+			for (k = 0; k < 3; k++) {
+				if ((i == 0 && c == 0) || pos[k] < min[k])
+					min[k] = pos[k];
+				if ((i == 0 && c == 0) || pos[k] > max[k])
+					max[k] = pos[k];
+			}
+		}
+
+		if (fwrite(buf, reclens[format], n, out) != n)
+			goto error;
+	}
+
+	lasgen_header(hdr, format, npoints, min, max);
+	if (fseek(out, 0, SEEK_SET) != 0 ||
+	    fwrite(hdr, sizeof(hdr), 1, out) != 1)
+		goto error;
+
+	free(buf);
+	if (fclose(out) != 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	return 0;
+
+error:
+	perror(argv[optind]);
+	free(buf);
+	fclose(out);
+	return 1;
+}
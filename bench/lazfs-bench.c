@@ -0,0 +1,679 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains benchmark of mounted lazfs. It copies .las files from
+ * a source directory into the mount and runs scenarios on them, results are
+ * written as one JSON object per scenario and line.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Buffer used for copying and sequential reads */
+#define BENCH_BUFSIZE (1024 * 1024)
+
+/* Random reads are this big */
+#define BENCH_RANDSIZE 4096
+
+/* Size of LAS 1.4 header, header scans read this much */
+#define BENCH_HDRSIZE 375
+
+typedef struct bench_result {
+	pthread_mutex_t lock;
+	uint64_t *lats;		/* Latencies of all operations in ns */
+	size_t nlats;
+	size_t size;
+	uint64_t bytes;
+	uint64_t errors;
+} bench_result_t;
+
+typedef struct bench_files {
+	char **names;
+	size_t n;
+} bench_files_t;
+
+typedef struct bench {
+	const char *mount;
+	const char *src;
+	const char *only;	/* Comma separated scenarios to run or NULL */
+	int threads;
+	int rounds;		/* Repetitions of stat storm */
+	int randreads;		/* Random reads per file */
+	FILE *report;
+	bench_files_t tiles;	/* Large files in tiles/ of the mount */
+	bench_files_t small;	/* Small files in small/ of the mount */
+} bench_t;
+
+typedef struct bench_thread {
+	bench_t *bench;
+	bench_result_t *res;
+	int index;
+} bench_thread_t;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench_record(bench_result_t *res, uint64_t lat, uint64_t bytes, int error)
+{
+	uint64_t *lats;
+
+	pthread_mutex_lock(&res->lock);
+	if (res->nlats == res->size) {
+		res->size = res->size ? 2 * res->size : 1024;
+		lats = realloc(res->lats, res->size * sizeof(*lats));
+		if (lats == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		res->lats = lats;
+	}
+	res->lats[res->nlats++] = lat;
+	res->bytes += bytes;
+	if (error)
+		res->errors++;
+	pthread_mutex_unlock(&res->lock);
+}
+
+static int
+bench_cmplat(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+bench_percentile(const bench_result_t *res, double q)
+{
+	size_t i;
+
+	if (res->nlats == 0)
+		return 0;
+
+	i = q * res->nlats;
+	if (i >= res->nlats)
+		i = res->nlats - 1;
+
+	return res->lats[i] / 1000.0;
+}
+
+static void
+bench_report(bench_t *bench, const char *name, bench_result_t *res,
+	     uint64_t elapsed)
+{
+	double secs = elapsed / 1e9;
+
+	qsort(res->lats, res->nlats, sizeof(*res->lats), bench_cmplat);
+
+	fprintf(bench->report, "{\"scenario\": \"%s\", \"threads\": %d, "
+		"\"ops\": %zu, \"errors\": %llu, \"bytes\": %llu, "
+		"\"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+		"\"mb_per_sec\": %.2f, \"lat_p50_us\": %.1f, "
+		"\"lat_p90_us\": %.1f, \"lat_p99_us\": %.1f, "
+		"\"lat_max_us\": %.1f}\n", name, bench->threads, res->nlats,
+		(unsigned long long) res->errors,
+		(unsigned long long) res->bytes, secs,
+		secs > 0 ? res->nlats / secs : 0,
+		secs > 0 ? res->bytes / secs / (1024 * 1024) : 0,
+		bench_percentile(res, 0.5), bench_percentile(res, 0.9),
+		bench_percentile(res, 0.99), bench_percentile(res, 1));
+	fflush(bench->report);
+
+	fprintf(stderr, "%-12s %8zu ops %6llu errors %10.3f s p50 %10.1f us "
+		"p99 %10.1f us\n", name, res->nlats,
+		(unsigned long long) res->errors, secs,
+		bench_percentile(res, 0.5), bench_percentile(res, 0.99));
+}
+
+/* Copies file, returns number of bytes or -errno */
+static int64_t
+bench_copy(const char *src, const char *dst, char *buf)
+{
+	int64_t total = 0;
+	ssize_t len;
+	int sfd, dfd, err = 0;
+
+	sfd = open(src, O_RDONLY);
+	if (sfd == -1)
+		return -errno;
+
+	dfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dfd == -1) {
+		err = -errno;
+		close(sfd);
+		return err;
+	}
+
+	while ((len = read(sfd, buf, BENCH_BUFSIZE)) > 0) {
+		if (write(dfd, buf, len) != len) {
+			err = -errno;
+			break;
+		}
+		total += len;
+	}
+	if (len < 0)
+		err = -errno;
+
+	close(sfd);
+	if (close(dfd) != 0 && err == 0)
+		err = -errno;
+
+	return err ? err : total;
+}
+
+/* Reads whole file, returns number of bytes or -errno */
+static int64_t
+bench_readfile(const char *path, char *buf)
+{
+	int64_t total = 0;
+	ssize_t len;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	while ((len = read(fd, buf, BENCH_BUFSIZE)) > 0)
+		total += len;
+	if (len < 0)
+		err = -errno;
+
+	close(fd);
+
+	return err ? err : total;
+}
+
+/* Lists regular files in dir */
+static int
+bench_listdir(const char *dir, bench_files_t *files)
+{
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+	char **names;
+	DIR *d;
+
+	files->names = NULL;
+	files->n = 0;
+
+	d = opendir(dir);
+	if (d == NULL)
+		return -errno;
+
+	while ((de = readdir(d)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		names = realloc(files->names, (files->n + 1) * sizeof(*names));
+		if (names == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		files->names = names;
+		names[files->n] = strdup(de->d_name);
+		if (names[files->n] == NULL) {
+			perror("strdup");
+			exit(1);
+		}
+		files->n++;
+	}
+
+	closedir(d);
+
+	return 0;
+}
+
+/* Copies files from src subdirectory into the same one in the mount */
+static void
+bench_write(bench_t *bench, const char *subdir, bench_files_t *files,
+	    bench_result_t *res)
+{
+	char src[PATH_MAX], dst[PATH_MAX];
+	char *buf;
+	uint64_t start;
+	int64_t ret;
+	size_t i;
+
+	buf = malloc(BENCH_BUFSIZE);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < files->n; i++) {
+		snprintf(src, sizeof(src), "%s/%s/%s", bench->src, subdir,
+			 files->names[i]);
+		snprintf(dst, sizeof(dst), "%s/%s/%s", bench->mount, subdir,
+			 files->names[i]);
+
+		start = bench_now();
+		ret = bench_copy(src, dst, buf);
+		bench_record(res, bench_now() - start, ret > 0 ? ret : 0,
+			     ret < 0);
+	}
+
+	free(buf);
+}
+
+static void
+bench_read(bench_t *bench, const char *subdir, bench_files_t *files,
+	   bench_result_t *res)
+{
+	char path[PATH_MAX];
+	char *buf;
+	uint64_t start;
+	int64_t ret;
+	size_t i;
+
+	buf = malloc(BENCH_BUFSIZE);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < files->n; i++) {
+		snprintf(path, sizeof(path), "%s/%s/%s", bench->mount, subdir,
+			 files->names[i]);
+
+		start = bench_now();
+		ret = bench_readfile(path, buf);
+		bench_record(res, bench_now() - start, ret > 0 ? ret : 0,
+			     ret < 0);
+	}
+
+	free(buf);
+}
+
+/* Reads only the header of every file like catalog tools do */
+static void
+bench_header(bench_t *bench, const char *subdir, bench_files_t *files,
+	     bench_result_t *res)
+{
+	char path[PATH_MAX], buf[BENCH_HDRSIZE];
+	uint64_t start;
+	ssize_t len;
+	size_t i;
+	int fd;
+
+	for (i = 0; i < files->n; i++) {
+		snprintf(path, sizeof(path), "%s/%s/%s", bench->mount, subdir,
+			 files->names[i]);
+
+		start = bench_now();
+		len = -1;
+		fd = open(path, O_RDONLY);
+		if (fd != -1) {
+			len = pread(fd, buf, sizeof(buf), 0);
+			close(fd);
+		}
+		bench_record(res, bench_now() - start, len > 0 ? len : 0,
+			     len <= 0);
+	}
+}
+
+/* Random reads of every tile, latency of every read is recorded */
+static void
+bench_random(bench_t *bench, bench_result_t *res)
+{
+	char path[PATH_MAX], buf[BENCH_RANDSIZE];
+	struct stat st;
+	unsigned int seed = 1;
+	uint64_t start;
+	ssize_t len;
+	off_t off;
+	size_t i;
+	int fd, r;
+
+	for (i = 0; i < bench->tiles.n; i++) {
+		snprintf(path, sizeof(path), "%s/tiles/%s", bench->mount,
+			 bench->tiles.names[i]);
+
+		fd = open(path, O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) != 0 ||
+		    st.st_size < BENCH_RANDSIZE) {
+			bench_record(res, 0, 0, 1);
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+
+		for (r = 0; r < bench->randreads; r++) {
+			off = (off_t) ((double) rand_r(&seed) / RAND_MAX *
+				       (st.st_size - BENCH_RANDSIZE));
+			start = bench_now();
+			len = pread(fd, buf, sizeof(buf), off);
+			bench_record(res, bench_now() - start,
+				     len > 0 ? len : 0, len <= 0);
+		}
+
+		close(fd);
+	}
+}
+
+/* Every thread reads the first tile at once */
+static void *
+bench_parallelthread(void *arg)
+{
+	bench_thread_t *t = arg;
+	char path[PATH_MAX];
+	char *buf;
+	uint64_t start;
+	int64_t ret;
+
+	buf = malloc(BENCH_BUFSIZE);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	snprintf(path, sizeof(path), "%s/tiles/%s", t->bench->mount,
+		 t->bench->tiles.names[0]);
+
+	start = bench_now();
+	ret = bench_readfile(path, buf);
+	bench_record(t->res, bench_now() - start, ret > 0 ? ret : 0, ret < 0);
+
+	free(buf);
+
+	return NULL;
+}
+
+static void
+bench_statfiles(bench_thread_t *t, const char *subdir, bench_files_t *files)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t start;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < files->n; i++) {
+		snprintf(path, sizeof(path), "%s/%s/%s", t->bench->mount,
+			 subdir, files->names[i]);
+
+		start = bench_now();
+		ret = stat(path, &st);
+		bench_record(t->res, bench_now() - start, 0, ret != 0);
+	}
+}
+
+/* Every thread stats all files repeatedly like ls -l or file managers do */
+static void *
+bench_statthread(void *arg)
+{
+	bench_thread_t *t = arg;
+	int r;
+
+	for (r = 0; r < t->bench->rounds; r++) {
+		bench_statfiles(t, "tiles", &t->bench->tiles);
+		bench_statfiles(t, "small", &t->bench->small);
+	}
+
+	return NULL;
+}
+
+static void
+bench_threads(bench_t *bench, void *(*routine)(void *), bench_result_t *res)
+{
+	pthread_t *tids;
+	bench_thread_t *args;
+	int i;
+
+	tids = malloc(bench->threads * sizeof(*tids));
+	args = malloc(bench->threads * sizeof(*args));
+	if (tids == NULL || args == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < bench->threads; i++) {
+		args[i].bench = bench;
+		args[i].res = res;
+		args[i].index = i;
+		if (pthread_create(&tids[i], NULL, routine, &args[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < bench->threads; i++)
+		pthread_join(tids[i], NULL);
+
+	free(args);
+	free(tids);
+}
+
+/* Returns non-zero if scenario was selected by -S */
+static int
+bench_selected(bench_t *bench, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (bench->only == NULL)
+		return 1;
+
+	for (p = bench->only; (p = strstr(p, name)) != NULL; p += len) {
+		if ((p == bench->only || p[-1] == ',') &&
+		    (p[len] == '\0' || p[len] == ','))
+			return 1;
+	}
+
+	return 0;
+}
+
+typedef enum {
+	BENCH_WRITE,
+	BENCH_SMALL_WRITE,
+	BENCH_COLD_READ,
+	BENCH_HEADER,
+	BENCH_RANDOM,
+	BENCH_SMALL_READ,
+	BENCH_PARALLEL,
+	BENCH_STAT,
+	BENCH_NSCENARIOS
+} bench_scenario_t;
+
+static const char *scenarios[BENCH_NSCENARIOS] = {
+	"write",
+	"small_write",
+	"cold_read",
+	"header",
+	"random",
+	"small_read",
+	"parallel",
+	"stat",
+};
+
+/* Drops attributes cached by lazfs so every scenario starts cold */
+static void
+bench_drop(bench_t *bench)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/.lazfs/ctl", bench->mount);
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return;
+
+	if (write(fd, "drop\n", 5) != 5)
+		perror(path);
+	close(fd);
+}
+
+static void
+bench_run(bench_t *bench, bench_scenario_t scenario)
+{
+	bench_result_t res;
+	uint64_t start;
+
+	memset(&res, 0, sizeof(res));
+	pthread_mutex_init(&res.lock, NULL);
+	bench_drop(bench);
+
+	start = bench_now();
+	switch (scenario) {
+	case BENCH_WRITE:
+		bench_write(bench, "tiles", &bench->tiles, &res);
+		break;
+	case BENCH_SMALL_WRITE:
+		bench_write(bench, "small", &bench->small, &res);
+		break;
+	case BENCH_COLD_READ:
+		bench_read(bench, "tiles", &bench->tiles, &res);
+		break;
+	case BENCH_HEADER:
+		bench_header(bench, "tiles", &bench->tiles, &res);
+		bench_header(bench, "small", &bench->small, &res);
+		break;
+	case BENCH_RANDOM:
+		bench_random(bench, &res);
+		break;
+	case BENCH_SMALL_READ:
+		bench_read(bench, "small", &bench->small, &res);
+		break;
+	case BENCH_PARALLEL:
+		if (bench->tiles.n > 0)
+			bench_threads(bench, bench_parallelthread, &res);
+		break;
+	case BENCH_STAT:
+		bench_threads(bench, bench_statthread, &res);
+		break;
+	default:
+		break;
+	}
+
+	bench_report(bench, scenarios[scenario], &res, bench_now() - start);
+
+	free(res.lats);
+	pthread_mutex_destroy(&res.lock);
+}
+
+static void
+bench_usage(const char *argv0)
+{
+	int i;
+
+	fprintf(stderr, "usage: %s -m mountdir -s srcdir [-t threads] "
+		"[-r rounds] [-R randreads] [-S scenario,...] [-o report]\n"
+		"    srcdir contains .las files in tiles/ and small/, they are "
+		"copied into\n    the same directories in mountdir\n"
+		"    scenarios:", argv0);
+	for (i = 0; i < BENCH_NSCENARIOS; i++)
+		fprintf(stderr, " %s", scenarios[i]);
+	fprintf(stderr, "\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[PATH_MAX];
+	bench_t bench;
+	const char *report = NULL;
+	int opt, i;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.threads = 8;
+	bench.rounds = 10;
+	bench.randreads = 1000;
+
+	while ((opt = getopt(argc, argv, "m:s:t:r:R:S:o:")) != -1) {
+		switch (opt) {
+		case 'm':
+			bench.mount = optarg;
+			break;
+		case 's':
+			bench.src = optarg;
+			break;
+		case 't':
+			bench.threads = atoi(optarg);
+			break;
+		case 'r':
+			bench.rounds = atoi(optarg);
+			break;
+		case 'R':
+			bench.randreads = atoi(optarg);
+			break;
+		case 'S':
+			bench.only = optarg;
+			break;
+		case 'o':
+			report = optarg;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (bench.mount == NULL || bench.src == NULL || bench.threads < 1) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	bench.report = stdout;
+	if (report != NULL) {
+		bench.report = fopen(report, "w");
+		if (bench.report == NULL) {
+			perror(report);
+			return 1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/tiles", bench.src);
+	if (bench_listdir(path, &bench.tiles) != 0) {
+		perror(path);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/small", bench.src);
+	if (bench_listdir(path, &bench.small) != 0) {
+		perror(path);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/tiles", bench.mount);
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		perror(path);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/small", bench.mount);
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		perror(path);
+		return 1;
+	}
+
+	/* Scenarios which read need files written by the first two */
+	for (i = 0; i < BENCH_NSCENARIOS; i++) {
+		if (i <= BENCH_SMALL_WRITE || bench_selected(&bench, scenarios[i]))
+			bench_run(&bench, i);
+	}
+
+	if (bench.report != stdout)
+		fclose(bench.report);
+
+	return 0;
+}
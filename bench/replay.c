@@ -0,0 +1,601 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains replay of the trace recorded by lazfs -o trace=PATH
+ * against a mount. Every FUSE thread of the trace is replayed by own thread
+ * with the original timing (optionally scaled) or as fast as possible.
+ * Results are written as one JSON object per operation and a summary.
+ */
+
+#include "stats.h"
+#include "trace.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+/* Operations recorded in the trace are FUSE operations only */
+#define REPLAY_NOPS (STATS_OP_FGETATTR + 1)
+
+typedef struct replay_thread {
+	pthread_t tid;
+	trace_record_t **ops;	/* Operations of the thread in time order */
+	size_t nops;
+	size_t size;
+	uint64_t lag;		/* The latest start after schedule, ns */
+	char *buf;		/* Data of reads and writes */
+	size_t bufsize;
+	uint64_t *lats[REPLAY_NOPS];
+	size_t nlats[REPLAY_NOPS];
+	size_t sizes[REPLAY_NOPS];
+	uint64_t errors[REPLAY_NOPS];
+	uint64_t mismatches[REPLAY_NOPS];
+	struct replay *replay;
+} replay_thread_t;
+
+/* Map of fi->fh of the trace to file descriptors of the replay */
+typedef struct replay_file {
+	uint64_t fh;
+	int fd;
+	struct replay_file *next;
+} replay_file_t;
+
+typedef struct replay {
+	const char *mount;
+	double speed;		/* 0 is as fast as possible */
+	char **paths;		/* Indexed by path id */
+	uint32_t npaths;
+	replay_thread_t *threads;
+	int nthreads;
+	pthread_mutex_t lock;	/* Protects files */
+	replay_file_t *files;
+	uint64_t start;
+} replay_t;
+
+static uint64_t
+replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+replay_alloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+
+	return ptr;
+}
+
+/* Reads the whole trace, returns 0 or -1 */
+static int
+replay_load(replay_t *replay, const char *path)
+{
+	trace_record_t rec, *op;
+	replay_thread_t *t;
+	char magic[TRACE_MAGICLEN];
+	FILE *f;
+	int ret = -1;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, TRACE_MAGIC, TRACE_MAGICLEN) != 0) {
+		fprintf(stderr, "%s: not a lazfs trace\n", path);
+		goto cleanup;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (rec.type == TRACE_PATH) {
+			if (rec.path >= replay->npaths) {
+				replay->paths = replay_alloc(replay->paths,
+					(rec.path + 1) * sizeof(char *));
+				memset(replay->paths + replay->npaths, 0,
+				       (rec.path + 1 - replay->npaths) *
+				       sizeof(char *));
+				replay->npaths = rec.path + 1;
+			}
+			replay->paths[rec.path] = replay_alloc(NULL,
+							       rec.size + 1);
+			if (fread(replay->paths[rec.path], rec.size, 1, f) != 1)
+				break;
+			replay->paths[rec.path][rec.size] = '\0';
+			continue;
+		}
+
+		if (rec.type != TRACE_OP || rec.op >= REPLAY_NOPS)
+			continue;
+
+		if (rec.thread >= replay->nthreads) {
+			replay->threads = replay_alloc(replay->threads,
+				(rec.thread + 1) * sizeof(replay_thread_t));
+			memset(replay->threads + replay->nthreads, 0,
+			       (rec.thread + 1 - replay->nthreads) *
+			       sizeof(replay_thread_t));
+			replay->nthreads = rec.thread + 1;
+		}
+
+		t = &replay->threads[rec.thread];
+		if (t->nops == t->size) {
+			t->size = t->size ? 2 * t->size : 1024;
+			t->ops = replay_alloc(t->ops, t->size * sizeof(*t->ops));
+		}
+		op = replay_alloc(NULL, sizeof(*op));
+		*op = rec;
+		t->ops[t->nops++] = op;
+	}
+
+	ret = 0;
+
+cleanup:
+	fclose(f);
+
+	return ret;
+}
+
+static int
+replay_cmpop(const void *a, const void *b)
+{
+	const trace_record_t *x = *(trace_record_t * const *) a;
+	const trace_record_t *y = *(trace_record_t * const *) b;
+
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+/* Returns full path of path id in the mount */
+static int
+replay_path(replay_t *replay, uint32_t id, char path[PATH_MAX])
+{
+	if (id == 0 || id >= replay->npaths || replay->paths[id] == NULL)
+		return -1;
+
+	snprintf(path, PATH_MAX, "%s%s", replay->mount, replay->paths[id]);
+
+	return 0;
+}
+
+static void
+replay_setfd(replay_t *replay, uint64_t fh, int fd)
+{
+	replay_file_t *file;
+
+	file = replay_alloc(NULL, sizeof(*file));
+	file->fh = fh;
+	file->fd = fd;
+
+	pthread_mutex_lock(&replay->lock);
+	file->next = replay->files;
+	replay->files = file;
+	pthread_mutex_unlock(&replay->lock);
+}
+
+/*
+ * Returns descriptor of the traced file, opens it if it was opened before
+ * the trace started
+ */
+static int
+replay_getfd(replay_t *replay, uint64_t fh, const char *path, int flags)
+{
+	replay_file_t *file;
+	int fd = -1;
+
+	pthread_mutex_lock(&replay->lock);
+	for (file = replay->files; file != NULL; file = file->next) {
+		if (file->fh == fh) {
+			fd = file->fd;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&replay->lock);
+
+	if (fd == -1) {
+		fd = open(path, flags);
+		if (fd != -1)
+			replay_setfd(replay, fh, fd);
+	}
+
+	return fd;
+}
+
+/* Closes descriptor of the traced file */
+static void
+replay_putfd(replay_t *replay, uint64_t fh)
+{
+	replay_file_t **filep, *file;
+
+	pthread_mutex_lock(&replay->lock);
+	for (filep = &replay->files; *filep != NULL; filep = &(*filep)->next) {
+		if ((*filep)->fh == fh) {
+			file = *filep;
+			*filep = file->next;
+			close(file->fd);
+			free(file);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&replay->lock);
+}
+
+static char *
+replay_buf(replay_thread_t *t, size_t size)
+{
+	if (size > t->bufsize) {
+		t->buf = replay_alloc(t->buf, size);
+		memset(t->buf, 0, size);
+		t->bufsize = size;
+	}
+
+	return t->buf;
+}
+
+/* Executes one operation, returns 0 or -errno */
+static int
+replay_op(replay_thread_t *t, const trace_record_t *op)
+{
+	replay_t *replay = t->replay;
+	char path[PATH_MAX], path2[PATH_MAX];
+	struct stat st;
+	struct statvfs stv;
+	struct dirent *de;
+	DIR *dir;
+	ssize_t len;
+	int fd, ret = 0;
+
+	if (replay_path(replay, op->path, path) != 0)
+		return -EINVAL;
+	if (op->path2 != 0 && replay_path(replay, op->path2, path2) != 0)
+		return -EINVAL;
+
+	switch (op->op) {
+	case STATS_OP_GETATTR:
+		ret = lstat(path, &st);
+		break;
+	case STATS_OP_READLINK:
+		ret = readlink(path, replay_buf(t, op->size), op->size);
+		break;
+	case STATS_OP_MKNOD:
+		ret = mknod(path, op->mode, op->offset);
+		break;
+	case STATS_OP_MKDIR:
+		ret = mkdir(path, op->mode);
+		break;
+	case STATS_OP_UNLINK:
+		ret = unlink(path);
+		break;
+	case STATS_OP_RMDIR:
+		ret = rmdir(path);
+		break;
+	case STATS_OP_SYMLINK:
+		/* path is the link content, path2 the new link */
+		ret = symlink(replay->paths[op->path], path2);
+		break;
+	case STATS_OP_RENAME:
+		ret = rename(path, path2);
+		break;
+	case STATS_OP_LINK:
+		ret = link(path, path2);
+		break;
+	case STATS_OP_CHMOD:
+		ret = chmod(path, op->mode);
+		break;
+	case STATS_OP_CHOWN:
+		ret = lchown(path, op->offset, op->size);
+		break;
+	case STATS_OP_TRUNCATE:
+		ret = truncate(path, op->offset);
+		break;
+	case STATS_OP_UTIME:
+		ret = utime(path, NULL);
+		break;
+	case STATS_OP_OPEN:
+	case STATS_OP_CREATE:
+		fd = open(path, op->flags |
+			  (op->op == STATS_OP_CREATE ? O_CREAT : 0), op->mode);
+		if (fd == -1)
+			return -errno;
+		/* Handle of failed open means nothing */
+		if (op->ret < 0) {
+			close(fd);
+			break;
+		}
+		replay_putfd(replay, op->fh);
+		replay_setfd(replay, op->fh, fd);
+		break;
+	case STATS_OP_READ:
+		fd = replay_getfd(replay, op->fh, path, O_RDONLY);
+		len = (fd == -1) ? -1 : pread(fd, replay_buf(t, op->size),
+					      op->size, op->offset);
+		ret = (len < 0) ? -1 : 0;
+		break;
+	case STATS_OP_WRITE:
+		fd = replay_getfd(replay, op->fh, path, O_WRONLY);
+		len = (fd == -1) ? -1 : pwrite(fd, replay_buf(t, op->size),
+					       op->size, op->offset);
+		ret = (len < 0) ? -1 : 0;
+		break;
+	case STATS_OP_STATFS:
+		ret = statvfs(path, &stv);
+		break;
+	case STATS_OP_FLUSH:
+	case STATS_OP_OPENDIR:
+	case STATS_OP_RELEASEDIR:
+		break;
+	case STATS_OP_RELEASE:
+		replay_putfd(replay, op->fh);
+		break;
+	case STATS_OP_FSYNC:
+		fd = replay_getfd(replay, op->fh, path, O_RDONLY);
+		ret = (fd == -1) ? -1 :
+		      (op->flags ? fdatasync(fd) : fsync(fd));
+		break;
+	case STATS_OP_SETXATTR:
+		ret = lsetxattr(path, replay->paths[op->path2],
+				replay_buf(t, op->size), op->size, op->flags);
+		break;
+	case STATS_OP_GETXATTR:
+		ret = lgetxattr(path, replay->paths[op->path2],
+				replay_buf(t, op->size), op->size);
+		break;
+	case STATS_OP_LISTXATTR:
+		ret = llistxattr(path, replay_buf(t, op->size), op->size);
+		break;
+	case STATS_OP_REMOVEXATTR:
+		ret = lremovexattr(path, replay->paths[op->path2]);
+		break;
+	case STATS_OP_READDIR:
+		dir = opendir(path);
+		if (dir == NULL)
+			return -errno;
+		while ((de = readdir(dir)) != NULL)
+			;
+		closedir(dir);
+		break;
+	case STATS_OP_FSYNCDIR:
+		break;
+	case STATS_OP_ACCESS:
+		ret = access(path, op->flags);
+		break;
+	case STATS_OP_FTRUNCATE:
+		fd = replay_getfd(replay, op->fh, path, O_WRONLY);
+		ret = (fd == -1) ? -1 : ftruncate(fd, op->offset);
+		break;
+	case STATS_OP_FGETATTR:
+		fd = replay_getfd(replay, op->fh, path, O_RDONLY);
+		ret = (fd == -1) ? -1 : fstat(fd, &st);
+		break;
+	default:
+		break;
+	}
+
+	return (ret < 0) ? -errno : 0;
+}
+
+static void *
+replay_thread(void *arg)
+{
+	replay_thread_t *t = arg;
+	replay_t *replay = t->replay;
+	const trace_record_t *op;
+	struct timespec ts;
+	uint64_t when, now, start;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < t->nops; i++) {
+		op = t->ops[i];
+
+		if (replay->speed > 0) {
+			when = replay->start + op->time / replay->speed;
+			now = replay_now();
+			if (when > now) {
+				ts.tv_sec = (when - now) / 1000000000ULL;
+				ts.tv_nsec = (when - now) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			} else if (now - when > t->lag) {
+				t->lag = now - when;
+			}
+		}
+
+		start = replay_now();
+		ret = replay_op(t, op);
+		now = replay_now();
+
+		if (t->nlats[op->op] == t->sizes[op->op]) {
+			t->sizes[op->op] = t->sizes[op->op] ?
+					   2 * t->sizes[op->op] : 256;
+			t->lats[op->op] = replay_alloc(t->lats[op->op],
+				t->sizes[op->op] * sizeof(uint64_t));
+		}
+		t->lats[op->op][t->nlats[op->op]++] = now - start;
+		if (ret < 0)
+			t->errors[op->op]++;
+		if ((ret < 0) != (op->ret < 0))
+			t->mismatches[op->op]++;
+	}
+
+	return NULL;
+}
+
+static int
+replay_cmplat(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+replay_percentile(const uint64_t *lats, size_t n, double q)
+{
+	size_t i;
+
+	if (n == 0)
+		return 0;
+
+	i = q * n;
+	if (i >= n)
+		i = n - 1;
+
+	return lats[i] / 1000.0;
+}
+
+static void
+replay_report(replay_t *replay, uint64_t elapsed)
+{
+	uint64_t *lats, errors, mismatches, lag = 0;
+	uint64_t totalops = 0, totalerrors = 0, totalmismatches = 0;
+	size_t n;
+	int op, i;
+
+	for (op = 0; op < REPLAY_NOPS; op++) {
+		lats = NULL;
+		n = 0;
+		errors = 0;
+		mismatches = 0;
+
+		for (i = 0; i < replay->nthreads; i++) {
+			replay_thread_t *t = &replay->threads[i];
+
+			if (t->nlats[op] == 0)
+				continue;
+			lats = replay_alloc(lats,
+					    (n + t->nlats[op]) * sizeof(*lats));
+			memcpy(lats + n, t->lats[op],
+			       t->nlats[op] * sizeof(*lats));
+			n += t->nlats[op];
+			errors += t->errors[op];
+			mismatches += t->mismatches[op];
+		}
+		if (n == 0)
+			continue;
+
+		qsort(lats, n, sizeof(*lats), replay_cmplat);
+		printf("{\"op\": \"%s\", \"count\": %zu, \"errors\": %llu, "
+		       "\"mismatches\": %llu, \"lat_p50_us\": %.1f, "
+		       "\"lat_p90_us\": %.1f, \"lat_p99_us\": %.1f, "
+		       "\"lat_max_us\": %.1f}\n", stats_histname(op), n,
+		       (unsigned long long) errors,
+		       (unsigned long long) mismatches,
+		       replay_percentile(lats, n, 0.5),
+		       replay_percentile(lats, n, 0.9),
+		       replay_percentile(lats, n, 0.99),
+		       replay_percentile(lats, n, 1));
+		free(lats);
+
+		totalops += n;
+		totalerrors += errors;
+		totalmismatches += mismatches;
+	}
+
+	for (i = 0; i < replay->nthreads; i++) {
+		if (replay->threads[i].lag > lag)
+			lag = replay->threads[i].lag;
+	}
+
+	printf("{\"op\": \"total\", \"count\": %llu, \"errors\": %llu, "
+	       "\"mismatches\": %llu, \"threads\": %d, \"speed\": %g, "
+	       "\"seconds\": %.6f, \"max_lag_ms\": %.3f}\n",
+	       (unsigned long long) totalops,
+	       (unsigned long long) totalerrors,
+	       (unsigned long long) totalmismatches, replay->nthreads,
+	       replay->speed, elapsed / 1e9, lag / 1e6);
+
+	fprintf(stderr, "%llu operations in %.3f s, %llu errors, %llu differ "
+		"from the trace\n", (unsigned long long) totalops,
+		elapsed / 1e9, (unsigned long long) totalerrors,
+		(unsigned long long) totalmismatches);
+}
+
+static void
+replay_usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s -m mountdir [-s speed | -f] trace\n"
+		"    -s     speed of the replay, 2 is twice as fast as "
+		"recorded (default 1)\n"
+		"    -f     replay as fast as possible\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	replay_t replay;
+	uint64_t elapsed;
+	int opt, i, err;
+
+	memset(&replay, 0, sizeof(replay));
+	replay.speed = 1;
+	pthread_mutex_init(&replay.lock, NULL);
+
+	while ((opt = getopt(argc, argv, "m:s:f")) != -1) {
+		switch (opt) {
+		case 'm':
+			replay.mount = optarg;
+			break;
+		case 's':
+			replay.speed = atof(optarg);
+			break;
+		case 'f':
+			replay.speed = 0;
+			break;
+		default:
+			replay_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (replay.mount == NULL || optind + 1 != argc || replay.speed < 0) {
+		replay_usage(argv[0]);
+		return 1;
+	}
+
+	if (replay_load(&replay, argv[optind]) != 0)
+		return 1;
+
+	for (i = 0; i < replay.nthreads; i++) {
+		replay.threads[i].replay = &replay;
+		qsort(replay.threads[i].ops, replay.threads[i].nops,
+		      sizeof(trace_record_t *), replay_cmpop);
+	}
+
+	replay.start = replay_now();
+	for (i = 0; i < replay.nthreads; i++) {
+		err = pthread_create(&replay.threads[i].tid, NULL,
+				     replay_thread, &replay.threads[i]);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			return 1;
+		}
+	}
+	for (i = 0; i < replay.nthreads; i++)
+		pthread_join(replay.threads[i].tid, NULL);
+	elapsed = replay_now() - replay.start;
+
+	replay_report(&replay, elapsed);
+
+	return 0;
+}
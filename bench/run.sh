@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Runs lazfs benchmark: generates synthetic .las files, mounts lazfs on a
+# local backend directory and runs lazfs-bench on the mount. It is started
+# by "make bench", builddir with lazfs, lasgen and lazfs-bench is the first
+# argument.
+#
+# Environment:
+#   BENCH_DIR      work directory (default bench-work), it is removed first
+#   BENCH_POINTS   points of every tile (default 1000000)
+#   BENCH_SMALL    number of small files with 1000 points (default 200)
+#   BENCH_THREADS  threads of parallel read and stat scenarios (default 8)
+#   BENCH_ARGS     additional lazfs-bench arguments, e.g. "-S cold_read"
+#   LAZFS_OPTS     additional lazfs -o options
+#
+# Report is written into $BENCH_DIR/report.json, one JSON object per
+# scenario. Statistics of lazfs after the run are in $BENCH_DIR/stats.
+
+set -e
+
+builddir=${1:-.}
+dir=${BENCH_DIR:-bench-work}
+points=${BENCH_POINTS:-1000000}
+small=${BENCH_SMALL:-200}
+threads=${BENCH_THREADS:-8}
+
+rm -rf "$dir"
+mkdir -p "$dir/src/tiles" "$dir/src/small" "$dir/backend" "$dir/mnt"
+dir=$(cd "$dir" && pwd)
+
+echo "Generating tiles with $points points"
+for format in 0 1 2 3; do
+	for dist in uniform grid cluster; do
+		"$builddir/lasgen" -f $format -n $points -d $dist -s $format \
+			"$dir/src/tiles/f${format}_$dist.las"
+	done
+done
+
+echo "Generating $small small files"
+i=0
+while [ $i -lt $small ]; do
+	"$builddir/lasgen" -f $((i % 4)) -n 1000 -s $i \
+		"$dir/src/small/s$i.las"
+	i=$((i + 1))
+done
+
+"$builddir/lazfs" -o "log=$dir/lazfs.log${LAZFS_OPTS:+,$LAZFS_OPTS}" \
+	"$dir/backend" "$dir/mnt"
+trap 'fusermount -u "$dir/mnt"' EXIT
+
+i=0
+while [ ! -d "$dir/mnt/.lazfs" ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "lazfs didn't mount $dir/mnt" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+"$builddir/lazfs-bench" -m "$dir/mnt" -s "$dir/src" -t $threads \
+	-o "$dir/report.json" $BENCH_ARGS
+cp "$dir/mnt/.lazfs/stats" "$dir/stats"
+
+echo "Report written to $dir/report.json"
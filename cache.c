@@ -8,6 +8,8 @@
  */
 
 #include "cache.h"
+#include "probes.h"
+#include "stats.h"
 #include "util.h"
 #include "workq.h"
 #include <assert.h>
@@ -16,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 typedef struct file_entry file_entry_t;
@@ -25,7 +28,16 @@ struct file_entry {
 	int fd; /* Open fd to compressed .laz */
 	int tmpfd; /* Open fd of the temporary decompressed .las */
 	int refs; /* Number of external references to this entry */
+	pid_t pid; /* Process which created the file or read from it last */
 	char dirty; /* Tracks if compressed file need to be updated */
+	lazfs_rangeset_t dirtyset; /* Byte ranges written since open */
+	off_t origsize; /* Size before first write, -1 if dirtyset is incomplete */
+	lazfs_stream_t *stream; /* Streaming compression, owned by caller */
+	void *lazy; /* On-demand decompression, owned by caller */
+	codec_job_t codecjob; /* Argument of the decompression job */
+	char prefetched; /* The only reference belongs to prefetch */
+	lazfs_workq_t *workq; /* Queue of lowjob */
+	lazfs_workq_job_t *lowjob; /* Low priority decompression, see cache_boost() */
 
 	/* Asynchronous compression/decompression */
 	char ready; /* Zero if file is being compressed/decompressed */
@@ -54,6 +66,7 @@ file_entry_destroy(file_entry_t **entryp)
 		free(entry->tmpname);
 	if (entry->name != NULL)
 		free(entry->name);
+	rangeset_clear(&entry->dirtyset);
 
 	err = pthread_cond_destroy(&entry->cond);
 	assert(err == 0);
@@ -106,12 +119,69 @@ cleanup:
 	return -err;
 }
 
+/*
+ * Moves low priority decompression of entry among regular jobs, somebody
+ * waits for it. The job is freed after it marks entry ready, so lowjob is
+ * valid only until then.
+ */
+static inline void
+cache_boost(file_entry_t *entry)
+{
+	if (entry->lowjob != NULL && !entry->ready)
+		lazfs_workq_boost(entry->workq, entry->lowjob);
+	entry->lowjob = NULL;
+}
+
 static inline void
 cache_waitentry(laz_cache_t *cache, file_entry_t *entry)
 {
+	uint64_t start;
+
+	if (entry->ready) {
+		entry->lowjob = NULL;
+		return;
+	}
+
+	cache_boost(entry);
+
+	LAZFS_PROBE1(cache__wait__start, entry->name);
+	start = stats_now();
 	while (!entry->ready) {
 		WAIT(entry->cond, cache->lock);
 	}
+	stats_record(STATS_CACHE_WAIT, stats_now() - start, 0);
+	LAZFS_PROBE1(cache__wait__done, entry->name);
+}
+
+static file_entry_t *
+cache_find(laz_cache_t *cache, const char *filename)
+{
+	file_entry_t *entry;
+
+	for (entry = cache->entries.lh_first; entry != NULL; entry = entry->link.le_next) {
+		if (strcmp(entry->name, filename) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void
+cache_fillstat(file_entry_t *entry, laz_cachestat_t *cstat)
+{
+	cstat->name = entry->name;
+	cstat->tmppath = entry->tmpname;
+	cstat->fd = entry->fd;
+	cstat->tmpfd = entry->tmpfd;
+	cstat->pid = entry->pid;
+	cstat->dirty = entry->dirty;
+	cstat->dirtyset = &entry->dirtyset;
+	cstat->origsize = entry->origsize;
+	cstat->stream = entry->stream;
+	cstat->lazy = entry->lazy;
+	cstat->lastref = (entry->refs == 1) ? 1 : 0;
+	cstat->prefetched = 0;
+	cstat->err = entry->err;
 }
 
 int
@@ -161,20 +231,28 @@ cache_destroy(laz_cache_t **cachep)
 	*cachep = NULL;
 }
 
-int
-cache_add(laz_cache_t *cache, const char *filename, const char *tmpfilename,
-	  int fd, int tmpfd, lazfs_workq_t *workq)
+/*
+ * Adds entry and runs call(arg) or decompression by rule when call is NULL.
+ * Decompression runs as low priority job for prefetch.
+ */
+static int
+cache_insert(laz_cache_t *cache, const char *filename, const char *tmpfilename,
+	     int fd, int tmpfd, const codec_rule_t *rule,
+	     int (*call)(void *arg), void *arg, lazfs_workq_t *workq,
+	     char prefetch)
 {
 	int err = 0;
 	file_entry_t *entry = NULL;
 	lazfs_workq_job_t *job = NULL;
 
 	assert(cache != NULL);
+	assert(workq == NULL || rule != NULL || call != NULL);
 
 	if (workq != NULL) {
 		job = malloc(sizeof(*job));
 		if (job == NULL)
 			return -ENOMEM;
+		memset(job, 0, sizeof(*job));
 	}
 
 	err = file_entry_create(&entry, filename, tmpfilename, fd, tmpfd);
@@ -183,14 +261,28 @@ cache_add(laz_cache_t *cache, const char *filename, const char *tmpfilename,
 
 	entry->refs++;
 	LIST_INSERT_HEAD(&cache->entries, entry, link);
+	LAZFS_PROBE3(cache__add, entry->name, fd, tmpfd);
 
 	if (workq != NULL) {
-		job->routine = lazfs_decompress;
-		job->sfd = fd;
-		job->dfd = tmpfd;
+		if (call == NULL) {
+			entry->codecjob.rule = rule;
+			entry->codecjob.sfd = fd;
+			entry->codecjob.dfd = tmpfd;
+			call = codec_decompressjob;
+			arg = &entry->codecjob;
+		}
+		job->call = call;
+		job->arg = arg;
 		job->ret = &entry->err;
 		job->complete = &entry->ready;
 		job->signal = &entry->cond;
+		job->lock = &cache->lock;
+		if (prefetch) {
+			job->lowprio = LAZFS_WORKQ_PREFETCH;
+			entry->prefetched = 1;
+			entry->workq = workq;
+			entry->lowjob = job;
+		}
 
 		lazfs_workq_run(workq, job);
 	} else {
@@ -206,6 +298,63 @@ cleanup:
 	return err;
 }
 
+int
+cache_add(laz_cache_t *cache, const char *filename, const char *tmpfilename,
+	  int fd, int tmpfd, const codec_rule_t *rule, lazfs_workq_t *workq)
+{
+	return cache_insert(cache, filename, tmpfilename, fd, tmpfd, rule, NULL,
+			    NULL, workq, 0);
+}
+
+int
+cache_addcall(laz_cache_t *cache, const char *filename,
+	      const char *tmpfilename, int fd, int tmpfd,
+	      int (*call)(void *arg), void *arg, lazfs_workq_t *workq)
+{
+	assert(call != NULL && workq != NULL);
+
+	return cache_insert(cache, filename, tmpfilename, fd, tmpfd, NULL, call,
+			    arg, workq, 0);
+}
+
+int
+cache_prefetch(laz_cache_t *cache, const char *filename,
+	       const char *tmpfilename, int fd, int tmpfd,
+	       const codec_rule_t *rule, lazfs_workq_t *workq)
+{
+	assert(rule != NULL && workq != NULL);
+
+	return cache_insert(cache, filename, tmpfilename, fd, tmpfd, rule, NULL,
+			    NULL, workq, 1);
+}
+
+int
+cache_getprefetched(laz_cache_t *cache, const char *filename, char wait,
+		    laz_cachestat_t *cstat)
+{
+	file_entry_t *entry;
+
+	assert(cache != NULL);
+	assert(filename != NULL);
+	assert(cstat != NULL);
+
+	/* Entry can be taken over and removed while we wait, look it up again */
+	while ((entry = cache_find(cache, filename)) != NULL &&
+	       entry->prefetched && !entry->ready) {
+		if (!wait)
+			return -EBUSY;
+		cache_waitentry(cache, entry);
+	}
+
+	if (entry == NULL || !entry->prefetched)
+		return 1;
+
+	cache_fillstat(entry, cstat);
+	cstat->prefetched = 1;
+
+	return 0;
+}
+
 void
 cache_remove(laz_cache_t *cache, const char *filename)
 {
@@ -234,64 +383,109 @@ cache_remove(laz_cache_t *cache, const char *filename)
 }
 
 void
-cache_dirty(laz_cache_t *cache, const char *filename)
+cache_dirty(laz_cache_t *cache, const char *filename, off_t offset, off_t len)
 {
 	file_entry_t *entry;
+	struct stat statbuf;
 
 	assert(cache != NULL);
 	assert(filename != NULL);
 
 	for (entry = cache->entries.lh_first; entry != NULL; entry = entry->link.le_next) {
 		if (strcmp(entry->name, filename) == 0) {
-			entry->dirty = 1;
+			if (!entry->dirty) {
+				entry->dirty = 1;
+				entry->origsize = (fstat(entry->tmpfd, &statbuf) == 0) ?
+						  statbuf.st_size : -1;
+			}
+			if (entry->origsize != -1 &&
+			    rangeset_add(&entry->dirtyset, offset, offset + len) != 0)
+				entry->origsize = -1;
 			return;
 		}
 	}
 }
 
-int
-cache_finish(laz_cache_t *cache, const char *filename, int fd, int tmpfd,
-	     lazfs_workq_t *workq)
+/* Runs job for the file and waits for it, job is freed if it can't run */
+static int
+cache_finishjob(laz_cache_t *cache, const char *filename,
+		lazfs_workq_job_t *job, lazfs_workq_t *workq)
 {
 	file_entry_t *entry;
-	lazfs_workq_job_t *job = NULL;
+	uint64_t start;
 	int err = 0;
 	char complete = 0;
 
 	assert(cache != NULL);
 
-	for (entry = cache->entries.lh_first; entry != NULL; entry = entry->link.le_next) {
-		if (strcmp(entry->name, filename) == 0) {
-			entry->dead = 1;
-			job = malloc(sizeof(*job));
-			if (job == NULL)
-				return -ENOMEM;
-
-			entry->ready = 0;
-
-			job->routine = &lazfs_compress;
-			job->sfd = fd;
-			job->dfd = tmpfd;
-			job->ret = &err;
-			job->complete = &complete;
-			job->signal = &entry->cond;
-			lazfs_workq_run(workq, job);
-
-			while (!complete) {
-				WAIT(entry->cond, cache->lock);
-			}
+	entry = cache_find(cache, filename);
+	if (entry == NULL) {
+		free(job);
+		return 0;
+	}
 
-			break;
-		}
+	entry->dead = 1;
+	entry->ready = 0;
+	entry->lowjob = NULL;
+	job->lock = &cache->lock;
+
+	job->ret = &err;
+	job->complete = &complete;
+	job->signal = &entry->cond;
+	LAZFS_PROBE1(cache__finish__start, entry->name);
+	lazfs_workq_run(workq, job);
+
+	start = stats_now();
+	while (!complete) {
+		WAIT(entry->cond, cache->lock);
 	}
+	stats_record(STATS_CACHE_WAIT, stats_now() - start, err < 0);
+	LAZFS_PROBE2(cache__finish__done, filename, err);
 
 	return err;
 }
 
+int
+cache_finish(laz_cache_t *cache, const char *filename,
+	     int (*routine)(int sfd, int dfd), int sfd, int dfd,
+	     lazfs_workq_t *workq)
+{
+	lazfs_workq_job_t *job;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL)
+		return -ENOMEM;
+	memset(job, 0, sizeof(*job));
+
+	job->routine = routine;
+	job->sfd = sfd;
+	job->dfd = dfd;
+
+	return cache_finishjob(cache, filename, job, workq);
+}
+
+int
+cache_finishcall(laz_cache_t *cache, const char *filename,
+		 int (*call)(void *arg), void *arg, lazfs_workq_t *workq)
+{
+	lazfs_workq_job_t *job;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL)
+		return -ENOMEM;
+	memset(job, 0, sizeof(*job));
+
+	job->call = call;
+	job->arg = arg;
+
+	return cache_finishjob(cache, filename, job, workq);
+}
+
 int
 cache_get(laz_cache_t *cache, const char *filename, char increfs, laz_cachestat_t *cstat)
 {
 	file_entry_t *entry;
+	char prefetched;
 
 	assert(cache != NULL);
 	assert(filename != NULL);
@@ -304,18 +498,19 @@ cache_get(laz_cache_t *cache, const char *filename, char increfs, laz_cachestat_
 			if (entry->dead)
 				return 1;
 
-			if (increfs)
+			/* Reference of prefetch is taken over */
+			prefetched = increfs && entry->prefetched;
+			if (prefetched)
+				entry->prefetched = 0;
+			else if (increfs)
 				entry->refs++;
 
 			while (!entry->ready) {
 				WAIT(entry->cond, cache->lock);
 			}
 
-			cstat->tmppath = entry->tmpname;
-			cstat->fd = entry->fd;
-			cstat->tmpfd = entry->tmpfd;
-			cstat->dirty = entry->dirty;
-			cstat->lastref = (entry->refs == 1) ? 1 : 0;
+			cache_fillstat(entry, cstat);
+			cstat->prefetched = prefetched;
 			break;
 		}
 	}
@@ -334,32 +529,187 @@ cache_markready(laz_cache_t *cache, const char *filename)
 	for (entry = cache->entries.lh_first; entry != NULL; entry = entry->link.le_next) {
 		if (strcmp(entry->name, filename) == 0) {
 			entry->ready = 1;
-			pthread_cond_signal(&entry->cond);
+			pthread_cond_broadcast(&entry->cond);
 			break;
 		}
 	}
 }
 
+/* Returns non-zero if name is filename or a file beneath it */
+static inline int
+cache_under(const char *name, const char *filename, size_t len)
+{
+	return strncmp(name, filename, len) == 0 &&
+	       (name[len] == '\0' || name[len] == '/');
+}
+
 void
 cache_wait(laz_cache_t *cache, const char *filename)
 {
 	file_entry_t *entry;
+	uint64_t start;
+	size_t len;
 
 	assert(cache != NULL);
 	assert(filename != NULL);
 
+	len = strlen(filename);
+again:
 	for (entry = cache->entries.lh_first; entry != NULL; entry = entry->link.le_next) {
-		if (strcmp(entry->name, filename) == 0) {
-			cache_waitentry(cache, entry);
-			return;
+		if (!entry->ready && !entry->prefetched &&
+		    cache_under(entry->name, filename, len)) {
+			LAZFS_PROBE1(cache__wait__start, entry->name);
+			start = stats_now();
+			WAIT(entry->cond, cache->lock);
+			stats_record(STATS_CACHE_WAIT, stats_now() - start, 0);
+			LAZFS_PROBE1(cache__wait__done, entry->name);
+			/* Entries can be removed while we wait, start over */
+			goto again;
 		}
 	}
 }
 
+int
+cache_rename(laz_cache_t *cache, const char *filename, const char *newname)
+{
+	file_entry_t *entry;
+	const char *rest;
+	size_t len;
+	char *name;
+
+	assert(cache != NULL);
+	assert(filename != NULL);
+	assert(newname != NULL);
+
+	len = strlen(filename);
+	for (entry = cache->entries.lh_first; entry != NULL; entry = entry->link.le_next) {
+		if (!cache_under(entry->name, filename, len))
+			continue;
+
+		rest = entry->name + len;
+		name = malloc(strlen(newname) + strlen(rest) + 1);
+		if (name == NULL)
+			return -ENOMEM;
+
+		strcpy(name, newname);
+		strcat(name, rest);
+		free(entry->name);
+		entry->name = name;
+	}
+
+	return 0;
+}
+
+char
+cache_contains(laz_cache_t *cache, const char *filename)
+{
+	assert(cache != NULL);
+	assert(filename != NULL);
+
+	return cache_find(cache, filename) != NULL;
+}
+
+void
+cache_setstream(laz_cache_t *cache, const char *filename,
+		lazfs_stream_t *stream)
+{
+	file_entry_t *entry;
+
+	assert(cache != NULL);
+
+	entry = cache_find(cache, filename);
+	if (entry != NULL)
+		entry->stream = stream;
+}
+
+void
+cache_setlazy(laz_cache_t *cache, const char *filename, void *lazy)
+{
+	file_entry_t *entry;
+
+	assert(cache != NULL);
+
+	entry = cache_find(cache, filename);
+	if (entry != NULL)
+		entry->lazy = lazy;
+}
+
+void
+cache_setpid(laz_cache_t *cache, const char *filename, pid_t pid)
+{
+	file_entry_t *entry;
+
+	assert(cache != NULL);
+	assert(filename != NULL);
+
+	entry = cache_find(cache, filename);
+	if (entry != NULL)
+		entry->pid = pid;
+}
+
+int
+cache_copysource(laz_cache_t *cache, const char *filename, pid_t pid,
+		 off_t size, laz_cachestat_t *cstat)
+{
+	file_entry_t *entry;
+	struct stat statbuf;
+
+	assert(cache != NULL);
+	assert(filename != NULL);
+	assert(cstat != NULL);
+
+	for (entry = cache->entries.lh_first; entry != NULL; entry = entry->link.le_next) {
+		if (entry->pid != pid || !entry->ready || entry->dead ||
+		    entry->dirty || entry->prefetched ||
+		    strcmp(entry->name, filename) == 0)
+			continue;
+
+		if (fstat(entry->tmpfd, &statbuf) != 0 || statbuf.st_size != size)
+			continue;
+
+		entry->ready = 0;
+		entry->lowjob = NULL;
+		cache_fillstat(entry, cstat);
+		cstat->lastref = 0;
+
+		return 0;
+	}
+
+	return 1;
+}
+
+void
+cache_info(laz_cache_t *cache, laz_cacheinfo_t *info)
+{
+	file_entry_t *entry;
+	struct stat statbuf;
+
+	assert(cache != NULL);
+	assert(info != NULL);
+
+	memset(info, 0, sizeof(*info));
+
+	for (entry = cache->entries.lh_first; entry != NULL; entry = entry->link.le_next) {
+		if (entry->dead)
+			info->dead++;
+		else if (!entry->ready)
+			info->decompressing++;
+		else if (entry->dirty)
+			info->dirty++;
+		else
+			info->ready++;
+
+		if (fstat(entry->tmpfd, &statbuf) == 0)
+			info->scratch += (off_t) statbuf.st_blocks * 512;
+	}
+}
+
 void
 cache_lock(laz_cache_t *cache)
 {
+	LAZFS_PROBE1(cache__lock__start, cache);
 	LOCK(cache->lock);
+	LAZFS_PROBE1(cache__lock__done, cache);
 }
 
 void
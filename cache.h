@@ -8,6 +8,9 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
+#include "codec.h"
+#include "rangeset.h"
+#include "stream.h"
 #include "workq.h"
 #include <sys/types.h>
 
@@ -16,11 +19,19 @@
 typedef struct laz_cache laz_cache_t;
 
 typedef struct laz_cachestat {
+	const char *name;
 	char *tmppath;
 	int fd;
 	int tmpfd;
+	pid_t pid;
 	char dirty;
+	const lazfs_rangeset_t *dirtyset; /* Valid only if origsize != -1 */
+	off_t origsize; /* Size of the file before it got dirty */
+	lazfs_stream_t *stream; /* Streaming compression of created file */
+	void *lazy; /* On-demand decompression, see codec_lazyops_t */
 	char lastref;
+	char prefetched; /* Reference was taken over from prefetch */
+	int err; /* Decompression failed with -errno when non-zero */
 } laz_cachestat_t;
 
 /* Creates and initializes file cache. Returns zero on success */
@@ -33,30 +44,72 @@ cache_destroy(laz_cache_t **cachep);
 
 /*
  * Adds file which is not yet decompressed + it's open fd to cache and run
- * decompression in separate thread (via workq). Initial cache
- * external references count is 1.
+ * decompression of the rule's codec in separate thread (via workq).
+ * When workq is NULL, file is ready immediately. Initial cache external
+ * references count is 1.
  */
 int
 cache_add(laz_cache_t *cache, const char *filename, const char *tmpfilename,
-	  int fd, int tmpfd, lazfs_workq_t *workq);
+	  int fd, int tmpfd, const codec_rule_t *rule, lazfs_workq_t *workq);
+
+/*
+ * Same as cache_add() but call(arg) prepares the file instead of the codec.
+ * Call is never run when error is returned.
+ */
+int
+cache_addcall(laz_cache_t *cache, const char *filename,
+	      const char *tmpfilename, int fd, int tmpfd,
+	      int (*call)(void *arg), void *arg, lazfs_workq_t *workq);
+
+/*
+ * Same as cache_add() but the file is decompressed by a low priority job
+ * which is moved among regular jobs when somebody waits for the file. The
+ * reference belongs to prefetch: the first cache_get() which increments
+ * references takes it over instead and sets cstat->prefetched. Cache_wait()
+ * doesn't wait for such file.
+ */
+int
+cache_prefetch(laz_cache_t *cache, const char *filename,
+	       const char *tmpfilename, int fd, int tmpfd,
+	       const codec_rule_t *rule, lazfs_workq_t *workq);
+
+/*
+ * Checks file added by cache_prefetch(). Returns 0 and fills cstat when
+ * nobody took the file over and it's ready, prefetch can drop it by
+ * cache_remove() then. Returns -EBUSY when it's still being decompressed
+ * and wait is zero, or 1 when it was taken over or isn't in cache.
+ */
+int
+cache_getprefetched(laz_cache_t *cache, const char *filename, char wait,
+		    laz_cachestat_t *cstat);
 
 /* Removes file from cache. */
 void
 cache_remove(laz_cache_t *cache, const char *filename);
 
-/* Mark file in cache as dirty (i.e. it was written to it) */
+/*
+ * Mark file in cache as dirty (i.e. it was written to it), len bytes from
+ * offset are modified. Must be called before the data are written.
+ */
 void
-cache_dirty(laz_cache_t *cache, const char *filename);
+cache_dirty(laz_cache_t *cache, const char *filename, off_t offset, off_t len);
 
 /*
  * Mark file in cache as not ready dead (i.e. it will be removed and shouldn't be reused
- * and compress it via workq. After return file should be marked as "ready" via
- * cache_markready();
+ * and process it via workq, routine is usually lazfs_compress. Cache is
+ * unlocked while routine runs. Returns return value of the routine. After
+ * return file should be marked as "ready" via cache_markready();
  */
 int
-cache_finish(laz_cache_t *cache, const char *filename, int fd, int tmpfd,
+cache_finish(laz_cache_t *cache, const char *filename,
+	     int (*routine)(int sfd, int dfd), int sfd, int dfd,
 	     lazfs_workq_t *workq);
 
+/* Same as cache_finish() but routine gets arbitrary argument */
+int
+cache_finishcall(laz_cache_t *cache, const char *filename,
+		 int (*call)(void *arg), void *arg, lazfs_workq_t *workq);
+
 /* 
  * Get item from cache, waits if item is being compressed/decompressed.
  * Returns zero if found. 
@@ -71,10 +124,61 @@ cache_get(laz_cache_t *cache, const char *filename, char increfs,
 void
 cache_markready(laz_cache_t *cache, const char *filename);
 
-/* Waits until cache item gets ready, i.e. isn't being compressed/decompressed */
+/*
+ * Waits until cache item gets ready, i.e. isn't being compressed/decompressed.
+ * When filename is a directory, waits for all items beneath it.
+ */
 void
 cache_wait(laz_cache_t *cache, const char *filename);
 
+/*
+ * Renames file in cache. When filename is a directory, all files beneath it
+ * are renamed too.
+ */
+int
+cache_rename(laz_cache_t *cache, const char *filename, const char *newname);
+
+/* Returns non-zero if file is in cache */
+char
+cache_contains(laz_cache_t *cache, const char *filename);
+
+/* Attaches streaming compression to the file, cache doesn't own it */
+void
+cache_setstream(laz_cache_t *cache, const char *filename,
+		lazfs_stream_t *stream);
+
+/* Attaches on-demand decompression state to the file, cache doesn't own it */
+void
+cache_setlazy(laz_cache_t *cache, const char *filename, void *lazy);
+
+/* Remembers process which created file or read from it */
+void
+cache_setpid(laz_cache_t *cache, const char *filename, pid_t pid);
+
+/*
+ * Finds ready, clean file which is not filename, was read by process pid and
+ * whose decompressed size is size. Such file is likely source of a copy.
+ * Found file is marked as not ready so it can't be modified, renamed or
+ * removed and caller must mark it ready via cache_markready(). Returns zero
+ * if found.
+ */
+int
+cache_copysource(laz_cache_t *cache, const char *filename, pid_t pid,
+		 off_t size, laz_cachestat_t *cstat);
+
+/* Occupancy of the cache, entries are counted by state */
+typedef struct laz_cacheinfo {
+	unsigned int decompressing; /* Being decompressed */
+	unsigned int ready; /* Ready and unmodified */
+	unsigned int dirty; /* Ready and modified */
+	unsigned int dead; /* Being compressed or removed */
+	off_t scratch; /* Bytes allocated by decompressed files */
+} laz_cacheinfo_t;
+
+/* Fills info, must be called with cache locked */
+void
+cache_info(laz_cache_t *cache, laz_cacheinfo_t *info);
+
 /* Lock the cache */
 void
 cache_lock(laz_cache_t *cache);
@@ -0,0 +1,662 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains registry of codecs and rules which select codec by
+ * suffix of the file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "codec.h"
+#ifdef HAVE_LIBLRZIP
+#include "compress_lrzip.h"
+#endif
+#ifdef HAVE_LIBZSTD
+#include "compress_zstd.h"
+#endif
+#include "lasheader.h"
+#include "lazfile.h"
+#include "log.h"
+#include "reorder.h"
+#include "stats.h"
+#include "util.h"
+#include <assert.h>
+#include <attr/xattr.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Rules used when no rules file is given */
+#define CODEC_DEFAULTSUFFIX ".las"
+#define CODEC_DEFAULTSTORED ".laz"
+#define CODEC_DEFAULTCODEC "laz"
+
+/* First word of the line which configures tier codec */
+#define CODEC_TIERKEYWORD "tier"
+
+static codec_rule_t *codec_rules;
+static codec_rule_t *codec_tierrule;
+
+/* Decompressed size of .laz is computed from its LAS header and VLRs */
+static int
+codec_lasprobe(int fd, off_t *size)
+{
+	unsigned char *prefix = NULL;
+	lasheader_t hdr;
+	int ret;
+
+	ret = lazfile_readprefix(fd, &hdr, &prefix);
+	if (ret != 0)
+		return ret;
+
+	*size = lazfile_lassize(prefix, &hdr);
+	free(prefix);
+
+	return 0;
+}
+
+#if defined(HAVE_LIBLRZIP) || defined(HAVE_LIBZSTD)
+/*
+ * Accounts run of a codec without known structure which started at start,
+ * rawfd is the decompressed side.
+ */
+static int
+codec_rawstats(lazfs_hist_t hist, lazfs_stat_t bytes, int rawfd,
+	       uint64_t start, int ret)
+{
+	struct stat statbuf;
+
+	stats_record(hist, stats_now() - start, ret != 0);
+	if (ret == 0 && fstat(rawfd, &statbuf) == 0)
+		stats_add(bytes, statbuf.st_size);
+
+	return ret;
+}
+#endif
+
+/*
+ * Points of rules with order= or lod= option are sorted into temporary file
+ * first, the order and chunk size of level of detail order are recorded in
+ * xattrs of the .laz.
+ */
+static int
+codec_lazcompress(const codec_rule_t *rule, int sfd, int dfd)
+{
+	lazfs_order_t order;
+	char chunk[16];
+	int tmpfd, ret;
+
+	order = lazfs_reorder_order(rule->opts);
+	if (!codec_reorders(rule))
+		return lazfs_compress(sfd, dfd);
+
+	tmpfd = lazfs_tmpfile();
+	if (tmpfd < 0)
+		return tmpfd;
+
+	ret = lazfs_reorder(rule->opts, sfd, tmpfd);
+	if (ret == 0 && lseek(tmpfd, 0, SEEK_SET) != 0)
+		ret = -errno;
+	if (ret == 0)
+		ret = lazfs_compress(tmpfd, dfd);
+	if (ret == 0 && order != LAZFS_ORDER_NONE &&
+	    fsetxattr(dfd, ORDERATTR, lazfs_reorder_name(order),
+		      strlen(lazfs_reorder_name(order)), 0) != 0)
+		ret = -errno;
+	if (ret == 0 && lazfs_reorder_lod(rule->opts)) {
+		snprintf(chunk, sizeof(chunk), "%u", LAZFS_LOD_CHUNK);
+		if (fsetxattr(dfd, LODATTR, chunk, strlen(chunk), 0) != 0)
+			ret = -errno;
+	}
+	close(tmpfd);
+
+	return ret;
+}
+
+static int
+codec_lazdecompress(const codec_rule_t *rule, int sfd, int dfd)
+{
+	return lazfs_decompress(sfd, dfd);
+}
+
+static int
+codec_lazsetopt(codec_rule_t *rule, const char *name, const char *value)
+{
+	return lazfs_reorder_setopt((lazfs_reorderopts_t **) &rule->opts, name,
+				    value);
+}
+
+static void
+codec_lazfreeopts(void *opts)
+{
+	lazfs_reorder_freeopts(opts);
+}
+
+#ifdef HAVE_LIBZSTD
+static int
+codec_zstdcompress(const codec_rule_t *rule, int sfd, int dfd)
+{
+	uint64_t start = stats_now();
+
+	return codec_rawstats(STATS_COMPRESS, STATS_COMPRESS_BYTES, sfd, start,
+			      lazfs_zstd_compress(rule->opts, sfd, dfd));
+}
+
+static int
+codec_zstddecompress(const codec_rule_t *rule, int sfd, int dfd)
+{
+	uint64_t start = stats_now();
+
+	return codec_rawstats(STATS_DECOMPRESS, STATS_DECOMPRESS_BYTES, dfd,
+			      start, lazfs_zstd_decompress(rule->opts, sfd, dfd));
+}
+
+static int
+codec_zstdsetopt(codec_rule_t *rule, const char *name, const char *value)
+{
+	return lazfs_zstd_setopt((lazfs_zstdopts_t **) &rule->opts, name,
+				 value);
+}
+
+static void
+codec_zstdfreeopts(void *opts)
+{
+	lazfs_zstd_freeopts(opts);
+}
+
+static int
+codec_zstdopen(const codec_rule_t *rule, int sfd, int dfd, void **lazyp)
+{
+	return lazfs_zstd_open(rule->opts, sfd, dfd,
+			       (lazfs_zstdseek_t **) lazyp);
+}
+
+static int
+codec_zstdfetch(void *lazy, off_t offset, off_t len)
+{
+	return lazfs_zstd_fetch(lazy, offset, len);
+}
+
+static int
+codec_zstdtruncate(void *lazy, off_t size)
+{
+	return lazfs_zstd_truncate(lazy, size);
+}
+
+static int
+codec_zstdcomplete(void *lazy)
+{
+	return lazfs_zstd_complete(lazy);
+}
+
+static int
+codec_zstdrecompress(void *lazy, const lazfs_rangeset_t *dirty, int dfd)
+{
+	uint64_t start = stats_now();
+	int ret;
+
+	ret = lazfs_zstd_recompress(lazy, dirty, dfd);
+	stats_record(STATS_COMPRESS, stats_now() - start, ret != 0);
+
+	return ret;
+}
+
+static void
+codec_zstdclose(void *lazy)
+{
+	lazfs_zstd_close(lazy);
+}
+
+static const codec_lazyops_t codec_zstdlazy = {
+	codec_zstdopen, codec_zstdfetch, codec_zstdtruncate,
+	codec_zstdcomplete, codec_zstdrecompress, codec_zstdclose
+};
+#endif
+
+#ifdef HAVE_LIBLRZIP
+static int
+codec_lrzipcompress(const codec_rule_t *rule, int sfd, int dfd)
+{
+	uint64_t start = stats_now();
+
+	return codec_rawstats(STATS_COMPRESS, STATS_COMPRESS_BYTES, sfd, start,
+			      lazfs_lrzip_compress(sfd, dfd));
+}
+
+static int
+codec_lrzipdecompress(const codec_rule_t *rule, int sfd, int dfd)
+{
+	uint64_t start = stats_now();
+
+	return codec_rawstats(STATS_DECOMPRESS, STATS_DECOMPRESS_BYTES, dfd,
+			      start, lazfs_lrzip_decompress(sfd, dfd));
+}
+#endif
+
+static const codec_t codecs[] = {
+	{ "laz", codec_lazcompress, codec_lazdecompress, codec_lasprobe,
+	  codec_lazsetopt, codec_lazfreeopts, NULL, CODEC_LAS },
+#ifdef HAVE_LIBZSTD
+	{ "zstd", codec_zstdcompress, codec_zstddecompress,
+	  lazfs_zstd_probesize, codec_zstdsetopt, codec_zstdfreeopts,
+	  &codec_zstdlazy, 0 },
+#endif
+#ifdef HAVE_LIBLRZIP
+	{ "lrzip", codec_lrzipcompress, codec_lrzipdecompress,
+	  lazfs_lrzip_probesize, NULL, NULL, NULL, 0 },
+#endif
+};
+
+#define CODEC_NCODECS (sizeof(codecs) / sizeof(codecs[0]))
+
+const codec_t *
+codec_get(unsigned int i)
+{
+	return (i < CODEC_NCODECS) ? &codecs[i] : NULL;
+}
+
+const codec_t *
+codec_find(const char *name)
+{
+	unsigned int i;
+
+	assert(name != NULL);
+
+	for (i = 0; i < CODEC_NCODECS; i++)
+		if (strcmp(codecs[i].name, name) == 0)
+			return &codecs[i];
+
+	return NULL;
+}
+
+/* Appends rule, rules are matched in order of the file */
+static int
+codec_addrule(codec_rule_t ***tailp, const char *suffix, const char *stored,
+	      const codec_t *codec)
+{
+	codec_rule_t *rule;
+
+	rule = calloc(1, sizeof(*rule));
+	if (rule == NULL)
+		return -ENOMEM;
+
+	rule->suffix = strdup(suffix);
+	rule->stored = strdup(stored);
+	if (rule->suffix == NULL || rule->stored == NULL) {
+		free(rule->suffix);
+		free(rule->stored);
+		free(rule);
+		return -ENOMEM;
+	}
+	rule->codec = codec;
+
+	**tailp = rule;
+	*tailp = &rule->next;
+
+	return 0;
+}
+
+/* Parses "name=value" option of the rule */
+static int
+codec_setopt(codec_rule_t *rule, char *opt, const char *path,
+	     unsigned int lineno)
+{
+	const codec_t *codec = rule->codec;
+	char *value;
+	int ret;
+
+	value = strchr(opt, '=');
+	if (value == NULL || codec->setopt == NULL) {
+		fprintf(stderr, "%s:%u: %s\n", path, lineno,
+			(value == NULL) ? "options must be \"name=value\"" :
+			"codec has no options");
+		return -EINVAL;
+	}
+	*value++ = '\0';
+
+	ret = codec->setopt(rule, opt, value);
+	if (ret != 0)
+		fprintf(stderr, "%s:%u: option \"%s\" of %s: %s\n", path,
+			lineno, opt, codec->name, (ret == -ENOENT) ?
+			"unknown option" : strerror(-ret));
+
+	return (ret == -ENOMEM) ? ret : (ret != 0) ? -EINVAL : 0;
+}
+
+/* Parses "tier codec [name=value...]", save points behind the codec */
+static int
+codec_loadtier(const char *name, char **save, const char *path,
+	       unsigned int lineno)
+{
+	const codec_t *codec;
+	char *opt;
+	int ret = 0;
+
+	codec = (name != NULL) ? codec_find(name) : NULL;
+	if (codec == NULL || (codec->flags & CODEC_LAS) ||
+	    codec_tierrule != NULL) {
+		fprintf(stderr, "%s:%u: expected one \"tier codec "
+			"[name=value...]\" line with compiled in codec other "
+			"than laz\n", path, lineno);
+		return -EINVAL;
+	}
+
+	codec_tierrule = calloc(1, sizeof(*codec_tierrule));
+	if (codec_tierrule == NULL)
+		return -ENOMEM;
+	codec_tierrule->codec = codec;
+
+	while (ret == 0 && (opt = strtok_r(NULL, " \t\r\n", save)) != NULL)
+		ret = codec_setopt(codec_tierrule, opt, path, lineno);
+
+	return ret;
+}
+
+/* Tier codec defaults to the first codec which doesn't store LAS */
+static int
+codec_defaulttier(void)
+{
+	unsigned int i;
+
+	if (codec_tierrule != NULL)
+		return 0;
+
+	for (i = 0; i < CODEC_NCODECS; i++) {
+		if (codecs[i].flags & CODEC_LAS)
+			continue;
+
+		codec_tierrule = calloc(1, sizeof(*codec_tierrule));
+		if (codec_tierrule == NULL)
+			return -ENOMEM;
+		codec_tierrule->codec = &codecs[i];
+		break;
+	}
+
+	return 0;
+}
+
+int
+codec_loadrules(const char *path)
+{
+	codec_rule_t **tail = &codec_rules, **last;
+	const codec_t *codec;
+	char *line = NULL, *suffix, *stored, *name, *save, *opt, *p;
+	size_t linesize = 0;
+	unsigned int lineno = 0;
+	FILE *fp;
+	int ret = 0;
+
+	assert(codec_rules == NULL);
+
+	if (path == NULL) {
+		ret = codec_addrule(&tail, CODEC_DEFAULTSUFFIX,
+				    CODEC_DEFAULTSTORED,
+				    codec_find(CODEC_DEFAULTCODEC));
+		if (ret == 0)
+			ret = codec_defaulttier();
+		if (ret != 0)
+			codec_freerules();
+		return ret;
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		ret = -errno;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+
+		p = strchr(line, '#');
+		if (p != NULL)
+			*p = '\0';
+
+		suffix = strtok_r(line, " \t\r\n", &save);
+		if (suffix == NULL)
+			continue;
+		stored = strtok_r(NULL, " \t\r\n", &save);
+
+		if (strcmp(suffix, CODEC_TIERKEYWORD) == 0) {
+			ret = codec_loadtier(stored, &save, path, lineno);
+			if (ret != 0)
+				break;
+			continue;
+		}
+		name = strtok_r(NULL, " \t\r\n", &save);
+		if (name == NULL) {
+			fprintf(stderr, "%s:%u: expected \"suffix stored-suffix "
+				"codec [name=value...]\"\n", path, lineno);
+			ret = -EINVAL;
+			break;
+		}
+
+		if (suffix[0] != '.' || stored[0] != '.' ||
+		    strcmp(suffix, stored) == 0) {
+			fprintf(stderr, "%s:%u: suffixes must start with '.' "
+				"and differ\n", path, lineno);
+			ret = -EINVAL;
+			break;
+		}
+
+		codec = codec_find(name);
+		if (codec == NULL) {
+			fprintf(stderr, "%s:%u: codec \"%s\" is not compiled "
+				"in\n", path, lineno, name);
+			ret = -EINVAL;
+			break;
+		}
+
+		last = tail;
+		ret = codec_addrule(&tail, suffix, stored, codec);
+		if (ret != 0)
+			break;
+
+		while (ret == 0 &&
+		       (opt = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+			ret = codec_setopt(*last, opt, path, lineno);
+		if (ret != 0)
+			break;
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (ret == 0)
+		ret = codec_defaulttier();
+	if (ret != 0)
+		codec_freerules();
+
+	return ret;
+}
+
+static void
+codec_freerule(codec_rule_t *rule)
+{
+	if (rule->opts != NULL)
+		rule->codec->freeopts(rule->opts);
+	free(rule->suffix);
+	free(rule->stored);
+	free(rule);
+}
+
+void
+codec_freerules(void)
+{
+	codec_rule_t *rule;
+
+	while (codec_rules != NULL) {
+		rule = codec_rules;
+		codec_rules = rule->next;
+		codec_freerule(rule);
+	}
+
+	if (codec_tierrule != NULL) {
+		codec_freerule(codec_tierrule);
+		codec_tierrule = NULL;
+	}
+}
+
+int
+codec_reorders(const codec_rule_t *rule)
+{
+	assert(rule != NULL);
+
+	/* Options of other codecs aren't lazfs_reorderopts_t */
+	return (rule->codec->flags & CODEC_LAS) &&
+	       (lazfs_reorder_order(rule->opts) != LAZFS_ORDER_NONE ||
+		lazfs_reorder_lod(rule->opts));
+}
+
+const codec_rule_t *
+codec_tier(void)
+{
+	return codec_tierrule;
+}
+
+/* Returns non-zero if name ends with suffix */
+static int
+codec_hassuffix(const char *name, size_t len, const char *suffix)
+{
+	size_t slen = strlen(suffix);
+
+	return len >= slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+const codec_rule_t *
+codec_match(const char *path)
+{
+	const codec_rule_t *rule, *best = NULL;
+	size_t len;
+
+	assert(path != NULL);
+
+	/* The longest suffix wins, ".xyz.gz" is more specific than ".gz" */
+	len = strlen(path);
+	for (rule = codec_rules; rule != NULL; rule = rule->next)
+		if (codec_hassuffix(path, len, rule->suffix) &&
+		    (best == NULL || strlen(rule->suffix) > strlen(best->suffix)))
+			best = rule;
+
+	return best;
+}
+
+const codec_rule_t *
+codec_matchstored(const char *name, char vname[PATH_MAX])
+{
+	const codec_rule_t *rule, *best = NULL;
+	size_t len;
+
+	assert(name != NULL);
+
+	len = strlen(name);
+	for (rule = codec_rules; rule != NULL; rule = rule->next)
+		if (codec_hassuffix(name, len, rule->stored) &&
+		    (best == NULL || strlen(rule->stored) > strlen(best->stored)))
+			best = rule;
+
+	if (best == NULL)
+		return NULL;
+
+	len -= strlen(best->stored);
+	if (len + strlen(best->suffix) >= PATH_MAX)
+		return NULL;
+
+	memcpy(vname, name, len);
+	strcpy(vname + len, best->suffix);
+
+	return best;
+}
+
+int
+codec_storedpath(const codec_rule_t *rule, const char *path,
+		 char cpath[PATH_MAX])
+{
+	size_t len;
+
+	assert(rule != NULL);
+	assert(path != NULL);
+
+	len = strlen(path);
+	assert(codec_hassuffix(path, len, rule->suffix));
+
+	len -= strlen(rule->suffix);
+	if (len + strlen(rule->stored) >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	memcpy(cpath, path, len);
+	strcpy(cpath + len, rule->stored);
+
+	return 0;
+}
+
+int
+codec_probesize(const codec_rule_t *rule, const char *path, off_t *size)
+{
+	const codec_t *codec;
+	struct stat statbuf;
+	int fd, tmpfd, ret;
+
+	assert(rule != NULL);
+
+	codec = rule->codec;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return lazfs_error("codec_probesize open");
+
+	if (codec->probesize != NULL && codec->probesize(fd, size) == 0) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	/* Size isn't in the header, it's cached in xattr by the caller */
+	log_debug("    codec_probesize: decompressing \"%s\"\n", path);
+	tmpfd = lazfs_tmpfile();
+	if (tmpfd < 0) {
+		ret = tmpfd;
+		goto cleanup;
+	}
+
+	ret = codec->decompress(rule, fd, tmpfd);
+	if (ret == 0 && fstat(tmpfd, &statbuf) != 0)
+		ret = -errno;
+	if (ret == 0)
+		*size = statbuf.st_size;
+	close(tmpfd);
+
+cleanup:
+	close(fd);
+
+	if (ret != 0)
+		log_error("    ERROR codec_probesize: can't get size of \"%s\" "
+			  "via %s: %s\n", path, codec->name, strerror(-ret));
+
+	return ret;
+}
+
+int
+codec_compressjob(void *arg)
+{
+	codec_job_t *job = arg;
+
+	return job->rule->codec->compress(job->rule, job->sfd, job->dfd);
+}
+
+int
+codec_decompressjob(void *arg)
+{
+	codec_job_t *job = arg;
+
+	return job->rule->codec->decompress(job->rule, job->sfd, job->dfd);
+}
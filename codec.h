@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include "rangeset.h"
+#include <limits.h>
+#include <sys/types.h>
+
+/*
+ * Registry of codecs and rules which map suffix of virtual files to suffix
+ * of compressed backend files. Virtual file "foo.las" is stored as
+ * "foo.laz" when rule ".las .laz laz" is loaded.
+ *
+ * Rules are loaded once before mount and are read-only afterwards, lookups
+ * don't need any locking. All codec_* functions return -errno as errors.
+ */
+
+/*
+ * Decompressed data is LAS. LAS-aware paths (header patching, per-chunk
+ * recompression, streaming compression, size from header) are used only
+ * for such codecs.
+ */
+#define CODEC_LAS 0x1
+
+typedef struct codec_rule codec_rule_t;
+
+/*
+ * On-demand decompression. Instead of decompressing whole file on open,
+ * dfd gets size of the decompressed file and parts of it are decompressed
+ * when they are accessed. All functions but open are thread safe and return
+ * -errno as errors.
+ */
+typedef struct codec_lazyops {
+	/*
+	 * Reads index of compressed sfd and sizes dfd. Returns -ENOTSUP if
+	 * sfd can't be decompressed by parts.
+	 */
+	int (*open)(const codec_rule_t *rule, int sfd, int dfd, void **lazyp);
+	/* Decompresses parts of range [offset, offset + len) missing in dfd */
+	int (*fetch)(void *lazy, off_t offset, off_t len);
+	/* Called before dfd is truncated to size */
+	int (*truncate)(void *lazy, off_t size);
+	/* Returns non-zero when whole file was decompressed */
+	int (*complete)(void *lazy);
+	/*
+	 * Writes new compressed file to dfd. Parts which don't intersect
+	 * dirty are copied from sfd, dirty NULL means everything is dirty.
+	 */
+	int (*recompress)(void *lazy, const lazfs_rangeset_t *dirty, int dfd);
+	void (*close)(void *lazy);
+} codec_lazyops_t;
+
+typedef struct codec {
+	const char *name;
+	/* Compresses or decompresses sfd to dfd, both are positioned at 0 */
+	int (*compress)(const codec_rule_t *rule, int sfd, int dfd);
+	int (*decompress)(const codec_rule_t *rule, int sfd, int dfd);
+	/*
+	 * Reads decompressed size from the compressed fd without full
+	 * decompression. NULL or failure means the file must be decompressed
+	 * to get its size.
+	 */
+	int (*probesize)(int fd, off_t *size);
+	/*
+	 * Parses "name=value" option of the rule into rule->opts, NULL if
+	 * codec has no options.
+	 */
+	int (*setopt)(codec_rule_t *rule, const char *name, const char *value);
+	void (*freeopts)(void *opts);
+	const codec_lazyops_t *lazy; /* NULL if codec can't decompress parts */
+	unsigned int flags;
+} codec_t;
+
+struct codec_rule {
+	char *suffix; /* Suffix of the virtual file, e.g. ".las" */
+	char *stored; /* Suffix of the backend file, e.g. ".laz" */
+	const codec_t *codec;
+	void *opts; /* Parsed options, NULL means codec defaults */
+	struct codec_rule *next;
+};
+
+/* Codec run via workq, see codec_compressjob() */
+typedef struct codec_job {
+	const codec_rule_t *rule;
+	int sfd;
+	int dfd;
+} codec_job_t;
+
+/* Returns i-th compiled in codec or NULL after the last one */
+const codec_t *
+codec_get(unsigned int i);
+
+/* Returns codec of the given name or NULL if it isn't compiled in */
+const codec_t *
+codec_find(const char *name);
+
+/*
+ * Loads rules from file, one "suffix stored-suffix codec [name=value...]"
+ * per line, '#' starts a comment. When path is NULL, the only rule is
+ * ".las .laz laz". Line "tier codec [name=value...]" selects codec of cold
+ * files, see tier.h. Errors are reported to stderr with line number.
+ */
+int
+codec_loadrules(const char *path);
+
+/* Frees loaded rules */
+void
+codec_freerules(void);
+
+/*
+ * Returns rule of the tier codec (without suffixes), NULL if there is no
+ * codec other than laz
+ */
+const codec_rule_t *
+codec_tier(void);
+
+/*
+ * Returns non-zero if compression by rule changes order of points (laz
+ * codec with order= or lod= option), so points of the stored file differ
+ * from the decompressed one.
+ */
+int
+codec_reorders(const codec_rule_t *rule);
+
+/* Returns rule which suffix matches path, NULL if there is none */
+const codec_rule_t *
+codec_match(const char *path);
+
+/*
+ * Returns rule which stored suffix matches name of the backend file, NULL
+ * if there is none. Name of the virtual file is stored to vname.
+ */
+const codec_rule_t *
+codec_matchstored(const char *name, char vname[PATH_MAX]);
+
+/*
+ * Stores backend path of the virtual path to cpath. Path must match the
+ * rule. Returns 0 or -ENAMETOOLONG.
+ */
+int
+codec_storedpath(const codec_rule_t *rule, const char *path,
+		 char cpath[PATH_MAX]);
+
+/*
+ * Gets decompressed size of the backend file path, via probesize or by
+ * decompression.
+ */
+int
+codec_probesize(const codec_rule_t *rule, const char *path, off_t *size);
+
+/* Runs compression or decompression of job (codec_job_t) via workq */
+int
+codec_compressjob(void *arg);
+
+int
+codec_decompressjob(void *arg);
+
+#endif
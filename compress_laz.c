@@ -7,8 +7,14 @@
 
 #include "compress_laz.h"
 #include "log.h"
+#include "probes.h"
+#include "stats.h"
 #include <errno.h>
 #include <liblas/capi/liblas.h>
+#include <stdint.h>
+
+/* Points in one chunk written by laszip (its default chunk size) */
+#define LAZ_CHUNKPOINTS 50000
 
 static int
 laz_processfile(int sfd, int dfd, char compress)
@@ -17,12 +23,12 @@ laz_processfile(int sfd, int dfd, char compress)
 	LASWriterH writer = NULL;
 	LASHeaderH wheader = NULL;
 	LASPointH p = NULL;
+	uint64_t npoints = 0, start, now;
 	int ret = 0;
 
-	/*
-	 * FIXME: No logging works here because this function is not called from fuse
-	 * thread. It is called from workq thread. */
-	//log_debug("\nlaz_processfile: sfd: \"%d\", dfd:\"%d\"\n", sfd, dfd);
+	log_debug("\nlaz_processfile: sfd: \"%d\", dfd:\"%d\"\n", sfd, dfd);
+	LAZFS_PROBE3(codec__start, compress, sfd, dfd);
+	start = stats_now();
 
 	reader = LASReader_CreateFromFile(fdopen(sfd, "r"));
 	if (reader == NULL) {
@@ -57,6 +63,10 @@ laz_processfile(int sfd, int dfd, char compress)
 		goto cleanup;
 	}
 
+	now = stats_now();
+	stats_record(STATS_CODEC_HEADER, now - start, 0);
+	start = now;
+
 	/* Process point-by-point */
 	p = LASReader_GetNextPoint(reader);
 	while (p) {
@@ -67,13 +77,29 @@ laz_processfile(int sfd, int dfd, char compress)
 			ret = -ENOSPC;
 			goto cleanup;
 		}
+		if (++npoints % LAZ_CHUNKPOINTS == 0)
+			LAZFS_PROBE3(codec__chunk, compress,
+				     npoints / LAZ_CHUNKPOINTS - 1,
+				     LAZ_CHUNKPOINTS);
 		p = LASReader_GetNextPoint(reader);
 	}
 
+	if (npoints % LAZ_CHUNKPOINTS != 0)
+		LAZFS_PROBE3(codec__chunk, compress, npoints / LAZ_CHUNKPOINTS,
+			     npoints % LAZ_CHUNKPOINTS);
+
+	now = stats_now();
+	stats_record(STATS_CODEC_POINTS, now - start, 0);
+	start = now;
+
+	/* Writer writes the last chunk and chunk table when destroyed */
 	LASWriter_Destroy(writer);
 	LASHeader_Destroy(wheader);
 	LASReader_Destroy(reader);
 
+	stats_record(STATS_CODEC_FLUSH, stats_now() - start, 0);
+
+	LAZFS_PROBE3(codec__done, compress, 0, npoints);
 	return 0;
 
 cleanup:
@@ -84,6 +110,7 @@ cleanup:
 	if (reader != NULL)
 		LASReader_Destroy(reader);
 
+	LAZFS_PROBE3(codec__done, compress, ret, npoints);
 	return ret;
 }
 
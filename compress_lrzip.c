@@ -8,9 +8,17 @@
 #include "compress_lrzip.h"
 #include "log.h"
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <Lrzip.h>
 
+/* lrzip 0.6 header: "LRZI", major, minor, expected size (LE) */
+#define LRZIP_MAGIC "LRZI"
+#define LRZIP_SIZEOFF 6
+
 static void
 lrzip_log(void *data, unsigned int level, unsigned int line, const char *file,
 	  const char *format, va_list args)
@@ -24,29 +32,47 @@ lrzip_log(void *data, unsigned int level, unsigned int line, const char *file,
 	
 }
 
+/* Codec runs in several workq threads at once */
+static pthread_once_t lrzip_once = PTHREAD_ONCE_INIT;
+
+static void
+lrzip_initonce(void)
+{
+	lrzip_init();
+}
+
 static int
 lrzip_processfile(int sfd, int dfd, char compress)
 {
-	static char once = 0;
 	int ret = 0;
 	FILE *sfp = NULL;
 	FILE *dfp = NULL;
 	Lrzip *lr = NULL;
 
-	if (!once) {
-		once = 1;
-		lrzip_init();
-	}
+	pthread_once(&lrzip_once, lrzip_initonce);
+
+	/* Streams are closed when done, fds are owned by the caller */
+	sfd = dup(sfd);
+	if (sfd == -1)
+		return -errno;
 
 	sfp = fdopen(sfd, "rb");
 	if (sfp == NULL) {
 		ret = -errno;
+		close(sfd);
 		return ret;
 	}
 
+	dfd = dup(dfd);
+	if (dfd == -1) {
+		ret = -errno;
+		goto cleanup;
+	}
+
 	dfp = fdopen(dfd, "wb");
 	if (dfp == NULL) {
 		ret = -errno;
+		close(dfd);
 		goto cleanup;
 	}
 
@@ -58,7 +84,7 @@ lrzip_processfile(int sfd, int dfd, char compress)
 
 	lrzip_config_env(lr);
 	lrzip_log_cb_set(lr, &lrzip_log, NULL);
-	lrzip_log_level_set(lr, debug ? LRZIP_LOG_LEVEL_DEBUG : LRZIP_LOG_LEVEL_ERROR);
+	lrzip_log_level_set(lr, log_enabled(LOG_LEVEL_DEBUG) ? LRZIP_LOG_LEVEL_DEBUG : LRZIP_LOG_LEVEL_ERROR);
 
 	if (compress) {
 		/* Set the best compression */
@@ -76,11 +102,8 @@ lrzip_processfile(int sfd, int dfd, char compress)
 		goto cleanup;
 	}
 
-	lrzip_free(lr);
-	fflush(dfp);
-	fflush(sfp);
-
-	return 0;
+	if (fflush(dfp) != 0)
+		ret = -errno;
 
 cleanup:
 	if (lr != NULL)
@@ -105,3 +128,26 @@ lazfs_lrzip_compress(int sfd, int dfd)
 	return lrzip_processfile(sfd, dfd, 1);
 }
 
+
+int
+lazfs_lrzip_probesize(int fd, off_t *size)
+{
+	unsigned char buf[LRZIP_SIZEOFF + 8];
+	uint64_t esize = 0;
+	int i;
+
+	if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+	    memcmp(buf, LRZIP_MAGIC, 4) != 0 || buf[4] != 0 || buf[5] < 6)
+		return -EINVAL;
+
+	for (i = 7; i >= 0; i--)
+		esize = (esize << 8) | buf[LRZIP_SIZEOFF + i];
+
+	/* Size is zero when lrzip compressed stdin */
+	if (esize == 0)
+		return -EINVAL;
+
+	*size = esize;
+
+	return 0;
+}
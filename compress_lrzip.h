@@ -8,10 +8,16 @@
 #ifndef _COMPRESS_LRZIP_H_
 #define _COMPRESS_LRZIP_H_
 
+#include <sys/types.h>
+
 int
 lazfs_lrzip_decompress(int sfd, int dfd);
 
 int
 lazfs_lrzip_compress(int sfd, int dfd);
 
+/* Reads decompressed size from the lrzip header */
+int
+lazfs_lrzip_probesize(int fd, off_t *size);
+
 #endif
@@ -0,0 +1,1066 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains zstd codec for files without known structure, see
+ * compress_zstd.h. Seek table follows the zstd seekable format:
+ *
+ *   skippable frame magic (u32), size of the table (u32),
+ *   per frame: compressed size (u32), decompressed size (u32)
+ *              [, checksum (u32) if descriptor bit 7 is set],
+ *   number of frames (u32), descriptor (u8), seekable magic (u32)
+ *
+ * All numbers are little endian.
+ */
+
+#include "compress_zstd.h"
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+/* Defaults of the options */
+#define ZSTD_DEFLEVEL 3
+#define ZSTD_DEFTHREADS 4
+#define ZSTD_DEFFRAME (1024 * 1024)
+
+#define ZSTD_MAXTHREADS 64
+#define ZSTD_MINFRAME (64 * 1024)
+#define ZSTD_MAXFRAME (64 * 1024 * 1024)
+#define ZSTD_MAXDICT (16 * 1024 * 1024)
+
+/* Frames compressed ahead of the writer per thread */
+#define ZSTD_WINDOW 2
+
+#define ZSTD_SKIPPABLEMAGIC 0x184D2A5EU
+#define ZSTD_SEEKABLEMAGIC 0x8F92EAB1U
+#define ZSTD_FOOTERSIZE 9
+#define ZSTD_CHECKSUMFLAG 0x80
+#define ZSTD_HEADERSIZE 18 /* ZSTD_FRAMEHEADERSIZE_MAX */
+
+/* Frame states of zstdseek */
+#define ZSTD_MISSING 0
+#define ZSTD_BUSY 1
+#define ZSTD_DONE 2
+
+struct lazfs_zstdopts {
+	int level;
+	unsigned int threads;
+	size_t frame;
+	char *dict;
+	size_t dictlen;
+	ZSTD_CDict *cdict; /* Built for level, shared by threads */
+	ZSTD_DDict *ddict;
+};
+
+static const lazfs_zstdopts_t zstd_defopts = {
+	ZSTD_DEFLEVEL, ZSTD_DEFTHREADS, ZSTD_DEFFRAME, NULL, 0, NULL, NULL
+};
+
+typedef struct zstd_frame {
+	off_t coff;	/* Offset in the compressed file */
+	off_t doff;	/* Offset in the decompressed file */
+	uint32_t csize;
+	uint32_t dsize;
+} zstd_frame_t;
+
+struct lazfs_zstdseek {
+	const lazfs_zstdopts_t *opts;
+	int sfd;
+	int dfd;
+	zstd_frame_t *frames;
+	uint32_t nframes;
+	off_t size;	/* Decompressed size when opened */
+	off_t minsize;	/* Frames beyond it are invalid, see truncate */
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *state;	/* ZSTD_MISSING, ZSTD_BUSY or ZSTD_DONE */
+	uint32_t ndone;
+};
+
+/* Output frame of the compressor, either compressed or copied */
+typedef struct zstd_task {
+	off_t doff;
+	uint32_t dsize;
+	const zstd_frame_t *copy; /* Copied from cfd if set */
+} zstd_task_t;
+
+typedef struct zstd_slot {
+	char *buf;
+	size_t size;
+	size_t len;
+	char ready;
+} zstd_slot_t;
+
+/* Compressor threads fill slots, caller writes them in order */
+typedef struct zstd_pool {
+	const lazfs_zstdopts_t *opts;
+	int rawfd;		/* Decompressed data */
+	int cfd;		/* Compressed file of copied frames */
+	lazfs_zstdseek_t *zs;	/* Fetched before rawfd is read or NULL */
+	zstd_task_t *tasks;
+	uint32_t ntasks;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	zstd_slot_t *slots;
+	unsigned int nslots;
+	uint32_t next;		/* Next task to take */
+	uint32_t written;	/* Tasks written by caller */
+	int err;
+} zstd_pool_t;
+
+static void
+zstd_putle32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t
+zstd_getle32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Reads exactly len bytes, returns 0 or -errno (-EIO on short read) */
+static int
+zstd_pread(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread(fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int
+zstd_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Parses positive number with optional K or M suffix */
+static int
+zstd_parsesize(const char *value, unsigned long *size)
+{
+	char *end;
+
+	errno = 0;
+	*size = strtoul(value, &end, 10);
+	if (errno != 0 || end == value)
+		return -EINVAL;
+
+	if (*end == 'K' || *end == 'k') {
+		*size *= 1024;
+		end++;
+	} else if (*end == 'M' || *end == 'm') {
+		*size *= 1024 * 1024;
+		end++;
+	}
+
+	return (*end == '\0') ? 0 : -EINVAL;
+}
+
+/* (Re)builds dictionaries, compression one depends on level */
+static int
+zstd_builddicts(lazfs_zstdopts_t *opts)
+{
+	if (opts->dict == NULL)
+		return 0;
+
+	ZSTD_freeCDict(opts->cdict);
+	opts->cdict = ZSTD_createCDict(opts->dict, opts->dictlen, opts->level);
+	if (opts->ddict == NULL)
+		opts->ddict = ZSTD_createDDict(opts->dict, opts->dictlen);
+
+	return (opts->cdict != NULL && opts->ddict != NULL) ? 0 : -ENOMEM;
+}
+
+static int
+zstd_loaddict(lazfs_zstdopts_t *opts, const char *path)
+{
+	struct stat statbuf;
+	int fd, ret;
+
+	if (opts->dict != NULL)
+		return -EEXIST;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &statbuf) != 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	if (statbuf.st_size == 0 || statbuf.st_size > ZSTD_MAXDICT) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	opts->dict = malloc(statbuf.st_size);
+	if (opts->dict == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+	opts->dictlen = statbuf.st_size;
+
+	ret = zstd_pread(fd, opts->dict, opts->dictlen, 0);
+	if (ret == 0)
+		ret = zstd_builddicts(opts);
+
+cleanup:
+	close(fd);
+
+	return ret;
+}
+
+int
+lazfs_zstd_setopt(lazfs_zstdopts_t **optsp, const char *name,
+		  const char *value)
+{
+	lazfs_zstdopts_t *opts;
+	unsigned long num;
+	char *end;
+	long level;
+
+	assert(optsp != NULL);
+
+	opts = *optsp;
+	if (opts == NULL) {
+		opts = malloc(sizeof(*opts));
+		if (opts == NULL)
+			return -ENOMEM;
+		*opts = zstd_defopts;
+		*optsp = opts;
+	}
+
+	if (strcmp(name, "level") == 0) {
+		errno = 0;
+		level = strtol(value, &end, 10);
+		if (errno != 0 || end == value || *end != '\0' ||
+		    level < ZSTD_minCLevel() || level > ZSTD_maxCLevel())
+			return -EINVAL;
+		opts->level = level;
+		return zstd_builddicts(opts);
+	} else if (strcmp(name, "threads") == 0) {
+		if (zstd_parsesize(value, &num) != 0 || num < 1 ||
+		    num > ZSTD_MAXTHREADS)
+			return -EINVAL;
+		opts->threads = num;
+	} else if (strcmp(name, "frame") == 0) {
+		if (zstd_parsesize(value, &num) != 0 || num < ZSTD_MINFRAME ||
+		    num > ZSTD_MAXFRAME)
+			return -EINVAL;
+		opts->frame = num;
+	} else if (strcmp(name, "dict") == 0) {
+		return zstd_loaddict(opts, value);
+	} else
+		return -ENOENT;
+
+	return 0;
+}
+
+void
+lazfs_zstd_freeopts(lazfs_zstdopts_t *opts)
+{
+	if (opts == NULL)
+		return;
+
+	ZSTD_freeCDict(opts->cdict);
+	ZSTD_freeDDict(opts->ddict);
+	free(opts->dict);
+	free(opts);
+}
+
+/* Compresses or copies one task into its slot */
+static int
+zstd_runtask(zstd_pool_t *pool, ZSTD_CCtx *cctx, char **inbuf,
+	     size_t *insize, const zstd_task_t *task, zstd_slot_t *slot)
+{
+	size_t need, ret;
+	char *buf;
+	int err;
+
+	if (task->copy != NULL)
+		need = task->copy->csize;
+	else
+		need = ZSTD_compressBound(task->dsize);
+
+	if (slot->size < need) {
+		buf = realloc(slot->buf, need);
+		if (buf == NULL)
+			return -ENOMEM;
+		slot->buf = buf;
+		slot->size = need;
+	}
+
+	if (task->copy != NULL) {
+		slot->len = task->copy->csize;
+		return zstd_pread(pool->cfd, slot->buf, slot->len,
+				  task->copy->coff);
+	}
+
+	if (*insize < task->dsize) {
+		buf = realloc(*inbuf, task->dsize);
+		if (buf == NULL)
+			return -ENOMEM;
+		*inbuf = buf;
+		*insize = task->dsize;
+	}
+
+	if (pool->zs != NULL) {
+		err = lazfs_zstd_fetch(pool->zs, task->doff, task->dsize);
+		if (err != 0)
+			return err;
+	}
+
+	err = zstd_pread(pool->rawfd, *inbuf, task->dsize, task->doff);
+	if (err != 0)
+		return err;
+
+	ret = ZSTD_compress2(cctx, slot->buf, slot->size, *inbuf, task->dsize);
+	if (ZSTD_isError(ret)) {
+		log_error("    ERROR zstd_compress: %s\n", ZSTD_getErrorName(ret));
+		return -EIO;
+	}
+	slot->len = ret;
+
+	return 0;
+}
+
+static void *
+zstd_worker(void *arg)
+{
+	zstd_pool_t *pool = arg;
+	ZSTD_CCtx *cctx;
+	char *inbuf = NULL;
+	size_t insize = 0;
+	uint32_t i;
+	int ret = 0;
+
+	cctx = ZSTD_createCCtx();
+	if (cctx == NULL) {
+		ret = -ENOMEM;
+	} else if (pool->opts->cdict != NULL) {
+		ZSTD_CCtx_refCDict(cctx, pool->opts->cdict);
+	} else {
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+				       pool->opts->level);
+	}
+	if (cctx != NULL)
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+
+	LOCK(pool->lock);
+	if (ret != 0)
+		pool->err = ret;
+	while (pool->err == 0 && pool->next < pool->ntasks) {
+		i = pool->next;
+		/* Slot of the task is free when task nslots back was written */
+		if (i >= pool->written + pool->nslots) {
+			WAIT(pool->cond, pool->lock);
+			continue;
+		}
+		pool->next++;
+		UNLOCK(pool->lock);
+
+		ret = zstd_runtask(pool, cctx, &inbuf, &insize,
+				   &pool->tasks[i], &pool->slots[i % pool->nslots]);
+
+		LOCK(pool->lock);
+		if (ret != 0 && pool->err == 0)
+			pool->err = ret;
+		pool->slots[i % pool->nslots].ready = 1;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	UNLOCK(pool->lock);
+
+	free(inbuf);
+	ZSTD_freeCCtx(cctx);
+
+	return NULL;
+}
+
+/* Writes seek table after frames of total size off */
+static int
+zstd_writetable(int dfd, off_t off, const zstd_task_t *tasks,
+		const uint32_t *csizes, uint32_t ntasks)
+{
+	unsigned char *table, *p;
+	size_t len;
+	uint32_t i;
+	int ret;
+
+	len = 8 + 8 * (size_t) ntasks + ZSTD_FOOTERSIZE;
+	table = malloc(len);
+	if (table == NULL)
+		return -ENOMEM;
+
+	p = table;
+	zstd_putle32(p, ZSTD_SKIPPABLEMAGIC);
+	zstd_putle32(p + 4, len - 8);
+	p += 8;
+	for (i = 0; i < ntasks; i++) {
+		zstd_putle32(p, csizes[i]);
+		zstd_putle32(p + 4, tasks[i].dsize);
+		p += 8;
+	}
+	zstd_putle32(p, ntasks);
+	p[4] = 0; /* No checksums, frames carry their own */
+	zstd_putle32(p + 5, ZSTD_SEEKABLEMAGIC);
+
+	ret = zstd_pwrite(dfd, table, len, off);
+	free(table);
+
+	return ret;
+}
+
+/* Runs tasks by pool of threads, frames and seek table are written to dfd */
+static int
+zstd_runpool(zstd_pool_t *pool, int dfd)
+{
+	pthread_t threads[ZSTD_MAXTHREADS];
+	unsigned int nthreads, i, started = 0;
+	uint32_t *csizes = NULL;
+	zstd_slot_t *slot;
+	off_t off = 0;
+	uint32_t t;
+	int ret = 0;
+
+	nthreads = pool->opts->threads;
+	if (nthreads > pool->ntasks)
+		nthreads = pool->ntasks;
+
+	pool->nslots = ZSTD_WINDOW * (nthreads ? nthreads : 1);
+	pool->slots = calloc(pool->nslots, sizeof(*pool->slots));
+	csizes = malloc((pool->ntasks ? pool->ntasks : 1) * sizeof(*csizes));
+	if (pool->slots == NULL || csizes == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, zstd_worker, pool) != 0)
+			break;
+		started++;
+	}
+	if (started == 0 && pool->ntasks > 0) {
+		ret = -EAGAIN;
+		goto destroy;
+	}
+
+	for (t = 0; t < pool->ntasks; t++) {
+		slot = &pool->slots[t % pool->nslots];
+
+		LOCK(pool->lock);
+		while (!slot->ready && pool->err == 0)
+			WAIT(pool->cond, pool->lock);
+		ret = pool->err;
+		UNLOCK(pool->lock);
+		if (ret != 0)
+			break;
+
+		ret = zstd_pwrite(dfd, slot->buf, slot->len, off);
+		if (ret != 0)
+			break;
+		off += slot->len;
+		csizes[t] = slot->len;
+		if (pool->tasks[t].copy != NULL)
+			stats_add(STATS_FRAMES_COPIED, 1);
+
+		LOCK(pool->lock);
+		slot->ready = 0;
+		pool->written++;
+		pthread_cond_broadcast(&pool->cond);
+		UNLOCK(pool->lock);
+	}
+
+	/* Stop workers on error */
+	LOCK(pool->lock);
+	if (ret != 0 && pool->err == 0)
+		pool->err = ret;
+	pthread_cond_broadcast(&pool->cond);
+	UNLOCK(pool->lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (ret == 0)
+		ret = zstd_writetable(dfd, off, pool->tasks, csizes,
+				      pool->ntasks);
+
+destroy:
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+
+cleanup:
+	if (pool->slots != NULL)
+		for (i = 0; i < pool->nslots; i++)
+			free(pool->slots[i].buf);
+	free(pool->slots);
+	free(csizes);
+
+	return ret;
+}
+
+/* Appends tasks compressing [start, end) in frames of opts->frame */
+static int
+zstd_addtasks(zstd_task_t **tasksp, uint32_t *ntasks, uint32_t *allocated,
+	      const lazfs_zstdopts_t *opts, off_t start, off_t end,
+	      const zstd_frame_t *copy)
+{
+	zstd_task_t *tasks;
+	off_t len;
+
+	do {
+		if (*ntasks == *allocated) {
+			*allocated = *allocated ? 2 * *allocated : 64;
+			tasks = realloc(*tasksp, *allocated * sizeof(*tasks));
+			if (tasks == NULL)
+				return -ENOMEM;
+			*tasksp = tasks;
+		}
+
+		len = end - start;
+		if (copy == NULL && len > (off_t) opts->frame)
+			len = opts->frame;
+
+		tasks = &(*tasksp)[(*ntasks)++];
+		tasks->doff = start;
+		tasks->dsize = len;
+		tasks->copy = copy;
+		start += len;
+	} while (start < end);
+
+	return 0;
+}
+
+int
+lazfs_zstd_compress(const lazfs_zstdopts_t *opts, int sfd, int dfd)
+{
+	zstd_pool_t pool;
+	struct stat statbuf;
+	uint32_t allocated = 0;
+	int ret;
+
+	log_debug("\nzstd_compress: sfd: \"%d\", dfd:\"%d\"\n", sfd, dfd);
+
+	memset(&pool, 0, sizeof(pool));
+	pool.opts = (opts != NULL) ? opts : &zstd_defopts;
+	pool.rawfd = sfd;
+	pool.cfd = -1;
+
+	if (fstat(sfd, &statbuf) != 0)
+		return -errno;
+
+	ret = 0;
+	if (statbuf.st_size > 0)
+		ret = zstd_addtasks(&pool.tasks, &pool.ntasks, &allocated,
+				    pool.opts, 0, statbuf.st_size, NULL);
+	if (ret == 0)
+		ret = zstd_runpool(&pool, dfd);
+
+	free(pool.tasks);
+
+	return ret;
+}
+
+int
+lazfs_zstd_decompress(const lazfs_zstdopts_t *opts, int sfd, int dfd)
+{
+	ZSTD_DCtx *dctx = NULL;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	char *ibuf = NULL, *obuf = NULL;
+	size_t ilen, olen, left = 0;
+	off_t off = 0;
+	ssize_t rlen;
+	int ret = 0;
+
+	log_debug("\nzstd_decompress: sfd: \"%d\", dfd:\"%d\"\n", sfd, dfd);
+
+	ilen = ZSTD_DStreamInSize();
+	olen = ZSTD_DStreamOutSize();
+	ibuf = malloc(ilen);
+	obuf = malloc(olen);
+	dctx = ZSTD_createDCtx();
+	if (ibuf == NULL || obuf == NULL || dctx == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	if (opts != NULL && opts->ddict != NULL)
+		ZSTD_DCtx_refDDict(dctx, opts->ddict);
+
+	/* Seek table is a skippable frame, decoder skips it */
+	while ((rlen = read(sfd, ibuf, ilen)) != 0) {
+		if (rlen < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			goto cleanup;
+		}
+
+		in.src = ibuf;
+		in.size = rlen;
+		in.pos = 0;
+		while (in.pos < in.size) {
+			out.dst = obuf;
+			out.size = olen;
+			out.pos = 0;
+			left = ZSTD_decompressStream(dctx, &out, &in);
+			if (ZSTD_isError(left)) {
+				log_error("    ERROR zstd_decompress: %s\n",
+					  ZSTD_getErrorName(left));
+				ret = -EIO;
+				goto cleanup;
+			}
+
+			ret = zstd_pwrite(dfd, obuf, out.pos, off);
+			if (ret != 0)
+				goto cleanup;
+			off += out.pos;
+		}
+	}
+
+	/* Non-zero hint means the last frame is truncated */
+	if (left != 0) {
+		log_error("    ERROR zstd_decompress: truncated frame\n");
+		ret = -EIO;
+	}
+
+cleanup:
+	ZSTD_freeDCtx(dctx);
+	free(obuf);
+	free(ibuf);
+
+	return ret;
+}
+
+/* Reads seek table of fd, returns -ENOTSUP if there is none */
+static int
+zstd_readtable(int fd, zstd_frame_t **framesp, uint32_t *nframesp,
+	       off_t *sizep)
+{
+	unsigned char footer[ZSTD_FOOTERSIZE], *table = NULL, *p;
+	zstd_frame_t *frames = NULL;
+	struct stat statbuf;
+	uint32_t nframes, i;
+	size_t esize, len;
+	off_t coff = 0, doff = 0, start;
+	int ret;
+
+	if (fstat(fd, &statbuf) != 0)
+		return -errno;
+
+	if (statbuf.st_size < 8 + ZSTD_FOOTERSIZE)
+		return -ENOTSUP;
+
+	ret = zstd_pread(fd, footer, sizeof(footer),
+			 statbuf.st_size - ZSTD_FOOTERSIZE);
+	if (ret != 0)
+		return ret;
+
+	if (zstd_getle32(footer + 5) != ZSTD_SEEKABLEMAGIC)
+		return -ENOTSUP;
+
+	nframes = zstd_getle32(footer);
+	esize = (footer[4] & ZSTD_CHECKSUMFLAG) ? 12 : 8;
+	len = 8 + esize * nframes + ZSTD_FOOTERSIZE;
+	if ((off_t) len > statbuf.st_size || len / esize < nframes)
+		return -EINVAL;
+	start = statbuf.st_size - len;
+
+	table = malloc(len);
+	frames = malloc((nframes ? nframes : 1) * sizeof(*frames));
+	if (table == NULL || frames == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	ret = zstd_pread(fd, table, len, start);
+	if (ret != 0)
+		goto cleanup;
+
+	if (zstd_getle32(table) != ZSTD_SKIPPABLEMAGIC ||
+	    zstd_getle32(table + 4) != len - 8) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	for (i = 0, p = table + 8; i < nframes; i++, p += esize) {
+		frames[i].coff = coff;
+		frames[i].doff = doff;
+		frames[i].csize = zstd_getle32(p);
+		frames[i].dsize = zstd_getle32(p + 4);
+		coff += frames[i].csize;
+		doff += frames[i].dsize;
+	}
+
+	/* Frames must end where the seek table starts */
+	if (coff != start) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	*framesp = frames;
+	frames = NULL;
+	*nframesp = nframes;
+	*sizep = doff;
+
+cleanup:
+	free(frames);
+	free(table);
+
+	return ret;
+}
+
+int
+lazfs_zstd_probesize(int fd, off_t *size)
+{
+	char buf[ZSTD_HEADERSIZE];
+	unsigned long long csize;
+	zstd_frame_t *frames;
+	uint32_t nframes;
+	ssize_t len;
+
+	if (zstd_readtable(fd, &frames, &nframes, size) == 0) {
+		free(frames);
+		return 0;
+	}
+
+	/* Single frame written by zstd tool */
+	len = pread(fd, buf, sizeof(buf), 0);
+	if (len < 0)
+		return -errno;
+
+	csize = ZSTD_getFrameContentSize(buf, len);
+	if (csize == ZSTD_CONTENTSIZE_UNKNOWN ||
+	    csize == ZSTD_CONTENTSIZE_ERROR)
+		return -EINVAL;
+
+	*size = csize;
+
+	return 0;
+}
+
+int
+lazfs_zstd_open(const lazfs_zstdopts_t *opts, int sfd, int dfd,
+		lazfs_zstdseek_t **zsp)
+{
+	lazfs_zstdseek_t *zs;
+	int ret;
+
+	assert(zsp != NULL);
+
+	zs = calloc(1, sizeof(*zs));
+	if (zs == NULL)
+		return -ENOMEM;
+
+	zs->opts = (opts != NULL) ? opts : &zstd_defopts;
+	zs->sfd = sfd;
+	zs->dfd = dfd;
+
+	ret = zstd_readtable(sfd, &zs->frames, &zs->nframes, &zs->size);
+	if (ret != 0)
+		goto cleanup;
+	zs->minsize = zs->size;
+
+	zs->state = calloc(zs->nframes ? zs->nframes : 1, 1);
+	if (zs->state == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	if (ftruncate(dfd, zs->size) != 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	pthread_mutex_init(&zs->lock, NULL);
+	pthread_cond_init(&zs->cond, NULL);
+	*zsp = zs;
+
+	return 0;
+
+cleanup:
+	free(zs->state);
+	free(zs->frames);
+	free(zs);
+
+	return ret;
+}
+
+/* Returns index of the frame holding offset, offset must be below size */
+static uint32_t
+zstd_findframe(const lazfs_zstdseek_t *zs, off_t offset)
+{
+	uint32_t lo = 0, hi = zs->nframes - 1, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (zs->frames[mid].doff <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+static int
+zstd_fetchframe(lazfs_zstdseek_t *zs, ZSTD_DCtx *dctx, const zstd_frame_t *f)
+{
+	char *cbuf, *dbuf;
+	size_t ret;
+	int err;
+
+	cbuf = malloc(f->csize);
+	dbuf = malloc(f->dsize ? f->dsize : 1);
+	if (cbuf == NULL || dbuf == NULL) {
+		err = -ENOMEM;
+		goto cleanup;
+	}
+
+	err = zstd_pread(zs->sfd, cbuf, f->csize, f->coff);
+	if (err != 0)
+		goto cleanup;
+
+	if (zs->opts->ddict != NULL)
+		ret = ZSTD_decompress_usingDDict(dctx, dbuf, f->dsize, cbuf,
+						 f->csize, zs->opts->ddict);
+	else
+		ret = ZSTD_decompressDCtx(dctx, dbuf, f->dsize, cbuf, f->csize);
+	if (ZSTD_isError(ret) || ret != f->dsize) {
+		log_error("    ERROR zstd_fetch: frame at %lld: %s\n",
+			  (long long) f->coff, ZSTD_isError(ret) ?
+			  ZSTD_getErrorName(ret) : "size mismatch");
+		err = -EIO;
+		goto cleanup;
+	}
+
+	err = zstd_pwrite(zs->dfd, dbuf, f->dsize, f->doff);
+	if (err == 0)
+		stats_add(STATS_FRAMES_FETCHED, 1);
+
+cleanup:
+	free(dbuf);
+	free(cbuf);
+
+	return err;
+}
+
+int
+lazfs_zstd_fetch(lazfs_zstdseek_t *zs, off_t offset, off_t len)
+{
+	ZSTD_DCtx *dctx = NULL;
+	uint32_t i, last;
+	int ret = 0;
+
+	assert(zs != NULL);
+
+	if (offset >= zs->size || len <= 0 || zs->nframes == 0)
+		return 0;
+	if (len > zs->size - offset)
+		len = zs->size - offset;
+
+	i = zstd_findframe(zs, offset);
+	last = zstd_findframe(zs, offset + len - 1);
+
+	for (; i <= last && ret == 0; i++) {
+		LOCK(zs->lock);
+		while (zs->state[i] == ZSTD_BUSY)
+			WAIT(zs->cond, zs->lock);
+		if (zs->state[i] == ZSTD_DONE) {
+			UNLOCK(zs->lock);
+			continue;
+		}
+		zs->state[i] = ZSTD_BUSY;
+		UNLOCK(zs->lock);
+
+		if (dctx == NULL) {
+			dctx = ZSTD_createDCtx();
+			if (dctx == NULL)
+				ret = -ENOMEM;
+		}
+		if (ret == 0)
+			ret = zstd_fetchframe(zs, dctx, &zs->frames[i]);
+
+		LOCK(zs->lock);
+		if (ret == 0) {
+			zs->state[i] = ZSTD_DONE;
+			zs->ndone++;
+		} else
+			zs->state[i] = ZSTD_MISSING;
+		pthread_cond_broadcast(&zs->cond);
+		UNLOCK(zs->lock);
+	}
+
+	ZSTD_freeDCtx(dctx);
+
+	return ret;
+}
+
+int
+lazfs_zstd_truncate(lazfs_zstdseek_t *zs, off_t size)
+{
+	uint32_t i;
+	int ret;
+
+	assert(zs != NULL);
+
+	if (size >= zs->minsize)
+		return 0;
+
+	/* Kept part of the frame which is cut must be valid */
+	i = (size > 0) ? zstd_findframe(zs, size - 1) : 0;
+	if (size > 0) {
+		ret = lazfs_zstd_fetch(zs, zs->frames[i].doff,
+				       size - zs->frames[i].doff);
+		if (ret != 0)
+			return ret;
+		i++;
+	}
+
+	/* Data of the following frames are gone, never fetch them */
+	LOCK(zs->lock);
+	for (; i < zs->nframes; i++) {
+		while (zs->state[i] == ZSTD_BUSY)
+			WAIT(zs->cond, zs->lock);
+		if (zs->state[i] != ZSTD_DONE) {
+			zs->state[i] = ZSTD_DONE;
+			zs->ndone++;
+		}
+	}
+	zs->minsize = size;
+	UNLOCK(zs->lock);
+
+	return 0;
+}
+
+int
+lazfs_zstd_complete(lazfs_zstdseek_t *zs)
+{
+	int ret;
+
+	assert(zs != NULL);
+
+	LOCK(zs->lock);
+	ret = (zs->ndone == zs->nframes);
+	UNLOCK(zs->lock);
+
+	return ret;
+}
+
+int
+lazfs_zstd_recompress(lazfs_zstdseek_t *zs, const lazfs_rangeset_t *dirty,
+		      int cfd)
+{
+	const zstd_frame_t *f, *copy;
+	zstd_pool_t pool;
+	struct stat statbuf;
+	uint32_t i, allocated = 0;
+	off_t size, pos = 0, end;
+	int ret = 0;
+
+	assert(zs != NULL);
+
+	if (fstat(zs->dfd, &statbuf) != 0)
+		return -errno;
+	size = statbuf.st_size;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.opts = zs->opts;
+	pool.rawfd = zs->dfd;
+	pool.cfd = zs->sfd;
+	pool.zs = zs;
+
+	/*
+	 * Old frame boundaries are kept, clean frames which weren't cut by
+	 * truncation are copied as they are.
+	 */
+	for (i = 0; i < zs->nframes && pos < size && ret == 0; i++) {
+		f = &zs->frames[i];
+		end = f->doff + f->dsize;
+		copy = NULL;
+		if (dirty != NULL && end <= zs->minsize && end <= size &&
+		    !rangeset_intersects(dirty, f->doff, end))
+			copy = f;
+		if (end > size)
+			end = size;
+		if (end > f->doff)
+			ret = zstd_addtasks(&pool.tasks, &pool.ntasks,
+					    &allocated, pool.opts, f->doff,
+					    end, copy);
+		pos = end;
+	}
+
+	/* Appended data */
+	if (ret == 0 && pos < size)
+		ret = zstd_addtasks(&pool.tasks, &pool.ntasks, &allocated,
+				    pool.opts, pos, size, NULL);
+	if (ret == 0)
+		ret = zstd_runpool(&pool, cfd);
+
+	free(pool.tasks);
+
+	return ret;
+}
+
+void
+lazfs_zstd_close(lazfs_zstdseek_t *zs)
+{
+	if (zs == NULL)
+		return;
+
+	pthread_cond_destroy(&zs->cond);
+	pthread_mutex_destroy(&zs->lock);
+	free(zs->state);
+	free(zs->frames);
+	free(zs);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _COMPRESS_ZSTD_H_
+#define _COMPRESS_ZSTD_H_
+
+#include "rangeset.h"
+#include <sys/types.h>
+
+/*
+ * Files are stored in zstd seekable format: independent frames of at most
+ * "frame" decompressed bytes followed by seek table in a skippable frame.
+ * Plain zstd tools decompress such files, lazfs can decompress only frames
+ * which are accessed. Frames are compressed by several threads at once.
+ *
+ * All lazfs_zstd_* functions return -errno as errors.
+ */
+
+/* Options of the codec, NULL means defaults */
+typedef struct lazfs_zstdopts lazfs_zstdopts_t;
+
+/* Seekable file being decompressed on demand */
+typedef struct lazfs_zstdseek lazfs_zstdseek_t;
+
+/*
+ * Sets option, *optsp is allocated on first call. Options are
+ * level=N, threads=N, frame=SIZE[K|M] and dict=PATH.
+ */
+int
+lazfs_zstd_setopt(lazfs_zstdopts_t **optsp, const char *name,
+		  const char *value);
+
+void
+lazfs_zstd_freeopts(lazfs_zstdopts_t *opts);
+
+int
+lazfs_zstd_decompress(const lazfs_zstdopts_t *opts, int sfd, int dfd);
+
+int
+lazfs_zstd_compress(const lazfs_zstdopts_t *opts, int sfd, int dfd);
+
+/* Reads decompressed size from the seek table or the frame header */
+int
+lazfs_zstd_probesize(int fd, off_t *size);
+
+/*
+ * Reads seek table of sfd and truncates dfd to the decompressed size.
+ * Returns -ENOTSUP if sfd has no seek table.
+ */
+int
+lazfs_zstd_open(const lazfs_zstdopts_t *opts, int sfd, int dfd,
+		lazfs_zstdseek_t **zsp);
+
+/* Decompresses frames of range [offset, offset + len) to dfd if missing */
+int
+lazfs_zstd_fetch(lazfs_zstdseek_t *zs, off_t offset, off_t len);
+
+/* Called before dfd is truncated, frames beyond size are never fetched */
+int
+lazfs_zstd_truncate(lazfs_zstdseek_t *zs, off_t size);
+
+/* Returns non-zero if all frames are decompressed */
+int
+lazfs_zstd_complete(lazfs_zstdseek_t *zs);
+
+/*
+ * Compresses dfd of zs into new file cfd. Frames which don't intersect
+ * dirty are copied from sfd, dirty NULL means all frames are dirty.
+ */
+int
+lazfs_zstd_recompress(lazfs_zstdseek_t *zs, const lazfs_rangeset_t *dirty,
+		      int cfd);
+
+void
+lazfs_zstd_close(lazfs_zstdseek_t *zs);
+
+#endif
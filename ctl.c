@@ -0,0 +1,663 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains virtual files in CTL_DIR. "stats" and "stats.prom"
+ * describe state of lazfs, text is generated when the file is opened so
+ * every reader gets consistent snapshot, "prefetch" lists prefetched files.
+ * Commands written to "ctl" are executed immediately.
+ */
+
+#define _GNU_SOURCE /* posix_fadvise() */
+
+#include "params.h"
+#include "ctl.h"
+#include "diskcache.h"
+#include "log.h"
+#include "prefetch.h"
+#include "raw.h"
+#include "stats.h"
+#include "tier.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+/* Longest accepted command */
+#define CTL_CMDMAX PATH_MAX
+
+/*
+ * Prometheus histogram buckets are powers of two nanoseconds, from 2^10 ns
+ * (~1us) to 2^36 ns (~69s), so they match histogram buckets exactly.
+ */
+#define CTL_PROM_MINEXP 10
+#define CTL_PROM_MAXEXP 36
+#define CTL_PROM_STEP 2
+
+typedef struct ctl_file {
+	ctl_node_t node;
+	char *buf; /* Generated text or unterminated command */
+	size_t len;
+	size_t allocated;
+} ctl_file_t;
+
+static const char *ctl_names[] = {
+	[CTL_STATS] = "stats",
+	[CTL_PROM] = "stats.prom",
+	[CTL_PREFETCH] = "prefetch",
+	[CTL_CTL] = "ctl",
+};
+
+ctl_node_t
+ctl_lookup(const char *path)
+{
+	size_t len = strlen(CTL_DIR);
+	int i;
+
+	if (strncmp(path, CTL_DIR, len) != 0)
+		return CTL_NONE;
+	if (path[len] == '\0')
+		return CTL_ROOT;
+	if (path[len] != '/')
+		return CTL_NONE;
+
+	for (i = CTL_STATS; i <= CTL_CTL; i++) {
+		if (strcmp(path + len + 1, ctl_names[i]) == 0)
+			return i;
+	}
+
+	return CTL_MISSING;
+}
+
+/* Only the user who mounted lazfs (or root) can control it */
+static int
+ctl_permitted(void)
+{
+	uid_t uid = fuse_get_context()->uid;
+
+	return uid == 0 || uid == getuid();
+}
+
+int
+ctl_getattr(ctl_node_t node, struct stat *statbuf)
+{
+	assert(statbuf != NULL);
+
+	if (node == CTL_MISSING)
+		return -ENOENT;
+
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_uid = getuid();
+	statbuf->st_gid = getgid();
+	statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = time(NULL);
+
+	switch (node) {
+	case CTL_ROOT:
+		statbuf->st_mode = S_IFDIR | 0555;
+		statbuf->st_nlink = 2;
+		break;
+	case CTL_CTL:
+		statbuf->st_mode = S_IFREG | 0600;
+		statbuf->st_nlink = 1;
+		break;
+	default:
+		/* Size is unknown until file is opened, read uses direct_io */
+		statbuf->st_mode = S_IFREG | 0444;
+		statbuf->st_nlink = 1;
+		break;
+	}
+
+	return 0;
+}
+
+int
+ctl_access(ctl_node_t node, int mask)
+{
+	if (node == CTL_MISSING)
+		return -ENOENT;
+	if (node == CTL_CTL)
+		return ctl_permitted() ? 0 : -EACCES;
+	if (mask & W_OK)
+		return -EACCES;
+
+	return 0;
+}
+
+int
+ctl_opendir(ctl_node_t node)
+{
+	if (node == CTL_MISSING)
+		return -ENOENT;
+
+	return (node == CTL_ROOT) ? 0 : -ENOTDIR;
+}
+
+int
+ctl_readdir(ctl_node_t node, void *buf, fuse_fill_dir_t filler)
+{
+	int i;
+
+	if (node != CTL_ROOT)
+		return -ENOTDIR;
+
+	if (filler(buf, ".", NULL, 0) != 0 || filler(buf, "..", NULL, 0) != 0)
+		return -ENOMEM;
+
+	for (i = CTL_STATS; i <= CTL_CTL; i++) {
+		if (filler(buf, ctl_names[i], NULL, 0) != 0)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Appends formatted text to the file */
+static int
+ctl_printf(ctl_file_t *file, const char *format, ...)
+{
+	va_list ap;
+	size_t allocated;
+	char *buf;
+	int len;
+
+	while (1) {
+		va_start(ap, format);
+		len = vsnprintf(file->buf + file->len,
+				file->allocated - file->len, format, ap);
+		va_end(ap);
+
+		if (len < 0)
+			return -EINVAL;
+		if (file->len + len < file->allocated)
+			break;
+
+		allocated = file->allocated ? file->allocated * 2 : 16384;
+		while (allocated <= file->len + len)
+			allocated *= 2;
+		buf = realloc(file->buf, allocated);
+		if (buf == NULL)
+			return -ENOMEM;
+		file->buf = buf;
+		file->allocated = allocated;
+	}
+
+	file->len += len;
+
+	return 0;
+}
+
+/* Values shared by both formats of statistics */
+typedef struct ctl_state {
+	double uptime;
+	laz_cacheinfo_t cache;
+	unsigned long long scratchfree;
+	unsigned int attrentries;
+	int nworkers, nrunning, nqueued;
+	double busy; /* Seconds spent by workers running jobs */
+} ctl_state_t;
+
+static void
+ctl_getstate(ctl_state_t *state)
+{
+	stats_histogram_t h;
+	struct statvfs sv;
+
+	memset(state, 0, sizeof(*state));
+
+	state->uptime = (stats_now() - LAZFS_DATA->mounted) / 1e9;
+
+	cache_lock(LAZFS_DATA->cache);
+	cache_info(LAZFS_DATA->cache, &state->cache);
+	cache_unlock(LAZFS_DATA->cache);
+
+	if (statvfs(diskcache_scratchdir(), &sv) == 0)
+		state->scratchfree = (unsigned long long) sv.f_bavail *
+				     sv.f_frsize;
+
+	state->attrentries = attrcache_count(LAZFS_DATA->attrcache);
+	lazfs_workq_info(LAZFS_DATA->workq, &state->nworkers,
+			 &state->nrunning, &state->nqueued);
+
+	stats_gethist(STATS_WORKQ_RUN, &h);
+	state->busy = h.sum / 1e9;
+}
+
+static int
+ctl_stats(ctl_file_t *file)
+{
+	stats_histogram_t h;
+	ctl_state_t state;
+	int i, ret;
+
+	ctl_getstate(&state);
+
+	ret = ctl_printf(file,
+			 "uptime_seconds %.3f\n"
+			 "cache_decompressing %u\n"
+			 "cache_ready %u\n"
+			 "cache_dirty %u\n"
+			 "cache_dead %u\n"
+			 "scratch_bytes %lld\n"
+			 "scratch_free_bytes %llu\n"
+			 "attrcache_entries %u\n"
+			 "workq_workers %d\n"
+			 "workq_depth %d\n"
+			 "workq_busy_workers %d\n"
+			 "workq_utilization %.3f\n"
+			 "log_level %s\n",
+			 state.uptime, state.cache.decompressing,
+			 state.cache.ready, state.cache.dirty, state.cache.dead,
+			 (long long) state.cache.scratch, state.scratchfree,
+			 state.attrentries, state.nworkers, state.nqueued,
+			 state.nrunning,
+			 state.uptime > 0 ?
+			 state.busy / (state.uptime * state.nworkers) : 0,
+			 log_levelname(log_level));
+
+	for (i = 0; i < STATS_NCOUNTERS && ret == 0; i++)
+		ret = ctl_printf(file, "%s %lld\n", stats_name(i),
+				 (long long) stats_get(i));
+
+	if (ret == 0)
+		ret = ctl_printf(file, "\n%-12s %10s %8s %10s %10s %10s %10s "
+				 "%10s\n", "latency_us", "count", "errors",
+				 "avg", "p50", "p90", "p99", "max");
+
+	for (i = 0; i < STATS_NHISTS && ret == 0; i++) {
+		stats_gethist(i, &h);
+		ret = ctl_printf(file, "%-12s %10llu %8llu %10.1f %10.1f %10.1f "
+				 "%10.1f %10.1f\n", stats_histname(i),
+				 (unsigned long long) h.count,
+				 (unsigned long long) h.errors,
+				 h.count ? h.sum / 1e3 / h.count : 0.0,
+				 stats_percentile(&h, 0.5) / 1e3,
+				 stats_percentile(&h, 0.9) / 1e3,
+				 stats_percentile(&h, 0.99) / 1e3,
+				 h.max / 1e3);
+	}
+
+	return ret;
+}
+
+static int
+ctl_promgauge(ctl_file_t *file, const char *name, const char *help,
+	      double value)
+{
+	return ctl_printf(file, "# HELP lazfs_%s %s\n"
+			  "# TYPE lazfs_%s gauge\n"
+			  "lazfs_%s %.15g\n", name, help, name, name, value);
+}
+
+static int
+ctl_prom(ctl_file_t *file)
+{
+	stats_histogram_t h;
+	ctl_state_t state;
+	int i, exp, ret;
+
+	ctl_getstate(&state);
+
+	ret = ctl_promgauge(file, "uptime_seconds", "Time since mount.",
+			    state.uptime);
+	if (ret == 0)
+		ret = ctl_printf(file,
+				 "# HELP lazfs_cache_entries Open files by state.\n"
+				 "# TYPE lazfs_cache_entries gauge\n"
+				 "lazfs_cache_entries{state=\"decompressing\"} %u\n"
+				 "lazfs_cache_entries{state=\"ready\"} %u\n"
+				 "lazfs_cache_entries{state=\"dirty\"} %u\n"
+				 "lazfs_cache_entries{state=\"dead\"} %u\n",
+				 state.cache.decompressing, state.cache.ready,
+				 state.cache.dirty, state.cache.dead);
+	if (ret == 0)
+		ret = ctl_promgauge(file, "scratch_bytes",
+				    "Space used by decompressed files.",
+				    state.cache.scratch);
+	if (ret == 0)
+		ret = ctl_promgauge(file, "scratch_free_bytes",
+				    "Free space for decompressed files.",
+				    state.scratchfree);
+	if (ret == 0)
+		ret = ctl_promgauge(file, "attrcache_entries",
+				    "Files in attribute cache.",
+				    state.attrentries);
+	if (ret == 0)
+		ret = ctl_promgauge(file, "workq_workers",
+				    "Number of workq threads.", state.nworkers);
+	if (ret == 0)
+		ret = ctl_promgauge(file, "workq_depth",
+				    "Jobs waiting in workq.", state.nqueued);
+	if (ret == 0)
+		ret = ctl_promgauge(file, "workq_busy_workers",
+				    "Workq threads running a job.",
+				    state.nrunning);
+	if (ret == 0)
+		ret = ctl_printf(file,
+				 "# HELP lazfs_workq_busy_seconds_total Time workq threads spent running jobs.\n"
+				 "# TYPE lazfs_workq_busy_seconds_total counter\n"
+				 "lazfs_workq_busy_seconds_total %.9f\n",
+				 state.busy);
+
+	for (i = 0; i < STATS_NCOUNTERS && ret == 0; i++) {
+		if (stats_isgauge(i))
+			ret = ctl_printf(file, "# TYPE lazfs_%s gauge\n"
+					 "lazfs_%s %lld\n", stats_name(i),
+					 stats_name(i),
+					 (long long) stats_get(i));
+		else
+			ret = ctl_printf(file, "# TYPE lazfs_%s_total counter\n"
+					 "lazfs_%s_total %lld\n", stats_name(i),
+					 stats_name(i),
+					 (long long) stats_get(i));
+	}
+
+	if (ret == 0)
+		ret = ctl_printf(file,
+				 "# HELP lazfs_duration_seconds Latency of operations.\n"
+				 "# TYPE lazfs_duration_seconds histogram\n");
+	for (i = 0; i < STATS_NHISTS && ret == 0; i++) {
+		stats_gethist(i, &h);
+		for (exp = CTL_PROM_MINEXP; exp <= CTL_PROM_MAXEXP && ret == 0;
+		     exp += CTL_PROM_STEP)
+			ret = ctl_printf(file, "lazfs_duration_seconds_bucket"
+					 "{op=\"%s\",le=\"%.9g\"} %llu\n",
+					 stats_histname(i), (1ULL << exp) / 1e9,
+					 (unsigned long long)
+					 stats_countbelow(&h, 1ULL << exp));
+		if (ret == 0)
+			ret = ctl_printf(file, "lazfs_duration_seconds_bucket"
+					 "{op=\"%s\",le=\"+Inf\"} %llu\n"
+					 "lazfs_duration_seconds_sum{op=\"%s\"} %.9f\n"
+					 "lazfs_duration_seconds_count{op=\"%s\"} %llu\n",
+					 stats_histname(i),
+					 (unsigned long long) h.count,
+					 stats_histname(i), h.sum / 1e9,
+					 stats_histname(i),
+					 (unsigned long long) h.count);
+	}
+
+	if (ret == 0)
+		ret = ctl_printf(file,
+				 "# HELP lazfs_errors_total Failed operations.\n"
+				 "# TYPE lazfs_errors_total counter\n");
+	for (i = 0; i < STATS_NHISTS && ret == 0; i++) {
+		stats_gethist(i, &h);
+		ret = ctl_printf(file, "lazfs_errors_total{op=\"%s\"} %llu\n",
+				 stats_histname(i),
+				 (unsigned long long) h.errors);
+	}
+
+	return ret;
+}
+
+static int
+ctl_prefetchedfile(void *arg, const char *path, const char *state,
+		   int explicit)
+{
+	return ctl_printf(arg, "%-7s %-7s %s\n", state,
+			  explicit ? "request" : "ahead", path);
+}
+
+/* Lists prefetched files, requested ones and ones ahead of readers */
+static int
+ctl_prefetched(ctl_file_t *file)
+{
+	return lazfs_prefetch_walk(&ctl_prefetchedfile, file);
+}
+
+static int
+ctl_help(ctl_file_t *file)
+{
+	return ctl_printf(file,
+			  "drop                  drop cached file attributes\n"
+			  "evict PATH            drop files of PATH prefetched by request\n"
+			  "loglevel error|debug  change log level (now %s)\n"
+			  "prefetch PATH         decompress file or files of directory "
+			  "PATH ahead\n"
+			  "tier [DAYS]           tier files unused for DAYS (default "
+			  "tier_days)\n",
+			  log_levelname(log_level));
+}
+
+int
+ctl_open(ctl_node_t node, struct fuse_file_info *fi)
+{
+	ctl_file_t *file;
+	int ret = 0;
+
+	if (node == CTL_MISSING)
+		return -ENOENT;
+	if (node == CTL_ROOT)
+		return -EISDIR;
+	if (node == CTL_CTL && !ctl_permitted())
+		return -EACCES;
+	if (node != CTL_CTL && (fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	file = calloc(1, sizeof(*file));
+	if (file == NULL)
+		return -ENOMEM;
+	file->node = node;
+
+	if (node == CTL_STATS)
+		ret = ctl_stats(file);
+	else if (node == CTL_PROM)
+		ret = ctl_prom(file);
+	else if (node == CTL_PREFETCH)
+		ret = ctl_prefetched(file);
+	else if ((fi->flags & O_ACCMODE) == O_RDONLY)
+		ret = ctl_help(file); /* Only writers send commands */
+
+	if (ret != 0) {
+		free(file->buf);
+		free(file);
+		return ret;
+	}
+
+	/* Generated text changes every time, don't cache it */
+	fi->direct_io = 1;
+	fi->fh = (uintptr_t) file;
+
+	return 0;
+}
+
+int
+ctl_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset)
+{
+	ctl_file_t *file = (ctl_file_t *) (uintptr_t) fi->fh;
+
+	if (file->node == CTL_CTL && (fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EBADF;
+	if (offset >= (off_t) file->len)
+		return 0;
+	if (size > file->len - offset)
+		size = file->len - offset;
+
+	memcpy(buf, file->buf + offset, size);
+
+	return size;
+}
+
+/* Returns non-zero when path names a file or directory of the backend */
+static int
+ctl_backendpath(const char *path)
+{
+	char bpath[PATH_MAX];
+
+	return path[0] == '/' && ctl_lookup(path) == CTL_NONE &&
+	       !raw_lookup(path, bpath);
+}
+
+/*
+ * Requests decompression of file or directory path, metadata and page cache
+ * of compressed file are warmed first.
+ */
+static int
+ctl_prefetch(const char *path)
+{
+	char fpath[PATH_MAX], cpath[PATH_MAX];
+	const codec_rule_t *rule;
+	struct stat statbuf;
+	off_t size;
+	int fd, ret;
+
+	if (!ctl_backendpath(path))
+		return -EINVAL;
+
+	lazfs_fullpath(fpath, path);
+	rule = lazfs_exec_hooks(fpath, cpath);
+	if (rule == NULL)
+		return lazfs_prefetch_add(path);
+
+	fd = open(cpath, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	ret = fstat(fd, &statbuf) == 0 ? 0 : -errno;
+	if (ret == 0)
+		ret = lazfs_getsize(cpath, rule, &size);
+	if (ret == 0) {
+		attrcache_store(LAZFS_DATA->attrcache, cpath, &statbuf, size,
+				NULL);
+		ret = -posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+
+	close(fd);
+
+	return (ret == 0) ? lazfs_prefetch_add(path) : ret;
+}
+
+/* Starts pass over backend which tiers cold files */
+static int
+ctl_tier(const char *arg)
+{
+	unsigned long days = LAZFS_DATA->tier_days;
+	char *end;
+
+	if (arg != NULL) {
+		days = strtoul(arg, &end, 10);
+		if (end == arg || *end != '\0' || days > UINT_MAX)
+			return -EINVAL;
+	}
+
+	return lazfs_tier_start(LAZFS_DATA->rootdir, LAZFS_DATA->workq,
+				LAZFS_DATA->cache, days,
+				LAZFS_DATA->tier_iorate, LAZFS_DATA->tier_cpu);
+}
+
+static int
+ctl_command(char *cmd)
+{
+	char *arg;
+	int level;
+
+	arg = strchr(cmd, ' ');
+	if (arg != NULL) {
+		*arg++ = '\0';
+		while (*arg == ' ')
+			arg++;
+	}
+
+	log_debug("    ctl: command \"%s\" argument \"%s\"\n", cmd,
+		  arg ? arg : "");
+
+	if (strcmp(cmd, "drop") == 0 && arg == NULL) {
+		attrcache_clear(LAZFS_DATA->attrcache);
+		return 0;
+	}
+
+	if (strcmp(cmd, "loglevel") == 0 && arg != NULL) {
+		level = log_parselevel(arg);
+		if (level == -1)
+			return -EINVAL;
+		log_setlevel(level);
+		return 0;
+	}
+
+	if (strcmp(cmd, "prefetch") == 0 && arg != NULL)
+		return ctl_prefetch(arg);
+
+	if (strcmp(cmd, "evict") == 0 && arg != NULL)
+		return ctl_backendpath(arg) ? lazfs_prefetch_remove(arg) :
+					      -EINVAL;
+
+	if (strcmp(cmd, "tier") == 0)
+		return ctl_tier(arg);
+
+	/* Empty lines are ignored */
+	return (cmd[0] == '\0' && arg == NULL) ? 0 : -EINVAL;
+}
+
+/* Executes complete lines in file buffer */
+static int
+ctl_execute(ctl_file_t *file, char flush)
+{
+	char *line, *end;
+	size_t done = 0;
+	int ret = 0;
+
+	while (ret == 0 && done < file->len) {
+		line = file->buf + done;
+		end = memchr(line, '\n', file->len - done);
+		if (end == NULL) {
+			if (!flush)
+				break;
+			end = file->buf + file->len;
+		}
+
+		*end = '\0';
+		done = end - file->buf + (end < file->buf + file->len);
+		if (end > line && end[-1] == '\r')
+			end[-1] = '\0';
+		ret = ctl_command(line);
+	}
+
+	/* Keep unterminated command for next write */
+	memmove(file->buf, file->buf + done, file->len - done);
+	file->len -= done;
+
+	return ret;
+}
+
+int
+ctl_write(struct fuse_file_info *fi, const char *buf, size_t size)
+{
+	ctl_file_t *file = (ctl_file_t *) (uintptr_t) fi->fh;
+	int ret;
+
+	if (file->node != CTL_CTL)
+		return -EBADF;
+
+	if (file->len + size > CTL_CMDMAX)
+		return -E2BIG;
+
+	ret = ctl_printf(file, "%.*s", (int) size, buf);
+	if (ret == 0)
+		ret = ctl_execute(file, 0);
+
+	return (ret == 0) ? (int) size : ret;
+}
+
+int
+ctl_release(struct fuse_file_info *fi)
+{
+	ctl_file_t *file = (ctl_file_t *) (uintptr_t) fi->fh;
+	int ret = 0;
+
+	if (file->node == CTL_CTL && (fi->flags & O_ACCMODE) != O_RDONLY)
+		ret = ctl_execute(file, 1);
+
+	free(file->buf);
+	free(file);
+
+	return ret;
+}
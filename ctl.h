@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _CTL_H_
+#define _CTL_H_
+
+#include "params.h"
+#include <sys/stat.h>
+
+/*
+ * Virtual directory in the root of the mount. It is not listed by readdir
+ * and shadows directory of the same name in the backend.
+ */
+#define CTL_DIR "/.lazfs"
+
+typedef enum {
+	CTL_NONE = 0,	/* Path is not in CTL_DIR */
+	CTL_ROOT,	/* CTL_DIR itself */
+	CTL_STATS,	/* Statistics in text format */
+	CTL_PROM,	/* Statistics in Prometheus text format */
+	CTL_PREFETCH,	/* Prefetched files and their state */
+	CTL_CTL,	/* Control file accepting commands */
+	CTL_MISSING	/* Non-existent file in CTL_DIR */
+} ctl_node_t;
+
+/* Returns which virtual file path is */
+ctl_node_t
+ctl_lookup(const char *path);
+
+/*
+ * Functions below implement FUSE operations of virtual files, they return 0
+ * or -errno. Open virtual file keeps its state in fi->fh.
+ */
+int
+ctl_getattr(ctl_node_t node, struct stat *statbuf);
+
+int
+ctl_access(ctl_node_t node, int mask);
+
+int
+ctl_opendir(ctl_node_t node);
+
+int
+ctl_readdir(ctl_node_t node, void *buf, fuse_fill_dir_t filler);
+
+int
+ctl_open(ctl_node_t node, struct fuse_file_info *fi);
+
+/* Returns number of bytes read */
+int
+ctl_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset);
+
+/* Executes complete command lines, returns size or -errno */
+int
+ctl_write(struct fuse_file_info *fi, const char *buf, size_t size);
+
+/* Executes unterminated command and releases the file */
+int
+ctl_release(struct fuse_file_info *fi);
+
+#endif
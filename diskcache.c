@@ -0,0 +1,909 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains persistent cache of decompressed files, see
+ * diskcache.h. Kept files are tracked in memory, most recently kept first,
+ * the journal only records changes so it survives crash at any point.
+ * Journal is compacted on mount, unmount and when it grows too long.
+ */
+
+#define _GNU_SOURCE /* getline(), flock() */
+
+#include "params.h"
+#include "codec.h"
+#include "diskcache.h"
+#include "lazindex.h"
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DISKCACHE_JOURNAL "journal"
+#define DISKCACHE_LOCK "lock"
+#define DISKCACHE_KEEP "keep."
+#define DISKCACHE_TMP "lazfs."
+
+/* Longest name of a file in the cache directory */
+#define DISKCACHE_NAMEMAX 64
+
+/* Journal is compacted when it has more records than live ones plus this */
+#define DISKCACHE_SLACK 1024
+
+typedef struct diskcache_entry diskcache_entry_t;
+struct diskcache_entry {
+	char *name; /* File in the cache directory */
+	char *path; /* Path in the mount */
+	diskcache_key_t key; /* Kept files only */
+	off_t bytes; /* Size of the kept file, -1 until it's found on mount */
+	TAILQ_ENTRY(diskcache_entry) link;
+};
+
+TAILQ_HEAD(diskcache_list, diskcache_entry);
+
+/* Kept files, most recently kept first, and dirty decompressed files */
+static struct diskcache_list entries = TAILQ_HEAD_INITIALIZER(entries);
+static struct diskcache_list dirtyfiles = TAILQ_HEAD_INITIALIZER(dirtyfiles);
+static unsigned int nentries, ndirty;
+
+/* Protects everything below cachedir and rootdir, which are set on start */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *cachedir; /* NULL when disabled */
+static char *rootdir;
+static off_t budget;
+static off_t kept; /* Bytes of kept files */
+static unsigned long long seq; /* Number of the last kept file */
+static int journalfd = -1, lockfd = -1;
+static unsigned int nrecords; /* Records in the journal */
+
+static diskcache_entry_t *
+diskcache_newentry(const char *name, const char *path)
+{
+	diskcache_entry_t *entry;
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return NULL;
+
+	entry->name = strdup(name);
+	entry->path = strdup(path);
+	if (entry->name == NULL || entry->path == NULL) {
+		free(entry->name);
+		free(entry->path);
+		free(entry);
+		return NULL;
+	}
+	entry->bytes = -1;
+
+	return entry;
+}
+
+static void
+diskcache_freeentry(diskcache_entry_t *entry)
+{
+	free(entry->name);
+	free(entry->path);
+	free(entry);
+}
+
+static void
+diskcache_freelist(struct diskcache_list *list)
+{
+	diskcache_entry_t *entry;
+
+	while ((entry = TAILQ_FIRST(list)) != NULL) {
+		TAILQ_REMOVE(list, entry, link);
+		diskcache_freeentry(entry);
+	}
+}
+
+/* Finds entry of file name, or of path when name is NULL */
+static diskcache_entry_t *
+diskcache_find(struct diskcache_list *list, const char *name,
+	       const char *path)
+{
+	diskcache_entry_t *entry;
+
+	TAILQ_FOREACH(entry, list, link) {
+		if (name != NULL ? strcmp(entry->name, name) == 0 :
+				   strcmp(entry->path, path) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Returns name of decompressed file tmppath if it's in the cache directory */
+static const char *
+diskcache_name(const char *tmppath)
+{
+	size_t len;
+
+	if (cachedir == NULL)
+		return NULL;
+
+	len = strlen(cachedir);
+	if (strncmp(tmppath, cachedir, len) != 0 || tmppath[len] != '/')
+		return NULL;
+
+	return tmppath + len + 1;
+}
+
+/* Full path of file name in the cache directory */
+static int
+diskcache_path(char path[PATH_MAX], const char *name)
+{
+	int len;
+
+	len = snprintf(path, PATH_MAX, "%s/%s", cachedir, name);
+
+	return (len < PATH_MAX) ? 0 : -ENAMETOOLONG;
+}
+
+int
+diskcache_keystat(int fd, diskcache_key_t *key)
+{
+	struct stat statbuf;
+
+	if (cachedir == NULL)
+		return -ENOENT;
+	if (fstat(fd, &statbuf) != 0)
+		return -errno;
+
+	key->ino = statbuf.st_ino;
+	key->mtime = (long long) statbuf.st_mtim.tv_sec * 1000000000LL +
+		     statbuf.st_mtim.tv_nsec;
+	key->size = statbuf.st_size;
+	key->sum = 0;
+
+	return 0;
+}
+
+/*
+ * Checksum is FNV-1a of the first and last DISKCACHE_SAMPLE bytes, which
+ * covers LAZ header and chunk table, so files rewritten with preserved mtime
+ * and size are caught as well.
+ */
+int
+diskcache_keysum(int fd, diskcache_key_t *key)
+{
+	unsigned char buf[4096];
+	off_t offset, end;
+	diskcache_key_t after;
+	uint64_t h = 14695981039346656037ULL;
+	ssize_t i, len;
+	int ret;
+
+	offset = 0;
+	while (offset < key->size) {
+		/* Skip the middle of the file */
+		if (offset == DISKCACHE_SAMPLE &&
+		    key->size - DISKCACHE_SAMPLE > offset)
+			offset = key->size - DISKCACHE_SAMPLE;
+
+		end = (offset < DISKCACHE_SAMPLE) ? DISKCACHE_SAMPLE :
+						    key->size;
+		if (end - offset > (off_t) sizeof(buf))
+			end = offset + sizeof(buf);
+
+		len = pread(fd, buf, end - offset, offset);
+		if (len < 0)
+			return -errno;
+		if (len == 0)
+			break;
+
+		for (i = 0; i < len; i++) {
+			h ^= buf[i];
+			h *= 1099511628211ULL;
+		}
+		offset += len;
+	}
+
+	/* File might have been written while it was read */
+	ret = diskcache_keystat(fd, &after);
+	if (ret != 0)
+		return ret;
+	if (after.ino != key->ino || after.mtime != key->mtime ||
+	    after.size != key->size)
+		return -ESTALE;
+	key->sum = h;
+
+	return 0;
+}
+
+static int
+diskcache_keyeq(const diskcache_key_t *a, const diskcache_key_t *b)
+{
+	return a->ino == b->ino && a->mtime == b->mtime &&
+	       a->size == b->size && a->sum == b->sum;
+}
+
+static int
+diskcache_writekeep(FILE *fp, const diskcache_entry_t *entry)
+{
+	return fprintf(fp, "keep %s %llu %lld %lld %llx %s\n", entry->name,
+		       entry->key.ino, entry->key.mtime, entry->key.size,
+		       entry->key.sum, entry->path);
+}
+
+/*
+ * Rewrites the journal with live records only, must be called with lock
+ * held. Dirty records of files which are gone are dropped.
+ */
+static int
+diskcache_compact(void)
+{
+	char path[PATH_MAX], newpath[PATH_MAX], dpath[PATH_MAX];
+	diskcache_entry_t *entry, *next;
+	unsigned int n = 0;
+	FILE *fp;
+	int fd, ret = 0;
+
+	if (diskcache_path(path, DISKCACHE_JOURNAL) != 0 ||
+	    diskcache_path(newpath, DISKCACHE_JOURNAL ".new") != 0)
+		return -ENAMETOOLONG;
+
+	fp = fopen(newpath, "w");
+	if (fp == NULL)
+		return -errno;
+
+	/* Oldest first, replay inserts them in the same order */
+	TAILQ_FOREACH_REVERSE(entry, &entries, diskcache_list, link) {
+		if (diskcache_writekeep(fp, entry) < 0)
+			ret = -EIO;
+		n++;
+	}
+
+	for (entry = TAILQ_FIRST(&dirtyfiles); entry != NULL; entry = next) {
+		next = TAILQ_NEXT(entry, link);
+		if (diskcache_path(dpath, entry->name) != 0 ||
+		    access(dpath, F_OK) != 0) {
+			TAILQ_REMOVE(&dirtyfiles, entry, link);
+			diskcache_freeentry(entry);
+			ndirty--;
+			continue;
+		}
+		if (fprintf(fp, "dirty %s %s\n", entry->name, entry->path) < 0)
+			ret = -EIO;
+		n++;
+	}
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+		ret = -errno;
+	if (fclose(fp) != 0 && ret == 0)
+		ret = -errno;
+	if (ret == 0 && rename(newpath, path) != 0)
+		ret = -errno;
+	if (ret != 0) {
+		unlink(newpath);
+		return ret;
+	}
+
+	fd = open(path, O_WRONLY | O_APPEND);
+	if (fd == -1)
+		return -errno;
+	if (journalfd != -1)
+		close(journalfd);
+	journalfd = fd;
+	nrecords = n;
+
+	return 0;
+}
+
+/* Appends record to the journal, must be called with lock held */
+static void
+diskcache_record(const char *format, ...)
+{
+	char buf[PATH_MAX + 128];
+	va_list ap;
+	int len;
+
+	/* Journal is written by compaction at the end of start */
+	if (journalfd == -1)
+		return;
+
+	va_start(ap, format);
+	len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	/* Journal is only an optimization, lost record loses kept file */
+	if (len < 0 || len >= (int) sizeof(buf) ||
+	    write(journalfd, buf, len) != len) {
+		log_error("diskcache: journal write failed\n");
+		return;
+	}
+
+	if (++nrecords > 2 * (nentries + ndirty) + DISKCACHE_SLACK &&
+	    diskcache_compact() != 0)
+		log_error("diskcache: journal compaction failed\n");
+}
+
+/* Removes kept file, must be called with lock held */
+static void
+diskcache_drop(diskcache_entry_t *entry, int removefile)
+{
+	char path[PATH_MAX];
+
+	TAILQ_REMOVE(&entries, entry, link);
+	nentries--;
+	kept -= entry->bytes;
+	stats_add(STATS_DISKCACHE_KEPT, -entry->bytes);
+
+	if (removefile && diskcache_path(path, entry->name) == 0)
+		unlink(path);
+	diskcache_record("drop %s\n", entry->name);
+	diskcache_freeentry(entry);
+}
+
+/* Drops least recently kept files over budget, lock must be held */
+static void
+diskcache_evict(void)
+{
+	while (kept > budget && !TAILQ_EMPTY(&entries))
+		diskcache_drop(TAILQ_LAST(&entries, diskcache_list), 1);
+}
+
+/* Replaces entry of the same name in list with new one */
+static diskcache_entry_t *
+diskcache_put(struct diskcache_list *list, const char *name,
+	      const char *path)
+{
+	diskcache_entry_t *entry;
+
+	entry = diskcache_find(list, name, NULL);
+	if (entry != NULL) {
+		TAILQ_REMOVE(list, entry, link);
+		diskcache_freeentry(entry);
+	}
+
+	entry = diskcache_newentry(name, path);
+	if (entry != NULL)
+		TAILQ_INSERT_TAIL(list, entry, link);
+
+	return entry;
+}
+
+/* Reads records of the journal into keeps and dirties */
+static void
+diskcache_replay(struct diskcache_list *keeps, struct diskcache_list *dirties)
+{
+	char path[PATH_MAX], name[DISKCACHE_NAMEMAX];
+	diskcache_entry_t *entry;
+	diskcache_key_t key;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *fp;
+	int off;
+
+	if (diskcache_path(path, DISKCACHE_JOURNAL) != 0)
+		return;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+
+	while ((len = getline(&line, &size, fp)) > 0) {
+		/* Last record might be torn by crash */
+		if (line[len - 1] != '\n')
+			break;
+		line[len - 1] = '\0';
+
+		off = 0;
+		if (sscanf(line, "keep %63s %llu %lld %lld %llx %n", name,
+			   &key.ino, &key.mtime, &key.size, &key.sum,
+			   &off) == 5 && off > 0) {
+			entry = diskcache_put(keeps, name, line + off);
+			if (entry != NULL)
+				entry->key = key;
+		} else if (sscanf(line, "dirty %63s %n", name, &off) == 1 &&
+			   off > 0) {
+			diskcache_put(dirties, name, line + off);
+		} else if (sscanf(line, "drop %63s", name) == 1) {
+			entry = diskcache_find(keeps, name, NULL);
+			if (entry != NULL) {
+				TAILQ_REMOVE(keeps, entry, link);
+				diskcache_freeentry(entry);
+			}
+			entry = diskcache_find(dirties, name, NULL);
+			if (entry != NULL) {
+				TAILQ_REMOVE(dirties, entry, link);
+				diskcache_freeentry(entry);
+			}
+		}
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+/* Returns non-zero if backend file of path still has key (checksum aside) */
+static int
+diskcache_valid(const char *path, const diskcache_key_t *key)
+{
+	char fpath[PATH_MAX], cpath[PATH_MAX];
+	const codec_rule_t *rule;
+	struct stat statbuf;
+
+	if (snprintf(fpath, PATH_MAX, "%s%s", rootdir, path) >= PATH_MAX)
+		return 0;
+
+	rule = codec_match(fpath);
+	if (rule == NULL || codec_storedpath(rule, fpath, cpath) != 0 ||
+	    stat(cpath, &statbuf) != 0)
+		return 0;
+
+	return statbuf.st_ino == key->ino && statbuf.st_size == key->size &&
+	       (long long) statbuf.st_mtim.tv_sec * 1000000000LL +
+	       statbuf.st_mtim.tv_nsec == key->mtime;
+}
+
+/*
+ * Compresses dirty leftover name of path back to its backend file, like
+ * full compression on release would.
+ */
+static int
+diskcache_recover(const char *name, const char *path)
+{
+	char fpath[PATH_MAX], cpath[PATH_MAX], npath[PATH_MAX];
+	char tpath[PATH_MAX], ipath[PATH_MAX];
+	const codec_rule_t *rule;
+	struct stat statbuf;
+	int sfd = -1, dfd = -1, renamed = 0, ret;
+
+	if (snprintf(fpath, PATH_MAX, "%s%s", rootdir, path) >= PATH_MAX ||
+	    snprintf(tpath, PATH_MAX, "%s/lazfs.XXXXXX", rootdir) >= PATH_MAX ||
+	    diskcache_path(npath, name) != 0)
+		return -ENAMETOOLONG;
+
+	rule = codec_match(fpath);
+	if (rule == NULL || codec_storedpath(rule, fpath, cpath) != 0)
+		return -EINVAL;
+
+	sfd = open(npath, O_RDONLY);
+	if (sfd == -1)
+		return -errno;
+
+	dfd = mkstemp(tpath);
+	if (dfd == -1) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	ret = rule->codec->compress(rule, sfd, dfd);
+	if (ret != 0)
+		goto cleanup;
+
+	/* Keep owner and mode of the replaced file */
+	if (stat(cpath, &statbuf) == 0 &&
+	    (fchown(dfd, statbuf.st_uid, statbuf.st_gid) != 0 ||
+	     fchmod(dfd, statbuf.st_mode) != 0)) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	if (fstat(sfd, &statbuf) != 0 || rename(tpath, cpath) != 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+	renamed = 1;
+
+	/* Index and statistics of the old file are stale */
+	if ((rule->codec->flags & CODEC_LAS) &&
+	    lazindex_path(ipath, cpath) == 0)
+		unlink(ipath);
+	ret = lazfs_setsize(cpath, statbuf.st_size);
+
+cleanup:
+	close(sfd);
+	if (dfd != -1) {
+		close(dfd);
+		if (!renamed)
+			unlink(tpath);
+	}
+
+	return ret;
+}
+
+/* Adopts kept files and resolves leftovers found in the cache directory */
+static int
+diskcache_scan(struct diskcache_list *keeps, struct diskcache_list *dirties)
+{
+	char path[PATH_MAX];
+	diskcache_entry_t *entry;
+	unsigned long long n;
+	struct stat statbuf;
+	struct dirent *de;
+	DIR *dp;
+	int ret;
+
+	dp = opendir(cachedir);
+	if (dp == NULL)
+		return -errno;
+
+	while ((de = readdir(dp)) != NULL) {
+		if (diskcache_path(path, de->d_name) != 0)
+			continue;
+
+		if (strncmp(de->d_name, DISKCACHE_KEEP,
+			    strlen(DISKCACHE_KEEP)) == 0) {
+			n = strtoull(de->d_name + strlen(DISKCACHE_KEEP), NULL,
+				     10);
+			if (n > seq)
+				seq = n;
+
+			entry = diskcache_find(keeps, de->d_name, NULL);
+			if (entry != NULL && lstat(path, &statbuf) == 0 &&
+			    S_ISREG(statbuf.st_mode) &&
+			    diskcache_valid(entry->path, &entry->key)) {
+				entry->bytes = statbuf.st_size;
+				continue;
+			}
+			log_debug("diskcache: dropping stale \"%s\"\n", path);
+			unlink(path);
+		} else if (strncmp(de->d_name, DISKCACHE_TMP,
+				   strlen(DISKCACHE_TMP)) == 0) {
+			entry = diskcache_find(dirties, de->d_name, NULL);
+			if (entry == NULL) {
+				unlink(path);
+				continue;
+			}
+
+			ret = diskcache_recover(entry->name, entry->path);
+			if (ret != 0) {
+				/* Retried on next mount */
+				log_error("diskcache: can't write back \"%s\" "
+					  "to \"%s\": %s\n", path, entry->path,
+					  strerror(-ret));
+				TAILQ_REMOVE(dirties, entry, link);
+				TAILQ_INSERT_TAIL(&dirtyfiles, entry, link);
+				ndirty++;
+				continue;
+			}
+			log_error("diskcache: \"%s\" written back from crashed "
+				  "run\n", entry->path);
+			stats_add(STATS_DISKCACHE_RECOVERED, 1);
+			unlink(path);
+		}
+	}
+	closedir(dp);
+
+	/* Journal order is the order files were kept in */
+	while ((entry = TAILQ_FIRST(keeps)) != NULL) {
+		TAILQ_REMOVE(keeps, entry, link);
+		if (entry->bytes < 0) {
+			diskcache_freeentry(entry);
+			continue;
+		}
+		TAILQ_INSERT_HEAD(&entries, entry, link);
+		nentries++;
+		kept += entry->bytes;
+		stats_add(STATS_DISKCACHE_KEPT, entry->bytes);
+	}
+
+	return 0;
+}
+
+int
+diskcache_start(const char *dir, const char *root, off_t max)
+{
+	struct diskcache_list keeps = TAILQ_HEAD_INITIALIZER(keeps);
+	struct diskcache_list dirties = TAILQ_HEAD_INITIALIZER(dirties);
+	char path[PATH_MAX];
+	int ret;
+
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+		return -errno;
+
+	LOCK(lock);
+	/* Relative path would break after daemon() */
+	cachedir = realpath(dir, NULL);
+	rootdir = strdup(root);
+	if (cachedir == NULL || rootdir == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+	budget = max;
+
+	ret = diskcache_path(path, DISKCACHE_LOCK);
+	if (ret != 0)
+		goto cleanup;
+	lockfd = open(path, O_RDWR | O_CREAT, 0600);
+	if (lockfd == -1) {
+		ret = -errno;
+		goto cleanup;
+	}
+	if (flock(lockfd, LOCK_EX | LOCK_NB) != 0) {
+		ret = (errno == EWOULDBLOCK) ? -EBUSY : -errno;
+		goto cleanup;
+	}
+
+	diskcache_replay(&keeps, &dirties);
+	ret = diskcache_scan(&keeps, &dirties);
+	if (ret == 0) {
+		diskcache_evict();
+		ret = diskcache_compact();
+	}
+
+	log_debug("diskcache: %u files (%lld bytes) kept in \"%s\"\n",
+		  nentries, (long long) kept, dir);
+
+cleanup:
+	diskcache_freelist(&keeps);
+	diskcache_freelist(&dirties);
+	if (ret != 0) {
+		diskcache_freelist(&entries);
+		diskcache_freelist(&dirtyfiles);
+		nentries = ndirty = 0;
+		stats_add(STATS_DISKCACHE_KEPT, -kept);
+		kept = 0;
+		if (lockfd != -1)
+			close(lockfd);
+		lockfd = -1;
+		free(cachedir);
+		free(rootdir);
+		cachedir = rootdir = NULL;
+	}
+	UNLOCK(lock);
+
+	return ret;
+}
+
+void
+diskcache_stop(void)
+{
+	LOCK(lock);
+	if (cachedir == NULL) {
+		UNLOCK(lock);
+		return;
+	}
+
+	if (diskcache_compact() != 0)
+		log_error("diskcache: journal compaction failed\n");
+
+	diskcache_freelist(&entries);
+	diskcache_freelist(&dirtyfiles);
+	nentries = ndirty = 0;
+	stats_add(STATS_DISKCACHE_KEPT, -kept);
+	kept = 0;
+	close(journalfd);
+	close(lockfd);
+	journalfd = lockfd = -1;
+	free(cachedir);
+	free(rootdir);
+	cachedir = rootdir = NULL;
+	UNLOCK(lock);
+}
+
+const char *
+diskcache_scratchdir(void)
+{
+	return (cachedir != NULL) ? cachedir : "/tmp";
+}
+
+void
+diskcache_tmppath(char tmppath[PATH_MAX])
+{
+	if (snprintf(tmppath, PATH_MAX, "%s/" DISKCACHE_TMP "XXXXXX",
+		     diskcache_scratchdir()) >= PATH_MAX)
+		strcpy(tmppath, "/tmp/" DISKCACHE_TMP "XXXXXX");
+}
+
+int
+diskcache_lookup(const char *path, const char *cpath, int flags, int *fdp,
+		 diskcache_key_t *key)
+{
+	diskcache_entry_t *entry;
+	int fd;
+
+	if (cachedir == NULL)
+		return -ENOENT;
+
+	LOCK(lock);
+	entry = diskcache_find(&entries, NULL, path);
+	UNLOCK(lock);
+	if (entry == NULL)
+		return -ENOENT;
+
+	fd = open(cpath, flags);
+	if (fd == -1)
+		return -ENOENT;
+	if (diskcache_keystat(fd, key) != 0 || diskcache_keysum(fd, key) != 0) {
+		close(fd);
+		return -ENOENT;
+	}
+	*fdp = fd;
+
+	return 0;
+}
+
+int
+diskcache_adopt(const char *path, const diskcache_key_t *key,
+		char tmppath[PATH_MAX], int *tmpfdp)
+{
+	char kpath[PATH_MAX];
+	diskcache_entry_t *entry;
+	int tmpfd = -1, ret = -ENOENT;
+
+	if (cachedir == NULL)
+		return -ENOENT;
+
+	LOCK(lock);
+	entry = diskcache_find(&entries, NULL, path);
+	if (entry != NULL) {
+		/* Kept file is dropped from the list, journal follows below */
+		TAILQ_REMOVE(&entries, entry, link);
+		nentries--;
+		kept -= entry->bytes;
+		stats_add(STATS_DISKCACHE_KEPT, -entry->bytes);
+	}
+	UNLOCK(lock);
+
+	if (entry == NULL || diskcache_path(kpath, entry->name) != 0 ||
+	    !diskcache_keyeq(key, &entry->key))
+		goto cleanup;
+
+	/* Reserve unique name and move kept file over it */
+	diskcache_tmppath(tmppath);
+	tmpfd = mkstemp(tmppath);
+	if (tmpfd == -1)
+		goto cleanup;
+	close(tmpfd);
+	if (rename(kpath, tmppath) != 0) {
+		unlink(tmppath);
+		goto cleanup;
+	}
+
+	tmpfd = open(tmppath, O_RDWR);
+	if (tmpfd == -1) {
+		unlink(tmppath);
+		goto cleanup;
+	}
+
+	log_debug("diskcache: \"%s\" adopted from \"%s\"\n", path, kpath);
+	stats_add(STATS_DISKCACHE_HITS, 1);
+	*tmpfdp = tmpfd;
+	ret = 0;
+
+cleanup:
+	if (entry != NULL) {
+		if (ret != 0)
+			unlink(kpath);
+		LOCK(lock);
+		diskcache_record("drop %s\n", entry->name);
+		UNLOCK(lock);
+		diskcache_freeentry(entry);
+	}
+
+	return ret;
+}
+
+int
+diskcache_keep(const char *path, const diskcache_key_t *key, char *tmppath,
+	       int *fd, int *tmpfd)
+{
+	char name[DISKCACHE_NAMEMAX], kpath[PATH_MAX];
+	diskcache_entry_t *entry;
+	struct stat statbuf;
+	int ret;
+
+	if (diskcache_name(tmppath) == NULL || strchr(path, '\n') != NULL)
+		return -EINVAL;
+
+	if (fstat(*tmpfd, &statbuf) != 0)
+		return -errno;
+	if (statbuf.st_size > budget)
+		return -EFBIG;
+
+	LOCK(lock);
+	entry = diskcache_find(&entries, NULL, path);
+	if (entry != NULL)
+		diskcache_drop(entry, 1);
+
+	snprintf(name, sizeof(name), DISKCACHE_KEEP "%llu", seq + 1);
+	entry = diskcache_newentry(name, path);
+	if (entry == NULL) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	ret = diskcache_path(kpath, name);
+	if (ret == 0 && rename(tmppath, kpath) != 0)
+		ret = -errno;
+	if (ret != 0) {
+		diskcache_freeentry(entry);
+		goto unlock;
+	}
+
+	seq++;
+	entry->key = *key;
+	entry->bytes = statbuf.st_size;
+	TAILQ_INSERT_HEAD(&entries, entry, link);
+	nentries++;
+	kept += entry->bytes;
+	stats_add(STATS_DISKCACHE_KEPT, entry->bytes);
+	diskcache_record("keep %s %llu %lld %lld %llx %s\n", entry->name,
+			 key->ino, key->mtime, key->size, key->sum, path);
+	diskcache_evict();
+
+unlock:
+	UNLOCK(lock);
+
+	if (ret == 0) {
+		close(*fd);
+		close(*tmpfd);
+		*fd = *tmpfd = -1;
+	}
+
+	return ret;
+}
+
+void
+diskcache_dirty(const char *path, const char *tmppath)
+{
+	const char *name;
+
+	name = diskcache_name(tmppath);
+	if (name == NULL || strchr(path, '\n') != NULL)
+		return;
+
+	LOCK(lock);
+	if (diskcache_find(&dirtyfiles, name, NULL) == NULL)
+		ndirty++;
+	if (diskcache_put(&dirtyfiles, name, path) == NULL)
+		ndirty--;
+	diskcache_record("dirty %s %s\n", name, path);
+
+	/* Record must survive crash of the machine too */
+	fdatasync(journalfd);
+	UNLOCK(lock);
+}
+
+void
+diskcache_clean(const char *tmppath)
+{
+	diskcache_entry_t *entry;
+	const char *name;
+
+	name = diskcache_name(tmppath);
+	if (name == NULL)
+		return;
+
+	LOCK(lock);
+	entry = diskcache_find(&dirtyfiles, name, NULL);
+	if (entry != NULL) {
+		TAILQ_REMOVE(&dirtyfiles, entry, link);
+		ndirty--;
+		diskcache_record("drop %s\n", entry->name);
+		diskcache_freeentry(entry);
+	}
+	UNLOCK(lock);
+}
+
+void
+diskcache_forget(const char *path)
+{
+	diskcache_entry_t *entry;
+
+	if (cachedir == NULL)
+		return;
+
+	LOCK(lock);
+	entry = diskcache_find(&entries, NULL, path);
+	if (entry != NULL)
+		diskcache_drop(entry, 1);
+	UNLOCK(lock);
+}
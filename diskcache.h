@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _DISKCACHE_H_
+#define _DISKCACHE_H_
+
+#include <limits.h>
+#include <sys/types.h>
+
+/*
+ * Persistent cache of decompressed files (-o cache_dir). Decompressed files
+ * of open files are created in the cache directory instead of /tmp and clean
+ * files are kept there after their last close, so the next open, also after
+ * remount, doesn't decompress them again. The directory contains:
+ *
+ * lazfs.XXXXXX  decompressed files of open files
+ * keep.N        decompressed files kept after close
+ * journal       append-only index of the files above
+ * lock          locked by the mount which uses the directory
+ *
+ * Journal lines are "keep NAME INO MTIME SIZE SUM PATH" (NAME keeps file
+ * PATH of the mount whose backend file had inode INO, mtime in ns, SIZE and
+ * checksum SUM of its first and last DISKCACHE_SAMPLE bytes), "dirty NAME
+ * PATH" (decompressed file of open PATH was modified) and "drop NAME".
+ *
+ * On mount, kept files are revalidated by stat of their backend files only,
+ * checksum is verified when they are opened. Dirty leftovers of a crashed
+ * run are compressed back to their backend files, other leftovers are
+ * removed.
+ */
+
+#define DISKCACHE_SAMPLE (64 * 1024)
+
+/*
+ * Starts persistent cache in directory dir (created if it doesn't exist) of
+ * the backend rootdir, kept files take at most budget bytes. Returns 0,
+ * -EBUSY when another mount uses dir or -errno.
+ */
+int
+diskcache_start(const char *dir, const char *rootdir, off_t budget);
+
+/* Compacts the journal and stops the cache, kept files stay */
+void
+diskcache_stop(void);
+
+/* Directory of decompressed files, the cache directory or /tmp */
+const char *
+diskcache_scratchdir(void);
+
+/* Writes mkstemp() template of decompressed file to tmppath */
+void
+diskcache_tmppath(char tmppath[PATH_MAX]);
+
+/* Backend file a kept file was decompressed from */
+typedef struct diskcache_key {
+	unsigned long long ino;
+	long long mtime; /* ns */
+	long long size;
+	unsigned long long sum; /* See diskcache_keysum() */
+} diskcache_key_t;
+
+/*
+ * Reads stat part of key of backend file fd, it's cheap enough to be called
+ * under cache lock. Returns 0, -ENOENT when the cache is disabled or -errno.
+ */
+int
+diskcache_keystat(int fd, diskcache_key_t *key);
+
+/*
+ * Completes key of backend file fd read by diskcache_keystat(). It reads
+ * the file, so it's called without cache lock. Returns 0, -ESTALE when the
+ * file changed since diskcache_keystat() or -errno.
+ */
+int
+diskcache_keysum(int fd, diskcache_key_t *key);
+
+/*
+ * Opens backend file cpath of path with flags to fd and reads its key when
+ * path has a kept file, before cache lock is taken. Returns 0 or -ENOENT
+ * when there is no kept file or its backend file can't be read.
+ */
+int
+diskcache_lookup(const char *path, const char *cpath, int flags, int *fd,
+		 diskcache_key_t *key);
+
+/*
+ * Looks for kept file of path whose backend file has key read by
+ * diskcache_lookup(). When it's still valid, it becomes decompressed file
+ * tmppath opened to tmpfd. Returns 0 or -ENOENT when there is no valid
+ * file, kept file is dropped either way.
+ */
+int
+diskcache_adopt(const char *path, const diskcache_key_t *key,
+		char tmppath[PATH_MAX], int *tmpfd);
+
+/*
+ * Keeps complete decompressed file tmppath of path after the last close,
+ * key is of its backend file as it was written back. Closes both files and
+ * returns 0 when it was kept, returns -errno and changes nothing otherwise.
+ */
+int
+diskcache_keep(const char *path, const diskcache_key_t *key, char *tmppath,
+	       int *fd, int *tmpfd);
+
+/*
+ * Notes that decompressed file tmppath of path is being modified, so it's
+ * compressed back on next mount if lazfs crashes before release.
+ */
+void
+diskcache_dirty(const char *path, const char *tmppath);
+
+/* Notes that decompressed file tmppath was written back or is removed */
+void
+diskcache_clean(const char *tmppath);
+
+/* Drops kept file of path, the backend file is gone */
+void
+diskcache_forget(const char *path);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains parser of the LAS public header block. It reads header
+ * fields directly from the file so no LAS library (and no decompression) is
+ * involved.
+ */
+
+#include "lasheader.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+int
+lasheader_read(int fd, lasheader_t *hdr)
+{
+	unsigned char buf[LASHEADER_MAXSIZE];
+	ssize_t len;
+	int i;
+
+	assert(fd >= 0);
+	assert(hdr != NULL);
+
+	len = pread(fd, buf, sizeof(buf), 0);
+	if (len < 0)
+		return -errno;
+
+	if (len < LASHEADER_MINSIZE || memcmp(buf, "LASF", 4) != 0)
+		return -EINVAL;
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	hdr->version_major = buf[24];
+	hdr->version_minor = buf[25];
+	hdr->header_size = le16(buf + 94);
+	hdr->data_offset = le32(buf + 96);
+	hdr->nvlrs = le32(buf + 100);
+	hdr->compressed = (buf[104] & LAZ_FORMAT_MASK) ? 1 : 0;
+	hdr->point_format = buf[104] & ~LAZ_FORMAT_MASK;
+	hdr->record_length = le16(buf + 105);
+	hdr->npoints = le32(buf + 107);
+
+	for (i = 0; i < 3; i++) {
+		hdr->scale[i] = ledouble(buf + 131 + 8 * i);
+		hdr->offset[i] = ledouble(buf + 155 + 8 * i);
+		/* Maximum and minimum are interleaved (max X, min X, max Y...) */
+		hdr->max[i] = ledouble(buf + 179 + 16 * i);
+		hdr->min[i] = ledouble(buf + 187 + 16 * i);
+	}
+
+	/* LAS 1.4 stores 64bit point count, legacy field can be zero */
+	if (hdr->header_size >= LASHEADER_MAXSIZE && len >= LASHEADER_MAXSIZE &&
+	    (hdr->version_major > 1 || hdr->version_minor >= 4))
+		hdr->npoints = le64(buf + 247);
+
+	if (hdr->header_size < LASHEADER_MINSIZE ||
+	    hdr->data_offset < hdr->header_size || hdr->record_length == 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+off_t
+lasheader_lassize(const lasheader_t *hdr)
+{
+	assert(hdr != NULL);
+
+	return (off_t) hdr->data_offset +
+	       (off_t) hdr->npoints * (off_t) hdr->record_length;
+}
+
+int
+lasheader_checksize(const lasheader_t *hdr, off_t size)
+{
+	off_t points;
+
+	assert(hdr != NULL);
+
+	points = (off_t) hdr->npoints * (off_t) hdr->record_length;
+	if (size < points)
+		return 0;
+
+	/* Decompression can drop laszip VLR, data offset can only shrink */
+	return size - points >= hdr->header_size &&
+	       size - points <= hdr->data_offset;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _LASHEADER_H_
+#define _LASHEADER_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* LAZ marks compressed point formats by setting the two highest bits */
+#define LAZ_FORMAT_MASK 0xC0
+
+/* Size of the LAS 1.0 - 1.2 public header block */
+#define LASHEADER_MINSIZE 227
+
+/* Size of the LAS 1.4 public header block */
+#define LASHEADER_MAXSIZE 375
+
+/*
+ * Fields of the LAS public header block which lazfs cares about. Point format
+ * is stored without the LAZ compression bits, "compressed" is set instead.
+ */
+typedef struct lasheader {
+	uint8_t version_major;
+	uint8_t version_minor;
+	uint16_t header_size;
+	uint32_t data_offset;
+	uint32_t nvlrs;
+	uint8_t point_format;
+	char compressed;
+	uint16_t record_length;
+	uint64_t npoints;
+	double scale[3];
+	double offset[3];
+	double min[3];
+	double max[3];
+} lasheader_t;
+
+/* Little endian accessors of the raw LAS data */
+static inline uint16_t
+le16(const unsigned char *p)
+{
+	return (uint16_t) p[0] | ((uint16_t) p[1] << 8);
+}
+
+static inline uint32_t
+le32(const unsigned char *p)
+{
+	return (uint32_t) le16(p) | ((uint32_t) le16(p + 2) << 16);
+}
+
+static inline uint64_t
+le64(const unsigned char *p)
+{
+	return (uint64_t) le32(p) | ((uint64_t) le32(p + 4) << 32);
+}
+
+static inline void
+setle16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static inline void
+setle32(unsigned char *p, uint32_t v)
+{
+	setle16(p, v & 0xffff);
+	setle16(p + 2, v >> 16);
+}
+
+static inline void
+setle64(unsigned char *p, uint64_t v)
+{
+	setle32(p, v & 0xffffffff);
+	setle32(p + 4, v >> 32);
+}
+
+static inline double
+ledouble(const unsigned char *p)
+{
+	uint64_t u = le64(p);
+	double d;
+
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+/*
+ * Reads public header block of the LAS/LAZ file opened as fd. Only the header
+ * is read, point data are never touched. Returns 0 on success or -errno.
+ */
+int
+lasheader_read(int fd, lasheader_t *hdr);
+
+/* Returns size of the decompressed .las file described by the header */
+off_t
+lasheader_lassize(const lasheader_t *hdr);
+
+/*
+ * Returns non-zero if size can be size of the decompressed .las file described
+ * by the header, i.e. it holds all points and header block of valid size.
+ */
+int
+lasheader_checksize(const lasheader_t *hdr, off_t size);
+
+#endif
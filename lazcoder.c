@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains arithmetic coder and integer compressor compatible with
+ * LASzip. LAZ stores chunk table with them, it's the only part of the LAZ
+ * file which lazfs needs to code itself, points are coded by LASzip.
+ */
+
+#include "lazcoder.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AC_MINLENGTH 0x01000000U
+#define AC_MAXLENGTH 0xFFFFFFFFU
+
+/* Bit model */
+#define BM_LENGTHSHIFT 13
+#define BM_MAXCOUNT (1U << BM_LENGTHSHIFT)
+
+/* Symbol model */
+#define DM_LENGTHSHIFT 15
+#define DM_MAXCOUNT (1U << DM_LENGTHSHIFT)
+#define DM_MAXSYMBOLS 256
+
+/* Integer compressor with 32 bits corrector and 8 bits coded by models */
+#define IC_BITS 32
+#define IC_BITSHIGH 8
+#define IC_CONTEXTS 2
+
+typedef struct lazcoder_model {
+	uint32_t symbols;
+	uint32_t total_count;
+	uint32_t update_cycle;
+	uint32_t symbols_until_update;
+	uint32_t distribution[DM_MAXSYMBOLS];
+	uint32_t symbol_count[DM_MAXSYMBOLS];
+} lazcoder_model_t;
+
+typedef struct lazcoder_bitmodel {
+	uint32_t bit_0_count;
+	uint32_t bit_count;
+	uint32_t bit_0_prob;
+	uint32_t update_cycle;
+	uint32_t bits_until_update;
+} lazcoder_bitmodel_t;
+
+typedef struct lazcoder_ic {
+	lazcoder_model_t bits[IC_CONTEXTS];
+	lazcoder_bitmodel_t corr0;
+	lazcoder_model_t corr[IC_BITS + 1]; /* Index 0 is unused */
+} lazcoder_ic_t;
+
+typedef struct lazcoder_enc {
+	unsigned char *buf;
+	size_t len;
+	size_t allocated;
+	uint32_t base;
+	uint32_t length;
+	char nomem;
+} lazcoder_enc_t;
+
+typedef struct lazcoder_dec {
+	const unsigned char *buf;
+	size_t len;
+	size_t pos;
+	uint32_t value;
+	uint32_t length;
+	char overrun;
+} lazcoder_dec_t;
+
+static void
+model_update(lazcoder_model_t *m)
+{
+	uint32_t k, sum = 0, scale;
+
+	if ((m->total_count += m->update_cycle) > DM_MAXCOUNT) {
+		m->total_count = 0;
+		for (k = 0; k < m->symbols; k++) {
+			m->symbol_count[k] = (m->symbol_count[k] + 1) >> 1;
+			m->total_count += m->symbol_count[k];
+		}
+	}
+
+	scale = 0x80000000U / m->total_count;
+	for (k = 0; k < m->symbols; k++) {
+		m->distribution[k] = (scale * sum) >> (31 - DM_LENGTHSHIFT);
+		sum += m->symbol_count[k];
+	}
+
+	m->update_cycle = (5 * m->update_cycle) >> 2;
+	if (m->update_cycle > (m->symbols + 6) << 3)
+		m->update_cycle = (m->symbols + 6) << 3;
+	m->symbols_until_update = m->update_cycle;
+}
+
+static void
+model_init(lazcoder_model_t *m, uint32_t symbols)
+{
+	uint32_t k;
+
+	assert(symbols >= 2 && symbols <= DM_MAXSYMBOLS);
+
+	m->symbols = symbols;
+	m->total_count = 0;
+	m->update_cycle = symbols;
+	for (k = 0; k < symbols; k++)
+		m->symbol_count[k] = 1;
+
+	model_update(m);
+	m->symbols_until_update = m->update_cycle = (symbols + 6) >> 1;
+}
+
+static void
+bitmodel_update(lazcoder_bitmodel_t *m)
+{
+	uint32_t scale;
+
+	if ((m->bit_count += m->update_cycle) > BM_MAXCOUNT) {
+		m->bit_count = (m->bit_count + 1) >> 1;
+		m->bit_0_count = (m->bit_0_count + 1) >> 1;
+		if (m->bit_0_count == m->bit_count)
+			m->bit_count++;
+	}
+
+	scale = 0x80000000U / m->bit_count;
+	m->bit_0_prob = (m->bit_0_count * scale) >> (31 - BM_LENGTHSHIFT);
+
+	m->update_cycle = (5 * m->update_cycle) >> 2;
+	if (m->update_cycle > 64)
+		m->update_cycle = 64;
+	m->bits_until_update = m->update_cycle;
+}
+
+static void
+bitmodel_init(lazcoder_bitmodel_t *m)
+{
+	m->bit_0_count = 1;
+	m->bit_count = 2;
+	m->bit_0_prob = 1U << (BM_LENGTHSHIFT - 1);
+	m->update_cycle = m->bits_until_update = 4;
+}
+
+static void
+ic_init(lazcoder_ic_t *ic)
+{
+	uint32_t i;
+
+	for (i = 0; i < IC_CONTEXTS; i++)
+		model_init(&ic->bits[i], IC_BITS + 1);
+
+	bitmodel_init(&ic->corr0);
+	for (i = 1; i <= IC_BITS; i++)
+		model_init(&ic->corr[i], 1U << (i <= IC_BITSHIGH ? i : IC_BITSHIGH));
+}
+
+static void
+enc_putbyte(lazcoder_enc_t *enc, unsigned char byte)
+{
+	unsigned char *buf;
+	size_t allocated;
+
+	if (enc->len == enc->allocated) {
+		allocated = enc->allocated ? enc->allocated * 2 : 256;
+		buf = realloc(enc->buf, allocated);
+		if (buf == NULL) {
+			enc->nomem = 1;
+			return;
+		}
+		enc->buf = buf;
+		enc->allocated = allocated;
+	}
+
+	enc->buf[enc->len++] = byte;
+}
+
+static void
+enc_carry(lazcoder_enc_t *enc)
+{
+	size_t p = enc->len;
+
+	while (p > 0 && enc->buf[p - 1] == 0xFF)
+		enc->buf[--p] = 0;
+	if (p > 0)
+		enc->buf[p - 1]++;
+}
+
+static void
+enc_renorm(lazcoder_enc_t *enc)
+{
+	do {
+		enc_putbyte(enc, enc->base >> 24);
+		enc->base <<= 8;
+	} while ((enc->length <<= 8) < AC_MINLENGTH);
+}
+
+static void
+enc_symbol(lazcoder_enc_t *enc, lazcoder_model_t *m, uint32_t sym)
+{
+	uint32_t x, init_base = enc->base;
+
+	if (sym == m->symbols - 1) {
+		x = m->distribution[sym] * (enc->length >> DM_LENGTHSHIFT);
+		enc->base += x;
+		enc->length -= x;
+	} else {
+		enc->length >>= DM_LENGTHSHIFT;
+		x = m->distribution[sym] * enc->length;
+		enc->base += x;
+		enc->length = m->distribution[sym + 1] * enc->length - x;
+	}
+
+	if (init_base > enc->base)
+		enc_carry(enc);
+	if (enc->length < AC_MINLENGTH)
+		enc_renorm(enc);
+
+	m->symbol_count[sym]++;
+	if (--m->symbols_until_update == 0)
+		model_update(m);
+}
+
+static void
+enc_bit(lazcoder_enc_t *enc, lazcoder_bitmodel_t *m, uint32_t bit)
+{
+	uint32_t x, init_base;
+
+	x = m->bit_0_prob * (enc->length >> BM_LENGTHSHIFT);
+	if (bit == 0) {
+		enc->length = x;
+		m->bit_0_count++;
+	} else {
+		init_base = enc->base;
+		enc->base += x;
+		enc->length -= x;
+		if (init_base > enc->base)
+			enc_carry(enc);
+	}
+
+	if (enc->length < AC_MINLENGTH)
+		enc_renorm(enc);
+	if (--m->bits_until_update == 0)
+		bitmodel_update(m);
+}
+
+static void
+enc_bits(lazcoder_enc_t *enc, uint32_t bits, uint32_t sym)
+{
+	uint32_t init_base;
+
+	assert(bits > 0 && bits <= 32);
+
+	if (bits > 19) {
+		enc_bits(enc, 16, sym & 0xFFFF);
+		sym >>= 16;
+		bits -= 16;
+	}
+
+	init_base = enc->base;
+	enc->base += sym * (enc->length >>= bits);
+	if (init_base > enc->base)
+		enc_carry(enc);
+	if (enc->length < AC_MINLENGTH)
+		enc_renorm(enc);
+}
+
+static void
+enc_done(lazcoder_enc_t *enc)
+{
+	uint32_t init_base = enc->base;
+	char another_byte = 1;
+
+	if (enc->length > 2 * AC_MINLENGTH) {
+		enc->base += AC_MINLENGTH;
+		enc->length = AC_MINLENGTH >> 1;
+	} else {
+		enc->base += AC_MINLENGTH >> 1;
+		enc->length = AC_MINLENGTH >> 9;
+		another_byte = 0;
+	}
+
+	if (init_base > enc->base)
+		enc_carry(enc);
+	enc_renorm(enc);
+
+	/* Decoder reads ahead, keep it in sync */
+	enc_putbyte(enc, 0);
+	enc_putbyte(enc, 0);
+	if (another_byte)
+		enc_putbyte(enc, 0);
+}
+
+static unsigned char
+dec_getbyte(lazcoder_dec_t *dec)
+{
+	if (dec->pos == dec->len) {
+		dec->overrun = 1;
+		return 0;
+	}
+
+	return dec->buf[dec->pos++];
+}
+
+static void
+dec_init(lazcoder_dec_t *dec, const unsigned char *buf, size_t len)
+{
+	int i;
+
+	dec->buf = buf;
+	dec->len = len;
+	dec->pos = 0;
+	dec->overrun = 0;
+	dec->value = 0;
+	for (i = 0; i < 4; i++)
+		dec->value = (dec->value << 8) | dec_getbyte(dec);
+	dec->length = AC_MAXLENGTH;
+}
+
+static void
+dec_renorm(lazcoder_dec_t *dec)
+{
+	do {
+		dec->value = (dec->value << 8) | dec_getbyte(dec);
+	} while ((dec->length <<= 8) < AC_MINLENGTH);
+}
+
+static uint32_t
+dec_symbol(lazcoder_dec_t *dec, lazcoder_model_t *m)
+{
+	uint32_t n, k, z, sym = 0, x = 0, y = dec->length;
+
+	dec->length >>= DM_LENGTHSHIFT;
+	n = m->symbols;
+	k = n >> 1;
+	do {
+		z = dec->length * m->distribution[k];
+		if (z > dec->value) {
+			n = k;
+			y = z;
+		} else {
+			sym = k;
+			x = z;
+		}
+	} while ((k = (sym + n) >> 1) != sym);
+
+	dec->value -= x;
+	dec->length = y - x;
+	if (dec->length < AC_MINLENGTH)
+		dec_renorm(dec);
+
+	m->symbol_count[sym]++;
+	if (--m->symbols_until_update == 0)
+		model_update(m);
+
+	return sym;
+}
+
+static uint32_t
+dec_bit(lazcoder_dec_t *dec, lazcoder_bitmodel_t *m)
+{
+	uint32_t x, bit;
+
+	x = m->bit_0_prob * (dec->length >> BM_LENGTHSHIFT);
+	bit = (dec->value >= x);
+	if (bit == 0) {
+		dec->length = x;
+		m->bit_0_count++;
+	} else {
+		dec->value -= x;
+		dec->length -= x;
+	}
+
+	if (dec->length < AC_MINLENGTH)
+		dec_renorm(dec);
+	if (--m->bits_until_update == 0)
+		bitmodel_update(m);
+
+	return bit;
+}
+
+static uint32_t
+dec_bits(lazcoder_dec_t *dec, uint32_t bits)
+{
+	uint32_t lo, sym;
+
+	assert(bits > 0 && bits <= 32);
+
+	if (bits > 19) {
+		lo = dec_bits(dec, 16);
+		return (dec_bits(dec, bits - 16) << 16) | lo;
+	}
+
+	sym = dec->value / (dec->length >>= bits);
+	dec->value -= dec->length * sym;
+	if (dec->length < AC_MINLENGTH)
+		dec_renorm(dec);
+
+	return sym;
+}
+
+static void
+ic_compress(lazcoder_enc_t *enc, lazcoder_ic_t *ic, uint32_t pred,
+	    uint32_t real, int context)
+{
+	int32_t c = (int32_t) (real - pred);
+	uint32_t c1, k = 0, k1;
+
+	/* Tightest interval [-(2^k - 1), 2^k] which contains c */
+	c1 = (c <= 0) ? 0U - (uint32_t) c : (uint32_t) c - 1;
+	while (c1) {
+		c1 >>= 1;
+		k++;
+	}
+
+	enc_symbol(enc, &ic->bits[context], k);
+	if (k == 0) {
+		/* c is either 0 or 1 */
+		enc_bit(enc, &ic->corr0, c);
+		return;
+	}
+
+	if (k == IC_BITS)
+		return;
+
+	/* Move c into [0, 2^k - 1] */
+	c1 = (c < 0) ? (uint32_t) c + ((1U << k) - 1) : (uint32_t) c - 1;
+	if (k <= IC_BITSHIGH) {
+		enc_symbol(enc, &ic->corr[k], c1);
+	} else {
+		k1 = k - IC_BITSHIGH;
+		enc_symbol(enc, &ic->corr[k], c1 >> k1);
+		enc_bits(enc, k1, c1 & ((1U << k1) - 1));
+	}
+}
+
+static uint32_t
+ic_decompress(lazcoder_dec_t *dec, lazcoder_ic_t *ic, uint32_t pred,
+	      int context)
+{
+	uint32_t c, k, k1;
+
+	k = dec_symbol(dec, &ic->bits[context]);
+	if (k == 0)
+		return pred + dec_bit(dec, &ic->corr0);
+
+	if (k == IC_BITS)
+		return pred + 0x80000000U;
+
+	if (k <= IC_BITSHIGH) {
+		c = dec_symbol(dec, &ic->corr[k]);
+	} else {
+		k1 = k - IC_BITSHIGH;
+		c = dec_symbol(dec, &ic->corr[k]) << k1;
+		c |= dec_bits(dec, k1);
+	}
+
+	/* Move c back into its interval */
+	if (c >= (1U << (k - 1)))
+		c += 1;
+	else
+		c -= (1U << k) - 1;
+
+	return pred + c;
+}
+
+int
+lazcoder_decodetable(const unsigned char *buf, size_t len, uint32_t n,
+		     uint32_t *sizes, uint32_t *counts)
+{
+	lazcoder_dec_t dec;
+	lazcoder_ic_t *ic;
+	uint32_t i;
+
+	assert(buf != NULL);
+	assert(sizes != NULL);
+
+	if (n == 0)
+		return 0;
+
+	ic = malloc(sizeof(*ic));
+	if (ic == NULL)
+		return -ENOMEM;
+
+	ic_init(ic);
+	dec_init(&dec, buf, len);
+
+	for (i = 0; i < n; i++) {
+		if (counts != NULL)
+			counts[i] = ic_decompress(&dec, ic, i ? counts[i - 1] : 0, 0);
+		sizes[i] = ic_decompress(&dec, ic, i ? sizes[i - 1] : 0, 1);
+	}
+
+	free(ic);
+
+	return dec.overrun ? -EINVAL : 0;
+}
+
+int
+lazcoder_encodetable(uint32_t n, const uint32_t *sizes, const uint32_t *counts,
+		     unsigned char **bufp, size_t *lenp)
+{
+	lazcoder_enc_t enc;
+	lazcoder_ic_t *ic;
+	uint32_t i;
+
+	assert(sizes != NULL);
+	assert(bufp != NULL && *bufp == NULL);
+	assert(lenp != NULL);
+
+	memset(&enc, 0, sizeof(enc));
+	enc.length = AC_MAXLENGTH;
+
+	if (n > 0) {
+		ic = malloc(sizeof(*ic));
+		if (ic == NULL)
+			return -ENOMEM;
+
+		ic_init(ic);
+		for (i = 0; i < n; i++) {
+			if (counts != NULL)
+				ic_compress(&enc, ic, i ? counts[i - 1] : 0,
+					    counts[i], 0);
+			ic_compress(&enc, ic, i ? sizes[i - 1] : 0, sizes[i], 1);
+		}
+		enc_done(&enc);
+
+		free(ic);
+	}
+
+	if (enc.nomem) {
+		free(enc.buf);
+		return -ENOMEM;
+	}
+
+	*bufp = enc.buf;
+	*lenp = enc.len;
+
+	return 0;
+}
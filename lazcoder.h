@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _LAZCODER_H_
+#define _LAZCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decodes n entries of the LAZ chunk table stored after the version and
+ * number of chunks fields. Chunk sizes in bytes are stored to sizes, point
+ * counts to counts (only when chunks have variable size, NULL otherwise).
+ * Returns 0 on success or -EINVAL.
+ */
+int
+lazcoder_decodetable(const unsigned char *buf, size_t len, uint32_t n,
+		     uint32_t *sizes, uint32_t *counts);
+
+/*
+ * Encodes n entries of the LAZ chunk table, counts is NULL when chunks have
+ * fixed size. *bufp is allocated and must be freed by caller. Returns 0 on
+ * success or -ENOMEM.
+ */
+int
+lazcoder_encodetable(uint32_t n, const uint32_t *sizes, const uint32_t *counts,
+		     unsigned char **bufp, size_t *lenp);
+
+#endif
@@ -0,0 +1,820 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains helpers which work with layout of the LAZ file (header,
+ * VLRs, compressed point data) without decompressing it.
+ */
+
+#include "lazcoder.h"
+#include "lazfile.h"
+#include "probes.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Returns non-zero if the file has LAS 1.3 waveform data or LAS 1.4 extended
+ * VLRs. Those are addressed by absolute offsets so they can't be moved.
+ */
+static char
+lazfile_hasevlrs(const unsigned char *prefix, const lasheader_t *hdr)
+{
+	if (hdr->version_major > 1 || hdr->version_minor >= 3) {
+		if (hdr->header_size >= 235 && le64(prefix + 227) != 0)
+			return 1;
+	}
+	if (hdr->version_major > 1 || hdr->version_minor >= 4) {
+		if (hdr->header_size >= 247 && le32(prefix + 243) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns size (including header) of VLR at offset off or -EINVAL if it
+ * doesn't fit into the prefix.
+ */
+static ssize_t
+lazfile_vlrsize(const unsigned char *prefix, const lasheader_t *hdr,
+		size_t off)
+{
+	size_t size;
+
+	if (off + LAZFILE_VLRHEADER > hdr->data_offset)
+		return -EINVAL;
+
+	size = LAZFILE_VLRHEADER + le16(prefix + off + 20);
+	if (off + size > hdr->data_offset)
+		return -EINVAL;
+
+	return size;
+}
+
+static char
+lazfile_isvlr(const unsigned char *vlr, const char *user_id,
+	      uint16_t record_id)
+{
+	return strncmp((const char *) vlr + 2, user_id, 16) == 0 &&
+	       le16(vlr + 18) == record_id;
+}
+
+int
+lazfile_readprefix(int fd, lasheader_t *hdr, unsigned char **prefixp)
+{
+	unsigned char *prefix;
+	ssize_t len;
+	int ret;
+
+	assert(hdr != NULL);
+	assert(prefixp != NULL && *prefixp == NULL);
+
+	ret = lasheader_read(fd, hdr);
+	if (ret != 0)
+		return ret;
+
+	prefix = malloc(hdr->data_offset);
+	if (prefix == NULL)
+		return -ENOMEM;
+
+	len = pread(fd, prefix, hdr->data_offset, 0);
+	if (len != (ssize_t) hdr->data_offset) {
+		ret = (len < 0) ? -errno : -EINVAL;
+		free(prefix);
+		return ret;
+	}
+
+	*prefixp = prefix;
+
+	return 0;
+}
+
+int
+lazfile_findvlr(const unsigned char *prefix, const lasheader_t *hdr,
+		const char *user_id, uint16_t record_id, size_t *offp,
+		size_t *sizep)
+{
+	size_t off = hdr->header_size;
+	ssize_t size;
+	uint32_t i;
+
+	assert(prefix != NULL);
+	assert(hdr != NULL);
+	assert(user_id != NULL);
+	assert(offp != NULL);
+	assert(sizep != NULL);
+
+	for (i = 0; i < hdr->nvlrs; i++) {
+		size = lazfile_vlrsize(prefix, hdr, off);
+		if (size < 0)
+			return size;
+
+		if (lazfile_isvlr(prefix + off, user_id, record_id)) {
+			*offp = off;
+			*sizep = size;
+			return 0;
+		}
+		off += size;
+	}
+
+	return -ENOENT;
+}
+
+int
+lazfile_makeprefix(const unsigned char *las, const lasheader_t *lashdr,
+		   const unsigned char *zipvlr, size_t zipsize,
+		   uint8_t formatbits, unsigned char **prefixp, size_t *sizep)
+{
+	unsigned char *prefix;
+	size_t off, len;
+	ssize_t size;
+	uint32_t i, nvlrs = 0;
+
+	assert(las != NULL);
+	assert(lashdr != NULL);
+	assert(zipvlr != NULL);
+	assert(prefixp != NULL && *prefixp == NULL);
+	assert(sizep != NULL);
+
+	if (lashdr->compressed || lazfile_hasevlrs(las, lashdr))
+		return -EINVAL;
+
+	prefix = malloc(lashdr->data_offset + zipsize);
+	if (prefix == NULL)
+		return -ENOMEM;
+
+	memcpy(prefix, las, lashdr->header_size);
+	len = off = lashdr->header_size;
+
+	/* Copy VLRs, laszip VLR of the .las (if any) is replaced */
+	for (i = 0; i < lashdr->nvlrs; i++) {
+		size = lazfile_vlrsize(las, lashdr, off);
+		if (size < 0) {
+			free(prefix);
+			return size;
+		}
+
+		if (!lazfile_isvlr(las + off, LAZFILE_LASZIP_USERID,
+				   LAZFILE_LASZIP_RECORDID)) {
+			memcpy(prefix + len, las + off, size);
+			len += size;
+			nvlrs++;
+		}
+		off += size;
+	}
+
+	memcpy(prefix + len, zipvlr, zipsize);
+	len += zipsize;
+	nvlrs++;
+
+	/* Keep user defined bytes between VLRs and point data */
+	memcpy(prefix + len, las + off, lashdr->data_offset - off);
+	len += lashdr->data_offset - off;
+
+	if (len > UINT32_MAX) {
+		free(prefix);
+		return -EINVAL;
+	}
+
+	prefix[104] = (las[104] & ~LAZ_FORMAT_MASK) | formatbits;
+	setle32(prefix + 96, len);
+	setle32(prefix + 100, nvlrs);
+
+	*prefixp = prefix;
+	*sizep = len;
+
+	return 0;
+}
+
+int
+lazfile_buildprefix(int lasfd, int lazfd, unsigned char **prefixp,
+		    size_t *sizep)
+{
+	lasheader_t lashdr, lazhdr;
+	unsigned char *las = NULL, *laz = NULL;
+	size_t zipoff, zipsize;
+	int ret;
+
+	assert(prefixp != NULL && *prefixp == NULL);
+	assert(sizep != NULL);
+
+	ret = lazfile_readprefix(lasfd, &lashdr, &las);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lazfile_readprefix(lazfd, &lazhdr, &laz);
+	if (ret != 0)
+		goto cleanup;
+
+	if (!lazhdr.compressed ||
+	    lashdr.point_format != lazhdr.point_format ||
+	    lashdr.record_length != lazhdr.record_length ||
+	    lashdr.npoints != lazhdr.npoints || lazfile_hasevlrs(laz, &lazhdr)) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	ret = lazfile_findvlr(laz, &lazhdr, LAZFILE_LASZIP_USERID,
+			      LAZFILE_LASZIP_RECORDID, &zipoff, &zipsize);
+	if (ret != 0) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	ret = lazfile_makeprefix(las, &lashdr, laz + zipoff, zipsize,
+				 laz[104] & LAZ_FORMAT_MASK, prefixp, sizep);
+
+cleanup:
+	free(las);
+	free(laz);
+
+	return ret;
+}
+
+/*
+ * Reads offset of the chunk table of compressed points at pointsoff. Sets
+ * *posp to where the offset is stored. Returns 0 or -EINVAL.
+ */
+static int
+lazfile_tableoffset(int fd, off_t pointsoff, int64_t *tableoffp, off_t *posp)
+{
+	unsigned char buf[8];
+	struct stat statbuf;
+	off_t pos = pointsoff;
+
+	if (pread(fd, buf, sizeof(buf), pos) != sizeof(buf))
+		return -EINVAL;
+
+	*tableoffp = (int64_t) le64(buf);
+	if (*tableoffp == -1) {
+		/* Writer couldn't seek back, offset is at the end of file */
+		if (fstat(fd, &statbuf) != 0)
+			return -errno;
+		if (statbuf.st_size < pointsoff + 2 * (off_t) sizeof(buf))
+			return -EINVAL;
+
+		pos = statbuf.st_size - sizeof(buf);
+		if (pread(fd, buf, sizeof(buf), pos) != sizeof(buf))
+			return -EINVAL;
+
+		*tableoffp = (int64_t) le64(buf);
+	}
+
+	*posp = pos;
+
+	return 0;
+}
+
+/* Moves chunk table offset of compressed points at pointsoff by delta */
+static int
+lazfile_movechunktable(int fd, off_t pointsoff, off_t delta)
+{
+	unsigned char buf[8];
+	int64_t tableoff;
+	off_t pos;
+	int ret;
+
+	ret = lazfile_tableoffset(fd, pointsoff, &tableoff, &pos);
+	if (ret != 0 || tableoff == -1)
+		return ret;
+
+	setle64(buf, tableoff + delta);
+	if (pwrite(fd, buf, sizeof(buf), pos) != sizeof(buf))
+		return -EIO;
+
+	return 0;
+}
+
+int
+lazfile_findlaszip(const unsigned char *prefix, const lasheader_t *hdr,
+		   lazfile_laszip_t *zip)
+{
+	const unsigned char *data;
+	int ret;
+
+	assert(zip != NULL);
+
+	ret = lazfile_findvlr(prefix, hdr, LAZFILE_LASZIP_USERID,
+			      LAZFILE_LASZIP_RECORDID, &zip->offset, &zip->size);
+	if (ret != 0)
+		return ret;
+
+	/* compressor, coder, version (4 bytes), options, chunk size */
+	if (zip->size < LAZFILE_VLRHEADER + 16)
+		return -EINVAL;
+
+	data = prefix + zip->offset + LAZFILE_VLRHEADER;
+	zip->compressor = le16(data);
+	zip->chunk_size = le32(data + 12);
+
+	return 0;
+}
+
+off_t
+lazfile_lassize(const unsigned char *prefix, const lasheader_t *hdr)
+{
+	size_t off, size;
+
+	if (hdr->compressed &&
+	    lazfile_findvlr(prefix, hdr, LAZFILE_LASZIP_USERID,
+			    LAZFILE_LASZIP_RECORDID, &off, &size) == 0)
+		return lasheader_lassize(hdr) - (off_t) size;
+
+	return lasheader_lassize(hdr);
+}
+
+int
+lazfile_readchunks(int fd, const lazfile_laszip_t *zip, off_t pointsoff,
+		   lazfile_chunks_t *chunks)
+{
+	unsigned char hdr[8], *buf = NULL;
+	uint32_t *sizes = NULL, i;
+	struct stat statbuf;
+	int64_t tableoff;
+	off_t pos;
+	size_t len;
+	int ret;
+
+	assert(zip != NULL);
+	assert(chunks != NULL && chunks->starts == NULL);
+
+	if ((zip->compressor != LAZFILE_COMPRESSOR_CHUNKED &&
+	     zip->compressor != LAZFILE_COMPRESSOR_LAYERED) ||
+	    zip->chunk_size == 0 || zip->chunk_size == LAZFILE_CHUNK_VARIABLE)
+		return -EINVAL;
+
+	ret = lazfile_tableoffset(fd, pointsoff, &tableoff, &pos);
+	if (ret != 0)
+		return ret;
+
+	if (fstat(fd, &statbuf) != 0)
+		return -errno;
+
+	if (tableoff < pointsoff + 8 || tableoff + 8 > statbuf.st_size ||
+	    pread(fd, hdr, sizeof(hdr), tableoff) != sizeof(hdr) ||
+	    le32(hdr) != 0)
+		return -EINVAL;
+
+	/* Every chunk takes at least one byte */
+	chunks->nchunks = le32(hdr + 4);
+	if (chunks->nchunks > tableoff - pointsoff)
+		return -EINVAL;
+
+	chunks->starts = malloc((chunks->nchunks + 1) * sizeof(*chunks->starts));
+	sizes = malloc((chunks->nchunks + 1) * sizeof(*sizes));
+	if (chunks->starts == NULL || sizes == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	/* Table is at the end of file, possibly followed by its offset */
+	len = statbuf.st_size - tableoff - sizeof(hdr);
+	buf = malloc(len + 1);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	if (pread(fd, buf, len, tableoff + sizeof(hdr)) != (ssize_t) len) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	ret = lazcoder_decodetable(buf, len, chunks->nchunks, sizes, NULL);
+	if (ret != 0)
+		goto cleanup;
+
+	chunks->starts[0] = pointsoff + 8;
+	for (i = 0; i < chunks->nchunks; i++) {
+		chunks->starts[i + 1] = chunks->starts[i] + sizes[i];
+		if (chunks->starts[i + 1] > tableoff) {
+			ret = -EINVAL;
+			goto cleanup;
+		}
+	}
+
+cleanup:
+	free(buf);
+	free(sizes);
+	if (ret != 0)
+		lazfile_freechunks(chunks);
+
+	return ret;
+}
+
+int
+lazfile_writechunks(int fd, off_t pointsoff, const lazfile_chunks_t *chunks)
+{
+	unsigned char hdr[8], *buf = NULL;
+	uint32_t *sizes, i;
+	off_t tableoff;
+	size_t len;
+	int ret = 0;
+
+	assert(chunks != NULL);
+
+	sizes = malloc((chunks->nchunks + 1) * sizeof(*sizes));
+	if (sizes == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < chunks->nchunks; i++)
+		sizes[i] = chunks->starts[i + 1] - chunks->starts[i];
+
+	ret = lazcoder_encodetable(chunks->nchunks, sizes, NULL, &buf, &len);
+	if (ret != 0)
+		goto cleanup;
+
+	tableoff = chunks->nchunks ? chunks->starts[chunks->nchunks] :
+				     pointsoff + 8;
+
+	setle32(hdr, 0);
+	setle32(hdr + 4, chunks->nchunks);
+	if (pwrite(fd, hdr, sizeof(hdr), tableoff) != sizeof(hdr) ||
+	    (len && pwrite(fd, buf, len, tableoff + sizeof(hdr)) != (ssize_t) len)) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	setle64(hdr, tableoff);
+	if (pwrite(fd, hdr, sizeof(hdr), pointsoff) != sizeof(hdr))
+		ret = -errno;
+
+cleanup:
+	free(buf);
+	free(sizes);
+
+	return ret;
+}
+
+void
+lazfile_freechunks(lazfile_chunks_t *chunks)
+{
+	assert(chunks != NULL);
+
+	free(chunks->starts);
+	chunks->starts = NULL;
+	chunks->nchunks = 0;
+}
+
+int
+lazfile_copypoints(int sfd, int dfd)
+{
+	lasheader_t hdr, newhdr;
+	unsigned char *prefix = NULL;
+	lazfile_laszip_t zip;
+	off_t delta;
+	int ret;
+
+	ret = lazfile_readprefix(sfd, &hdr, &prefix);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lasheader_read(dfd, &newhdr);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lazfile_findlaszip(prefix, &hdr, &zip);
+	if (ret != 0) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	ret = lazfs_copyrange(sfd, hdr.data_offset, dfd, newhdr.data_offset,
+			      -1);
+	if (ret != 0)
+		goto cleanup;
+
+	delta = (off_t) newhdr.data_offset - (off_t) hdr.data_offset;
+	if (delta != 0 && (zip.compressor == LAZFILE_COMPRESSOR_CHUNKED ||
+			   zip.compressor == LAZFILE_COMPRESSOR_LAYERED))
+		ret = lazfile_movechunktable(dfd, newhdr.data_offset, delta);
+
+cleanup:
+	free(prefix);
+
+	return ret;
+}
+
+int
+lazfile_encodechunk(int lasfd, const unsigned char *las,
+		    const lasheader_t *lashdr, uint64_t first, uint32_t count,
+		    unsigned char **zipvlrp, size_t *zipsizep, int dfd,
+		    off_t doff, uint32_t *sizep)
+{
+	unsigned char *prefix = NULL, *mini = NULL;
+	lasheader_t minihdr;
+	lazfile_laszip_t zip;
+	lazfile_chunks_t chunks = LAZFILE_CHUNKS_INIT;
+	int minilasfd, minilazfd = -1, ret;
+
+	minilasfd = lazfs_tmpfile();
+	if (minilasfd < 0)
+		return minilasfd;
+
+	minilazfd = lazfs_tmpfile();
+	if (minilazfd < 0) {
+		ret = minilazfd;
+		minilazfd = -1;
+		goto cleanup;
+	}
+
+	/* Small .las with the same header and VLRs but only chunk points */
+	prefix = malloc(lashdr->data_offset);
+	if (prefix == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	memcpy(prefix, las, lashdr->data_offset);
+	setle32(prefix + 107, count);
+	if (lashdr->header_size >= LASHEADER_MAXSIZE &&
+	    (lashdr->version_major > 1 || lashdr->version_minor >= 4))
+		setle64(prefix + 247, count);
+
+	if (pwrite(minilasfd, prefix, lashdr->data_offset, 0) !=
+	    (ssize_t) lashdr->data_offset) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	ret = lazfs_copyrange(lasfd, lashdr->data_offset +
+			      first * lashdr->record_length, minilasfd,
+			      lashdr->data_offset,
+			      (off_t) count * lashdr->record_length);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lazfs_compress(minilasfd, minilazfd);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lazfile_readprefix(minilazfd, &minihdr, &mini);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lazfile_findlaszip(mini, &minihdr, &zip);
+	if (ret != 0) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	if (*zipvlrp == NULL) {
+		*zipvlrp = malloc(zip.size);
+		if (*zipvlrp == NULL) {
+			ret = -ENOMEM;
+			goto cleanup;
+		}
+		memcpy(*zipvlrp, mini + zip.offset, zip.size);
+		*zipsizep = zip.size;
+	} else if (zip.size != *zipsizep ||
+		   memcmp(mini + zip.offset + LAZFILE_VLRHEADER,
+			  *zipvlrp + LAZFILE_VLRHEADER,
+			  zip.size - LAZFILE_VLRHEADER) != 0) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	ret = lazfile_readchunks(minilazfd, &zip, minihdr.data_offset, &chunks);
+	if (ret != 0)
+		goto cleanup;
+
+	if (chunks.nchunks != 1) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	*sizep = chunks.starts[1] - chunks.starts[0];
+	ret = lazfs_copyrange(minilazfd, chunks.starts[0], dfd, doff, *sizep);
+	if (ret == 0)
+		LAZFS_PROBE3(lazfile__chunk, first, count, *sizep);
+
+cleanup:
+	lazfile_freechunks(&chunks);
+	free(mini);
+	free(prefix);
+	if (minilazfd != -1)
+		close(minilazfd);
+	close(minilasfd);
+
+	return ret;
+}
+
+int
+lazfile_decodechunk(int lazfd, const unsigned char *laz,
+		    const lasheader_t *lazhdr, const lazfile_chunks_t *chunks,
+		    uint32_t i, uint32_t count, int dfd)
+{
+	unsigned char *prefix = NULL;
+	lazfile_chunks_t mini;
+	off_t starts[2];
+	int minilazfd, ret;
+
+	assert(chunks != NULL && i < chunks->nchunks);
+
+	minilazfd = lazfs_tmpfile();
+	if (minilazfd < 0)
+		return minilazfd;
+
+	/* Small .laz with the same header and VLRs but only one chunk */
+	prefix = malloc(lazhdr->data_offset);
+	if (prefix == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	memcpy(prefix, laz, lazhdr->data_offset);
+	setle32(prefix + 107, count);
+	if (lazhdr->header_size >= LASHEADER_MAXSIZE &&
+	    (lazhdr->version_major > 1 || lazhdr->version_minor >= 4))
+		setle64(prefix + 247, count);
+
+	if (pwrite(minilazfd, prefix, lazhdr->data_offset, 0) !=
+	    (ssize_t) lazhdr->data_offset) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	starts[0] = lazhdr->data_offset + 8;
+	starts[1] = starts[0] + chunks->starts[i + 1] - chunks->starts[i];
+	ret = lazfs_copyrange(lazfd, chunks->starts[i], minilazfd, starts[0],
+			      starts[1] - starts[0]);
+	if (ret != 0)
+		goto cleanup;
+
+	mini.nchunks = 1;
+	mini.starts = starts;
+	ret = lazfile_writechunks(minilazfd, lazhdr->data_offset, &mini);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lazfs_decompress(minilazfd, dfd);
+
+cleanup:
+	free(prefix);
+	close(minilazfd);
+
+	return ret;
+}
+
+/*
+ * Marks chunks which hold points from the dirty ranges. Returns number of
+ * dirty chunks.
+ */
+static uint32_t
+lazfile_dirtychunks(const lazfs_rangeset_t *set, const lasheader_t *hdr,
+		    uint32_t chunk_size, char *dirty)
+{
+	uint64_t first, last, i;
+	uint32_t ndirty = 0;
+	off_t start;
+	int r;
+
+	for (r = 0; r < set->nranges; r++) {
+		if (set->ranges[r].end <= hdr->data_offset)
+			continue;
+
+		start = set->ranges[r].start;
+		if (start < hdr->data_offset)
+			start = hdr->data_offset;
+
+		first = (start - hdr->data_offset) / hdr->record_length;
+		last = (set->ranges[r].end - 1 - hdr->data_offset) /
+		       hdr->record_length;
+		if (first >= hdr->npoints)
+			continue;
+		if (last >= hdr->npoints)
+			last = hdr->npoints - 1;
+
+		for (i = first / chunk_size; i <= last / chunk_size; i++) {
+			if (!dirty[i]) {
+				dirty[i] = 1;
+				ndirty++;
+			}
+		}
+	}
+
+	return ndirty;
+}
+
+int
+lazfile_recompress(void *arg)
+{
+	lazfile_recompress_t *rc = arg;
+	lasheader_t lashdr, lazhdr;
+	unsigned char *las = NULL, *laz = NULL, *prefix = NULL, *zipvlr;
+	lazfile_chunks_t chunks = LAZFILE_CHUNKS_INIT;
+	lazfile_chunks_t newchunks = LAZFILE_CHUNKS_INIT;
+	lazfile_laszip_t zip;
+	struct stat statbuf;
+	char *dirty = NULL;
+	uint32_t i, count, size, ndirty;
+	size_t len;
+	off_t pos;
+	int ret;
+
+	assert(rc != NULL);
+
+	rc->rewritten = NULL;
+
+	ret = lazfile_readprefix(rc->lasfd, &lashdr, &las);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lazfile_readprefix(rc->lazfd, &lazhdr, &laz);
+	if (ret != 0)
+		goto cleanup;
+
+	if (fstat(rc->lasfd, &statbuf) != 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	if (statbuf.st_size != lasheader_lassize(&lashdr) ||
+	    lazfile_findlaszip(laz, &lazhdr, &zip) != 0) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	ret = lazfile_readchunks(rc->lazfd, &zip, lazhdr.data_offset, &chunks);
+	if (ret != 0)
+		goto cleanup;
+
+	if (chunks.nchunks != (lashdr.npoints + zip.chunk_size - 1) /
+			      zip.chunk_size) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	/* Also checks that points have the same layout */
+	ret = lazfile_buildprefix(rc->lasfd, rc->lazfd, &prefix, &len);
+	if (ret != 0)
+		goto cleanup;
+
+	dirty = calloc(chunks.nchunks + 1, 1);
+	newchunks.starts = malloc((chunks.nchunks + 1) *
+				  sizeof(*newchunks.starts));
+	if (dirty == NULL || newchunks.starts == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+	newchunks.nchunks = chunks.nchunks;
+
+	/* Nothing to reuse, compression from scratch is faster */
+	ndirty = lazfile_dirtychunks(rc->dirty, &lashdr, zip.chunk_size, dirty);
+	if (ndirty == chunks.nchunks) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	if (pwrite(rc->dfd, prefix, len, 0) != (ssize_t) len) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	zipvlr = laz + zip.offset;
+	pos = len + 8;
+	for (i = 0; i < chunks.nchunks; i++) {
+		newchunks.starts[i] = pos;
+		if (dirty[i]) {
+			count = zip.chunk_size;
+			if ((uint64_t) i * zip.chunk_size + count > lashdr.npoints)
+				count = lashdr.npoints - (uint64_t) i * zip.chunk_size;
+
+			ret = lazfile_encodechunk(rc->lasfd, las, &lashdr,
+						  (uint64_t) i * zip.chunk_size,
+						  count, &zipvlr, &zip.size,
+						  rc->dfd, pos, &size);
+		} else {
+			size = chunks.starts[i + 1] - chunks.starts[i];
+			ret = lazfs_copyrange(rc->lazfd, chunks.starts[i],
+					      rc->dfd, pos, size);
+		}
+		if (ret != 0)
+			goto cleanup;
+		pos += size;
+	}
+	newchunks.starts[i] = pos;
+
+	ret = lazfile_writechunks(rc->dfd, len, &newchunks);
+	if (ret == 0) {
+		rc->rewritten = dirty;
+		dirty = NULL;
+	}
+
+cleanup:
+	lazfile_freechunks(&newchunks);
+	lazfile_freechunks(&chunks);
+	free(dirty);
+	free(prefix);
+	free(laz);
+	free(las);
+
+	return ret;
+}
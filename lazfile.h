@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _LAZFILE_H_
+#define _LAZFILE_H_
+
+#include "lasheader.h"
+#include "rangeset.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the variable length record header */
+#define LAZFILE_VLRHEADER 54
+
+/* Identification of the VLR which describes LAZ compressed point data */
+#define LAZFILE_LASZIP_USERID "laszip encoded"
+#define LAZFILE_LASZIP_RECORDID 22204
+
+/* LAZ compression bits of the point format set by LASzip */
+#define LAZFILE_FORMAT_COMPRESSED 0x80
+
+/* LASzip compressors, chunked ones begin point data with chunk table offset */
+#define LAZFILE_COMPRESSOR_NONE 0
+#define LAZFILE_COMPRESSOR_POINTWISE 1
+#define LAZFILE_COMPRESSOR_CHUNKED 2
+#define LAZFILE_COMPRESSOR_LAYERED 3
+
+/* Variable chunk size in the laszip VLR */
+#define LAZFILE_CHUNK_VARIABLE UINT32_MAX
+
+/* Fields of the laszip VLR which lazfs cares about */
+typedef struct lazfile_laszip {
+	size_t offset; /* Offset of the VLR in the prefix */
+	size_t size; /* Size of the VLR including header */
+	uint16_t compressor;
+	uint32_t chunk_size; /* Number of points in a chunk */
+} lazfile_laszip_t;
+
+/* Chunk table, chunk i is stored at [starts[i], starts[i + 1]) */
+typedef struct lazfile_chunks {
+	uint32_t nchunks;
+	off_t *starts; /* nchunks + 1 entries */
+} lazfile_chunks_t;
+
+#define LAZFILE_CHUNKS_INIT { 0, NULL }
+
+/* Arguments of lazfile_recompress() */
+typedef struct lazfile_recompress {
+	int lasfd; /* Modified decompressed file */
+	int lazfd; /* Original compressed file */
+	int dfd; /* New compressed file */
+	const lazfs_rangeset_t *dirty; /* Modified ranges of lasfd */
+	char *rewritten; /* Chunks compressed again, set on success */
+} lazfile_recompress_t;
+
+/*
+ * Reads public header and everything up to point data (VLRs) of the LAS/LAZ
+ * file opened as fd. *prefixp is allocated and must be freed by caller.
+ * Returns 0 on success or -errno.
+ */
+int
+lazfile_readprefix(int fd, lasheader_t *hdr, unsigned char **prefixp);
+
+/*
+ * Finds VLR in prefix returned by lazfile_readprefix(). Sets offset and size
+ * (including VLR header) of the VLR. Returns 0 if found, -ENOENT if it's not
+ * there or -EINVAL if VLRs are malformed.
+ */
+int
+lazfile_findvlr(const unsigned char *prefix, const lasheader_t *hdr,
+		const char *user_id, uint16_t record_id, size_t *offp,
+		size_t *sizep);
+
+/*
+ * Finds and parses laszip VLR in prefix returned by lazfile_readprefix().
+ * Returns 0 on success, -ENOENT if file isn't compressed or -EINVAL.
+ */
+int
+lazfile_findlaszip(const unsigned char *prefix, const lasheader_t *hdr,
+		   lazfile_laszip_t *zip);
+
+/*
+ * Returns size of the decompressed .las described by prefix returned by
+ * lazfile_readprefix(). Decompression drops the laszip VLR so its whole
+ * record isn't counted.
+ */
+off_t
+lazfile_lassize(const unsigned char *prefix, const lasheader_t *hdr);
+
+/*
+ * Reads chunk table of compressed points starting at pointsoff. Only chunks
+ * of fixed size are supported. Chunks must be freed via lazfile_freechunks().
+ * Returns 0 on success, -EINVAL for unsupported or malformed table or -errno.
+ */
+int
+lazfile_readchunks(int fd, const lazfile_laszip_t *zip, off_t pointsoff,
+		   lazfile_chunks_t *chunks);
+
+/*
+ * Writes chunk table after the last chunk and stores its offset at the
+ * beginning of compressed points at pointsoff. Returns 0 or -errno.
+ */
+int
+lazfile_writechunks(int fd, off_t pointsoff, const lazfile_chunks_t *chunks);
+
+void
+lazfile_freechunks(lazfile_chunks_t *chunks);
+
+/*
+ * Builds header and VLRs of the .laz from header and VLRs of the .las (las),
+ * laszip VLR zipvlr and LAZ compression bits of the point format. *prefixp
+ * is allocated and must be freed by caller. Returns 0 on success, -EINVAL if
+ * .las can't be compressed this way or -ENOMEM.
+ */
+int
+lazfile_makeprefix(const unsigned char *las, const lasheader_t *lashdr,
+		   const unsigned char *zipvlr, size_t zipsize,
+		   uint8_t formatbits, unsigned char **prefixp, size_t *sizep);
+
+/*
+ * Builds new header and VLRs of the .laz opened as lazfd from header and VLRs
+ * of the decompressed .las opened as lasfd. Compressed point data of lazfd
+ * remain valid for the new prefix, so points must be the same (point format,
+ * record length and count) in both files. *prefixp is allocated and must be
+ * freed by caller. Returns 0 on success, -EINVAL if files aren't compatible
+ * or -errno.
+ */
+int
+lazfile_buildprefix(int lasfd, int lazfd, unsigned char **prefixp,
+		    size_t *sizep);
+
+/*
+ * Copies compressed point data (and everything after them) of sfd to dfd
+ * which already contains prefix from lazfile_buildprefix(). Chunk table
+ * offset is adjusted when point data moved. Has the same signature as
+ * lazfs_compress so it can be run via workq. Returns 0 on success or -errno.
+ */
+int
+lazfile_copypoints(int sfd, int dfd);
+
+/*
+ * Compresses count points of lasfd starting with point first into a single
+ * LAZ chunk written to dfd at doff. las is header and VLRs of lasfd. Chunk is
+ * coded by LASzip, it fits into file described by laszip VLR *zipvlrp only if
+ * LASzip produces the same VLR. When *zipvlrp is NULL, VLR produced by LASzip
+ * is stored there (and must be freed by caller). Sets *sizep to size of the
+ * chunk. Returns 0, -EINVAL if the chunk can't be used or -errno.
+ */
+int
+lazfile_encodechunk(int lasfd, const unsigned char *las,
+		    const lasheader_t *lashdr, uint64_t first, uint32_t count,
+		    unsigned char **zipvlrp, size_t *zipsizep, int dfd,
+		    off_t doff, uint32_t *sizep);
+
+/*
+ * Decompresses chunk i of lazfd which holds count points. laz is header and
+ * VLRs of lazfd and chunks its chunk table. Complete .las with the header and
+ * VLRs of lazfd and only points of the chunk is written to empty dfd. Returns
+ * 0 on success or -errno.
+ */
+int
+lazfile_decodechunk(int lazfd, const unsigned char *laz,
+		    const lasheader_t *lazhdr, const lazfile_chunks_t *chunks,
+		    uint32_t i, uint32_t count, int dfd);
+
+/*
+ * Writes new .laz which holds content of the decompressed file to dfd. Only
+ * chunks with modified points are compressed again, the rest is copied from
+ * the original .laz. Argument is lazfile_recompress_t, it can be run via
+ * workq. On success rewritten is set to array with non-zero entries for
+ * chunks which were compressed again, caller frees it. Returns 0 on success,
+ * -EINVAL if file must be compressed from scratch (e.g. number of points
+ * changed) or -errno.
+ */
+int
+lazfile_recompress(void *arg);
+
+#endif
@@ -25,8 +25,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -34,8 +36,47 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 
+#include "codec.h"
+#include "ctl.h"
+#include "diskcache.h"
+#include "lasheader.h"
+#include "lazfile.h"
+#include "lazindex.h"
+#include "pointstats.h"
 #include "log.h"
+#include "prefetch.h"
+#include "probes.h"
+#include "query.h"
+#include "raw.h"
+#include "scan.h"
+#include "tier.h"
+#include "stats.h"
+#include "stream.h"
+#include "trace.h"
 #include "util.h"
+#include "view.h"
+
+/* Maximum number of files in attribute cache */
+#define LAZFS_ATTRCACHE_ENTRIES 65536
+
+/* Default number of files scanned per second */
+#define LAZFS_SCAN_RATE 1000
+
+/* Default budgets of tiering, MiB per second and percent of time */
+#define LAZFS_TIER_IORATE 20
+#define LAZFS_TIER_CPU 25
+
+/* Default scratch space which prefetch can fill, MiB */
+#define LAZFS_PREFETCH_SCRATCH 1024
+
+/* Default size of decompressed files kept in cache_dir, MiB */
+#define LAZFS_CACHE_KEEP 4096
+
+/* Maximum size of the LAZ header and VLRs which is patched in place */
+#define LAZFS_PATCH_INPLACE 4096
+
+/* Default log file, relative to directory where lazfs is started */
+#define LAZFS_LOGPATH "lazfs.log"
 
 /*
  * Get file attributes.
@@ -51,19 +92,28 @@ lazfs_getattr(const char *path, struct stat *statbuf)
 	char fpath[PATH_MAX];
 	char fpath_laz[PATH_MAX];
 	laz_cache_t *cache = LAZFS_DATA->cache;
+	const codec_rule_t *rule;
 	char locked = 0;
 	off_t size;
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_getattr(node, statbuf);
+	if (raw_lookup(path, fpath))
+		return raw_getattr(fpath, statbuf);
+	if (query_lookup(path))
+		return query_getattr(path, statbuf);
+	if (view_lookup(path))
+		return view_getattr(path, statbuf);
 
 	log_debug("\nlazfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
 		  path, statbuf);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		/* We got request for .las file */
-		strncpy(fpath_laz, fpath, PATH_MAX);
-		fpath_laz[PATH_MAX - 1] = '\0';
-		fpath_laz[strlen(fpath_laz) - 1] = 'z';
-
+	rule = lazfs_exec_hooks(fpath, fpath_laz);
+	if (rule != NULL) {
+		/* We got request for virtual file */
 		cache_lock(cache);
 		locked = 1;
 
@@ -75,9 +125,17 @@ lazfs_getattr(const char *path, struct stat *statbuf)
 			goto cleanup;
 		}
 
-		retstat = lazfs_getsize(fpath_laz, &size);
-		if (retstat != 0)
-			goto cleanup;
+		if (attrcache_getsize(LAZFS_DATA->attrcache, fpath_laz, statbuf,
+				      &size) == 0) {
+			stats_add(STATS_ATTR_HITS, 1);
+		} else {
+			stats_add(STATS_ATTR_MISSES, 1);
+			retstat = lazfs_getsize(fpath_laz, rule, &size);
+			if (retstat != 0)
+				goto cleanup;
+			attrcache_store(LAZFS_DATA->attrcache, fpath_laz,
+					statbuf, size, NULL);
+		}
 
 		cache_unlock(cache);
 		locked = 0;
@@ -121,6 +179,9 @@ lazfs_readlink(const char *path, char *link, size_t size)
 	int retstat = 0;
 	char fpath[PATH_MAX];
 
+	if (raw_lookup(path, fpath))
+		return raw_readlink(fpath, link, size);
+
 	log_debug("lazfs_readlink(path=\"%s\", link=\"%s\", size=%d)\n",
 		  path, link, size);
 	lazfs_fullpath(fpath, path);
@@ -155,6 +216,11 @@ lazfs_mknod(const char *path, mode_t mode, dev_t dev)
 		  path, mode, dev);
 	lazfs_fullpath(fpath, path);
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	lazfs_setugid(&ugid);
 	// On Linux this could just be 'mknod(path, mode, rdev)' but this
 	// is more portable
@@ -191,6 +257,11 @@ lazfs_mkdir(const char *path, mode_t mode)
 	char fpath[PATH_MAX];
 	lazfs_ugid_t ugid;
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	log_debug("\nlazfs_mkdir(path=\"%s\", mode=0%3o)\n",
 		  path, mode);
 	lazfs_fullpath(fpath, path);
@@ -206,6 +277,35 @@ lazfs_mkdir(const char *path, mode_t mode)
 	return retstat;
 }
 
+/*
+ * Spatial index follows its compressed file cpath: it's moved to index of
+ * newcpath (linked when keep is set) or removed when newcpath is NULL. Index
+ * is optional and rebuilt by queries, so errors are only logged.
+ */
+static void
+lazfs_moveindex(const char *cpath, const char *newcpath, char keep)
+{
+	char ipath[PATH_MAX], newipath[PATH_MAX];
+	int ret;
+
+	if (lazindex_path(ipath, cpath) != 0 ||
+	    (newcpath != NULL && lazindex_path(newipath, newcpath) != 0))
+		return;
+
+	if (newcpath == NULL) {
+		ret = unlink(ipath);
+	} else {
+		/* Index of the replaced file is stale */
+		ret = unlink(newipath);
+		if (ret == 0 || errno == ENOENT)
+			ret = keep ? link(ipath, newipath) :
+				     rename(ipath, newipath);
+	}
+
+	if (ret != 0 && errno != ENOENT)
+		lazfs_error("lazfs_moveindex");
+}
+
 /* Remove a file */
 int
 lazfs_unlink(const char *path)
@@ -213,22 +313,29 @@ lazfs_unlink(const char *path)
 	int retstat = 0;
 	char fpath[PATH_MAX];
 	char path_las[PATH_MAX];
+	const codec_rule_t *rule;
+
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
 
 	log_debug("lazfs_unlink(path=\"%s\")\n",
 		  path);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		strncpy(path_las, fpath, PATH_MAX);
-		path_las[PATH_MAX - 1] = '\0';
-		path_las[strlen(path_las) - 1] = 'z';
-
+	rule = lazfs_exec_hooks(fpath, path_las);
+	if (rule != NULL) {
+		lazfs_prefetch_forget(path);
+		diskcache_forget(path);
 		retstat = unlink(path_las);
 	} else
 		retstat = unlink(fpath);
 
 	if (retstat < 0)
 		retstat = lazfs_error("lazfs_unlink unlink");
+	else if (rule != NULL && (rule->codec->flags & CODEC_LAS))
+		lazfs_moveindex(path_las, NULL, 0);
 
 	return retstat;
 }
@@ -240,6 +347,11 @@ lazfs_rmdir(const char *path)
 	int retstat = 0;
 	char fpath[PATH_MAX];
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	log_debug("lazfs_rmdir(path=\"%s\")\n",
 		  path);
 	lazfs_fullpath(fpath, path);
@@ -264,6 +376,11 @@ lazfs_symlink(const char *path, const char *link)
 	int retstat = 0;
 	char flink[PATH_MAX];
 
+	if (ctl_lookup(link) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(link, flink))
+		return -EROFS;
+
 	log_debug("\nlazfs_symlink(path=\"%s\", link=\"%s\")\n",
 		  path, link);
 	lazfs_fullpath(flink, link);
@@ -275,39 +392,156 @@ lazfs_symlink(const char *path, const char *link)
 	return retstat;
 }
 
-/* Rename a file. Both path and newpath are fs-relative. */
+/*
+ * Converts backend path of the (possibly virtual) file to path of the
+ * compressed file. Returns rule of the suffix or NULL if there is none.
+ */
+static const codec_rule_t *
+lazfs_lazpath(char fpath_laz[PATH_MAX], const char *fpath)
+{
+	const codec_rule_t *rule;
+
+	rule = codec_match(fpath);
+	if (rule == NULL || codec_storedpath(rule, fpath, fpath_laz) != 0)
+		return NULL;
+
+	return rule;
+}
+
+/*
+ * Rename a file. Both path and newpath are fs-relative.
+ *
+ * Virtual files are renamed by renaming underlying compressed file so
+ * nothing is decompressed. They can't be renamed to suffix of other codec,
+ * EXDEV makes tools to fall back to copy which stores data via the right
+ * codec.
+ */
 int
 lazfs_rename(const char *path, const char *newpath)
 {
 	int retstat = 0;
 	char fpath[PATH_MAX];
 	char fnewpath[PATH_MAX];
+	char fpath_laz[PATH_MAX];
+	char fnewpath_laz[PATH_MAX];
+	laz_cache_t *cache = LAZFS_DATA->cache;
+	const codec_rule_t *rule, *dstrule;
+	laz_cachestat_t cstat;
+	struct stat statbuf;
+
+	if (ctl_lookup(path) != CTL_NONE ||
+	    ctl_lookup(newpath) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath) || raw_lookup(newpath, fpath))
+		return -EROFS;
 
 	log_debug("\nlazfs_rename(fpath=\"%s\", newpath=\"%s\")\n",
 		  path, newpath);
 	lazfs_fullpath(fpath, path);
 	lazfs_fullpath(fnewpath, newpath);
+	dstrule = lazfs_lazpath(fnewpath_laz, fnewpath);
 
-	retstat = rename(fpath, fnewpath);
-	if (retstat < 0)
-		retstat = lazfs_error("lazfs_rename rename");
+	cache_lock(cache);
+
+	/* Just closed file can be still being compressed under old name */
+	cache_wait(cache, path);
+
+	/* We can't track two open files of the same name */
+	if (cache_contains(cache, newpath)) {
+		retstat = -EBUSY;
+		goto cleanup;
+	}
+
+	rule = lazfs_exec_hooks(fpath, fpath_laz);
+	if (rule != NULL) {
+		if (dstrule == NULL || dstrule->codec != rule->codec) {
+			retstat = -EXDEV;
+			goto cleanup;
+		}
+
+		retstat = rename(fpath_laz, fnewpath_laz);
+		if (retstat < 0) {
+			retstat = lazfs_error("lazfs_rename rename");
+			goto cleanup;
+		}
+		attrcache_remove(LAZFS_DATA->attrcache, fpath_laz);
+		if (rule->codec->flags & CODEC_LAS)
+			lazfs_moveindex(fpath_laz, fnewpath_laz, 0);
+
+		/* Uncompressed file of the same name would hide renamed one */
+		if (unlink(fnewpath) < 0 && errno != ENOENT)
+			lazfs_error("lazfs_rename unlink");
+	} else {
+		retstat = rename(fpath, fnewpath);
+		if (retstat < 0) {
+			retstat = lazfs_error("lazfs_rename rename");
+			goto cleanup;
+		}
+
+		/* Renamed file replaces compressed file of the same name */
+		if (dstrule != NULL && lstat(fnewpath, &statbuf) == 0 &&
+		    !S_ISDIR(statbuf.st_mode)) {
+			if (unlink(fnewpath_laz) < 0 && errno != ENOENT)
+				lazfs_error("lazfs_rename unlink");
+			if (dstrule->codec->flags & CODEC_LAS)
+				lazfs_moveindex(fnewpath_laz, NULL, 0);
+		}
+	}
+
+	/* Open files are tracked by name, follow the rename */
+	lazfs_prefetch_rename(path, newpath);
+	retstat = cache_rename(cache, path, newpath);
+	if (retstat != 0)
+		log_error("lazfs_rename: cache_rename failed\n");
+	else if (cache_get(cache, newpath, 0, &cstat) == 0 && cstat.dirty)
+		diskcache_dirty(newpath, cstat.tmppath);
+	diskcache_forget(path);
+	diskcache_forget(newpath);
+
+cleanup:
+	cache_unlock(cache);
 
 	return retstat;
 }
 
-/* Create a hard link to a file */
+/*
+ * Create a hard link to a file
+ *
+ * Virtual files are linked via underlying compressed file. Note that when
+ * file is written through one of the links, it gets new compressed file on
+ * close and links no longer share data.
+ */
 int
 lazfs_link(const char *path, const char *newpath)
 {
 	int retstat = 0;
 	char fpath[PATH_MAX], fnewpath[PATH_MAX];
+	char fpath_laz[PATH_MAX], fnewpath_laz[PATH_MAX];
+	const codec_rule_t *rule, *dstrule;
+
+	if (ctl_lookup(path) != CTL_NONE ||
+	    ctl_lookup(newpath) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath) || raw_lookup(newpath, fpath))
+		return -EROFS;
 
 	log_debug("\nlazfs_link(path=\"%s\", newpath=\"%s\")\n",
 		  path, newpath);
 	lazfs_fullpath(fpath, path);
 	lazfs_fullpath(fnewpath, newpath);
 
-	retstat = link(fpath, fnewpath);
+	rule = lazfs_exec_hooks(fpath, fpath_laz);
+	if (rule != NULL) {
+		dstrule = lazfs_lazpath(fnewpath_laz, fnewpath);
+		if (dstrule == NULL || dstrule->codec != rule->codec)
+			return -EXDEV;
+
+		retstat = link(fpath_laz, fnewpath_laz);
+		if (retstat == 0 && (rule->codec->flags & CODEC_LAS))
+			lazfs_moveindex(fpath_laz, fnewpath_laz, 1);
+	} else
+		retstat = link(fpath, fnewpath);
+
 	if (retstat < 0)
 		retstat = lazfs_error("lazfs_link link");
 
@@ -321,6 +555,11 @@ lazfs_chmod(const char *path, mode_t mode)
 	int retstat = 0;
 	char fpath[PATH_MAX];
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	log_debug("\nlazfs_chmod(fpath=\"%s\", mode=0%03o)\n",
 		  path, mode);
 	lazfs_fullpath(fpath, path);
@@ -339,6 +578,11 @@ lazfs_chown(const char *path, uid_t uid, gid_t gid)
 	int retstat = 0;
 	char fpath[PATH_MAX];
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	log_debug("\nlazfs_chown(path=\"%s\", uid=%d, gid=%d)\n",
 		  path, uid, gid);
 	lazfs_fullpath(fpath, path);
@@ -356,6 +600,13 @@ lazfs_truncate(const char *path, off_t newsize)
 {
 	int retstat = 0;
 	char fpath[PATH_MAX];
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return (node == CTL_CTL) ? 0 : -EACCES;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
 
 	log_debug("\nlazfs_truncate(path=\"%s\", newsize=%lld)\n",
 		  path, newsize);
@@ -379,17 +630,18 @@ lazfs_utime(const char *path, struct utimbuf *ubuf)
 	char fpath[PATH_MAX];
 	char path_las[PATH_MAX];
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	log_debug("\nlazfs_utime(path=\"%s\", ubuf=0x%08x)\n",
 		  path, ubuf);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		strncpy(path_las, fpath, PATH_MAX);
-		path_las[PATH_MAX - 1] = '\0';
-		path_las[strlen(path_las) - 1] = 'z';
-
+	if (lazfs_exec_hooks(fpath, path_las))
 		retstat = utime(path_las, ubuf);
-	} else
+	else
 		retstat = utime(fpath, ubuf);
 
 	if (retstat < 0)
@@ -415,46 +667,117 @@ lazfs_open(const char *path, struct fuse_file_info *fi)
 	int retstat = 0;
 	int fd = -1, tmpfd = -1;
 	char fpath[PATH_MAX], fpath_laz[PATH_MAX];
-	char tmppath[] = "/tmp/lazfs.XXXXXX";
+	char tmppath[PATH_MAX];
 	laz_cache_t *cache = LAZFS_DATA->cache;
+	const codec_rule_t *rule;
 	char decompressed = 0, locked = 0;
 	laz_cachestat_t cstat;
+	lazfs_tierjob_t *tierjob;
+	void *lazy = NULL;
+	int prefetched = 0;
+	diskcache_key_t key;
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_open(node, fi);
+	if (raw_lookup(path, fpath))
+		return raw_open(fpath, fi);
+	if (query_lookup(path))
+		return query_open(path, fi);
+	if (view_lookup(path))
+		return view_open(path, fi);
 
 	log_debug("\nlazfs_open(path\"%s\", fi=0x%08x)\n",
 		  path, fi);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		/* We got request for .las file */
+	rule = lazfs_exec_hooks(fpath, fpath_laz);
+	if (rule != NULL) {
+		/* We got request for virtual file */
+
+		/* Backend file of file decompressed before is read unlocked */
+		if (diskcache_lookup(path, fpath_laz, fi->flags, &fd,
+				     &key) != 0)
+			fd = -1;
 
 		cache_lock(cache);
 		locked = 1;
 		retstat = cache_get(cache, path, 1, &cstat);
 		if (retstat == 0) {
+			if (fd != -1)
+				close(fd);
 			fd = cstat.fd;
 			tmpfd = cstat.tmpfd;
+			prefetched = cstat.prefetched;
 			goto cached;
 		}
 
-		strncpy(fpath_laz, fpath, PATH_MAX);
-		fpath_laz[PATH_MAX - 1] = '\0';
-		fpath_laz[strlen(fpath_laz) - 1] = 'z';
+		log_debug("\nlazfs_open: opening %s file \"%s\"\n",
+			  rule->codec->name, fpath_laz);
+
+		/* File decompressed before, possibly by previous mount */
+		if (fd != -1 &&
+		    diskcache_adopt(path, &key, tmppath, &tmpfd) == 0) {
+			decompressed = 1;
+			retstat = cache_add(cache, path, tmppath, fd, tmpfd,
+					    rule, NULL);
+			if (retstat != 0) {
+				log_error("lazfs_open: cache_add failed");
+				goto cleanup;
+			}
+			goto cached;
+		}
 
-		log_debug("\nlazfs_open: opening laz file \"%s\"\n", fpath_laz);
+		if (fd != -1) {
+			close(fd);
+			fd = -1;
+		}
 
 		/* FIXME: We shouldn't ignore fi->flags */
+		diskcache_tmppath(tmppath);
 		retstat = lazfs_prepare_tmpfile(fpath_laz, tmppath, fi->flags, -1, &fd, &tmpfd);
 		if (retstat != 0) {
 			log_error("lazfs_open: lazfs_prepare_tmpfile failed");
 			goto cleanup;
 		}
+		decompressed = 1;
+
+		/* Cold file must be restored before it's decompressed */
+		retstat = lazfs_tier_prepare(LAZFS_DATA->rootdir, fpath_laz,
+					     rule, fd, tmpfd, &tierjob);
+		if (retstat < 0)
+			goto cleanup;
+		if (retstat > 0) {
+			retstat = cache_addcall(cache, path, tmppath, fd, tmpfd,
+						&lazfs_tier_promote, tierjob,
+						LAZFS_DATA->workq);
+			if (retstat != 0) {
+				log_error("lazfs_open: cache_addcall failed");
+				free(tierjob);
+				goto cleanup;
+			}
+			goto cached;
+		}
 
-		retstat = cache_add(cache, path, tmppath, fd, tmpfd, LAZFS_DATA->workq);
+		/*
+		 * Codecs which can decompress parts of the file do it on
+		 * access, fall back to full decompression when backend file
+		 * has no index (e.g. it was written by plain zstd tool).
+		 */
+		if (rule->codec->lazy != NULL &&
+		    rule->codec->lazy->open(rule, fd, tmpfd, &lazy) != 0)
+			lazy = NULL;
+
+		retstat = cache_add(cache, path, tmppath, fd, tmpfd, rule,
+				    (lazy != NULL) ? NULL : LAZFS_DATA->workq);
 		if (retstat != 0) {
 			log_error("lazfs_open: cache_add failed");
+			if (lazy != NULL)
+				rule->codec->lazy->close(lazy);
 			goto cleanup;
 		}
-		decompressed = 1;
+		cache_setlazy(cache, path, lazy);
 	} else {
 		fd = open(fpath, fi->flags);
 		if (fd < 0) {
@@ -467,6 +790,9 @@ cached:
 	fi->fh = fd;
 	log_fi(fi);
 
+	if (rule != NULL)
+		lazfs_prefetch_open(path, fuse_get_context()->pid, prefetched);
+
 	return 0;
 
 cleanup:
@@ -505,8 +831,21 @@ lazfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_f
 	int retstat = 0;
 	int tmpfd = -1;
 	laz_cache_t *cache = LAZFS_DATA->cache;
+	const codec_rule_t *rule;
 	char fpath[PATH_MAX];
 	laz_cachestat_t cstat;
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_read(fi, buf, size, offset);
+	if (raw_lookup(path, fpath))
+		return raw_read(fi, buf, size, offset);
+	if (query_lookup(path))
+		return query_read(fi, buf, size, offset);
+	if (view_lookup(path))
+		return view_read(fi, buf, size, offset);
+
 #if 0
 	log_debug("\nlazfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 		  path, buf, size, offset, fi);
@@ -514,13 +853,25 @@ lazfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_f
 #endif
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
+	rule = lazfs_exec_hooks(fpath, NULL);
+	if (rule != NULL) {
 		cache_lock(cache);
 		retstat = cache_get(cache, path, 1, &cstat);
-		cache_unlock(cache);
 		/* Every read file must have been opened & cached */
 		assert(retstat == 0);
+		/* Reader might be copying file, see lazfs_release() */
+		if (cstat.pid != fuse_get_context()->pid)
+			cache_setpid(cache, path, fuse_get_context()->pid);
+		cache_unlock(cache);
 		tmpfd = cstat.tmpfd;
+		if (cstat.stream != NULL)
+			lazfs_stream_access(cstat.stream, offset, size);
+		if (cstat.lazy != NULL) {
+			retstat = rule->codec->lazy->fetch(cstat.lazy, offset,
+							   size);
+			if (retstat != 0)
+				goto release;
+		}
 	} else
 		tmpfd = fi->fh;
 
@@ -528,7 +879,8 @@ lazfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_f
 	if (retstat < 0)
 		retstat = lazfs_error("lazfs_read read");
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
+release:
+	if (rule != NULL) {
 		cache_lock(cache);
 		cache_remove(cache, path);
 		cache_unlock(cache);
@@ -557,7 +909,14 @@ lazfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	int retstat = 0;
 	char fpath[PATH_MAX];
 	laz_cache_t *cache = LAZFS_DATA->cache;
+	const codec_rule_t *rule;
 	laz_cachestat_t cstat;
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_write(fi, buf, size);
+
 #if 0
 	log_debug("\nlazfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 		  path, buf, size, offset, fi);
@@ -565,17 +924,33 @@ lazfs_write(const char *path, const char *buf, size_t size, off_t offset,
 #endif
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
+	rule = lazfs_exec_hooks(fpath, NULL);
+	if (rule != NULL) {
 		cache_lock(cache);
 		retstat = cache_get(cache, path, 1, &cstat);
-		cache_unlock(cache);
 		assert(retstat == 0);
-		if (cstat.dirty == 0)
-			cache_dirty(cache, path);
+		cache_dirty(cache, path, offset, size);
+		cache_unlock(cache);
 
-		retstat = pwrite(cstat.tmpfd, buf, size, offset);
-		if (retstat < 0)
-			retstat = lazfs_error("lazfs_write pwrite");
+		/* Streamed and lazy files aren't complete in tmpfile */
+		if (!cstat.dirty && cstat.stream == NULL && cstat.lazy == NULL)
+			diskcache_dirty(path, cstat.tmppath);
+
+		if (cstat.stream != NULL)
+			lazfs_stream_access(cstat.stream, offset, size);
+
+		/* Partially written frames must be decompressed first */
+		if (cstat.lazy != NULL)
+			retstat = rule->codec->lazy->fetch(cstat.lazy, offset,
+							   size);
+		if (retstat == 0) {
+			retstat = pwrite(cstat.tmpfd, buf, size, offset);
+			if (retstat < 0)
+				retstat = lazfs_error("lazfs_write pwrite");
+			else if (cstat.stream != NULL)
+				lazfs_stream_write(cstat.stream, offset,
+						   retstat);
+		}
 		cache_lock(cache);
 		cache_remove(cache, path);
 		cache_unlock(cache);
@@ -602,6 +977,9 @@ lazfs_statfs(const char *path, struct statvfs *statv)
 	int retstat = 0;
 	char fpath[PATH_MAX];
 
+	if (raw_lookup(path, fpath))
+		return raw_statfs(fpath, statv);
+
 	log_debug("\nlazfs_statfs(path=\"%s\", statv=0x%08x)\n",
 		  path, statv);
 	lazfs_fullpath(fpath, path);
@@ -652,6 +1030,553 @@ lazfs_flush(const char *path, struct fuse_file_info *fi)
 	return retstat;
 }
 
+/*
+ * Points of compressfd are in the same order as in backend file fd, so it
+ * keeps its order xattrs. Failure only loses the record, it's not fatal.
+ */
+static void
+lazfs_keeporder(const char *path, int fd, int compressfd)
+{
+	int ret;
+
+	ret = lazfs_copyxattr(fd, compressfd, ORDERATTR);
+	if (ret == 0)
+		ret = lazfs_copyxattr(fd, compressfd, LODATTR);
+	if (ret != 0)
+		log_error("lazfs_keeporder: \"%s\": %s\n", path,
+			  strerror(-ret));
+}
+
+/*
+ * Source fd of the clone has point statistics and spatial index of cpath
+ * which are valid for the clone too. Statistics are copied to compressfd.
+ * Returns non-zero if both were there, index is linked after the rename.
+ */
+static char
+lazfs_keepindex(const char *path, const char *cpath, int fd, int compressfd)
+{
+	char ipath[PATH_MAX];
+	int ret;
+
+	if (fgetxattr(fd, POINTSATTR, NULL, 0) < 0 ||
+	    lazindex_path(ipath, cpath) != 0 || access(ipath, F_OK) != 0)
+		return 0;
+
+	ret = lazfs_copyxattr(fd, compressfd, POINTSATTR);
+	if (ret != 0) {
+		log_error("lazfs_keepindex: \"%s\": %s\n", path,
+			  strerror(-ret));
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Tries to store dirty file as a clone of .laz of another cached file. Copy
+ * tools read the source and write the destination, so when written content
+ * is equal to decompressed content of a file read by the same process, it's
+ * enough to clone the source .laz. Source must be stored by the same codec.
+ * When the clone keeps point statistics and index of the source, backend
+ * path of the source is stored to srccpath, otherwise it's left empty.
+ * Returns 0 if file was cloned to compressfd, 1 if it must be compressed or
+ * -errno.
+ */
+static int
+lazfs_clonecopy(laz_cache_t *cache, const char *path, laz_cachestat_t *cstat,
+		const codec_t *codec, int compressfd, char srccpath[PATH_MAX])
+{
+	const codec_rule_t *srcrule;
+	laz_cachestat_t srcstat;
+	char srcpath[PATH_MAX];
+	char srcfpath[PATH_MAX];
+	struct stat statbuf;
+	int ret;
+
+	srccpath[0] = '\0';
+
+	if (fstat(cstat->tmpfd, &statbuf) != 0 ||
+	    cache_copysource(cache, path, cstat->pid, statbuf.st_size,
+			     &srcstat) != 0)
+		return 1;
+
+	/* Source can't be renamed until it's marked ready */
+	strncpy(srcpath, srcstat.name, PATH_MAX);
+	srcpath[PATH_MAX - 1] = '\0';
+
+	srcrule = codec_match(srcpath);
+	if (srcrule == NULL || srcrule->codec != codec) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* Files decompressed on demand can't be compared until complete */
+	if ((cstat->lazy != NULL && !codec->lazy->complete(cstat->lazy)) ||
+	    (srcstat.lazy != NULL && !codec->lazy->complete(srcstat.lazy))) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	ret = cache_finish(cache, path, &lazfs_cmpfile, srcstat.tmpfd,
+			   cstat->tmpfd, LAZFS_DATA->workq);
+	if (ret == 0) {
+		log_debug("lazfs_clonecopy: \"%s\" is copy of \"%s\"\n",
+			  path, srcpath);
+		ret = lazfs_clonefile(srcstat.fd, compressfd);
+		if (ret != 0) {
+			/* Fall back to compression */
+			ret = (ftruncate(compressfd, 0) == 0) ? 1 : -errno;
+		} else {
+			lazfs_keeporder(path, srcstat.fd, compressfd);
+			lazfs_fullpath(srcfpath, srcpath);
+			if (lazfs_lazpath(srccpath, srcfpath) == NULL ||
+			    !lazfs_keepindex(path, srccpath, srcstat.fd,
+					     compressfd))
+				srccpath[0] = '\0';
+		}
+	} else if (ret < 0) {
+		log_error("lazfs_clonecopy: comparison failed: %s\n",
+			  strerror(-ret));
+		ret = 1;
+	}
+
+cleanup:
+	cache_markready(cache, srcpath);
+
+	return ret;
+}
+
+/*
+ * Tries to store dirty file by rewriting only header and VLRs of the .laz.
+ * When nothing but header and VLRs was modified, compressed point data are
+ * still valid. If size of the new header and VLRs is the same and the .laz
+ * has no other links, it's patched in place and *inplace is set. Otherwise
+ * the new prefix followed by copy of compressed points is written to
+ * compressfd. Returns 0 if patched, 1 if file must be compressed or -errno.
+ */
+static int
+lazfs_patchheader(laz_cache_t *cache, const char *path,
+		  laz_cachestat_t *cstat, int compressfd, char *inplace)
+{
+	unsigned char *prefix = NULL;
+	struct stat statbuf;
+	lasheader_t hdr;
+	size_t len;
+	int ret, flags;
+
+	*inplace = 0;
+
+	/* Points are untouched when size is the same and writes hit prefix */
+	if (cstat->origsize == -1 || fstat(cstat->tmpfd, &statbuf) != 0 ||
+	    statbuf.st_size != cstat->origsize)
+		return 1;
+
+	if (lasheader_read(cstat->tmpfd, &hdr) != 0 ||
+	    lasheader_lassize(&hdr) != statbuf.st_size ||
+	    rangeset_end(cstat->dirtyset) > hdr.data_offset)
+		return 1;
+
+	if (lazfile_buildprefix(cstat->tmpfd, cstat->fd, &prefix, &len) != 0)
+		return 1;
+
+	/*
+	 * Same-sized prefix within one page is rewritten in place and synced
+	 * before close returns. Hard links must keep their data (see
+	 * lazfs_link()), so only .laz with one link is patched. O_APPEND
+	 * would make pwrite() append.
+	 */
+	flags = fcntl(cstat->fd, F_GETFL);
+	if (flags != -1 && !(flags & O_APPEND) && len <= LAZFS_PATCH_INPLACE &&
+	    fstat(cstat->fd, &statbuf) == 0 && statbuf.st_nlink == 1 &&
+	    lasheader_read(cstat->fd, &hdr) == 0 && hdr.data_offset == len &&
+	    pwrite(cstat->fd, prefix, len, 0) == (ssize_t) len &&
+	    fdatasync(cstat->fd) == 0) {
+		log_debug("lazfs_patchheader: \"%s\" patched in place\n", path);
+		*inplace = 1;
+		ret = 0;
+		goto cleanup;
+	}
+
+	if (pwrite(compressfd, prefix, len, 0) != (ssize_t) len) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	ret = cache_finish(cache, path, &lazfile_copypoints, cstat->fd,
+			   compressfd, LAZFS_DATA->workq);
+	if (ret == 0) {
+		log_debug("lazfs_patchheader: \"%s\" header rewritten\n", path);
+		lazfs_keeporder(path, cstat->fd, compressfd);
+	} else {
+		log_error("lazfs_patchheader: copy failed: %s\n",
+			  strerror(-ret));
+		/* Fall back to compression */
+		ret = (ftruncate(compressfd, 0) == 0) ? 1 : -errno;
+	}
+
+cleanup:
+	free(prefix);
+
+	return ret;
+}
+
+/*
+ * Tries to store dirty file by compressing only LAZ chunks with modified
+ * points, other chunks are copied from the .laz. Chunks which were
+ * compressed again are marked in *rewrittenp, caller frees it. Returns 0 if
+ * new .laz was written to compressfd, 1 if file must be compressed or
+ * -errno.
+ */
+static int
+lazfs_recompress(laz_cache_t *cache, const char *path,
+		 laz_cachestat_t *cstat, int compressfd, char **rewrittenp)
+{
+	lazfile_recompress_t rc;
+	int ret;
+
+	if (cstat->origsize == -1)
+		return 1;
+
+	rc.lasfd = cstat->tmpfd;
+	rc.lazfd = cstat->fd;
+	rc.dfd = compressfd;
+	rc.dirty = cstat->dirtyset;
+
+	ret = cache_finishcall(cache, path, &lazfile_recompress, &rc,
+			       LAZFS_DATA->workq);
+	if (ret == 0) {
+		log_debug("lazfs_recompress: \"%s\" recompressed\n", path);
+		lazfs_keeporder(path, cstat->fd, compressfd);
+		*rewrittenp = rc.rewritten;
+		return 0;
+	}
+
+	if (ret != -EINVAL)
+		log_error("lazfs_recompress: \"%s\": %s\n", path, strerror(-ret));
+
+	/* Fall back to compression */
+	return (ftruncate(compressfd, 0) == 0) ? 1 : -errno;
+}
+
+/* Argument of lazfs_lazyjob() */
+typedef struct lazfs_lazyjob {
+	const codec_lazyops_t *ops;
+	void *lazy;
+	const lazfs_rangeset_t *dirty;
+	int dfd;
+} lazfs_lazyjob_t;
+
+static int
+lazfs_lazyjob(void *arg)
+{
+	lazfs_lazyjob_t *job = arg;
+
+	return job->ops->recompress(job->lazy, job->dirty, job->dfd);
+}
+
+/*
+ * Stores file decompressed on demand. Parts which weren't written are
+ * copied from the backend file, missing ones are decompressed first.
+ */
+static int
+lazfs_lazyrecompress(laz_cache_t *cache, const char *path,
+		     const codec_rule_t *rule, laz_cachestat_t *cstat,
+		     int compressfd)
+{
+	lazfs_lazyjob_t job;
+	int ret;
+
+	job.ops = rule->codec->lazy;
+	job.lazy = cstat->lazy;
+	job.dirty = (cstat->origsize != -1) ? cstat->dirtyset : NULL;
+	job.dfd = compressfd;
+
+	ret = cache_finishcall(cache, path, &lazfs_lazyjob, &job,
+			       LAZFS_DATA->workq);
+	if (ret == 0)
+		log_debug("lazfs_lazyrecompress: \"%s\" recompressed\n", path);
+	else
+		log_error("lazfs_lazyrecompress: \"%s\": %s\n", path,
+			  strerror(-ret));
+
+	return ret;
+}
+
+/*
+ * Stores point statistics ps into xattr of backend file fd, coordinates are
+ * scaled by the header of decompressed file lasfd. When ps is NULL, existing
+ * statistics of fd are scaled again, only the header has changed. Statistics
+ * are informative, failure is logged only.
+ */
+static void
+lazfs_storestats(const char *path, int fd, int lasfd, const pointstats_t *ps)
+{
+	pointstats_t old;
+	lasheader_t hdr;
+	int ret;
+
+	ret = lasheader_read(lasfd, &hdr);
+	if (ret == 0 && ps == NULL) {
+		ret = pointstats_read(fd, &old);
+		if (ret == -ENODATA)
+			return;
+		ps = &old;
+	}
+	if (ret == 0)
+		ret = pointstats_write(fd, ps, &hdr);
+	if (ret != 0)
+		log_error("lazfs_storestats: \"%s\": %s\n", path,
+			  strerror(-ret));
+}
+
+/*
+ * Updates index of .laz cpath for compressfd written by lazfs_recompress(),
+ * entries of chunks which weren't compressed again are kept. Point
+ * statistics of the .laz are updated the same way into stats and *counted is
+ * set, unless they are missing or can't be derived. Returns 0 or -errno,
+ * index must be built from scratch then.
+ */
+static int
+lazfs_updateindex(laz_cache_t *cache, const char *path, const char *cpath,
+		  laz_cachestat_t *cstat, int compressfd,
+		  const char *rewritten, lazindex_t *index,
+		  pointstats_t *stats, char *counted)
+{
+	pointstats_t added, removed;
+	lazindex_update_t job;
+	char ipath[PATH_MAX];
+	int ret;
+
+	ret = lazindex_path(ipath, cpath);
+	if (ret == 0)
+		ret = lazindex_read(ipath, index);
+	if (ret != 0)
+		return ret;
+
+	job.lasfd = cstat->tmpfd;
+	job.lazfd = compressfd;
+	job.oldfd = cstat->fd;
+	job.rewritten = rewritten;
+	job.index = index;
+	job.added = NULL;
+	job.removed = NULL;
+
+	/* Without previous statistics there is nothing to update */
+	if (pointstats_read(cstat->fd, stats) == 0) {
+		pointstats_init(&added);
+		pointstats_init(&removed);
+		job.added = &added;
+		job.removed = &removed;
+	}
+
+	ret = cache_finishcall(cache, path, &lazindex_updatejob, &job,
+			       LAZFS_DATA->workq);
+	if (ret != 0) {
+		log_debug("lazfs_updateindex: \"%s\": %s\n", path,
+			  strerror(-ret));
+		lazindex_free(index);
+		return ret;
+	}
+
+	if (job.added != NULL)
+		*counted = pointstats_replace(stats, &removed, &added) == 0;
+
+	return 0;
+}
+
+/*
+ * Stores content of dirty virtual file to the backend compressed file. Must
+ * be called with cache locked, for the last reference of the file. Shortcuts
+ * which avoid full compression are used for LAS codecs only, except clone of
+ * a copied file.
+ */
+static int
+lazfs_writeback(laz_cache_t *cache, const char *path, laz_cachestat_t *cstat)
+{
+	int ret, retstat = 0, compressfd = -1;
+	char fpath[PATH_MAX];
+	char fpath_laz[PATH_MAX];
+	char cpath[PATH_MAX];
+	char ipath[PATH_MAX];
+	char srccpath[PATH_MAX];
+	char renamed = 0, inplace = 0, indexed = 0, reordered = 0, counted = 0;
+	char carried = 0, patched = 0;
+	char *rewritten = NULL;
+	const lazindex_chunk_t *entries;
+	uint32_t nentries;
+	char las;
+	const codec_rule_t *rule;
+	struct stat statbuf;
+	codec_job_t job;
+	lazindex_job_t ij;
+	pointstats_job_t pj;
+
+	memset(&ij, 0, sizeof(ij));
+	lazfs_fullpath(fpath, path);
+	rule = lazfs_lazpath(fpath_laz, fpath);
+	if (rule == NULL) {
+		retstat = -EINVAL;
+		goto cleanup;
+	}
+	las = (rule->codec->flags & CODEC_LAS) != 0;
+
+	if (cstat->stream != NULL) {
+		ret = cache_finishcall(cache, path, &lazfs_stream_finish,
+				       cstat->stream, LAZFS_DATA->workq);
+		if (ret < 0) {
+			retstat = ret;
+			goto cleanup;
+		}
+		if (ret == 0) {
+			lazfs_stream_output(cstat->stream, &compressfd, cpath);
+			pj.stats = *lazfs_stream_stats(cstat->stream);
+			counted = 1;
+
+			/* Chunks were indexed as they were compressed */
+			entries = lazfs_stream_index(cstat->stream, &nentries);
+			indexed = lazindex_merge(compressfd, entries, nentries,
+						 &ij.index) == 0;
+			goto store;
+		}
+	}
+
+	/* FIXME: PATH_MAX can be too short */
+	ret = snprintf(cpath, PATH_MAX, "%s/lazfs.XXXXXX", LAZFS_DATA->rootdir);
+	if (ret + 1 + 6 > PATH_MAX) {
+		retstat = -ENAMETOOLONG;
+		goto cleanup;
+	}
+
+	compressfd = mkstemp(cpath);
+	if (compressfd == -1) {
+		retstat = -errno;
+		goto cleanup;
+	}
+
+	ret = las ? lazfs_patchheader(cache, path, cstat, compressfd,
+				      &inplace) : 1;
+	patched = ret == 0;
+	if (ret > 0) {
+		ret = lazfs_clonecopy(cache, path, cstat, rule->codec,
+				      compressfd, srccpath);
+		carried = ret == 0 && srccpath[0] != '\0';
+	}
+	if (ret > 0 && las)
+		ret = lazfs_recompress(cache, path, cstat, compressfd,
+				       &rewritten);
+	if (ret > 0 && cstat->lazy != NULL)
+		ret = lazfs_lazyrecompress(cache, path, rule, cstat,
+					   compressfd);
+	if (ret > 0) {
+		job.rule = rule;
+		job.sfd = cstat->tmpfd;
+		job.dfd = compressfd;
+		ret = cache_finishcall(cache, path, &codec_compressjob, &job,
+				       LAZFS_DATA->workq);
+		reordered = codec_reorders(rule);
+	}
+	if (ret != 0 || inplace) {
+		/* Size didn't change when patched in place, scale might */
+		if (ret == 0)
+			lazfs_storestats(path, cstat->fd, cstat->tmpfd, NULL);
+		retstat = ret;
+		goto cleanup;
+	}
+
+	/*
+	 * Header patch keeps points and so the index, clone keeps index and
+	 * statistics of its source. Index and statistics of recompressed file
+	 * need new points only of chunks which were compressed again.
+	 */
+	if (las && rewritten != NULL)
+		indexed = lazfs_updateindex(cache, path, fpath_laz, cstat,
+					    compressfd, rewritten, &ij.index,
+					    &pj.stats, &counted) == 0;
+
+	/* Points are the same, only scale of their bounds might change */
+	if (patched)
+		counted = pointstats_read(cstat->fd, &pj.stats) == 0;
+
+	/*
+	 * Whole point data are in the decompressed file, index and count
+	 * them in one pass. Points which were reordered are indexed from the
+	 * .laz itself.
+	 */
+	if (las && !carried && !patched && !indexed) {
+		ij.lasfd = reordered ? -1 : cstat->tmpfd;
+		ij.lazfd = compressfd;
+		ij.stats = &pj.stats;
+		pointstats_init(&pj.stats);
+		indexed = cache_finishcall(cache, path, &lazindex_buildjob, &ij,
+					   LAZFS_DATA->workq) == 0;
+		counted = indexed;
+	}
+	if (las && !carried && !counted) {
+		pj.lasfd = cstat->tmpfd;
+		counted = cache_finishcall(cache, path, &pointstats_scanjob,
+					   &pj, LAZFS_DATA->workq) == 0;
+	}
+
+store:
+	ret = fstat(cstat->fd, &statbuf);
+	if (ret != 0) {
+		retstat = -errno;
+		goto cleanup;
+	}
+
+	ret = fchown(compressfd, statbuf.st_uid, statbuf.st_gid);
+	if (ret != 0) {
+		retstat = -errno;
+		goto cleanup;
+	}
+
+	ret = fchmod(compressfd, statbuf.st_mode);
+	if (ret != 0) {
+		retstat = -errno;
+		goto cleanup;
+	}
+
+	if (counted)
+		lazfs_storestats(path, compressfd, cstat->tmpfd, &pj.stats);
+
+	ret = rename(cpath, fpath_laz);
+	if (ret != 0) {
+		retstat = -errno;
+		goto cleanup;
+	}
+	renamed = 1;
+
+	/* Queries would rebuild stale index, but don't leave it behind */
+	if (carried)
+		lazfs_moveindex(srccpath, fpath_laz, 1);
+	else if (las && !patched &&
+		 (!indexed || lazindex_path(ipath, fpath_laz) != 0 ||
+		  lazindex_write(&ij.index, ipath) != 0))
+		lazfs_moveindex(fpath_laz, NULL, 0);
+
+	ret = fstat(cstat->tmpfd, &statbuf);
+	if (ret != 0) {
+		retstat = -errno;
+		goto cleanup;
+	}
+
+	retstat = lazfs_setsize(fpath_laz, statbuf.st_size);
+
+cleanup:
+	if (compressfd != -1) {
+		ret = close(compressfd);
+		if (ret)
+			retstat = -errno;
+		if (!renamed)
+			unlink(cpath);
+	}
+	lazindex_free(&ij.index);
+	free(rewritten);
+	cache_markready(cache, path);
+
+	return retstat;
+}
+
 /*
  * Release an open file
  *
@@ -670,13 +1595,27 @@ lazfs_flush(const char *path, struct fuse_file_info *fi)
 int
 lazfs_release(const char *path, struct fuse_file_info *fi)
 {
-	int ret, retstat = 0, compressfd = -1;
+	int ret, retstat = 0;
 	laz_cache_t *cache = LAZFS_DATA->cache;
 	char fpath[PATH_MAX];
 	laz_cachestat_t cstat;
-	char cpath[PATH_MAX];
 	char fpath_laz[PATH_MAX];
-	struct stat statbuf;
+	const codec_rule_t *rule;
+	char tmppath[PATH_MAX];
+	int fd, tmpfd, cfd = -1;
+	diskcache_key_t key;
+	char keep = 0;
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_release(fi);
+	if (raw_lookup(path, fpath))
+		return raw_release(fi);
+	if (query_lookup(path))
+		return query_release(fi);
+	if (view_lookup(path))
+		return view_release(fi);
 
 	log_debug("\nlazfs_release(path=\"%s\", fi=0x%08x)\n",
 		  path, fi);
@@ -686,81 +1625,48 @@ lazfs_release(const char *path, struct fuse_file_info *fi)
 	// We need to close the file.  Had we allocated any resources
 	// (buffers etc) we'd need to free them here as well.
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
+	rule = lazfs_exec_hooks(fpath, fpath_laz);
+	if (rule != NULL) {
 		cache_lock(cache);
 		cache_get(cache, path, 0, &cstat);
 		/* NOTE: tmpfilename becomes invalid after cache_remove call. */
 		if (cstat.lastref) {
+			/* Only complete decompressed files can be kept */
+			keep = cstat.stream == NULL && cstat.lazy == NULL &&
+			       cstat.err == 0;
 			if (cstat.dirty) {
-				strncpy(fpath_laz, fpath, PATH_MAX);
-				fpath_laz[PATH_MAX - 1] = '\0';
-				fpath_laz[strlen(fpath_laz) - 1] = 'z';
-
-				/* FIXME: PATH_MAX can be too short */
-				ret = snprintf(cpath, PATH_MAX, "%s/lazfs.XXXXXX", LAZFS_DATA->rootdir);
-				if (ret + 1 + 6 > PATH_MAX) {
-					retstat = -ENAMETOOLONG;
-					goto cleanup;
-				}
-
-				compressfd = mkstemp(cpath);
-				if (compressfd == -1) {
-					retstat = -errno;
-					goto cleanup;
-				}
-
-				ret = cache_finish(cache, path, cstat.tmpfd, compressfd, LAZFS_DATA->workq);
-				if (ret != 0) {
-					retstat = ret;
-					goto cleanup;
-				}
-
-				ret = fstat(cstat.fd, &statbuf);
-				if (ret != 0) {
-					retstat = -errno;
-					goto cleanup;
-				}
-
-				ret = fchown(compressfd, statbuf.st_uid, statbuf.st_gid);
-				if (ret != 0) {
-					retstat = -errno;
-					goto cleanup;
-				}
-
-				ret = fchmod(compressfd, statbuf.st_mode);
-				if (ret != 0) {
-					retstat = -errno;
-					goto cleanup;
-				}
-
-				ret = rename(cpath, fpath_laz);
-				if (ret != 0) {
-					retstat = -errno;
-					goto cleanup;
-				}
-
-				ret = fstat(cstat.tmpfd, &statbuf);
-				if (ret != 0) {
-					retstat = -errno;
-					goto cleanup;
-				}
-
-				retstat = lazfs_setsize(fpath_laz, statbuf.st_size);
-				if (retstat != 0)
-					goto cleanup;
-
-				cache_markready(cache, path);
+				retstat = lazfs_writeback(cache, path, &cstat);
+				diskcache_clean(cstat.tmppath);
 			}
-cleanup:
-			if (compressfd != -1) {
-				ret = close(compressfd);
-				if (ret)
-					retstat = -ret;
+			if (cstat.stream != NULL)
+				lazfs_stream_destroy(&cstat.stream);
+			if (cstat.lazy != NULL)
+				rule->codec->lazy->close(cstat.lazy);
+			/*
+			 * Backend file as it was written back is opened here,
+			 * its checksum is read below without cache lock.
+			 */
+			if (keep && retstat == 0 &&
+			    (cfd = open(fpath_laz, O_RDONLY)) != -1 &&
+			    diskcache_keystat(cfd, &key) == 0) {
+				strcpy(tmppath, cstat.tmppath);
+				fd = cstat.fd;
+				tmpfd = cstat.tmpfd;
+			} else {
+				keep = 0;
+				lazfs_finish_tmpfile(cstat.tmppath, &cstat.fd,
+						     &cstat.tmpfd);
 			}
-			lazfs_finish_tmpfile(cstat.tmppath, &cstat.fd, &cstat.tmpfd);
 		}
 		cache_remove(cache, path);
 		cache_unlock(cache);
+
+		if (keep && (diskcache_keysum(cfd, &key) != 0 ||
+			     diskcache_keep(path, &key, tmppath, &fd,
+					    &tmpfd) != 0))
+			lazfs_finish_tmpfile(tmppath, &fd, &tmpfd);
+		if (cfd != -1)
+			close(cfd);
 	} else {
 		ret = close(fi->fh);
 		if (ret)
@@ -782,6 +1688,13 @@ int
 lazfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
 	int retstat = 0;
+	char bpath[PATH_MAX];
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE || raw_lookup(path, bpath) || query_lookup(path) ||
+	    view_lookup(path))
+		return 0;
 
 	log_debug("\nlazfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
 		  path, datasync, fi);
@@ -806,16 +1719,22 @@ lazfs_setxattr(const char *path, const char *name, const char *value, size_t siz
 	char fpath[PATH_MAX];
 	char fpath_laz[PATH_MAX];
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	log_debug("\nlazfs_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%d, flags=0x%08x)\n",
 		  path, name, value, size, flags);
 
+	/* Value of the request doesn't matter */
+	if (strcmp(name, PREFETCHATTR) == 0)
+		return lazfs_prefetch_add(path);
+
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		/* We got request for .las file */
-		strncpy(fpath_laz, fpath, PATH_MAX);
-		fpath_laz[PATH_MAX - 1] = '\0';
-		fpath_laz[strlen(fpath_laz) - 1] = 'z';
+	if (lazfs_exec_hooks(fpath, fpath_laz)) {
+		/* We got request for virtual file */
 		retstat = lsetxattr(fpath_laz, name, value, size, flags);
 	} else
 		retstat = lsetxattr(fpath, name, value, size, flags);
@@ -833,16 +1752,22 @@ lazfs_getxattr(const char *path, const char *name, char *value, size_t size)
 	int retstat = 0;
 	char fpath[PATH_MAX];
 	char fpath_laz[PATH_MAX];
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return -ENODATA;
+	if (raw_lookup(path, fpath))
+		return raw_getxattr(fpath, name, value, size);
 
 	log_debug("\nlazfs_getxattr(path = \"%s\", name = \"%s\", value = 0x%08x, size = %d)\n",
 		  path, name, value, size);
+	if (strcmp(name, PREFETCHATTR) == 0)
+		return lazfs_prefetch_state(path, value, size);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		/* We got request for .las file */
-		strncpy(fpath_laz, fpath, PATH_MAX);
-		fpath_laz[PATH_MAX - 1] = '\0';
-		fpath_laz[strlen(fpath_laz) - 1] = 'z';
+	if (lazfs_exec_hooks(fpath, fpath_laz)) {
+		/* We got request for virtual file */
 		retstat = lgetxattr(fpath_laz, name, value, size);
 	} else
 		retstat = lgetxattr(fpath, name, value, size);
@@ -863,16 +1788,20 @@ lazfs_listxattr(const char *path, char *list, size_t size)
 	char fpath[PATH_MAX];
 	char fpath_laz[PATH_MAX];
 	char *ptr;
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return 0;
+	if (raw_lookup(path, fpath))
+		return raw_listxattr(fpath, list, size);
 
 	log_debug("lazfs_listxattr(path=\"%s\", list=0x%08x, size=%d)\n",
 		  path, list, size);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		/* We got request for .las file */
-		strncpy(fpath_laz, fpath, PATH_MAX);
-		fpath_laz[PATH_MAX - 1] = '\0';
-		fpath_laz[strlen(fpath_laz) - 1] = 'z';
+	if (lazfs_exec_hooks(fpath, fpath_laz)) {
+		/* We got request for virtual file */
 		retstat = llistxattr(fpath_laz, list, size);
 	} else
 		retstat = llistxattr(fpath, list, size);
@@ -896,15 +1825,19 @@ lazfs_removexattr(const char *path, const char *name)
 	char fpath[PATH_MAX];
 	char fpath_laz[PATH_MAX];
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	log_debug("\nlazfs_removexattr(path=\"%s\", name=\"%s\")\n",
 		  path, name);
+	if (strcmp(name, PREFETCHATTR) == 0)
+		return lazfs_prefetch_remove(path);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		/* We got request for .las file */
-		strncpy(fpath_laz, fpath, PATH_MAX);
-		fpath_laz[PATH_MAX - 1] = '\0';
-		fpath_laz[strlen(fpath_laz) - 1] = 'z';
+	if (lazfs_exec_hooks(fpath, fpath_laz)) {
+		/* We got request for virtual file */
 		retstat = lremovexattr(fpath_laz, name);
 	} else
 		retstat = lremovexattr(fpath, name);
@@ -929,6 +1862,13 @@ lazfs_opendir(const char *path, struct fuse_file_info *fi)
 	DIR *dp;
 	int retstat = 0;
 	char fpath[PATH_MAX];
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_opendir(node);
+	if (raw_lookup(path, fpath))
+		return raw_opendir(fpath, fi);
 
 	log_debug("\nlazfs_opendir(path=\"%s\", fi=0x%08x)\n",
 		  path, fi);
@@ -945,6 +1885,26 @@ lazfs_opendir(const char *path, struct fuse_file_info *fi)
 	return retstat;
 }
 
+/* Returns non-zero if backend name is spatial index of a compressed file */
+static int
+lazfs_isindex(const char *name)
+{
+	char base[PATH_MAX], vname[PATH_MAX];
+	const codec_rule_t *rule;
+	size_t len, slen = strlen(LAZINDEX_SUFFIX);
+
+	len = strlen(name);
+	if (len <= slen || len >= PATH_MAX ||
+	    strcmp(name + len - slen, LAZINDEX_SUFFIX) != 0)
+		return 0;
+
+	memcpy(base, name, len - slen);
+	base[len - slen] = '\0';
+	rule = codec_matchstored(base, vname);
+
+	return rule != NULL && (rule->codec->flags & CODEC_LAS);
+}
+
 /*
  * Read directory
  *
@@ -975,6 +1935,13 @@ lazfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	DIR *dp;
 	struct dirent *de;
 	char path_las[PATH_MAX];
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_readdir(node, buf, filler);
+	if (raw_lookup(path, path_las))
+		return raw_readdir(fi, buf, filler);
 
 	log_debug("\nlazfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 		  path, buf, filler, offset, fi);
@@ -996,11 +1963,10 @@ lazfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	// returns something non-zero.  The first case just means I've
 	// read the whole directory; the second means the buffer is full.
 	do {
-		if (lazfs_exec_hooks(de->d_name, ".laz")) {
-			strncpy(path_las, de->d_name, PATH_MAX);
-			path_las[PATH_MAX - 1] = '\0';
-			path_las[strlen(path_las) - 1] = 's';
+		if (lazfs_isindex(de->d_name))
+			continue;
 
+		if (codec_matchstored(de->d_name, path_las)) {
 			log_debug("calling filler with name %s\n", path_las);
 			if (filler(buf, path_las, NULL, 0) != 0) {
 				log_error("    ERROR lazfs_readdir filler:  buffer full");
@@ -1029,6 +1995,14 @@ int
 lazfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
 	int retstat = 0;
+	char bpath[PATH_MAX];
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return 0;
+	if (raw_lookup(path, bpath))
+		return raw_releasedir(fi);
 
 	log_debug("\nlazfs_releasedir(path=\"%s\", fi=0x%08x)\n",
 		  path, fi);
@@ -1086,6 +2060,12 @@ lazfs_init(struct fuse_conn_info *conn)
 {
 	log_debug("\nlazfs_init()\n");
 
+	LAZFS_DATA->mounted = stats_now();
+
+	/* Flusher thread must be started after daemon() too */
+	if (log_start() != 0)
+		perror("Failed to start log flusher");
+
 	/*
 	 * Initialize work queue. Otherwise daemon() function called from
 	 * fuse_main() will terminate all threads.
@@ -1096,6 +2076,21 @@ lazfs_init(struct fuse_conn_info *conn)
 		abort();
 	}
 
+	if (LAZFS_DATA->scan &&
+	    lazfs_scan_start(LAZFS_DATA->rootdir, LAZFS_DATA->workq,
+			     LAZFS_DATA->attrcache, LAZFS_DATA->scan_rate) != 0)
+		log_error("lazfs_init: failed to start backend scanner\n");
+
+	if (LAZFS_DATA->tier_days > 0 &&
+	    lazfs_tier_start(LAZFS_DATA->rootdir, LAZFS_DATA->workq,
+			     LAZFS_DATA->cache, LAZFS_DATA->tier_days,
+			     LAZFS_DATA->tier_iorate, LAZFS_DATA->tier_cpu) != 0)
+		log_error("lazfs_init: failed to start tiering of cold files\n");
+
+	lazfs_prefetch_start(LAZFS_DATA->cache, LAZFS_DATA->workq,
+			     LAZFS_DATA->prefetch,
+			     (off_t) LAZFS_DATA->prefetch_scratch << 20);
+
 	return LAZFS_DATA;
 }
 
@@ -1110,6 +2105,12 @@ void
 lazfs_destroy(void *userdata)
 {
 	log_debug("\nlazfs_destroy(userdata=0x%08x)\n", userdata);
+	lazfs_prefetch_stop();
+	diskcache_stop();
+	query_destroy();
+	view_destroy();
+	trace_close();
+	log_close();
 }
 
 /*
@@ -1129,18 +2130,25 @@ lazfs_access(const char *path, int mask)
 	int retstat = 0;
 	char fpath[PATH_MAX];
 	char path_las[PATH_MAX];
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_access(node, mask);
+	if (raw_lookup(path, fpath))
+		return raw_access(fpath, mask);
+	if (query_lookup(path))
+		return query_access(path, mask);
+	if (view_lookup(path))
+		return view_access(path, mask);
 
 	log_debug("\nlazfs_access(path=\"%s\", mask=0%o)\n",
 		  path, mask);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		strncpy(path_las, fpath, PATH_MAX);
-		path_las[PATH_MAX - 1] = '\0';
-		path_las[strlen(path_las) - 1] = 'z';
-
+	if (lazfs_exec_hooks(fpath, path_las))
 		retstat = access(path_las, mask);
-	} else
+	else
 		retstat = access(fpath, mask);
 
 	if (retstat < 0)
@@ -1169,20 +2177,25 @@ lazfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	int fd = -1, tmpfd = -1;
 	char tmppath[] = "/tmp/lazfs.XXXXXX";
 	laz_cache_t *cache = LAZFS_DATA->cache;
+	const codec_rule_t *rule;
+	lazfs_stream_t *stream = NULL;
 	lazfs_ugid_t ugid;
 
+	if (ctl_lookup(path) != CTL_NONE)
+		return -EPERM;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+
 	log_debug("\nlazfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
 		  path, mode, fi);
 	lazfs_fullpath(fpath, path);
 
 	lazfs_setugid(&ugid);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
-		strncpy(fpath_laz, fpath, PATH_MAX);
-		fpath_laz[PATH_MAX - 1] = '\0';
-		fpath_laz[strlen(fpath_laz) - 1] = 'z';
-
-		log_debug("\nlazfs_create: creating laz file \"%s\"\n", fpath_laz);
+	rule = lazfs_exec_hooks(fpath, fpath_laz);
+	if (rule != NULL) {
+		log_debug("\nlazfs_create: creating %s file \"%s\"\n",
+			  rule->codec->name, fpath_laz);
 
 		/* FIXME: We shouldn't ignore fi->flags */
 		retstat = lazfs_prepare_tmpfile(fpath_laz, tmppath, -1, mode, &fd, &tmpfd);
@@ -1191,9 +2204,27 @@ lazfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 			goto cleanup;
 		}
 
-		retstat = cache_add(cache, path, tmppath, fd, tmpfd, NULL);
+		/*
+		 * Without stream the file is compressed on close. Points of
+		 * reordering rules can't be compressed before all arrive.
+		 */
+		if (!LAZFS_DATA->nostream && (rule->codec->flags & CODEC_LAS) &&
+		    !codec_reorders(rule) &&
+		    lazfs_stream_create(&stream, tmpfd, LAZFS_DATA->rootdir,
+					LAZFS_DATA->workq) != 0)
+			stream = NULL;
+
+		cache_lock(cache);
+		retstat = cache_add(cache, path, tmppath, fd, tmpfd, NULL, NULL);
+		if (retstat == 0) {
+			cache_setpid(cache, path, fuse_get_context()->pid);
+			cache_setstream(cache, path, stream);
+		}
+		cache_unlock(cache);
 		if (retstat != 0) {
 			log_error("lazfs_open: cache_add failed");
+			if (stream != NULL)
+				lazfs_stream_destroy(&stream);
 			goto cleanup;
 		}
 	} else {
@@ -1237,14 +2268,69 @@ int
 lazfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
 	int retstat = 0;
+	char fpath[PATH_MAX];
+	laz_cache_t *cache = LAZFS_DATA->cache;
+	const codec_rule_t *rule;
+	laz_cachestat_t cstat;
+	struct stat statbuf;
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return (node == CTL_CTL) ? 0 : -EACCES;
+	if (raw_lookup(path, fpath))
+		return -EROFS;
+	if (query_lookup(path))
+		return -EACCES;
+	if (view_lookup(path))
+		return -EACCES;
 
 	log_debug("\nlazfs_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)\n",
 		  path, offset, fi);
 	log_fi(fi);
 
-	retstat = ftruncate(fi->fh, offset);
-	if (retstat < 0)
-		retstat = lazfs_error("lazfs_ftruncate ftruncate");
+	lazfs_fullpath(fpath, path);
+
+	rule = lazfs_exec_hooks(fpath, NULL);
+	if (rule != NULL) {
+		/* fi->fh is the .laz, truncate decompressed file instead */
+		cache_lock(cache);
+		retstat = cache_get(cache, path, 1, &cstat);
+		assert(retstat == 0);
+		if (fstat(cstat.tmpfd, &statbuf) == 0 && statbuf.st_size != offset) {
+			if (offset < statbuf.st_size)
+				cache_dirty(cache, path, offset,
+					    statbuf.st_size - offset);
+			else
+				cache_dirty(cache, path, statbuf.st_size,
+					    offset - statbuf.st_size);
+			if (!cstat.dirty && cstat.stream == NULL &&
+			    cstat.lazy == NULL)
+				diskcache_dirty(path, cstat.tmppath);
+		}
+		cache_unlock(cache);
+
+		if (cstat.stream != NULL)
+			lazfs_stream_truncate(cstat.stream, offset);
+
+		if (cstat.lazy != NULL)
+			retstat = rule->codec->lazy->truncate(cstat.lazy,
+							      offset);
+		if (retstat == 0) {
+			retstat = ftruncate(cstat.tmpfd, offset);
+			if (retstat < 0)
+				retstat = lazfs_error("lazfs_ftruncate "
+						      "ftruncate");
+		}
+
+		cache_lock(cache);
+		cache_remove(cache, path);
+		cache_unlock(cache);
+	} else {
+		retstat = ftruncate(fi->fh, offset);
+		if (retstat < 0)
+			retstat = lazfs_error("lazfs_ftruncate ftruncate");
+	}
 
 	return retstat;
 }
@@ -1273,13 +2359,24 @@ lazfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi
 	struct stat tmpstatbuf;
 	char fpath[PATH_MAX];
 	laz_cachestat_t cstat;
+	ctl_node_t node;
+
+	node = ctl_lookup(path);
+	if (node != CTL_NONE)
+		return ctl_getattr(node, statbuf);
+	if (raw_lookup(path, fpath))
+		return raw_fgetattr(fi, statbuf);
+	if (query_lookup(path))
+		return query_fgetattr(fi, statbuf);
+	if (view_lookup(path))
+		return view_fgetattr(fi, statbuf);
 
 	log_debug("\nlazfs_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n",
 		  path, statbuf, fi);
 	log_fi(fi);
 	lazfs_fullpath(fpath, path);
 
-	if (lazfs_exec_hooks(fpath, ".las")) {
+	if (lazfs_exec_hooks(fpath, NULL)) {
 		cache_lock(cache);
 		retstat = cache_get(cache, path, 1, &cstat);
 		cache_unlock(cache);
@@ -1320,50 +2417,267 @@ cleanup:
 	return retstat;
 }
 
+/* Records finished operation into the trace */
+static void
+lazfs_trace(int op, const char *path, uint64_t start, uint64_t duration,
+	    int ret, uint64_t offset, uint64_t size, uint32_t flags,
+	    uint32_t mode, const char *path2, struct fuse_file_info *fi)
+{
+	trace_args_t args;
+
+	args.offset = offset;
+	args.size = size;
+	args.flags = flags;
+	args.mode = mode;
+	args.path2 = path2;
+
+	trace_record(op, path, start, duration, ret, fi ? fi->fh : 0, &args);
+}
+
+#define LAZFS_UNPACK(...) __VA_ARGS__
+
+/*
+ * Every operation is wrapped so its latency and failures are recorded in
+ * its histogram and it fires op__start and op__done probes. targs are
+ * (offset, size, flags, mode, path2, fi) recorded into the trace.
+ */
+#define LAZFS_TIMED(op, hist, proto, args, targs) \
+	static int \
+	lazfs_timed_##op proto \
+	{ \
+		uint64_t start, duration; \
+		int ret; \
+		LAZFS_PROBE2(op__start, #op, path); \
+		start = stats_now(); \
+		ret = lazfs_##op args; \
+		duration = stats_now() - start; \
+		stats_record(hist, duration, ret < 0); \
+		if (trace_enabled) \
+			lazfs_trace(hist, path, start, duration, ret, \
+				    LAZFS_UNPACK targs); \
+		LAZFS_PROBE3(op__done, #op, path, ret); \
+		return ret; \
+	}
+
+LAZFS_TIMED(getattr, STATS_OP_GETATTR,
+	    (const char *path, struct stat *statbuf),
+	    (path, statbuf),
+	    (0, 0, 0, 0, NULL, NULL))
+LAZFS_TIMED(readlink, STATS_OP_READLINK,
+	    (const char *path, char *link, size_t size),
+	    (path, link, size),
+	    (0, size, 0, 0, NULL, NULL))
+LAZFS_TIMED(mknod, STATS_OP_MKNOD,
+	    (const char *path, mode_t mode, dev_t dev),
+	    (path, mode, dev),
+	    (dev, 0, 0, mode, NULL, NULL))
+LAZFS_TIMED(mkdir, STATS_OP_MKDIR,
+	    (const char *path, mode_t mode),
+	    (path, mode),
+	    (0, 0, 0, mode, NULL, NULL))
+LAZFS_TIMED(unlink, STATS_OP_UNLINK,
+	    (const char *path),
+	    (path),
+	    (0, 0, 0, 0, NULL, NULL))
+LAZFS_TIMED(rmdir, STATS_OP_RMDIR,
+	    (const char *path),
+	    (path),
+	    (0, 0, 0, 0, NULL, NULL))
+LAZFS_TIMED(symlink, STATS_OP_SYMLINK,
+	    (const char *path, const char *link),
+	    (path, link),
+	    (0, 0, 0, 0, link, NULL))
+LAZFS_TIMED(rename, STATS_OP_RENAME,
+	    (const char *path, const char *newpath),
+	    (path, newpath),
+	    (0, 0, 0, 0, newpath, NULL))
+LAZFS_TIMED(link, STATS_OP_LINK,
+	    (const char *path, const char *newpath),
+	    (path, newpath),
+	    (0, 0, 0, 0, newpath, NULL))
+LAZFS_TIMED(chmod, STATS_OP_CHMOD,
+	    (const char *path, mode_t mode),
+	    (path, mode),
+	    (0, 0, 0, mode, NULL, NULL))
+LAZFS_TIMED(chown, STATS_OP_CHOWN,
+	    (const char *path, uid_t uid, gid_t gid),
+	    (path, uid, gid),
+	    (uid, gid, 0, 0, NULL, NULL))
+LAZFS_TIMED(truncate, STATS_OP_TRUNCATE,
+	    (const char *path, off_t newsize),
+	    (path, newsize),
+	    (newsize, 0, 0, 0, NULL, NULL))
+LAZFS_TIMED(utime, STATS_OP_UTIME,
+	    (const char *path, struct utimbuf *ubuf),
+	    (path, ubuf),
+	    (0, 0, 0, 0, NULL, NULL))
+LAZFS_TIMED(open, STATS_OP_OPEN,
+	    (const char *path, struct fuse_file_info *fi),
+	    (path, fi),
+	    (0, 0, fi->flags, 0, NULL, fi))
+LAZFS_TIMED(read, STATS_OP_READ,
+	    (const char *path, char *buf, size_t size, off_t offset,
+	    struct fuse_file_info *fi),
+	    (path, buf, size, offset, fi),
+	    (offset, size, 0, 0, NULL, fi))
+LAZFS_TIMED(write, STATS_OP_WRITE,
+	    (const char *path, const char *buf, size_t size,
+	    off_t offset, struct fuse_file_info *fi),
+	    (path, buf, size, offset, fi),
+	    (offset, size, 0, 0, NULL, fi))
+LAZFS_TIMED(statfs, STATS_OP_STATFS,
+	    (const char *path, struct statvfs *statv),
+	    (path, statv),
+	    (0, 0, 0, 0, NULL, NULL))
+LAZFS_TIMED(flush, STATS_OP_FLUSH,
+	    (const char *path, struct fuse_file_info *fi),
+	    (path, fi),
+	    (0, 0, 0, 0, NULL, fi))
+LAZFS_TIMED(release, STATS_OP_RELEASE,
+	    (const char *path, struct fuse_file_info *fi),
+	    (path, fi),
+	    (0, 0, fi->flags, 0, NULL, fi))
+LAZFS_TIMED(fsync, STATS_OP_FSYNC,
+	    (const char *path, int datasync, struct fuse_file_info *fi),
+	    (path, datasync, fi),
+	    (0, 0, datasync, 0, NULL, fi))
+LAZFS_TIMED(setxattr, STATS_OP_SETXATTR,
+	    (const char *path, const char *name, const char *value,
+	    size_t size, int flags),
+	    (path, name, value, size, flags),
+	    (0, size, flags, 0, name, NULL))
+LAZFS_TIMED(getxattr, STATS_OP_GETXATTR,
+	    (const char *path, const char *name, char *value,
+	    size_t size),
+	    (path, name, value, size),
+	    (0, size, 0, 0, name, NULL))
+LAZFS_TIMED(listxattr, STATS_OP_LISTXATTR,
+	    (const char *path, char *list, size_t size),
+	    (path, list, size),
+	    (0, size, 0, 0, NULL, NULL))
+LAZFS_TIMED(removexattr, STATS_OP_REMOVEXATTR,
+	    (const char *path, const char *name),
+	    (path, name),
+	    (0, 0, 0, 0, name, NULL))
+LAZFS_TIMED(opendir, STATS_OP_OPENDIR,
+	    (const char *path, struct fuse_file_info *fi),
+	    (path, fi),
+	    (0, 0, 0, 0, NULL, fi))
+LAZFS_TIMED(readdir, STATS_OP_READDIR,
+	    (const char *path, void *buf, fuse_fill_dir_t filler,
+	    off_t offset, struct fuse_file_info *fi),
+	    (path, buf, filler, offset, fi),
+	    (offset, 0, 0, 0, NULL, fi))
+LAZFS_TIMED(releasedir, STATS_OP_RELEASEDIR,
+	    (const char *path, struct fuse_file_info *fi),
+	    (path, fi),
+	    (0, 0, 0, 0, NULL, fi))
+LAZFS_TIMED(fsyncdir, STATS_OP_FSYNCDIR,
+	    (const char *path, int datasync, struct fuse_file_info *fi),
+	    (path, datasync, fi),
+	    (0, 0, datasync, 0, NULL, fi))
+LAZFS_TIMED(access, STATS_OP_ACCESS,
+	    (const char *path, int mask),
+	    (path, mask),
+	    (0, 0, mask, 0, NULL, NULL))
+LAZFS_TIMED(create, STATS_OP_CREATE,
+	    (const char *path, mode_t mode, struct fuse_file_info *fi),
+	    (path, mode, fi),
+	    (0, 0, fi->flags, mode, NULL, fi))
+LAZFS_TIMED(ftruncate, STATS_OP_FTRUNCATE,
+	    (const char *path, off_t offset, struct fuse_file_info *fi),
+	    (path, offset, fi),
+	    (offset, 0, 0, 0, NULL, fi))
+LAZFS_TIMED(fgetattr, STATS_OP_FGETATTR,
+	    (const char *path, struct stat *statbuf,
+	    struct fuse_file_info *fi),
+	    (path, statbuf, fi),
+	    (0, 0, 0, 0, NULL, fi))
+
 struct fuse_operations lazfs_oper = {
-	.getattr = lazfs_getattr,
-	.readlink = lazfs_readlink,
+	.getattr = lazfs_timed_getattr,
+	.readlink = lazfs_timed_readlink,
 	// no .getdir -- that's deprecated
 	.getdir = NULL,
-	.mknod = lazfs_mknod,
-	.mkdir = lazfs_mkdir,
-	.unlink = lazfs_unlink,
-	.rmdir = lazfs_rmdir,
-	.symlink = lazfs_symlink,
-	.rename = lazfs_rename,
-	.link = lazfs_link,
-	.chmod = lazfs_chmod,
-	.chown = lazfs_chown,
-	.truncate = lazfs_truncate,
-	.utime = lazfs_utime,
-	.open = lazfs_open,
-	.read = lazfs_read,
-	.write = lazfs_write,
+	.mknod = lazfs_timed_mknod,
+	.mkdir = lazfs_timed_mkdir,
+	.unlink = lazfs_timed_unlink,
+	.rmdir = lazfs_timed_rmdir,
+	.symlink = lazfs_timed_symlink,
+	.rename = lazfs_timed_rename,
+	.link = lazfs_timed_link,
+	.chmod = lazfs_timed_chmod,
+	.chown = lazfs_timed_chown,
+	.truncate = lazfs_timed_truncate,
+	.utime = lazfs_timed_utime,
+	.open = lazfs_timed_open,
+	.read = lazfs_timed_read,
+	.write = lazfs_timed_write,
 	/** Just a placeholder, don't set */ // huh???
-	.statfs = lazfs_statfs,
-	.flush = lazfs_flush,
-	.release = lazfs_release,
-	.fsync = lazfs_fsync,
-	.setxattr = lazfs_setxattr,
-	.getxattr = lazfs_getxattr,
-	.listxattr = lazfs_listxattr,
-	.removexattr = lazfs_removexattr,
-	.opendir = lazfs_opendir,
-	.readdir = lazfs_readdir,
-	.releasedir = lazfs_releasedir,
-	.fsyncdir = lazfs_fsyncdir,
+	.statfs = lazfs_timed_statfs,
+	.flush = lazfs_timed_flush,
+	.release = lazfs_timed_release,
+	.fsync = lazfs_timed_fsync,
+	.setxattr = lazfs_timed_setxattr,
+	.getxattr = lazfs_timed_getxattr,
+	.listxattr = lazfs_timed_listxattr,
+	.removexattr = lazfs_timed_removexattr,
+	.opendir = lazfs_timed_opendir,
+	.readdir = lazfs_timed_readdir,
+	.releasedir = lazfs_timed_releasedir,
+	.fsyncdir = lazfs_timed_fsyncdir,
 	.init = lazfs_init,
 	.destroy = lazfs_destroy,
-	.access = lazfs_access,
-	.create = lazfs_create,
-	.ftruncate = lazfs_ftruncate,
-	.fgetattr = lazfs_fgetattr
+	.access = lazfs_timed_access,
+	.create = lazfs_timed_create,
+	.ftruncate = lazfs_timed_ftruncate,
+	.fgetattr = lazfs_timed_fgetattr
+};
+
+#define LAZFS_OPT(t, p, v) { t, offsetof(struct lazfs_state, p), v }
+
+static struct fuse_opt lazfs_opts[] = {
+	LAZFS_OPT("scan", scan, 1),
+	LAZFS_OPT("scan_rate=%u", scan_rate, 0),
+	LAZFS_OPT("nostream", nostream, 1),
+	LAZFS_OPT("raw", raw, 1),
+	LAZFS_OPT("log=%s", logpath, 0),
+	LAZFS_OPT("loglevel=%s", loglevel, 0),
+	LAZFS_OPT("trace=%s", tracepath, 0),
+	LAZFS_OPT("codecs=%s", codecpath, 0),
+	LAZFS_OPT("tier_days=%u", tier_days, 0),
+	LAZFS_OPT("tier_iorate=%u", tier_iorate, 0),
+	LAZFS_OPT("tier_cpu=%u", tier_cpu, 0),
+	LAZFS_OPT("prefetch=%u", prefetch, 0),
+	LAZFS_OPT("prefetch_scratch=%u", prefetch_scratch, 0),
+	LAZFS_OPT("cache_dir=%s", cachedir, 0),
+	LAZFS_OPT("cache_keep=%u", cache_keep, 0),
+	FUSE_OPT_END
 };
 
 void
 lazfs_usage()
 {
-	fprintf(stderr, "usage:  lazfs [FUSE and mount options] rootDir mountPoint\n");
+	fprintf(stderr, "usage:  lazfs [FUSE and mount options] rootDir mountPoint\n"
+		"\n"
+		"lazfs options:\n"
+		"    -o scan                scan backend after mount and warm metadata\n"
+		"    -o scan_rate=N         scan at most N files per second (default %d, 0 = unlimited)\n"
+		"    -o nostream            compress created files on close only\n"
+		"    -o raw                 show backend files read-only in /.raw\n"
+		"    -o log=PATH            log file (default %s)\n"
+		"    -o loglevel=LEVEL      error or debug (default error)\n"
+		"    -o trace=PATH          record binary trace of operations\n"
+		"    -o codecs=PATH         codec rules (default \".las .laz laz\")\n"
+		"    -o tier_days=N         compress files unused for N days by tier codec\n"
+		"    -o tier_iorate=N       tier at most N MiB per second (default %d, 0 = unlimited)\n"
+		"    -o tier_cpu=N          tier codec runs at most N%% of time (default %d)\n"
+		"    -o prefetch=N          decompress up to N files ahead of sequential readers\n"
+		"    -o prefetch_scratch=N  prefetch below N MiB of decompressed files (default %d)\n"
+		"    -o cache_dir=PATH      decompress to PATH and keep files there across mounts\n"
+		"    -o cache_keep=N        keep at most N MiB of closed files in cache_dir (default %d)\n",
+		LAZFS_SCAN_RATE, LAZFS_LOGPATH, LAZFS_TIER_IORATE,
+		LAZFS_TIER_CPU, LAZFS_PREFETCH_SCRATCH, LAZFS_CACHE_KEEP);
 	exit(1);
 }
 
@@ -1372,6 +2686,8 @@ main(int argc, char *argv[])
 {
 	int fuse_stat;
 	struct lazfs_state *lazfs_data;
+	struct fuse_args args;
+	int level, ret;
 
 #if 0
 	// FIXME: This comment comes from original bbfs source, remove it once
@@ -1408,6 +2724,12 @@ main(int argc, char *argv[])
 		perror("main calloc");
 		abort();
 	}
+	memset(lazfs_data, 0, sizeof(*lazfs_data));
+	lazfs_data->scan_rate = LAZFS_SCAN_RATE;
+	lazfs_data->tier_iorate = LAZFS_TIER_IORATE;
+	lazfs_data->tier_cpu = LAZFS_TIER_CPU;
+	lazfs_data->prefetch_scratch = LAZFS_PREFETCH_SCRATCH;
+	lazfs_data->cache_keep = LAZFS_CACHE_KEEP;
 
 	/* Initialize .las file cache */
 	lazfs_data->cache = NULL;
@@ -1416,6 +2738,11 @@ main(int argc, char *argv[])
 		abort();
 	}
 
+	if (attrcache_create(&lazfs_data->attrcache, LAZFS_ATTRCACHE_ENTRIES) != 0) {
+		perror("Failed to create attribute cache");
+		abort();
+	}
+
 	// Pull the rootdir out of the argument list and save it in my
 	// internal data
 	lazfs_data->rootdir = realpath(argv[argc-2], NULL);
@@ -1423,11 +2750,46 @@ main(int argc, char *argv[])
 	argv[argc-1] = NULL;
 	argc--;
 
-	lazfs_data->logfile = log_open();
+	args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, lazfs_data, lazfs_opts, NULL) == -1)
+		lazfs_usage();
+
+	if (lazfs_data->loglevel != NULL) {
+		level = log_parselevel(lazfs_data->loglevel);
+		if (level == -1)
+			lazfs_usage();
+		log_setlevel(level);
+	}
+
+	if (codec_loadrules(lazfs_data->codecpath) != 0)
+		exit(EXIT_FAILURE);
+
+	if (log_open(lazfs_data->logpath ? lazfs_data->logpath :
+		     LAZFS_LOGPATH) != 0) {
+		perror("logfile");
+		exit(EXIT_FAILURE);
+	}
+
+	if (lazfs_data->tracepath != NULL &&
+	    trace_open(lazfs_data->tracepath) != 0) {
+		perror("trace");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Dirty leftovers are written back before anybody sees the files */
+	if (lazfs_data->cachedir != NULL) {
+		ret = diskcache_start(lazfs_data->cachedir, lazfs_data->rootdir,
+				      (off_t) lazfs_data->cache_keep << 20);
+		if (ret != 0) {
+			fprintf(stderr, "cache_dir: %s\n", strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	// turn over control to fuse
 	fprintf(stderr, "about to call fuse_main\n");
-	fuse_stat = fuse_main(argc, argv, &lazfs_oper, lazfs_data);
+	fuse_stat = fuse_main(args.argc, args.argv, &lazfs_oper, lazfs_data);
+	fuse_opt_free_args(&args);
 	fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
 
 	return fuse_stat;
@@ -0,0 +1,801 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains spatial index of LAZ chunks. Every chunk has bounding
+ * box and bitmap of cells of a coarse grid over the whole file which hold its
+ * points, so a chunk of points scattered along a flight line doesn't match
+ * every query which hits its bounding box.
+ *
+ * Index file starts with header (all integers little endian):
+ *
+ *   "LZIX", u32 version, u32 grid, u32 nchunks, u32 chunk_size, u64 npoints,
+ *   i32 min X, i32 min Y, i32 max X, i32 max Y
+ *
+ * followed by one entry per chunk:
+ *
+ *   u32 compressed size, i32 min X, i32 min Y, i32 max X, i32 max Y,
+ *   grid * grid bits of occupied cells, row by row
+ */
+
+#include "lazindex.h"
+#include "stats.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LAZINDEX_MAGIC "LZIX"
+#define LAZINDEX_VERSION 1
+
+/* Sizes of the header and of one chunk entry in the file */
+#define LAZINDEX_HEADER 44
+#define LAZINDEX_ENTRY (20 + LAZINDEX_GRID * LAZINDEX_GRID / 8)
+
+/* Number of points read at once while index is built */
+#define LAZINDEX_BATCH 4096
+
+int
+lazindex_path(char ipath[PATH_MAX], const char *cpath)
+{
+	if (snprintf(ipath, PATH_MAX, "%s%s", cpath, LAZINDEX_SUFFIX) >=
+	    PATH_MAX)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/* Converts coordinate from the header to raw integer, saturates */
+static int32_t
+lazindex_raw(double v, double scale, double offset)
+{
+	v = (scale != 0) ? (v - offset) / scale : 0;
+	if (!(v > INT32_MIN))
+		return INT32_MIN;
+	if (v >= INT32_MAX)
+		return INT32_MAX;
+
+	return (int32_t) v;
+}
+
+/* Returns cell of raw coordinate v, values outside extent map to edges */
+static unsigned int
+lazindex_cell(const lazindex_t *index, int axis, int32_t v)
+{
+	int64_t span;
+
+	if (v <= index->min[axis])
+		return 0;
+	if (v >= index->max[axis])
+		return LAZINDEX_GRID - 1;
+
+	span = (int64_t) index->max[axis] - index->min[axis] + 1;
+
+	return ((int64_t) v - index->min[axis]) * LAZINDEX_GRID / span;
+}
+
+/*
+ * Adds count points of LAS file lasfd with header hdr starting with point
+ * first to chunks of index and to stats unless it's NULL. Point first of
+ * lasfd is point number at of the indexed file.
+ */
+static int
+lazindex_scan(lazindex_t *index, pointstats_t *stats, int lasfd,
+	      const lasheader_t *hdr, uint64_t first, uint64_t count,
+	      uint64_t at)
+{
+	unsigned char *buf, *p;
+	lazindex_chunk_t *c;
+	uint64_t done, n, j;
+	uint32_t cell;
+	int32_t v[2];
+	ssize_t len;
+	int axis, ret = 0;
+
+	/* Every point format begins with X, Y and Z */
+	if (hdr->record_length < 12 || at > index->npoints ||
+	    count > index->npoints - at)
+		return -EINVAL;
+
+	buf = malloc((size_t) LAZINDEX_BATCH * hdr->record_length);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	for (done = 0; done < count; done += n) {
+		n = count - done;
+		if (n > LAZINDEX_BATCH)
+			n = LAZINDEX_BATCH;
+
+		len = pread(lasfd, buf, n * hdr->record_length,
+			    hdr->data_offset +
+			    (first + done) * hdr->record_length);
+		if (len < 0) {
+			ret = -errno;
+			goto cleanup;
+		}
+		if ((uint64_t) len != n * hdr->record_length) {
+			ret = -EINVAL;
+			goto cleanup;
+		}
+
+		for (j = 0; j < n; j++) {
+			p = buf + j * hdr->record_length;
+			c = &index->chunks[(at + done + j) /
+					   index->chunk_size];
+			for (axis = 0; axis < 2; axis++) {
+				v[axis] = (int32_t) le32(p + 4 * axis);
+				if (v[axis] < c->min[axis])
+					c->min[axis] = v[axis];
+				if (v[axis] > c->max[axis])
+					c->max[axis] = v[axis];
+			}
+			cell = lazindex_cell(index, 1, v[1]) * LAZINDEX_GRID +
+			       lazindex_cell(index, 0, v[0]);
+			c->cells[cell / 8] |= 1 << (cell % 8);
+		}
+
+		if (stats != NULL) {
+			ret = pointstats_add(stats, hdr, buf, n);
+			if (ret != 0)
+				goto cleanup;
+		}
+	}
+
+cleanup:
+	free(buf);
+
+	return ret;
+}
+
+/* Resets entry of chunk i of size bytes before its points are added */
+static void
+lazindex_resetchunk(lazindex_t *index, uint32_t i, uint32_t size)
+{
+	lazindex_chunk_t *c = &index->chunks[i];
+
+	memset(c, 0, sizeof(*c));
+	c->size = size;
+	c->min[0] = c->min[1] = INT32_MAX;
+	c->max[0] = c->max[1] = INT32_MIN;
+}
+
+/* Decompresses chunks of lazfd one by one and adds their points to index */
+static int
+lazindex_scanchunks(lazindex_t *index, pointstats_t *stats, int lazfd,
+		    const unsigned char *laz, const lasheader_t *lazhdr,
+		    const lazfile_chunks_t *chunks)
+{
+	lasheader_t hdr;
+	uint64_t first, count;
+	uint32_t i;
+	int lasfd, ret = 0;
+
+	for (i = 0; i < chunks->nchunks && ret == 0; i++) {
+		first = (uint64_t) i * index->chunk_size;
+		count = lazhdr->npoints - first;
+		if (count > index->chunk_size)
+			count = index->chunk_size;
+
+		lasfd = lazfs_tmpfile();
+		if (lasfd < 0)
+			return lasfd;
+
+		ret = lazfile_decodechunk(lazfd, laz, lazhdr, chunks, i, count,
+					  lasfd);
+		if (ret == 0)
+			ret = lasheader_read(lasfd, &hdr);
+		if (ret == 0)
+			ret = lazindex_scan(index, stats, lasfd, &hdr, 0, count,
+					    first);
+		close(lasfd);
+	}
+
+	return ret;
+}
+
+/*
+ * Reads header, VLRs (to *lazp) and chunk table of lazfd and makes index
+ * with its extent and empty entries of all chunks. Returns 0, -EINVAL if
+ * lazfd can't be indexed or -errno.
+ */
+static int
+lazindex_prepare(int lazfd, lazindex_t *index, unsigned char **lazp,
+		 lasheader_t *lazhdr, lazfile_chunks_t *chunks)
+{
+	lazfile_laszip_t zip;
+	uint32_t i;
+	int32_t t;
+	int axis, ret;
+
+	memset(index, 0, sizeof(*index));
+
+	ret = lazfile_readprefix(lazfd, lazhdr, lazp);
+	if (ret != 0)
+		return ret;
+
+	if (lazfile_findlaszip(*lazp, lazhdr, &zip) != 0)
+		return -EINVAL;
+
+	ret = lazfile_readchunks(lazfd, &zip, lazhdr->data_offset, chunks);
+	if (ret != 0)
+		return ret;
+
+	if (chunks->nchunks != (lazhdr->npoints + zip.chunk_size - 1) /
+			       zip.chunk_size)
+		return -EINVAL;
+
+	index->npoints = lazhdr->npoints;
+	index->chunk_size = zip.chunk_size;
+	index->nchunks = chunks->nchunks;
+	for (axis = 0; axis < 2; axis++) {
+		index->min[axis] = lazindex_raw(lazhdr->min[axis],
+						lazhdr->scale[axis],
+						lazhdr->offset[axis]);
+		index->max[axis] = lazindex_raw(lazhdr->max[axis],
+						lazhdr->scale[axis],
+						lazhdr->offset[axis]);
+		if (index->min[axis] > index->max[axis]) {
+			t = index->min[axis];
+			index->min[axis] = index->max[axis];
+			index->max[axis] = t;
+		}
+	}
+
+	index->chunks = calloc(chunks->nchunks, sizeof(*index->chunks));
+	if (index->chunks == NULL && chunks->nchunks != 0)
+		return -ENOMEM;
+
+	for (i = 0; i < chunks->nchunks; i++)
+		lazindex_resetchunk(index, i,
+				    chunks->starts[i + 1] - chunks->starts[i]);
+
+	return 0;
+}
+
+int
+lazindex_build(int lasfd, int lazfd, lazindex_t *index, pointstats_t *stats)
+{
+	lasheader_t lashdr, lazhdr;
+	unsigned char *laz = NULL;
+	lazfile_chunks_t chunks = LAZFILE_CHUNKS_INIT;
+	int ret;
+
+	assert(index != NULL);
+
+	ret = lazindex_prepare(lazfd, index, &laz, &lazhdr, &chunks);
+	if (ret != 0)
+		goto cleanup;
+
+	if (lasfd >= 0) {
+		ret = lasheader_read(lasfd, &lashdr);
+		if (ret == 0 && lashdr.npoints != lazhdr.npoints)
+			ret = -EINVAL;
+		if (ret != 0)
+			goto cleanup;
+	}
+
+	if (lasfd >= 0)
+		ret = lazindex_scan(index, stats, lasfd, &lashdr, 0,
+				    lazhdr.npoints, 0);
+	else
+		ret = lazindex_scanchunks(index, stats, lazfd, laz, &lazhdr,
+					  &chunks);
+	if (ret != 0)
+		goto cleanup;
+
+	stats_add(STATS_INDEX_BUILT, 1);
+
+cleanup:
+	lazfile_freechunks(&chunks);
+	free(laz);
+	if (ret != 0)
+		lazindex_free(index);
+
+	return ret;
+}
+
+int
+lazindex_buildjob(void *arg)
+{
+	lazindex_job_t *job = arg;
+
+	return lazindex_build(job->lasfd, job->lazfd, &job->index, job->stats);
+}
+
+/*
+ * Decompresses chunks of lazfd marked in rewritten and adds their points to
+ * stats. Chunks must be laid out as in index.
+ */
+static int
+lazindex_countchunks(const lazindex_t *index, int lazfd,
+		     const char *rewritten, pointstats_t *stats)
+{
+	lasheader_t lazhdr, hdr;
+	unsigned char *laz = NULL;
+	lazfile_chunks_t chunks = LAZFILE_CHUNKS_INIT;
+	lazfile_laszip_t zip;
+	uint64_t first, count;
+	uint32_t i;
+	int lasfd, ret;
+
+	ret = lazfile_readprefix(lazfd, &lazhdr, &laz);
+	if (ret != 0)
+		goto cleanup;
+
+	if (lazfile_findlaszip(laz, &lazhdr, &zip) != 0) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	ret = lazfile_readchunks(lazfd, &zip, lazhdr.data_offset, &chunks);
+	if (ret != 0)
+		goto cleanup;
+
+	if (index->npoints != lazhdr.npoints ||
+	    index->chunk_size != zip.chunk_size ||
+	    index->nchunks != chunks.nchunks) {
+		ret = -ESTALE;
+		goto cleanup;
+	}
+
+	for (i = 0; i < chunks.nchunks && ret == 0; i++) {
+		if (!rewritten[i])
+			continue;
+
+		first = (uint64_t) i * index->chunk_size;
+		count = lazhdr.npoints - first;
+		if (count > index->chunk_size)
+			count = index->chunk_size;
+
+		lasfd = lazfs_tmpfile();
+		if (lasfd < 0) {
+			ret = lasfd;
+			goto cleanup;
+		}
+
+		ret = lazfile_decodechunk(lazfd, laz, &lazhdr, &chunks, i,
+					  count, lasfd);
+		if (ret == 0)
+			ret = lasheader_read(lasfd, &hdr);
+		if (ret == 0)
+			ret = pointstats_scan(stats, lasfd, &hdr, 0, count);
+		close(lasfd);
+	}
+
+cleanup:
+	lazfile_freechunks(&chunks);
+	free(laz);
+
+	return ret;
+}
+
+int
+lazindex_scanchunk(lazindex_chunk_t *c, pointstats_t *stats, int lasfd,
+		   const lasheader_t *hdr, uint64_t first, uint64_t count)
+{
+	lazindex_t local = LAZINDEX_INIT;
+	int axis, ret;
+
+	assert(c != NULL);
+
+	/* Index of the chunk alone, extent is known after the first pass */
+	local.npoints = count;
+	local.chunk_size = (count > 0) ? count : 1;
+	local.nchunks = 1;
+	local.chunks = c;
+	lazindex_resetchunk(&local, 0, 0);
+
+	ret = lazindex_scan(&local, stats, lasfd, hdr, first, count, 0);
+	if (ret != 0 || count == 0)
+		return ret;
+
+	for (axis = 0; axis < 2; axis++) {
+		local.min[axis] = c->min[axis];
+		local.max[axis] = c->max[axis];
+	}
+	memset(c->cells, 0, sizeof(c->cells));
+
+	return lazindex_scan(&local, NULL, lasfd, hdr, first, count, 0);
+}
+
+/* Returns range of raw coordinates covered by cell of extent min - max */
+static void
+lazindex_cellrange(int32_t min, int32_t max, unsigned int cell,
+		   int32_t *lo, int32_t *hi)
+{
+	int64_t span = (int64_t) max - min + 1;
+
+	*lo = min + cell * span / LAZINDEX_GRID;
+	*hi = min + ((cell + 1) * span + LAZINDEX_GRID - 1) / LAZINDEX_GRID - 1;
+	if (*hi > max)
+		*hi = max;
+}
+
+int
+lazindex_merge(int lazfd, const lazindex_chunk_t *entries, uint32_t n,
+	       lazindex_t *index)
+{
+	lasheader_t lazhdr;
+	unsigned char *laz = NULL;
+	lazfile_chunks_t chunks = LAZFILE_CHUNKS_INIT;
+	const lazindex_chunk_t *e;
+	lazindex_chunk_t *c;
+	unsigned int x, y, gx, gy, cell;
+	unsigned int x0, x1, y0, y1;
+	int32_t lo, hi;
+	uint32_t i;
+	int ret;
+
+	assert(index != NULL);
+
+	ret = lazindex_prepare(lazfd, index, &laz, &lazhdr, &chunks);
+	if (ret == 0 && n != index->nchunks)
+		ret = -EINVAL;
+	if (ret != 0)
+		goto cleanup;
+
+	for (i = 0; i < n; i++) {
+		e = &entries[i];
+		c = &index->chunks[i];
+		memcpy(c->min, e->min, sizeof(c->min));
+		memcpy(c->max, e->max, sizeof(c->max));
+
+		/* Every cell of the chunk marks cells of index it overlaps */
+		for (y = 0; y < LAZINDEX_GRID; y++) {
+			for (x = 0; x < LAZINDEX_GRID; x++) {
+				cell = y * LAZINDEX_GRID + x;
+				if (!(e->cells[cell / 8] & (1 << (cell % 8))))
+					continue;
+
+				lazindex_cellrange(e->min[0], e->max[0], x,
+						   &lo, &hi);
+				x0 = lazindex_cell(index, 0, lo);
+				x1 = lazindex_cell(index, 0, hi);
+				lazindex_cellrange(e->min[1], e->max[1], y,
+						   &lo, &hi);
+				y0 = lazindex_cell(index, 1, lo);
+				y1 = lazindex_cell(index, 1, hi);
+
+				for (gy = y0; gy <= y1; gy++) {
+					for (gx = x0; gx <= x1; gx++) {
+						cell = gy * LAZINDEX_GRID + gx;
+						c->cells[cell / 8] |=
+							1 << (cell % 8);
+					}
+				}
+			}
+		}
+	}
+
+	stats_add(STATS_INDEX_BUILT, 1);
+
+cleanup:
+	lazfile_freechunks(&chunks);
+	free(laz);
+	if (ret != 0)
+		lazindex_free(index);
+
+	return ret;
+}
+
+int
+lazindex_update(int lasfd, int lazfd, int oldfd, const char *rewritten,
+		lazindex_t *index, pointstats_t *added, pointstats_t *removed)
+{
+	lasheader_t lashdr, lazhdr;
+	unsigned char *laz = NULL;
+	lazfile_chunks_t chunks = LAZFILE_CHUNKS_INIT;
+	lazfile_laszip_t zip;
+	uint64_t first, count;
+	uint32_t i, size;
+	int ret;
+
+	assert(rewritten != NULL);
+	assert(index != NULL);
+
+	ret = lasheader_read(lasfd, &lashdr);
+	if (ret != 0)
+		return ret;
+
+	ret = lazfile_readprefix(lazfd, &lazhdr, &laz);
+	if (ret != 0)
+		goto cleanup;
+
+	if (lazfile_findlaszip(laz, &lazhdr, &zip) != 0) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	ret = lazfile_readchunks(lazfd, &zip, lazhdr.data_offset, &chunks);
+	if (ret != 0)
+		goto cleanup;
+
+	if (index->npoints != lazhdr.npoints ||
+	    lashdr.npoints != lazhdr.npoints ||
+	    index->chunk_size != zip.chunk_size ||
+	    index->nchunks != chunks.nchunks) {
+		ret = -ESTALE;
+		goto cleanup;
+	}
+
+	/* Copied chunks must be the ones the index was built for */
+	for (i = 0; i < chunks.nchunks; i++) {
+		size = chunks.starts[i + 1] - chunks.starts[i];
+		if (!rewritten[i] && index->chunks[i].size != size) {
+			ret = -ESTALE;
+			goto cleanup;
+		}
+	}
+
+	for (i = 0; i < chunks.nchunks && ret == 0; i++) {
+		if (!rewritten[i])
+			continue;
+
+		first = (uint64_t) i * index->chunk_size;
+		count = lazhdr.npoints - first;
+		if (count > index->chunk_size)
+			count = index->chunk_size;
+
+		lazindex_resetchunk(index, i,
+				    chunks.starts[i + 1] - chunks.starts[i]);
+		ret = lazindex_scan(index, added, lasfd, &lashdr, first, count,
+				    first);
+	}
+
+	if (ret == 0 && removed != NULL)
+		ret = lazindex_countchunks(index, oldfd, rewritten, removed);
+
+	if (ret == 0)
+		stats_add(STATS_INDEX_UPDATED, 1);
+
+cleanup:
+	lazfile_freechunks(&chunks);
+	free(laz);
+
+	return ret;
+}
+
+int
+lazindex_updatejob(void *arg)
+{
+	lazindex_update_t *job = arg;
+
+	return lazindex_update(job->lasfd, job->lazfd, job->oldfd,
+			       job->rewritten, job->index, job->added,
+			       job->removed);
+}
+
+int
+lazindex_write(const lazindex_t *index, const char *ipath)
+{
+	char tmppath[PATH_MAX];
+	unsigned char *buf, *p;
+	size_t len;
+	uint32_t i;
+	int fd = -1, axis, ret = 0;
+
+	assert(index != NULL);
+
+	if (snprintf(tmppath, PATH_MAX, "%s.XXXXXX", ipath) >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	len = LAZINDEX_HEADER + (size_t) index->nchunks * LAZINDEX_ENTRY;
+	buf = malloc(len);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	memcpy(buf, LAZINDEX_MAGIC, 4);
+	setle32(buf + 4, LAZINDEX_VERSION);
+	setle32(buf + 8, LAZINDEX_GRID);
+	setle32(buf + 12, index->nchunks);
+	setle32(buf + 16, index->chunk_size);
+	setle64(buf + 20, index->npoints);
+	for (axis = 0; axis < 2; axis++) {
+		setle32(buf + 28 + 4 * axis, index->min[axis]);
+		setle32(buf + 36 + 4 * axis, index->max[axis]);
+	}
+
+	for (i = 0; i < index->nchunks; i++) {
+		p = buf + LAZINDEX_HEADER + (size_t) i * LAZINDEX_ENTRY;
+		setle32(p, index->chunks[i].size);
+		for (axis = 0; axis < 2; axis++) {
+			setle32(p + 4 + 4 * axis, index->chunks[i].min[axis]);
+			setle32(p + 12 + 4 * axis, index->chunks[i].max[axis]);
+		}
+		memcpy(p + 20, index->chunks[i].cells,
+		       sizeof(index->chunks[i].cells));
+	}
+
+	fd = mkstemp(tmppath);
+	if (fd == -1) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	if (pwrite(fd, buf, len, 0) != (ssize_t) len ||
+	    rename(tmppath, ipath) != 0) {
+		ret = -errno;
+		unlink(tmppath);
+	}
+
+cleanup:
+	if (fd != -1)
+		close(fd);
+	free(buf);
+
+	return ret;
+}
+
+int
+lazindex_read(const char *ipath, lazindex_t *index)
+{
+	unsigned char *buf = NULL, *p;
+	struct stat statbuf;
+	uint32_t i;
+	int fd, axis, ret = 0;
+
+	assert(index != NULL);
+
+	memset(index, 0, sizeof(*index));
+
+	fd = open(ipath, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &statbuf) != 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	if (statbuf.st_size < LAZINDEX_HEADER) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	buf = malloc(statbuf.st_size);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	if (pread(fd, buf, statbuf.st_size, 0) != statbuf.st_size ||
+	    memcmp(buf, LAZINDEX_MAGIC, 4) != 0 ||
+	    le32(buf + 4) != LAZINDEX_VERSION ||
+	    le32(buf + 8) != LAZINDEX_GRID ||
+	    statbuf.st_size != LAZINDEX_HEADER +
+			       (off_t) le32(buf + 12) * LAZINDEX_ENTRY) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	index->nchunks = le32(buf + 12);
+	index->chunk_size = le32(buf + 16);
+	index->npoints = le64(buf + 20);
+	for (axis = 0; axis < 2; axis++) {
+		index->min[axis] = (int32_t) le32(buf + 28 + 4 * axis);
+		index->max[axis] = (int32_t) le32(buf + 36 + 4 * axis);
+	}
+
+	index->chunks = calloc(index->nchunks, sizeof(*index->chunks));
+	if (index->chunks == NULL && index->nchunks != 0) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	for (i = 0; i < index->nchunks; i++) {
+		p = buf + LAZINDEX_HEADER + (size_t) i * LAZINDEX_ENTRY;
+		index->chunks[i].size = le32(p);
+		for (axis = 0; axis < 2; axis++) {
+			index->chunks[i].min[axis] = (int32_t) le32(p + 4 +
+								    4 * axis);
+			index->chunks[i].max[axis] = (int32_t) le32(p + 12 +
+								    4 * axis);
+		}
+		memcpy(index->chunks[i].cells, p + 20,
+		       sizeof(index->chunks[i].cells));
+	}
+
+cleanup:
+	free(buf);
+	close(fd);
+	if (ret != 0)
+		lazindex_free(index);
+
+	return ret;
+}
+
+int
+lazindex_check(const lazindex_t *index, const lasheader_t *hdr,
+	       const lazfile_laszip_t *zip, const lazfile_chunks_t *chunks)
+{
+	uint32_t i;
+
+	assert(index != NULL);
+
+	if (index->npoints != hdr->npoints ||
+	    index->chunk_size != zip->chunk_size ||
+	    index->nchunks != chunks->nchunks)
+		return -ESTALE;
+
+	for (i = 0; i < index->nchunks; i++) {
+		if (index->chunks[i].size !=
+		    chunks->starts[i + 1] - chunks->starts[i])
+			return -ESTALE;
+	}
+
+	return 0;
+}
+
+void
+lazindex_range(const lasheader_t *hdr, const double min[2],
+	       const double max[2], int32_t rmin[2], int32_t rmax[2])
+{
+	int32_t t;
+	int axis;
+
+	for (axis = 0; axis < 2; axis++) {
+		rmin[axis] = lazindex_raw(min[axis], hdr->scale[axis],
+					  hdr->offset[axis]);
+		rmax[axis] = lazindex_raw(max[axis], hdr->scale[axis],
+					  hdr->offset[axis]);
+		if (rmin[axis] > rmax[axis]) {
+			t = rmin[axis];
+			rmin[axis] = rmax[axis];
+			rmax[axis] = t;
+		}
+
+		/* Conversion truncates */
+		if (rmin[axis] > INT32_MIN)
+			rmin[axis]--;
+		if (rmax[axis] < INT32_MAX)
+			rmax[axis]++;
+	}
+}
+
+int
+lazindex_intersects(const lazindex_t *index, uint32_t i, const int32_t min[2],
+		    const int32_t max[2])
+{
+	const lazindex_chunk_t *c;
+	unsigned int x, y, x0, x1, y0, y1, cell;
+
+	assert(index != NULL && i < index->nchunks);
+
+	c = &index->chunks[i];
+	if (c->max[0] < min[0] || c->min[0] > max[0] ||
+	    c->max[1] < min[1] || c->min[1] > max[1])
+		return 0;
+
+	/* Cells are monotonic in coordinates, clamping keeps them conservative */
+	x0 = lazindex_cell(index, 0, min[0]);
+	x1 = lazindex_cell(index, 0, max[0]);
+	y0 = lazindex_cell(index, 1, min[1]);
+	y1 = lazindex_cell(index, 1, max[1]);
+
+	for (y = y0; y <= y1; y++) {
+		for (x = x0; x <= x1; x++) {
+			cell = y * LAZINDEX_GRID + x;
+			if (c->cells[cell / 8] & (1 << (cell % 8)))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+lazindex_free(lazindex_t *index)
+{
+	assert(index != NULL);
+
+	free(index->chunks);
+	index->chunks = NULL;
+	index->nchunks = 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _LAZINDEX_H_
+#define _LAZINDEX_H_
+
+#include "lasheader.h"
+#include "lazfile.h"
+#include "pointstats.h"
+#include <limits.h>
+#include <stdint.h>
+
+/*
+ * Spatial index of the .laz is stored next to it, in file of the same name
+ * followed by LAZINDEX_SUFFIX. It describes where points of every LAZ chunk
+ * lie so queries decompress only chunks which can hold matching points.
+ */
+#define LAZINDEX_SUFFIX ".lax"
+
+/* Extent of the file is split into LAZINDEX_GRID x LAZINDEX_GRID cells */
+#define LAZINDEX_GRID 16
+
+/*
+ * Coordinates in the index are raw X and Y integers of LAS points, so the
+ * index stays valid when scale or offset in the header change.
+ */
+typedef struct lazindex_chunk {
+	uint32_t size; /* Compressed size, index is stale if it differs */
+	int32_t min[2];
+	int32_t max[2];
+	uint8_t cells[LAZINDEX_GRID * LAZINDEX_GRID / 8]; /* Occupied cells */
+} lazindex_chunk_t;
+
+typedef struct lazindex {
+	uint64_t npoints;
+	uint32_t chunk_size;
+	uint32_t nchunks;
+	int32_t min[2]; /* Extent split into cells */
+	int32_t max[2];
+	lazindex_chunk_t *chunks;
+} lazindex_t;
+
+#define LAZINDEX_INIT { 0, 0, 0, { 0, 0 }, { 0, 0 }, NULL }
+
+/* Arguments of lazindex_buildjob() */
+typedef struct lazindex_job {
+	int lasfd; /* Decompressed file or -1 */
+	int lazfd; /* Its compressed file */
+	lazindex_t index; /* Built index, freed by caller */
+	pointstats_t *stats; /* Points are also counted here unless NULL */
+} lazindex_job_t;
+
+/* Arguments of lazindex_updatejob() */
+typedef struct lazindex_update {
+	int lasfd; /* Decompressed file */
+	int lazfd; /* Its compressed file */
+	int oldfd; /* Previous compressed file or -1 */
+	const char *rewritten; /* Chunks of lazfd which were compressed again */
+	lazindex_t *index; /* Index of the previous .laz, updated in place */
+	pointstats_t *added; /* Points of rewritten chunks unless NULL */
+	pointstats_t *removed; /* Points they replaced in oldfd unless NULL */
+} lazindex_update_t;
+
+/* Returns path of the index of .laz cpath or -ENAMETOOLONG */
+int
+lazindex_path(char ipath[PATH_MAX], const char *cpath);
+
+/*
+ * Builds index of lazfd from points of its decompressed content lasfd. When
+ * lasfd is -1, chunks of lazfd are decompressed one by one instead. Only
+ * chunked .laz with chunks of fixed size can be indexed. Index must be freed
+ * via lazindex_free(). Points are also added to stats unless it's NULL.
+ * Returns 0, -EINVAL if lazfd can't be indexed or -errno.
+ */
+int
+lazindex_build(int lasfd, int lazfd, lazindex_t *index, pointstats_t *stats);
+
+/* Same as lazindex_build(), gets lazindex_job_t so it can be run via workq */
+int
+lazindex_buildjob(void *arg);
+
+/*
+ * Indexes count points of LAS file lasfd with header hdr starting with point
+ * first into entry c of a chunk whose final file isn't known yet, cells of c
+ * are relative to the bounding box of the points. Points are also added to
+ * stats unless it's NULL. Returns 0 or -errno.
+ */
+int
+lazindex_scanchunk(lazindex_chunk_t *c, pointstats_t *stats, int lasfd,
+		   const lasheader_t *hdr, uint64_t first, uint64_t count);
+
+/*
+ * Builds index of lazfd from entries of its chunks made by
+ * lazindex_scanchunk(), nothing is decompressed. Cells are mapped to the
+ * extent of lazfd conservatively. Index must be freed via lazindex_free().
+ * Returns 0, -EINVAL if lazfd can't be indexed or entries don't match its
+ * chunks or -errno.
+ */
+int
+lazindex_merge(int lazfd, const lazindex_chunk_t *entries, uint32_t n,
+	       lazindex_t *index);
+
+/*
+ * Updates index of .laz whose chunks marked in rewritten were compressed
+ * again into lazfd, other chunks were copied. Only entries of rewritten
+ * chunks are built, from points of lasfd. Extent of the index is kept, cells
+ * stay conservative for points outside of it. Points of rewritten chunks are
+ * also added to added unless it's NULL. Points which were in those chunks of
+ * the previous .laz oldfd are decompressed and added to removed unless it's
+ * NULL. Returns 0, -ESTALE if index doesn't describe the copied chunks or
+ * -errno.
+ */
+int
+lazindex_update(int lasfd, int lazfd, int oldfd, const char *rewritten,
+		lazindex_t *index, pointstats_t *added, pointstats_t *removed);
+
+/* Same as lazindex_update(), gets lazindex_update_t for workq */
+int
+lazindex_updatejob(void *arg);
+
+/* Stores index into ipath via temporary file. Returns 0 or -errno */
+int
+lazindex_write(const lazindex_t *index, const char *ipath);
+
+/*
+ * Reads index from ipath. Returns 0, -ENOENT if there is none, -EINVAL if
+ * it's malformed or -errno.
+ */
+int
+lazindex_read(const char *ipath, lazindex_t *index);
+
+/*
+ * Checks that index describes .laz with header hdr, laszip VLR zip and chunk
+ * table chunks. Returns 0 if it does or -ESTALE.
+ */
+int
+lazindex_check(const lazindex_t *index, const lasheader_t *hdr,
+	       const lazfile_laszip_t *zip, const lazfile_chunks_t *chunks);
+
+/*
+ * Converts box [min, max] in coordinates of the file with header hdr to raw
+ * coordinates. Range is widened so that it holds all points in the box.
+ */
+void
+lazindex_range(const lasheader_t *hdr, const double min[2],
+	       const double max[2], int32_t rmin[2], int32_t rmax[2]);
+
+/*
+ * Returns non-zero if chunk i can hold points within raw coordinates
+ * [min, max] (inclusive).
+ */
+int
+lazindex_intersects(const lazindex_t *index, uint32_t i, const int32_t min[2],
+		    const int32_t max[2]);
+
+void
+lazindex_free(lazindex_t *index);
+
+#endif
@@ -1,5 +1,6 @@
 /*
   Copyright (C) 2012 Joseph J. Pfeiffer, Jr., Ph.D. <pfeiffer@cs.nmsu.edu>
+  Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
 
   This program can be distributed under the terms of the GNU GPLv3.
   See the file COPYING.
@@ -12,66 +13,391 @@
 
 #include "params.h"
 
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "log.h"
+#include "util.h"
 
-char debug = 1;
+/*
+ * Messages are formatted by the logging thread into its own ring buffer, so
+ * logging takes no lock and does no syscall. Background flusher writes the
+ * rings to the log file. Each thread has exactly one producer (itself) and
+ * the flusher is the only consumer so head and tail need only barriers.
+ */
+
+/* Size of per-thread ring, must be power of two */
+#define LOG_RINGSIZE (64 * 1024)
+/* Longest message, longer ones are truncated */
+#define LOG_MSGMAX 1024
+/* Flusher wakes up at least this often */
+#define LOG_FLUSH_MS 200
+/* Maximum number of error messages logged per second */
+#define LOG_ERRBURST 100
+
+typedef struct log_ring {
+	char buf[LOG_RINGSIZE];
+	volatile unsigned long head; /* Advanced by owning thread */
+	volatile unsigned long tail; /* Advanced by flusher */
+	volatile unsigned long dropped; /* Messages which didn't fit */
+	volatile char orphaned; /* Owning thread exited */
+	struct log_ring *next;
+} log_ring_t;
+
+volatile int log_level = LOG_LEVEL_ERROR;
+
+static int logfd = -1;
+
+/* List of rings, protected by log_lock */
+static log_ring_t *log_rings;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+/* Flusher state, protected by log_flushlock */
+static pthread_t log_flusher;
+static pthread_mutex_t log_flushlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_flushcond = PTHREAD_COND_INITIALIZER;
+static volatile char log_running;
+static char log_stopping;
 
-FILE *log_open()
+/* Error rate limiting */
+static volatile time_t log_errsecond;
+static volatile unsigned int log_errcount;
+static volatile unsigned long log_errsuppressed;
+
+static const char *log_levels[] = { "error", "debug" };
+
+int log_open(const char *path)
 {
-    FILE *logfile;
-    
-    // very first thing, open up the logfile and mark that we got in
-    // here.  If we can't open the logfile, we're dead.
-    logfile = fopen("lazfs.log", "w");
-    if (logfile == NULL) {
-	perror("logfile");
-	exit(EXIT_FAILURE);
-    }
-    
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+	assert(path != NULL);
+
+	logfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+	return (logfd == -1) ? -errno : 0;
+}
+
+void log_setlevel(int level)
+{
+	assert(level >= LOG_LEVEL_ERROR && level <= LOG_LEVEL_DEBUG);
+
+	log_level = level;
+}
+
+int log_parselevel(const char *name)
+{
+	int i;
+
+	for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++) {
+		if (strcmp(name, log_levels[i]) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+const char *log_levelname(int level)
+{
+	assert(level >= LOG_LEVEL_ERROR && level <= LOG_LEVEL_DEBUG);
 
-    return logfile;
+	return log_levels[level];
+}
+
+/* Writes whole buffer to the log file, errors are ignored */
+static void log_writefd(const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(logfd, buf, len);
+		if (ret <= 0)
+			return;
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* Thread exit, flusher frees the ring once it is drained */
+static void log_ringexit(void *arg)
+{
+	log_ring_t *ring = arg;
+
+	__sync_synchronize();
+	ring->orphaned = 1;
+}
+
+static void log_initkey(void)
+{
+	if (pthread_key_create(&log_key, log_ringexit) != 0)
+		abort();
+}
+
+/* Returns ring of calling thread, NULL if it can't be allocated */
+static log_ring_t *log_ring(void)
+{
+	log_ring_t *ring;
+
+	pthread_once(&log_once, log_initkey);
+
+	ring = pthread_getspecific(log_key);
+	if (ring != NULL)
+		return ring;
+
+	ring = malloc(sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+
+	memset(ring, 0, sizeof(*ring));
+	if (pthread_setspecific(log_key, ring) != 0) {
+		free(ring);
+		return NULL;
+	}
+
+	LOCK(log_lock);
+	ring->next = log_rings;
+	log_rings = ring;
+	UNLOCK(log_lock);
+
+	return ring;
+}
+
+static void log_push(log_ring_t *ring, const char *msg, size_t len)
+{
+	unsigned long head = ring->head;
+	size_t pos, part;
+
+	if (len > LOG_RINGSIZE - (head - ring->tail)) {
+		__sync_fetch_and_add(&ring->dropped, 1);
+		return;
+	}
+
+	pos = head & (LOG_RINGSIZE - 1);
+	part = LOG_RINGSIZE - pos;
+	if (part > len)
+		part = len;
+
+	memcpy(ring->buf + pos, msg, part);
+	memcpy(ring->buf, msg + part, len - part);
+
+	/* Message must be complete before flusher sees new head */
+	__sync_synchronize();
+	ring->head = head + len;
+}
+
+static void log_write(int level, const char *format, va_list args)
+{
+	char msg[LOG_MSGMAX];
+	log_ring_t *ring;
+	int len;
+
+	if (logfd == -1)
+		return;
+
+	len = vsnprintf(msg, sizeof(msg), format, args);
+	if (len < 0)
+		return;
+	if (len >= (int) sizeof(msg))
+		len = sizeof(msg) - 1;
+
+	ring = log_running ? log_ring() : NULL;
+	if (ring == NULL) {
+		/* No flusher (startup, shutdown) */
+		log_writefd(msg, len);
+		return;
+	}
+
+	log_push(ring, msg, len);
+
+	/* Errors are flushed without delay */
+	if (level == LOG_LEVEL_ERROR)
+		pthread_cond_signal(&log_flushcond);
+}
+
+/* Writes what is buffered in ring, returns non-zero if ring was empty */
+static int log_drain(log_ring_t *ring)
+{
+	unsigned long head, tail, dropped;
+	char note[64];
+	size_t pos, len;
+
+	head = ring->head;
+	tail = ring->tail;
+	/* Read message only after head */
+	__sync_synchronize();
+
+	if (head != tail) {
+		pos = tail & (LOG_RINGSIZE - 1);
+		len = head - tail;
+		if (pos + len > LOG_RINGSIZE) {
+			log_writefd(ring->buf + pos, LOG_RINGSIZE - pos);
+			len -= LOG_RINGSIZE - pos;
+			pos = 0;
+		}
+		log_writefd(ring->buf + pos, len);
+
+		/* Space can be reused only after it was written */
+		__sync_synchronize();
+		ring->tail = head;
+	}
+
+	dropped = __sync_lock_test_and_set(&ring->dropped, 0);
+	if (dropped > 0) {
+		len = snprintf(note, sizeof(note),
+			       "log: %lu messages dropped\n", dropped);
+		log_writefd(note, len);
+	}
+
+	return head == tail;
+}
+
+/* Drains all rings and frees rings of exited threads */
+static void log_flush(void)
+{
+	log_ring_t *ring, **prevp;
+	unsigned long suppressed;
+	char note[64];
+	size_t len;
+
+	LOCK(log_lock);
+	for (prevp = &log_rings; (ring = *prevp) != NULL; ) {
+		if (ring->orphaned && log_drain(ring)) {
+			*prevp = ring->next;
+			free(ring);
+			continue;
+		}
+
+		log_drain(ring);
+		prevp = &ring->next;
+	}
+	UNLOCK(log_lock);
+
+	suppressed = __sync_lock_test_and_set(&log_errsuppressed, 0);
+	if (suppressed > 0) {
+		len = snprintf(note, sizeof(note),
+			       "log: %lu error messages suppressed\n",
+			       suppressed);
+		log_writefd(note, len);
+	}
+}
+
+static void *log_flushroutine(void *arg)
+{
+	struct timespec timeout;
+	char stopping = 0;
+
+	while (!stopping) {
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_nsec += LOG_FLUSH_MS * 1000000L;
+		if (timeout.tv_nsec >= 1000000000L) {
+			timeout.tv_sec++;
+			timeout.tv_nsec -= 1000000000L;
+		}
+
+		LOCK(log_flushlock);
+		if (!log_stopping)
+			pthread_cond_timedwait(&log_flushcond, &log_flushlock,
+					       &timeout);
+		stopping = log_stopping;
+		UNLOCK(log_flushlock);
+
+		log_flush();
+	}
+
+	return NULL;
+}
+
+int log_start(void)
+{
+	int ret;
+
+	if (logfd == -1)
+		return 0;
+
+	log_stopping = 0;
+	ret = pthread_create(&log_flusher, NULL, log_flushroutine, NULL);
+	if (ret != 0)
+		return -ret;
+
+	log_running = 1;
+
+	return 0;
+}
+
+void log_close(void)
+{
+	if (log_running) {
+		log_running = 0;
+
+		LOCK(log_flushlock);
+		log_stopping = 1;
+		pthread_cond_signal(&log_flushcond);
+		UNLOCK(log_flushlock);
+
+		pthread_join(log_flusher, NULL);
+		/* Messages pushed while flusher was stopping */
+		log_flush();
+	}
+
+	if (logfd != -1) {
+		close(logfd);
+		logfd = -1;
+	}
 }
 
 void log_errorv(const char *format, va_list args)
 {
-    vfprintf(LAZFS_DATA->logfile, format, args);
+	time_t now = time(NULL);
+
+	/* Races only make the limit slightly inaccurate */
+	if (log_errsecond != now) {
+		log_errsecond = now;
+		log_errcount = 0;
+	}
+
+	if (__sync_add_and_fetch(&log_errcount, 1) > LOG_ERRBURST) {
+		__sync_fetch_and_add(&log_errsuppressed, 1);
+		return;
+	}
+
+	log_write(LOG_LEVEL_ERROR, format, args);
 }
 
 void log_error(const char *format, ...)
 {
-    va_list ap;
-    va_start(ap, format);
+	va_list ap;
 
-    log_errorv(format, ap);
-    va_end(ap);
+	va_start(ap, format);
+	log_errorv(format, ap);
+	va_end(ap);
 }
 
 void log_debugv(const char *format, va_list args)
 {
-    if (!debug)
-	return;
+	if (!log_enabled(LOG_LEVEL_DEBUG))
+		return;
 
-    vfprintf(LAZFS_DATA->logfile, format, args);
+	log_write(LOG_LEVEL_DEBUG, format, args);
 }
 
-void log_debug(const char *format, ...)
+void (log_debug)(const char *format, ...)
 {
-    va_list ap;
+	va_list ap;
 
-    va_start(ap, format);
-    log_debugv(format, ap);
-    va_end(ap);
+	va_start(ap, format);
+	log_debugv(format, ap);
+	va_end(ap);
 }
     
 // struct fuse_file_info keeps information about files (surprise!).
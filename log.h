@@ -12,20 +12,50 @@
 #include <fuse.h>
 #include <stdio.h>
 
-extern char debug;
+/* Log levels, messages above current level are not formatted at all */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_DEBUG 1
+
+extern volatile int log_level;
+
+#define log_enabled(level) ((level) <= log_level)
 
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
   log_debug("    " #field " = " #format "\n", typecast st->field)
 
-FILE *log_open(void);
+/*
+ * Opens log file, returns 0 or -errno. Until log_start() is called messages
+ * are written synchronously.
+ */
+int log_open(const char *path);
+/*
+ * Starts background flusher, from then on messages are buffered per thread.
+ * Must be called after the process daemonized.
+ */
+int log_start(void);
+/* Flushes buffered messages and closes log file */
+void log_close(void);
+/* Changes log level at runtime */
+void log_setlevel(int level);
+/* Returns level of given name or -1 */
+int log_parselevel(const char *name);
+const char *log_levelname(int level);
+
 void log_fi (struct fuse_file_info *fi);
 void log_stat(struct stat *si);
 void log_statvfs(struct statvfs *sv);
 void log_utime(struct utimbuf *buf);
 
 void log_debugv(const char *format, va_list args);
-void log_debug(const char *format, ...);
+void (log_debug)(const char *format, ...);
+/* Arguments aren't evaluated when debug messages are disabled */
+#define log_debug(...) \
+	do { \
+		if (log_enabled(LOG_LEVEL_DEBUG)) \
+			(log_debug)(__VA_ARGS__); \
+	} while (0)
+/* Error messages are rate limited */
 void log_errorv(const char *format, va_list args);
 void log_error(const char *format, ...);
 
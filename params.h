@@ -19,18 +19,40 @@
 
 // need this to get pwrite().  I have to use setvbuf() instead of
 // setlinebuf() later in consequence.
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 500
+#endif
 
 // maintain lazfs state in here
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
+#include "attrcache.h"
 #include "cache.h"
 #include "workq.h"
 struct lazfs_state {
-    FILE *logfile;
     char *rootdir;
     laz_cache_t *cache;
     lazfs_workq_t *workq;
+    lazfs_attrcache_t *attrcache;
+    uint64_t mounted; /* Time of mount, see stats_now() */
+
+    /* Options */
+    int scan; /* Scan backend after mount */
+    unsigned int scan_rate; /* Max. number of files scanned per second */
+    int nostream; /* Compress created files on close only */
+    int raw; /* Show the backend in RAW_DIR */
+    char *logpath; /* Log file */
+    char *loglevel; /* Initial log level name */
+    char *tracepath; /* Trace of FUSE operations or NULL */
+    char *codecpath; /* Codec rules file or NULL */
+    unsigned int tier_days; /* Files unused for more days are tiered, 0 = off */
+    unsigned int tier_iorate; /* Max. MiB per second read and written by tiering */
+    unsigned int tier_cpu; /* Max. percent of time tier codec runs */
+    unsigned int prefetch; /* Files decompressed ahead of sequential readers */
+    unsigned int prefetch_scratch; /* Prefetch only below this many MiB of scratch */
+    char *cachedir; /* Persistent cache of decompressed files or NULL */
+    unsigned int cache_keep; /* MiB of decompressed files kept after close */
 };
 #define LAZFS_DATA ((struct lazfs_state *) fuse_get_context()->private_data)
 
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains statistics of points, see pointstats.h. Coordinates of
+ * a block of records are first gathered into columns, min/max over the
+ * columns is branchless and split into lanes so the compiler vectorizes it.
+ */
+
+#include "pointstats.h"
+#include "util.h"
+#include <assert.h>
+#include <attr/xattr.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define POINTSTATS_MAGIC "LZPS"
+
+/* Size of the value without classes and of one class entry */
+#define POINTSTATS_HEADER 218
+#define POINTSTATS_CLASS 9
+#define POINTSTATS_MAXSIZE (POINTSTATS_HEADER + 256 * POINTSTATS_CLASS)
+
+/* Points gathered into columns at once */
+#define POINTSTATS_BLOCK 1024
+
+/* Width of the min/max kernel, eight 32bit values fill AVX2 register */
+#define POINTSTATS_LANES 8
+
+/* Points read at once by pointstats_scan() */
+#define POINTSTATS_BATCH 4096
+
+void
+pointstats_init(pointstats_t *ps)
+{
+	int axis;
+
+	assert(ps != NULL);
+
+	memset(ps, 0, sizeof(*ps));
+	for (axis = 0; axis < 3; axis++) {
+		ps->min[axis] = INT32_MAX;
+		ps->max[axis] = INT32_MIN;
+	}
+}
+
+/*
+ * Values are reduced in POINTSTATS_LANES independent lanes, the inner loops
+ * map to vector min/max instructions.
+ */
+static void
+pointstats_minmax(const int32_t *v, size_t n, int32_t *min, int32_t *max)
+{
+	int32_t lo[POINTSTATS_LANES], hi[POINTSTATS_LANES];
+	size_t i, k;
+
+	for (k = 0; k < POINTSTATS_LANES; k++) {
+		lo[k] = *min;
+		hi[k] = *max;
+	}
+
+	for (i = 0; i + POINTSTATS_LANES <= n; i += POINTSTATS_LANES) {
+		for (k = 0; k < POINTSTATS_LANES; k++) {
+			lo[k] = (v[i + k] < lo[k]) ? v[i + k] : lo[k];
+			hi[k] = (v[i + k] > hi[k]) ? v[i + k] : hi[k];
+		}
+	}
+
+	for (; i < n; i++) {
+		lo[0] = (v[i] < lo[0]) ? v[i] : lo[0];
+		hi[0] = (v[i] > hi[0]) ? v[i] : hi[0];
+	}
+
+	for (k = 0; k < POINTSTATS_LANES; k++) {
+		*min = (lo[k] < *min) ? lo[k] : *min;
+		*max = (hi[k] > *max) ? hi[k] : *max;
+	}
+}
+
+int
+pointstats_add(pointstats_t *ps, const lasheader_t *hdr,
+	       const unsigned char *buf, uint64_t n)
+{
+	int32_t col[POINTSTATS_BLOCK];
+	const unsigned char *p;
+	uint16_t reclen = hdr->record_length;
+	unsigned int coff, cmask, rmask;
+	uint64_t done, m, j;
+	int axis;
+
+	/*
+	 * Formats 6 and later have four bits of return number and whole byte
+	 * of classification after the flags, older ones three bits and five
+	 * low bits of byte 15.
+	 */
+	if (hdr->point_format < 6) {
+		coff = 15;
+		cmask = 0x1f;
+		rmask = 0x07;
+	} else {
+		coff = 16;
+		cmask = 0xff;
+		rmask = 0x0f;
+	}
+	if (reclen <= coff)
+		return -EINVAL;
+
+	for (done = 0; done < n; done += m) {
+		m = n - done;
+		if (m > POINTSTATS_BLOCK)
+			m = POINTSTATS_BLOCK;
+		p = buf + done * reclen;
+
+		for (axis = 0; axis < 3; axis++) {
+			for (j = 0; j < m; j++)
+				col[j] = (int32_t) le32(p + j * reclen +
+							4 * axis);
+			pointstats_minmax(col, m, &ps->min[axis],
+					  &ps->max[axis]);
+		}
+
+		for (j = 0; j < m; j++) {
+			ps->returns[p[j * reclen + 14] & rmask]++;
+			ps->classes[p[j * reclen + coff] & cmask]++;
+		}
+	}
+	ps->npoints += n;
+
+	return 0;
+}
+
+int
+pointstats_scan(pointstats_t *ps, int lasfd, const lasheader_t *hdr,
+		uint64_t first, uint64_t count)
+{
+	unsigned char *buf;
+	uint64_t done, n;
+	ssize_t len;
+	int ret = 0;
+
+	buf = malloc((size_t) POINTSTATS_BATCH * hdr->record_length);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	for (done = 0; done < count && ret == 0; done += n) {
+		n = count - done;
+		if (n > POINTSTATS_BATCH)
+			n = POINTSTATS_BATCH;
+
+		len = pread(lasfd, buf, n * hdr->record_length,
+			    hdr->data_offset +
+			    (first + done) * hdr->record_length);
+		if (len < 0)
+			ret = -errno;
+		else if ((uint64_t) len != n * hdr->record_length)
+			ret = -EINVAL;
+		else
+			ret = pointstats_add(ps, hdr, buf, n);
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+int
+pointstats_scanjob(void *arg)
+{
+	pointstats_job_t *job = arg;
+	lasheader_t hdr;
+	int ret;
+
+	pointstats_init(&job->stats);
+
+	ret = lasheader_read(job->lasfd, &hdr);
+	if (ret != 0)
+		return ret;
+	if (hdr.compressed)
+		return -EINVAL;
+
+	return pointstats_scan(&job->stats, job->lasfd, &hdr, 0, hdr.npoints);
+}
+
+int
+pointstats_replace(pointstats_t *ps, const pointstats_t *removed,
+		   const pointstats_t *added)
+{
+	int axis, i;
+
+	assert(ps != NULL && removed != NULL && added != NULL);
+
+	if (removed->npoints > ps->npoints)
+		return -ESTALE;
+
+	/* Nothing is kept, bounds of the rest don't matter */
+	if (removed->npoints == ps->npoints) {
+		*ps = *added;
+		return 0;
+	}
+
+	/*
+	 * Bound stays exact unless a removed point could lie on it, then
+	 * only added points reaching it still tell where it is.
+	 */
+	for (axis = 0; axis < 3; axis++) {
+		if ((removed->min[axis] <= ps->min[axis] &&
+		     added->min[axis] > ps->min[axis]) ||
+		    (removed->max[axis] >= ps->max[axis] &&
+		     added->max[axis] < ps->max[axis]))
+			return -ESTALE;
+	}
+
+	for (i = 0; i < 16; i++)
+		if (removed->returns[i] > ps->returns[i])
+			return -ESTALE;
+	for (i = 0; i < 256; i++)
+		if (removed->classes[i] > ps->classes[i])
+			return -ESTALE;
+
+	for (axis = 0; axis < 3; axis++) {
+		if (added->min[axis] < ps->min[axis])
+			ps->min[axis] = added->min[axis];
+		if (added->max[axis] > ps->max[axis])
+			ps->max[axis] = added->max[axis];
+	}
+	for (i = 0; i < 16; i++)
+		ps->returns[i] += added->returns[i] - removed->returns[i];
+	for (i = 0; i < 256; i++)
+		ps->classes[i] += added->classes[i] - removed->classes[i];
+	ps->npoints += added->npoints - removed->npoints;
+
+	return 0;
+}
+
+static void
+pointstats_setdouble(unsigned char *p, double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof(u));
+	setle64(p, u);
+}
+
+int
+pointstats_write(int fd, const pointstats_t *ps, const lasheader_t *hdr)
+{
+	unsigned char buf[POINTSTATS_MAXSIZE], *p;
+	int32_t min, max;
+	unsigned int i, nclasses = 0;
+	int axis;
+
+	memcpy(buf, POINTSTATS_MAGIC, 4);
+	setle16(buf + 4, POINTSTATS_VERSION);
+	buf[6] = hdr->point_format;
+	buf[7] = 0;
+	setle64(buf + 8, ps->npoints);
+
+	for (axis = 0; axis < 3; axis++) {
+		min = (ps->npoints != 0) ? ps->min[axis] : 0;
+		max = (ps->npoints != 0) ? ps->max[axis] : 0;
+		setle32(buf + 16 + 4 * axis, min);
+		setle32(buf + 28 + 4 * axis, max);
+		pointstats_setdouble(buf + 40 + 8 * axis,
+				     min * hdr->scale[axis] +
+				     hdr->offset[axis]);
+		pointstats_setdouble(buf + 64 + 8 * axis,
+				     max * hdr->scale[axis] +
+				     hdr->offset[axis]);
+	}
+
+	for (i = 0; i < 16; i++)
+		setle64(buf + 88 + 8 * i, ps->returns[i]);
+
+	p = buf + POINTSTATS_HEADER;
+	for (i = 0; i < 256; i++) {
+		if (ps->classes[i] == 0)
+			continue;
+		p[0] = i;
+		setle64(p + 1, ps->classes[i]);
+		p += POINTSTATS_CLASS;
+		nclasses++;
+	}
+	setle16(buf + 216, nclasses);
+
+	if (fsetxattr(fd, POINTSATTR, buf, p - buf, 0) != 0)
+		return -errno;
+
+	return 0;
+}
+
+int
+pointstats_read(int fd, pointstats_t *ps)
+{
+	unsigned char buf[POINTSTATS_MAXSIZE], *p;
+	unsigned int i, nclasses;
+	ssize_t len;
+	int axis;
+
+	len = fgetxattr(fd, POINTSATTR, buf, sizeof(buf));
+	if (len < 0)
+		return -errno;
+
+	if (len < POINTSTATS_HEADER || memcmp(buf, POINTSTATS_MAGIC, 4) != 0 ||
+	    le16(buf + 4) != POINTSTATS_VERSION)
+		return -EINVAL;
+
+	nclasses = le16(buf + 216);
+	if (len != POINTSTATS_HEADER + nclasses * POINTSTATS_CLASS)
+		return -EINVAL;
+
+	pointstats_init(ps);
+	ps->npoints = le64(buf + 8);
+	if (ps->npoints != 0) {
+		for (axis = 0; axis < 3; axis++) {
+			ps->min[axis] = (int32_t) le32(buf + 16 + 4 * axis);
+			ps->max[axis] = (int32_t) le32(buf + 28 + 4 * axis);
+		}
+	}
+
+	for (i = 0; i < 16; i++)
+		ps->returns[i] = le64(buf + 88 + 8 * i);
+
+	p = buf + POINTSTATS_HEADER;
+	for (i = 0; i < nclasses; i++, p += POINTSTATS_CLASS)
+		ps->classes[p[0]] = le64(p + 1);
+
+	return 0;
+}
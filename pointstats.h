@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _POINTSTATS_H_
+#define _POINTSTATS_H_
+
+#include "lasheader.h"
+#include <stdint.h>
+
+/*
+ * Statistics of points of a LiDAR file, counted while the file is stored and
+ * kept in xattr POINTSATTR of the compressed file, so they can be read by
+ * getxattr() of the virtual file without decompression. Value of the xattr
+ * (all numbers little endian):
+ *
+ *   "LZPS", u16 version (1), u8 point format, u8 0, u64 npoints,
+ *   i32 raw min X, Y, Z, i32 raw max X, Y, Z,
+ *   double min X, Y, Z, double max X, Y, Z (scaled by the header),
+ *   u64 points per return number 0 - 15,
+ *   u16 number of classes, per class with points: u8 class, u64 points
+ *
+ * Raw bounds are 0 when there are no points.
+ */
+#define POINTSTATS_VERSION 1
+
+typedef struct pointstats {
+	uint64_t npoints;
+	int32_t min[3]; /* Raw X, Y and Z */
+	int32_t max[3];
+	uint64_t returns[16]; /* Points per return number */
+	uint64_t classes[256]; /* Points per classification */
+} pointstats_t;
+
+/* Arguments of pointstats_scanjob() */
+typedef struct pointstats_job {
+	int lasfd;
+	pointstats_t stats;
+} pointstats_job_t;
+
+void
+pointstats_init(pointstats_t *ps);
+
+/*
+ * Adds n points of buf, records of LAS file with header hdr. Returns 0 or
+ * -EINVAL if records are too short for the point format.
+ */
+int
+pointstats_add(pointstats_t *ps, const lasheader_t *hdr,
+	       const unsigned char *buf, uint64_t n);
+
+/*
+ * Adds count points of LAS file lasfd with header hdr starting at point
+ * first. Returns 0 or -errno.
+ */
+int
+pointstats_scan(pointstats_t *ps, int lasfd, const lasheader_t *hdr,
+		uint64_t first, uint64_t count);
+
+/* Counts all points of job->lasfd into job->stats, can be run via workq */
+int
+pointstats_scanjob(void *arg);
+
+/*
+ * Replaces points removed, which were counted in ps, by points added.
+ * Returns 0 or -ESTALE if the result can't be derived without counting all
+ * points again, e.g. when removed points might have been the only ones on
+ * a bound of ps.
+ */
+int
+pointstats_replace(pointstats_t *ps, const pointstats_t *removed,
+		   const pointstats_t *added);
+
+/*
+ * Stores ps into xattr of fd, coordinates are scaled by header hdr. Returns 0
+ * or -errno.
+ */
+int
+pointstats_write(int fd, const pointstats_t *ps, const lasheader_t *hdr);
+
+/*
+ * Reads ps from xattr of fd. Returns 0, -ENOATTR if there is none, -EINVAL
+ * if it's malformed or -errno.
+ */
+int
+pointstats_read(int fd, pointstats_t *ps);
+
+#endif
@@ -0,0 +1,891 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains detection of processes which open files of a directory
+ * sequentially and prefetch of next files, see prefetch.h. Every process
+ * (and directory) has own stream with the list of files of codec rules in
+ * the directory, read on its second open there. Prefetched files are held
+ * in cache by a reference of prefetch until somebody opens them or until
+ * they are dropped as unused. Files requested explicitly have no stream and
+ * are never dropped as unused, only by lazfs_prefetch_remove().
+ */
+
+#include "params.h"
+#include "codec.h"
+#include "diskcache.h"
+#include "log.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "util.h"
+#include <assert.h>
+#include <attr/xattr.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+/* Number of streams tracked at once, least recently used is dropped */
+#define PREFETCH_STREAMS 16
+
+/* Stream without open for so long is dropped (ns) */
+#define PREFETCH_IDLE (60ULL * 1000000000ULL)
+
+/* Number of sequential opens which start prefetch */
+#define PREFETCH_RUN 2
+
+/* Maximum number of files ahead and maximum back-off exponent */
+#define PREFETCH_MAXDEPTH 64
+#define PREFETCH_MAXBACKOFF 6
+
+typedef enum {
+	PREFETCH_UNKNOWN,
+	PREFETCH_READDIR,
+	PREFETCH_SORTED
+} prefetch_order_t;
+
+typedef struct prefetch_name {
+	char *name;
+	unsigned int idx; /* Index in readdir order */
+} prefetch_name_t;
+
+/* Files of codec rules in a directory of the mount */
+typedef struct prefetch_list {
+	char **names; /* Readdir order */
+	prefetch_name_t *sorted; /* Sorted by name */
+	unsigned int *rank; /* Index in sorted of every name */
+	unsigned int n;
+} prefetch_list_t;
+
+typedef struct prefetch_stream prefetch_stream_t;
+struct prefetch_stream {
+	pid_t pid;
+	char *dir; /* Directory in the mount, "" for the root */
+	char listed; /* List was read */
+	prefetch_list_t list;
+	char *lastname; /* Name opened last, until list is read */
+	int last; /* Index of the file opened last, -1 if unknown */
+	prefetch_order_t order;
+	unsigned int run; /* Sequential opens in a row */
+	unsigned int depth; /* Files prefetched ahead */
+	unsigned int backoff; /* Zero depth restarts after PREFETCH_RUN << backoff */
+	uint64_t used; /* Time of the last open */
+	TAILQ_ENTRY(prefetch_stream) link;
+};
+
+typedef struct prefetch_file prefetch_file_t;
+struct prefetch_file {
+	char *path; /* Path in the mount */
+	prefetch_stream_t *stream; /* NULL when it's unused */
+	unsigned int pos; /* Position in order of the stream */
+	char explicit; /* Requested by lazfs_prefetch_add() */
+	off_t size; /* Decompressed size, reserved until it's ready */
+	TAILQ_ENTRY(prefetch_file) link;
+};
+
+/* Streams, most recently used first, and prefetched files */
+static TAILQ_HEAD(prefetch_streams, prefetch_stream) streams =
+	TAILQ_HEAD_INITIALIZER(streams);
+static unsigned int nstreams;
+static TAILQ_HEAD(prefetch_files, prefetch_file) files =
+	TAILQ_HEAD_INITIALIZER(files);
+
+/*
+ * Protects streams and files. Cache lock must be taken first and nobody
+ * may wait for a cache entry while holding it.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static laz_cache_t *prefetch_cache;
+static lazfs_workq_t *prefetch_workq;
+static unsigned int prefetch_depth; /* Zero when disabled */
+static off_t prefetch_scratch;
+
+static void
+prefetch_freelist(prefetch_list_t *list)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->n; i++)
+		free(list->names[i]);
+	free(list->names);
+	free(list->sorted);
+	free(list->rank);
+	memset(list, 0, sizeof(*list));
+}
+
+static int
+prefetch_namecmp(const void *a, const void *b)
+{
+	return strcmp(((const prefetch_name_t *) a)->name,
+		      ((const prefetch_name_t *) b)->name);
+}
+
+/* Reads names of files of codec rules in directory dir of the mount */
+static int
+prefetch_readlist(const char *dir, prefetch_list_t *list)
+{
+	char fpath[PATH_MAX], vname[PATH_MAX];
+	struct dirent *de;
+	unsigned int i, size = 0;
+	char **names;
+	DIR *dp;
+	int ret = 0;
+
+	memset(list, 0, sizeof(*list));
+	lazfs_fullpath(fpath, (dir[0] != '\0') ? dir : "/");
+
+	dp = opendir(fpath);
+	if (dp == NULL)
+		return -errno;
+
+	while ((de = readdir(dp)) != NULL) {
+		if (codec_matchstored(de->d_name, vname) == NULL)
+			continue;
+
+		if (list->n == size) {
+			size = (size != 0) ? 2 * size : 64;
+			names = realloc(list->names, size * sizeof(*names));
+			if (names == NULL) {
+				ret = -ENOMEM;
+				goto cleanup;
+			}
+			list->names = names;
+		}
+
+		list->names[list->n] = strdup(vname);
+		if (list->names[list->n] == NULL) {
+			ret = -ENOMEM;
+			goto cleanup;
+		}
+		list->n++;
+	}
+
+	list->sorted = malloc((list->n + 1) * sizeof(*list->sorted));
+	list->rank = malloc((list->n + 1) * sizeof(*list->rank));
+	if (list->sorted == NULL || list->rank == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	for (i = 0; i < list->n; i++) {
+		list->sorted[i].name = list->names[i];
+		list->sorted[i].idx = i;
+	}
+	qsort(list->sorted, list->n, sizeof(*list->sorted), &prefetch_namecmp);
+	for (i = 0; i < list->n; i++)
+		list->rank[list->sorted[i].idx] = i;
+
+cleanup:
+	closedir(dp);
+	if (ret != 0)
+		prefetch_freelist(list);
+
+	return ret;
+}
+
+/* Returns index of name in readdir order or -1 */
+static int
+prefetch_index(const prefetch_list_t *list, const char *name)
+{
+	prefetch_name_t key, *found;
+
+	if (name == NULL || list->n == 0)
+		return -1;
+
+	key.name = (char *) name;
+	found = bsearch(&key, list->sorted, list->n, sizeof(*list->sorted),
+			&prefetch_namecmp);
+
+	return (found != NULL) ? (int) found->idx : -1;
+}
+
+/* Position of file idx in order of the stream */
+static inline unsigned int
+prefetch_pos(const prefetch_stream_t *stream, unsigned int idx)
+{
+	return (stream->order == PREFETCH_SORTED) ? stream->list.rank[idx] :
+						    idx;
+}
+
+/* Index of file at position pos in order of the stream */
+static inline unsigned int
+prefetch_at(const prefetch_stream_t *stream, unsigned int pos)
+{
+	return (stream->order == PREFETCH_SORTED) ?
+	       stream->list.sorted[pos].idx : pos;
+}
+
+static prefetch_stream_t *
+prefetch_findstream(pid_t pid, const char *dir)
+{
+	prefetch_stream_t *stream;
+
+	TAILQ_FOREACH(stream, &streams, link) {
+		if (stream->pid == pid && strcmp(stream->dir, dir) == 0)
+			return stream;
+	}
+
+	return NULL;
+}
+
+static prefetch_file_t *
+prefetch_findfile(const char *path)
+{
+	prefetch_file_t *file;
+
+	TAILQ_FOREACH(file, &files, link) {
+		if (strcmp(file->path, path) == 0)
+			return file;
+	}
+
+	return NULL;
+}
+
+/*
+ * Marks files prefetched by stream at positions up to pos (all files when
+ * all is set) unused and backs the stream off if there were any.
+ */
+static void
+prefetch_skip(prefetch_stream_t *stream, unsigned int pos, int all)
+{
+	prefetch_file_t *file;
+	int skipped = 0;
+
+	TAILQ_FOREACH(file, &files, link) {
+		if (file->stream != stream || (!all && file->pos > pos))
+			continue;
+		file->stream = NULL;
+		skipped = 1;
+	}
+
+	if (skipped) {
+		stream->depth /= 2;
+		if (stream->backoff < PREFETCH_MAXBACKOFF)
+			stream->backoff++;
+	}
+}
+
+static void
+prefetch_dropstream(prefetch_stream_t *stream)
+{
+	prefetch_file_t *file;
+
+	TAILQ_FOREACH(file, &files, link) {
+		if (file->stream == stream)
+			file->stream = NULL;
+	}
+
+	TAILQ_REMOVE(&streams, stream, link);
+	nstreams--;
+
+	prefetch_freelist(&stream->list);
+	free(stream->lastname);
+	free(stream->dir);
+	free(stream);
+}
+
+static void
+prefetch_newstream(pid_t pid, const char *dir, const char *name,
+		   uint64_t now)
+{
+	prefetch_stream_t *stream;
+
+	if (nstreams == PREFETCH_STREAMS)
+		prefetch_dropstream(TAILQ_LAST(&streams, prefetch_streams));
+
+	stream = calloc(1, sizeof(*stream));
+	if (stream == NULL)
+		return;
+
+	stream->dir = strdup(dir);
+	stream->lastname = strdup(name);
+	if (stream->dir == NULL || stream->lastname == NULL) {
+		free(stream->dir);
+		free(stream->lastname);
+		free(stream);
+		return;
+	}
+
+	stream->pid = pid;
+	stream->last = -1;
+	stream->depth = 1;
+	stream->used = now;
+	TAILQ_INSERT_HEAD(&streams, stream, link);
+	nstreams++;
+}
+
+/* Moves stream to open of file idx (-1 if it isn't in the list) */
+static void
+prefetch_step(prefetch_stream_t *stream, int idx)
+{
+	const prefetch_list_t *list = &stream->list;
+	int last = stream->last;
+
+	/* File was opened again */
+	if (idx >= 0 && idx == last)
+		return;
+
+	stream->last = idx;
+	if (idx >= 0 && last >= 0 && stream->order != PREFETCH_SORTED &&
+	    idx == last + 1) {
+		stream->order = PREFETCH_READDIR;
+	} else if (idx >= 0 && last >= 0 &&
+		   stream->order != PREFETCH_READDIR &&
+		   list->rank[idx] == list->rank[last] + 1) {
+		stream->order = PREFETCH_SORTED;
+	} else {
+		prefetch_skip(stream, 0, 1);
+		stream->order = PREFETCH_UNKNOWN;
+		stream->run = 0;
+		return;
+	}
+
+	stream->run++;
+	prefetch_skip(stream, prefetch_pos(stream, idx), 0);
+	if (stream->depth == 0 &&
+	    stream->run >= (PREFETCH_RUN << stream->backoff))
+		stream->depth = 1;
+}
+
+/*
+ * Drops prefetched file if nobody took it over, must be called with cache
+ * locked. Waits for the file being decompressed when wait is set, returns
+ * -EBUSY otherwise. Returns zero when the file can be forgotten.
+ */
+static int
+prefetch_evict(prefetch_file_t *file, int wait)
+{
+	laz_cachestat_t cstat;
+	int ret;
+
+	ret = cache_getprefetched(prefetch_cache, file->path, wait, &cstat);
+	if (ret < 0)
+		return ret;
+
+	if (ret == 0) {
+		log_debug("    prefetch: dropping unused \"%s\"\n", file->path);
+		lazfs_finish_tmpfile(cstat.tmppath, &cstat.fd, &cstat.tmpfd);
+		cache_remove(prefetch_cache, file->path);
+		stats_add(STATS_PREFETCH_WASTED, 1);
+	}
+
+	return 0;
+}
+
+static void
+prefetch_freefile(prefetch_file_t *file)
+{
+	free(file->path);
+	free(file);
+}
+
+/* Drops unused files which are ready, forgets them if they were taken over */
+static void
+prefetch_reap(void)
+{
+	prefetch_file_t *file, *next;
+
+	cache_lock(prefetch_cache);
+	LOCK(lock);
+	for (file = TAILQ_FIRST(&files); file != NULL; file = next) {
+		next = TAILQ_NEXT(file, link);
+		if (file->stream != NULL || file->explicit)
+			continue;
+		if (prefetch_evict(file, 0) != 0)
+			continue;
+		TAILQ_REMOVE(&files, file, link);
+		prefetch_freefile(file);
+	}
+	UNLOCK(lock);
+	cache_unlock(prefetch_cache);
+}
+
+/*
+ * Returns decompressed size of files still being prefetched. Several run at
+ * once and their scratch grows only as they go, so the limit must count them
+ * whole. Must be called with cache and lock held.
+ */
+static off_t
+prefetch_pending(void)
+{
+	prefetch_file_t *file;
+	laz_cachestat_t cstat;
+	off_t pending = 0;
+
+	TAILQ_FOREACH(file, &files, link) {
+		if (cache_getprefetched(prefetch_cache, file->path, 0,
+					&cstat) == -EBUSY)
+			pending += file->size;
+	}
+
+	return pending;
+}
+
+/*
+ * Starts decompression of path at position pos of stream of pid and dir, or
+ * of explicitly requested path when dir is NULL. Returns -ENOSPC when there
+ * is no space for it, 0 otherwise.
+ */
+static int
+prefetch_issue(const char *path, pid_t pid, const char *dir, unsigned int pos)
+{
+	char fpath[PATH_MAX], cpath[PATH_MAX], tmppath[PATH_MAX];
+	const codec_rule_t *rule;
+	prefetch_stream_t *stream;
+	prefetch_file_t *file;
+	laz_cacheinfo_t info;
+	struct statvfs sv;
+	int fd = -1, tmpfd = -1;
+	off_t size;
+	int ret = 0;
+
+	lazfs_fullpath(fpath, path);
+	rule = lazfs_exec_hooks(fpath, cpath);
+
+	/* Codecs which decompress on access don't need it */
+	if (rule == NULL || rule->codec->lazy != NULL ||
+	    lazfs_getsize(cpath, rule, &size) != 0)
+		return 0;
+
+	if (statvfs(diskcache_scratchdir(), &sv) == 0 &&
+	    (unsigned long long) size >=
+	    (unsigned long long) sv.f_bavail * sv.f_frsize)
+		return -ENOSPC;
+
+	file = calloc(1, sizeof(*file));
+	if (file == NULL)
+		return 0;
+	file->path = strdup(path);
+	if (file->path == NULL)
+		goto cleanup;
+
+	diskcache_tmppath(tmppath);
+	if (lazfs_prepare_tmpfile(cpath, tmppath, O_RDONLY, -1, &fd,
+				  &tmpfd) != 0)
+		goto cleanup;
+
+	/* Cold file would be promoted, leave it to real open */
+	if (fgetxattr(fd, TIERATTR, NULL, 0) >= 0)
+		goto cleanup;
+
+	cache_lock(prefetch_cache);
+	LOCK(lock);
+	stream = (dir != NULL) ? prefetch_findstream(pid, dir) : NULL;
+	cache_info(prefetch_cache, &info);
+	if (info.scratch + prefetch_pending() + size > prefetch_scratch) {
+		ret = -ENOSPC;
+	} else if ((stream != NULL || dir == NULL) &&
+		   !cache_contains(prefetch_cache, path) &&
+		   cache_prefetch(prefetch_cache, path, tmppath, fd, tmpfd,
+				  rule, prefetch_workq) == 0) {
+		log_debug("    prefetch: \"%s\"\n", path);
+		file->stream = stream;
+		file->pos = pos;
+		file->explicit = (dir == NULL);
+		file->size = size;
+		TAILQ_INSERT_TAIL(&files, file, link);
+		file = NULL;
+		fd = tmpfd = -1;
+		stats_add(STATS_PREFETCH_ISSUED, 1);
+	}
+	UNLOCK(lock);
+	cache_unlock(prefetch_cache);
+
+cleanup:
+	if (fd != -1)
+		lazfs_finish_tmpfile(tmppath, &fd, &tmpfd);
+	if (file != NULL)
+		prefetch_freefile(file);
+
+	return ret;
+}
+
+/* Returns non-zero when path is dir or is under it, len is length of dir */
+static inline int
+prefetch_within(const char *path, const char *dir, size_t len)
+{
+	return strncmp(path, dir, len) == 0 &&
+	       (path[len] == '\0' || path[len] == '/');
+}
+
+/* State of prefetch of path, must be called with cache locked */
+static const char *
+prefetch_state(const char *path)
+{
+	laz_cachestat_t cstat;
+	int ret;
+
+	ret = cache_getprefetched(prefetch_cache, path, 0, &cstat);
+	if (ret == 0)
+		return "ready";
+	if (ret == -EBUSY)
+		return "pending";
+
+	return cache_contains(prefetch_cache, path) ? "open" : "none";
+}
+
+/* Requests prefetch of file path of a codec rule */
+static int
+prefetch_explicit(const char *path)
+{
+	prefetch_file_t *file;
+
+	/* File prefetched ahead of a stream is kept from now on */
+	LOCK(lock);
+	file = prefetch_findfile(path);
+	if (file != NULL) {
+		file->stream = NULL;
+		file->explicit = 1;
+	}
+	UNLOCK(lock);
+
+	return (file != NULL) ? 0 : prefetch_issue(path, 0, NULL, 0);
+}
+
+void
+lazfs_prefetch_start(laz_cache_t *cache, lazfs_workq_t *workq,
+		     unsigned int depth, off_t scratch)
+{
+	assert(cache != NULL);
+	assert(workq != NULL);
+
+	LOCK(lock);
+	prefetch_cache = cache;
+	prefetch_workq = workq;
+	prefetch_depth = (depth < PREFETCH_MAXDEPTH) ? depth : PREFETCH_MAXDEPTH;
+	prefetch_scratch = scratch;
+	UNLOCK(lock);
+
+	/* Files ahead of a stream are decompressed side by side */
+	lazfs_workq_setlimit(workq, LAZFS_WORKQ_PREFETCH, prefetch_depth);
+}
+
+void
+lazfs_prefetch_stop(void)
+{
+	prefetch_file_t *file;
+
+	LOCK(lock);
+	prefetch_depth = 0;
+	while (!TAILQ_EMPTY(&streams))
+		prefetch_dropstream(TAILQ_FIRST(&streams));
+	UNLOCK(lock);
+
+	/* Nobody else touches files now */
+	while (!TAILQ_EMPTY(&files)) {
+		file = TAILQ_FIRST(&files);
+		TAILQ_REMOVE(&files, file, link);
+		cache_lock(prefetch_cache);
+		prefetch_evict(file, 1);
+		cache_unlock(prefetch_cache);
+		prefetch_freefile(file);
+	}
+}
+
+void
+lazfs_prefetch_open(const char *path, pid_t pid, int hit)
+{
+	char dir[PATH_MAX], *paths[PREFETCH_MAXDEPTH];
+	unsigned int pos[PREFETCH_MAXDEPTH];
+	prefetch_stream_t *stream, *prev;
+	prefetch_file_t *file;
+	prefetch_list_t list;
+	const char *name;
+	uint64_t now;
+	unsigned int i, p, cur, n = 0;
+	size_t len;
+	int idx, ret;
+
+	if (prefetch_depth == 0 && !hit)
+		return;
+
+	if (hit)
+		stats_add(STATS_PREFETCH_HITS, 1);
+
+	name = strrchr(path, '/');
+	assert(name != NULL);
+	len = name - path;
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	name++;
+
+	now = stats_now();
+	LOCK(lock);
+	while ((prev = TAILQ_LAST(&streams, prefetch_streams)) != NULL &&
+	       prev->used + PREFETCH_IDLE < now)
+		prefetch_dropstream(prev);
+
+	if (hit) {
+		file = prefetch_findfile(path);
+		if (file != NULL) {
+			TAILQ_REMOVE(&files, file, link);
+			prefetch_freefile(file);
+		}
+	}
+
+	/* Explicitly prefetched file was opened */
+	if (prefetch_depth == 0)
+		goto unlock;
+
+	stream = prefetch_findstream(pid, dir);
+	if (stream == NULL) {
+		prefetch_newstream(pid, dir, name, now);
+		goto unlock;
+	}
+
+	TAILQ_REMOVE(&streams, stream, link);
+	TAILQ_INSERT_HEAD(&streams, stream, link);
+	stream->used = now;
+	if (hit && stream->depth < prefetch_depth)
+		stream->depth++;
+
+	/* List is read on the second open, single opens don't pay for it */
+	if (!stream->listed) {
+		UNLOCK(lock);
+		if (prefetch_readlist(dir, &list) != 0)
+			return;
+		LOCK(lock);
+
+		stream = prefetch_findstream(pid, dir);
+		if (stream == NULL || stream->listed) {
+			prefetch_freelist(&list);
+			goto unlock;
+		}
+		stream->list = list;
+		stream->listed = 1;
+		stream->last = prefetch_index(&stream->list, stream->lastname);
+		free(stream->lastname);
+		stream->lastname = NULL;
+	}
+
+	idx = prefetch_index(&stream->list, name);
+	prefetch_step(stream, idx);
+	if (idx < 0 || stream->run < PREFETCH_RUN || stream->depth == 0)
+		goto unlock;
+
+	cur = prefetch_pos(stream, idx);
+	for (p = cur + 1; p <= cur + stream->depth && p < stream->list.n;
+	     p++) {
+		name = stream->list.names[prefetch_at(stream, p)];
+		paths[n] = malloc(len + strlen(name) + 2);
+		if (paths[n] == NULL)
+			break;
+		sprintf(paths[n], "%s/%s", dir, name);
+		if (prefetch_findfile(paths[n]) != NULL) {
+			free(paths[n]);
+			continue;
+		}
+		pos[n++] = p;
+	}
+
+unlock:
+	UNLOCK(lock);
+
+	prefetch_reap();
+
+	ret = 0;
+	for (i = 0; i < n; i++) {
+		if (ret == 0)
+			ret = prefetch_issue(paths[i], pid, dir, pos[i]);
+		free(paths[i]);
+	}
+}
+
+void
+lazfs_prefetch_rename(const char *path, const char *newpath)
+{
+	prefetch_file_t *file;
+	const char *rest;
+	size_t len;
+	char *name;
+
+	len = strlen(path);
+	LOCK(lock);
+	TAILQ_FOREACH(file, &files, link) {
+		if (strncmp(file->path, path, len) != 0 ||
+		    (file->path[len] != '\0' && file->path[len] != '/'))
+			continue;
+
+		rest = file->path + len;
+		name = malloc(strlen(newpath) + strlen(rest) + 1);
+		if (name == NULL)
+			continue;
+
+		strcpy(name, newpath);
+		strcat(name, rest);
+		free(file->path);
+		file->path = name;
+	}
+	UNLOCK(lock);
+}
+
+void
+lazfs_prefetch_forget(const char *path)
+{
+	prefetch_file_t *file;
+
+	LOCK(lock);
+	file = prefetch_findfile(path);
+	if (file != NULL)
+		TAILQ_REMOVE(&files, file, link);
+	UNLOCK(lock);
+
+	if (file == NULL)
+		return;
+
+	/* It's out of files, so it can be waited for without the lock */
+	cache_lock(prefetch_cache);
+	prefetch_evict(file, 1);
+	cache_unlock(prefetch_cache);
+	prefetch_freefile(file);
+}
+
+int
+lazfs_prefetch_add(const char *path)
+{
+	char fpath[PATH_MAX], *child;
+	prefetch_list_t list;
+	struct stat statbuf;
+	unsigned int i;
+	size_t len;
+	int ret;
+
+	lazfs_fullpath(fpath, path);
+	if (lazfs_exec_hooks(fpath, NULL) != NULL) {
+		ret = prefetch_explicit(path);
+		goto reap;
+	}
+
+	if (stat(fpath, &statbuf) != 0)
+		return -errno;
+	if (!S_ISDIR(statbuf.st_mode))
+		return -EINVAL;
+
+	/* Root of the mount is "" in names of its files */
+	len = (strcmp(path, "/") != 0) ? strlen(path) : 0;
+	ret = prefetch_readlist((len != 0) ? path : "", &list);
+	if (ret != 0)
+		return ret;
+
+	for (i = 0; i < list.n; i++) {
+		child = malloc(len + strlen(list.names[i]) + 2);
+		if (child == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		memcpy(child, path, len);
+		sprintf(child + len, "/%s", list.names[i]);
+		ret = prefetch_explicit(child);
+		free(child);
+		if (ret != 0)
+			break;
+	}
+	prefetch_freelist(&list);
+
+reap:
+	prefetch_reap();
+
+	return ret;
+}
+
+int
+lazfs_prefetch_remove(const char *path)
+{
+	prefetch_file_t *file;
+	int found = 0;
+	size_t len;
+
+	len = (strcmp(path, "/") != 0) ? strlen(path) : 0;
+	LOCK(lock);
+	TAILQ_FOREACH(file, &files, link) {
+		if (!file->explicit || !prefetch_within(file->path, path, len))
+			continue;
+		/* Pending files are dropped by later reap */
+		file->explicit = 0;
+		found = 1;
+	}
+	UNLOCK(lock);
+
+	prefetch_reap();
+
+	return found ? 0 : -ENODATA;
+}
+
+int
+lazfs_prefetch_state(const char *path, char *buf, size_t size)
+{
+	char fpath[PATH_MAX], state[64];
+	unsigned int pending = 0, ready = 0;
+	prefetch_file_t *file;
+	struct stat statbuf;
+	const char *s;
+	size_t len;
+
+	prefetch_reap();
+
+	lazfs_fullpath(fpath, path);
+	if (lazfs_exec_hooks(fpath, NULL) != NULL) {
+		cache_lock(prefetch_cache);
+		snprintf(state, sizeof(state), "%s", prefetch_state(path));
+		cache_unlock(prefetch_cache);
+	} else if (stat(fpath, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+		len = (strcmp(path, "/") != 0) ? strlen(path) : 0;
+		cache_lock(prefetch_cache);
+		LOCK(lock);
+		TAILQ_FOREACH(file, &files, link) {
+			if (!file->explicit ||
+			    !prefetch_within(file->path, path, len))
+				continue;
+			s = prefetch_state(file->path);
+			if (strcmp(s, "ready") == 0)
+				ready++;
+			else if (strcmp(s, "pending") == 0)
+				pending++;
+		}
+		UNLOCK(lock);
+		cache_unlock(prefetch_cache);
+		snprintf(state, sizeof(state), "pending %u ready %u", pending,
+			 ready);
+	} else {
+		return -ENODATA;
+	}
+
+	len = strlen(state);
+	if (size == 0)
+		return len;
+	if (size < len)
+		return -ERANGE;
+	memcpy(buf, state, len);
+
+	return len;
+}
+
+int
+lazfs_prefetch_walk(int (*fn)(void *arg, const char *path, const char *state,
+			      int explicit),
+		    void *arg)
+{
+	prefetch_file_t *file;
+	int ret = 0;
+
+	cache_lock(prefetch_cache);
+	LOCK(lock);
+	TAILQ_FOREACH(file, &files, link) {
+		ret = fn(arg, file->path, prefetch_state(file->path),
+			 file->explicit);
+		if (ret != 0)
+			break;
+	}
+	UNLOCK(lock);
+	cache_unlock(prefetch_cache);
+
+	return ret;
+}
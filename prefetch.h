@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include "cache.h"
+#include "workq.h"
+#include <sys/types.h>
+
+/*
+ * Batch jobs usually open files of a directory one by one, in readdir or in
+ * sorted order. When a process opens files of one directory in such
+ * sequence, next files are decompressed ahead by low priority workq jobs
+ * (see cache_prefetch()), so their open doesn't wait for decompression.
+ *
+ * Every process starts with one file ahead, each prefetched file it opens
+ * adds one up to depth. When it skips a prefetched file or breaks the
+ * sequence, the number of files ahead is halved, unused files are dropped
+ * and a process which went down to zero must open exponentially more files
+ * in sequence before prefetch starts again. Nothing is prefetched while
+ * decompressed files (open ones included) allocate more than scratch bytes.
+ *
+ * Schedulers which know inputs of their next jobs can request prefetch of
+ * files explicitly, by PREFETCHATTR or by the control directory. Such files
+ * stay decompressed until they are opened, dropped or removed, even when
+ * prefetch of sequential readers is disabled.
+ */
+
+/*
+ * Virtual extended attribute of files and directories of the mount. Setting
+ * it (to any value) requests prefetch, getting it returns the state of
+ * prefetch (see lazfs_prefetch_state()) and removing it drops the files.
+ */
+#define PREFETCHATTR "user.lazfs.prefetch"
+
+/* Enables prefetch of at most depth files ahead, zero disables it */
+void
+lazfs_prefetch_start(laz_cache_t *cache, lazfs_workq_t *workq,
+		     unsigned int depth, off_t scratch);
+
+/* Disables prefetch and drops all prefetched files, waits for them */
+void
+lazfs_prefetch_stop(void);
+
+/*
+ * Notes that process pid opened path of a codec rule, hit is non-zero when
+ * the file was prefetched (see laz_cachestat_t). Starts prefetch of next
+ * files when the process reads the directory sequentially. Must be called
+ * with cache unlocked.
+ */
+void
+lazfs_prefetch_open(const char *path, pid_t pid, int hit);
+
+/*
+ * Follows rename of path (file or directory) to newpath, like
+ * cache_rename(). Must be called with cache locked.
+ */
+void
+lazfs_prefetch_rename(const char *path, const char *newpath);
+
+/* Drops prefetched file path which is being removed, cache unlocked */
+void
+lazfs_prefetch_forget(const char *path);
+
+/*
+ * Requests prefetch of path, a file of a codec rule or a directory whose
+ * files (not subdirectories) are prefetched in readdir order. Returns
+ * immediately, 0 when decompression was queued or wasn't needed, -ENOSPC
+ * when scratch space ran out (files before it are queued), -EINVAL when
+ * path isn't a file of a codec rule nor a directory or -errno.
+ */
+int
+lazfs_prefetch_add(const char *path);
+
+/*
+ * Drops files of path (file or directory) requested by lazfs_prefetch_add()
+ * which nobody opened, files still being decompressed are dropped once they
+ * are ready. Returns 0 or -ENODATA when there was no such file.
+ */
+int
+lazfs_prefetch_remove(const char *path);
+
+/*
+ * Writes state of prefetch of path to buf like getxattr(2): "none",
+ * "pending" (being decompressed), "ready" or "open" (open or taken over by
+ * an open) for a file, "pending M ready N" with counts of explicitly
+ * requested files for a directory. Returns length of the state, -ERANGE when
+ * size isn't enough or -ENODATA when path is neither.
+ */
+int
+lazfs_prefetch_state(const char *path, char *buf, size_t size);
+
+/*
+ * Calls fn for every prefetched file with its state and whether it was
+ * requested explicitly, stops when fn returns non-zero and returns it. Cache
+ * is locked during the walk.
+ */
+int
+lazfs_prefetch_walk(int (*fn)(void *arg, const char *path, const char *state,
+			      int explicit),
+		    void *arg);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Static tracepoints (USDT) of provider "lazfs". When sys/sdt.h is available
+ * every probe compiles to a single nop and arguments are only placed into
+ * registers, probes are enabled at runtime by bpftrace, perf or SystemTap.
+ * Without sys/sdt.h probes compile to nothing.
+ *
+ * Probes (double underscore is shown as dash by tracing tools):
+ *
+ * op__start(op, path)			FUSE operation starts
+ * op__done(op, path, ret)		FUSE operation returns
+ * cache__lock__start(cache)		thread starts to acquire cache lock
+ * cache__lock__done(cache)		cache lock acquired
+ * cache__add(name, fd, tmpfd)		file is added to the cache
+ * cache__wait__start(name)		thread starts to wait for file
+ * cache__wait__done(name)		file became ready
+ * cache__finish__start(name)		job finishing file (compression) queued
+ * cache__finish__done(name, ret)	job finishing file completed
+ * workq__queue(job, lowprio)		job is queued
+ * workq__job__start(job, waitns)	worker starts to execute job
+ * workq__job__done(job, ret)		worker finished job
+ * codec__start(compress, sfd, dfd)	laszip (de)compression of a file starts
+ * codec__chunk(compress, index, points) chunk of points was processed
+ * codec__done(compress, ret, points)	laszip (de)compression finished
+ * lazfile__chunk(first, count, size)	one chunk was compressed in place
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define LAZFS_PROBE1(name, a) DTRACE_PROBE1(lazfs, name, a)
+#define LAZFS_PROBE2(name, a, b) DTRACE_PROBE2(lazfs, name, a, b)
+#define LAZFS_PROBE3(name, a, b, c) DTRACE_PROBE3(lazfs, name, a, b, c)
+#else
+#define LAZFS_PROBE1(name, a) do { } while (0)
+#define LAZFS_PROBE2(name, a, b) do { } while (0)
+#define LAZFS_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,759 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains bbox and level of detail queries. Result of a query is
+ * made when it's looked up, because stat() must return its size, and it's
+ * kept in unlinked temporary file while the backend file doesn't change.
+ * Chunks which can hold points in the box are found via spatial index (see
+ * lazindex.h) and only they are decompressed. When .laz has no valid index,
+ * it's decompressed whole and the index is built for next queries. Level of
+ * detail of .laz in LOD order (see reorder.h) decompresses only the first
+ * points of every chunk, other files are decompressed whole and thinned.
+ * Queries see the backend file, i.e. content of the LAS file as it was last
+ * stored.
+ */
+
+#define _GNU_SOURCE /* st_mtim */
+
+#include "params.h"
+#include "codec.h"
+#include "lazfile.h"
+#include "lazindex.h"
+#include "log.h"
+#include "query.h"
+#include "reorder.h"
+#include "stats.h"
+#include "tier.h"
+#include "util.h"
+#include <assert.h>
+#include <attr/xattr.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+/* Number of results kept when no open file refers to them */
+#define QUERY_RESULTS 16
+
+/* Number of points filtered at once */
+#define QUERY_BATCH 4096
+
+typedef struct query_result query_result_t;
+struct query_result {
+	char *path; /* Virtual path */
+	struct stat cstat; /* Backend file the result was made of */
+	int fd; /* Unlinked temporary file with the result */
+	off_t size;
+	int refs; /* Open files and lookups in progress */
+	char ready; /* Result is made, fd and size are valid */
+	char detached; /* Not in results, freed by the last reference */
+	pthread_cond_t cond; /* Signalled when result gets ready */
+	TAILQ_ENTRY(query_result) link;
+};
+
+/* Results, most recently used first, protected by lock */
+static TAILQ_HEAD(query_results, query_result) results =
+	TAILQ_HEAD_INITIALIZER(results);
+static unsigned int nresults;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct query_box {
+	double min[2];
+	double max[2];
+	unsigned int lod; /* Level of detail, 0 for bbox query */
+} query_box_t;
+
+/* Result being made */
+typedef struct query_out {
+	int fd;
+	unsigned char *prefix; /* Header and VLRs */
+	lasheader_t hdr;
+	off_t pos; /* End of written points */
+	uint64_t npoints;
+	uint64_t returns[15]; /* Number of points by return */
+	double min[3];
+	double max[3];
+} query_out_t;
+
+/*
+ * Splits query path into path of the LAS file and box. Returns 0, -ENOENT
+ * if path isn't a query or -EINVAL if box or level is malformed.
+ */
+static int
+query_parse(const char *path, char vpath[PATH_MAX], query_box_t *box)
+{
+	const char *name, *at, *lod;
+	unsigned long level;
+	double v[4];
+	char *end;
+	int i;
+
+	name = strrchr(path, '/');
+	if (name == NULL)
+		name = path;
+	at = strstr(name, QUERY_BBOX);
+	lod = strstr(name, QUERY_LOD);
+	if (at == NULL || (lod != NULL && lod < at))
+		at = lod;
+	if (at == NULL || at - path >= PATH_MAX)
+		return -ENOENT;
+
+	memcpy(vpath, path, at - path);
+	vpath[at - path] = '\0';
+
+	if (box == NULL)
+		return 0;
+
+	memset(box, 0, sizeof(*box));
+	if (at == lod) {
+		at += strlen(QUERY_LOD);
+		errno = 0;
+		level = strtoul(at, &end, 10);
+		if (errno != 0 || end == at || *end != '\0' || level < 1 ||
+		    level > LAZFS_LOD_LEVELS)
+			return -EINVAL;
+		box->lod = level;
+		return 0;
+	}
+
+	at += strlen(QUERY_BBOX);
+	for (i = 0; i < 4; i++) {
+		v[i] = strtod(at, &end);
+		if (end == at || *end != ((i < 3) ? ',' : '\0'))
+			return -EINVAL;
+		at = end + 1;
+	}
+
+	if (!(v[0] <= v[2] && v[1] <= v[3]))
+		return -EINVAL;
+
+	box->min[0] = v[0];
+	box->min[1] = v[1];
+	box->max[0] = v[2];
+	box->max[1] = v[3];
+
+	return 0;
+}
+
+int
+query_lookup(const char *path)
+{
+	const codec_rule_t *rule;
+	char vpath[PATH_MAX];
+
+	if (query_parse(path, vpath, NULL) != 0)
+		return 0;
+
+	rule = codec_match(vpath);
+
+	return rule != NULL && (rule->codec->flags & CODEC_LAS);
+}
+
+static void
+query_setdouble(unsigned char *p, double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof(u));
+	setle64(p, u);
+}
+
+/*
+ * Appends points of lasfd which lie in box to out. Level of detail queries
+ * keep every stride-th point instead.
+ */
+static int
+query_filter(query_out_t *out, int lasfd, const query_box_t *box,
+	     uint64_t stride)
+{
+	unsigned char *buf = NULL, *kept = NULL, *p;
+	lasheader_t hdr;
+	uint64_t done, n, j;
+	size_t len;
+	ssize_t r;
+	double v[3];
+	int axis, ret, ret_no;
+
+	ret = lasheader_read(lasfd, &hdr);
+	if (ret != 0)
+		return ret;
+
+	/* Every point format begins with X, Y, Z, intensity and return bits */
+	if (hdr.record_length < 15)
+		return -EINVAL;
+
+	if (out->prefix == NULL) {
+		ret = lazfile_readprefix(lasfd, &out->hdr, &out->prefix);
+		if (ret != 0)
+			return ret;
+		out->pos = out->hdr.data_offset;
+	} else if (hdr.point_format != out->hdr.point_format ||
+		   hdr.record_length != out->hdr.record_length)
+		return -EINVAL;
+
+	buf = malloc((size_t) QUERY_BATCH * hdr.record_length);
+	kept = malloc((size_t) QUERY_BATCH * hdr.record_length);
+	if (buf == NULL || kept == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	for (done = 0; done < hdr.npoints; done += n) {
+		n = hdr.npoints - done;
+		if (n > QUERY_BATCH)
+			n = QUERY_BATCH;
+
+		r = pread(lasfd, buf, n * hdr.record_length,
+			  hdr.data_offset + done * hdr.record_length);
+		if (r < 0) {
+			ret = -errno;
+			goto cleanup;
+		}
+		if ((uint64_t) r != n * hdr.record_length) {
+			ret = -EINVAL;
+			goto cleanup;
+		}
+
+		len = 0;
+		for (j = 0; j < n; j++) {
+			if ((done + j) % stride != 0)
+				continue;
+
+			p = buf + j * hdr.record_length;
+			for (axis = 0; axis < 3; axis++)
+				v[axis] = (int32_t) le32(p + 4 * axis) *
+					  hdr.scale[axis] + hdr.offset[axis];
+			if (box->lod == 0 &&
+			    (v[0] < box->min[0] || v[0] > box->max[0] ||
+			     v[1] < box->min[1] || v[1] > box->max[1]))
+				continue;
+
+			for (axis = 0; axis < 3; axis++) {
+				if (out->npoints == 0 || v[axis] < out->min[axis])
+					out->min[axis] = v[axis];
+				if (out->npoints == 0 || v[axis] > out->max[axis])
+					out->max[axis] = v[axis];
+			}
+
+			/* Formats 6 and later have four bits of return number */
+			ret_no = p[14] & ((hdr.point_format < 6) ? 0x07 : 0x0f);
+			if (ret_no > 0)
+				out->returns[ret_no - 1]++;
+
+			out->npoints++;
+			memcpy(kept + len, p, hdr.record_length);
+			len += hdr.record_length;
+		}
+
+		if (len != 0 && pwrite(out->fd, kept, len, out->pos) !=
+				(ssize_t) len) {
+			ret = -errno;
+			goto cleanup;
+		}
+		out->pos += len;
+	}
+
+cleanup:
+	free(kept);
+	free(buf);
+
+	return ret;
+}
+
+/* Writes header of the result, it describes points which were kept */
+static int
+query_finish(query_out_t *out)
+{
+	unsigned char *p = out->prefix;
+	char legacy;
+	int i;
+
+	/* LAS 1.4 formats and too many points have only 64bit counts */
+	legacy = out->hdr.point_format < 6 && out->npoints <= UINT32_MAX;
+	setle32(p + 107, legacy ? out->npoints : 0);
+	for (i = 0; i < 5; i++)
+		setle32(p + 111 + 4 * i, legacy ? out->returns[i] : 0);
+
+	/* Maximum and minimum are interleaved (max X, min X, max Y...) */
+	for (i = 0; i < 3; i++) {
+		query_setdouble(p + 179 + 16 * i, out->max[i]);
+		query_setdouble(p + 187 + 16 * i, out->min[i]);
+	}
+
+	/* Extended VLRs after points are not copied */
+	if (out->hdr.header_size >= LASHEADER_MAXSIZE &&
+	    (out->hdr.version_major > 1 || out->hdr.version_minor >= 4)) {
+		setle64(p + 235, 0);
+		setle32(p + 243, 0);
+		setle64(p + 247, out->npoints);
+		for (i = 0; i < 15; i++)
+			setle64(p + 255 + 8 * i, out->returns[i]);
+	}
+
+	if (pwrite(out->fd, p, out->hdr.data_offset, 0) !=
+	    (ssize_t) out->hdr.data_offset)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Decompresses chunk i of lazfd and appends its points in box to out. Only
+ * the first points of chunk in LOD order are decompressed for level of
+ * detail queries.
+ */
+static int
+query_chunk(query_out_t *out, int lazfd, const unsigned char *laz,
+	    const lasheader_t *lazhdr, const lazfile_chunks_t *chunks,
+	    uint32_t chunk_size, uint32_t i, const query_box_t *box)
+{
+	uint64_t count, stride;
+	int lasfd, ret;
+
+	count = lazhdr->npoints - (uint64_t) i * chunk_size;
+	if (count > chunk_size)
+		count = chunk_size;
+
+	if (box->lod != 0) {
+		stride = (uint64_t) 1 << (2 * box->lod);
+		count = (count + stride - 1) / stride;
+	}
+
+	lasfd = lazfs_tmpfile();
+	if (lasfd < 0)
+		return lasfd;
+
+	ret = lazfile_decodechunk(lazfd, laz, lazhdr, chunks, i, count, lasfd);
+	if (ret == 0)
+		ret = query_filter(out, lasfd, box, 1);
+
+	close(lasfd);
+	stats_add(STATS_QUERY_CHUNKS, 1);
+
+	return ret;
+}
+
+/*
+ * Returns number of points per chunk of .laz fd in LOD order or 0 if it's
+ * not in LOD order.
+ */
+static uint32_t
+query_lodchunk(int fd)
+{
+	char buf[16], *end;
+	unsigned long chunk;
+	ssize_t len;
+
+	len = fgetxattr(fd, LODATTR, buf, sizeof(buf) - 1);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	chunk = strtoul(buf, &end, 10);
+	if (*end != '\0' || chunk > UINT32_MAX)
+		return 0;
+
+	return chunk;
+}
+
+/*
+ * Makes result of query box over .laz cpath. Sets *fdp to unlinked file with
+ * the result and *sizep to its size. Returns 0 or -errno.
+ */
+static int
+query_make(const char *cpath, const query_box_t *box, int *fdp, off_t *sizep)
+{
+	lasheader_t lazhdr;
+	unsigned char *laz = NULL;
+	lazfile_laszip_t zip;
+	lazfile_chunks_t chunks = LAZFILE_CHUNKS_INIT;
+	lazindex_t index = LAZINDEX_INIT;
+	query_out_t out;
+	char ipath[PATH_MAX], chunked;
+	int32_t rmin[2], rmax[2];
+	uint32_t i;
+	int fd, lazfd = -1, lasfd = -1, ret;
+
+	memset(&out, 0, sizeof(out));
+	out.fd = -1;
+
+	fd = open(cpath, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	/* Cold file is decompressed aside, it stays tiered */
+	ret = lazfs_tier_expand(cpath, fd, &lazfd);
+	if (ret < 0)
+		goto cleanup;
+	if (ret == 0)
+		lazfd = dup(fd);
+	if (lazfd == -1) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	out.fd = lazfs_tmpfile();
+	if (out.fd < 0) {
+		ret = out.fd;
+		goto cleanup;
+	}
+
+	ret = lazfile_readprefix(lazfd, &lazhdr, &laz);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = lazindex_path(ipath, cpath);
+	if (ret != 0)
+		goto cleanup;
+
+	chunked = lazfile_findlaszip(laz, &lazhdr, &zip) == 0 &&
+		  lazfile_readchunks(lazfd, &zip, lazhdr.data_offset,
+				     &chunks) == 0 &&
+		  chunks.nchunks != 0;
+	if (box->lod != 0 && chunked && query_lodchunk(fd) == zip.chunk_size) {
+		for (i = 0; i < chunks.nchunks; i++) {
+			ret = query_chunk(&out, lazfd, laz, &lazhdr, &chunks,
+					  zip.chunk_size, i, box);
+			if (ret != 0)
+				goto cleanup;
+		}
+	} else if (box->lod == 0 && chunked &&
+		   lazindex_read(ipath, &index) == 0 &&
+		   lazindex_check(&index, &lazhdr, &zip, &chunks) == 0) {
+		lazindex_range(&lazhdr, box->min, box->max, rmin, rmax);
+		for (i = 0; i < chunks.nchunks; i++) {
+			if (!lazindex_intersects(&index, i, rmin, rmax)) {
+				stats_add(STATS_QUERY_SKIPPED, 1);
+				continue;
+			}
+			ret = query_chunk(&out, lazfd, laz, &lazhdr, &chunks,
+					  zip.chunk_size, i, box);
+			if (ret != 0)
+				goto cleanup;
+		}
+
+		/* Header and VLRs of the result come from decompressed chunk */
+		if (out.prefix == NULL) {
+			ret = query_chunk(&out, lazfd, laz, &lazhdr, &chunks,
+					  zip.chunk_size, 0, box);
+			if (ret != 0)
+				goto cleanup;
+		}
+	} else if (box->lod != 0) {
+		log_debug("query_make: thinning whole \"%s\"\n", cpath);
+
+		lasfd = lazfs_tmpfile();
+		if (lasfd < 0) {
+			ret = lasfd;
+			goto cleanup;
+		}
+
+		ret = lazfs_decompress(lazfd, lasfd);
+		if (ret == 0)
+			ret = query_filter(&out, lasfd, box,
+					   (uint64_t) 1 << (2 * box->lod));
+		if (ret != 0)
+			goto cleanup;
+	} else {
+		log_debug("query_make: indexing \"%s\"\n", cpath);
+
+		lasfd = lazfs_tmpfile();
+		if (lasfd < 0) {
+			ret = lasfd;
+			goto cleanup;
+		}
+
+		ret = lazfs_decompress(lazfd, lasfd);
+		if (ret != 0)
+			goto cleanup;
+
+		/* Index is optional, the query doesn't fail without it */
+		lazindex_free(&index);
+		if (chunked && lazindex_build(lasfd, lazfd, &index, NULL) == 0 &&
+		    (ret = lazindex_write(&index, ipath)) != 0)
+			log_error("query_make: can't store index of \"%s\": "
+				  "%s\n", cpath, strerror(-ret));
+
+		ret = query_filter(&out, lasfd, box, 1);
+		if (ret != 0)
+			goto cleanup;
+	}
+
+	ret = query_finish(&out);
+	if (ret == 0) {
+		*fdp = out.fd;
+		*sizep = out.pos;
+		out.fd = -1;
+	}
+
+cleanup:
+	lazindex_free(&index);
+	lazfile_freechunks(&chunks);
+	free(out.prefix);
+	free(laz);
+	if (out.fd >= 0)
+		close(out.fd);
+	if (lasfd >= 0)
+		close(lasfd);
+	if (lazfd != -1)
+		close(lazfd);
+	close(fd);
+
+	return ret;
+}
+
+static void
+query_free(query_result_t *r)
+{
+	if (r->fd != -1)
+		close(r->fd);
+	pthread_cond_destroy(&r->cond);
+	free(r->path);
+	free(r);
+}
+
+/* Removes result from results, it's freed when unused. Lock must be held */
+static void
+query_detach(query_result_t *r)
+{
+	TAILQ_REMOVE(&results, r, link);
+	nresults--;
+
+	if (r->refs == 0)
+		query_free(r);
+	else
+		r->detached = 1;
+}
+
+/* Drops reference and unused results over limit. Lock must be held */
+static void
+query_unref(query_result_t *r)
+{
+	query_result_t *prev;
+
+	assert(r->refs > 0);
+
+	if (--r->refs == 0 && r->detached)
+		query_free(r);
+
+	for (r = TAILQ_LAST(&results, query_results);
+	     r != NULL && nresults > QUERY_RESULTS; r = prev) {
+		prev = TAILQ_PREV(r, query_results, link);
+		if (r->refs == 0)
+			query_detach(r);
+	}
+}
+
+/* Returns non-zero if backend file is the one result was made of */
+static int
+query_unchanged(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	       a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Returns referenced result of query path in *resultp, makes it if there is
+ * no valid one. Returns 0 or -errno.
+ */
+static int
+query_get(const char *path, query_result_t **resultp)
+{
+	char vpath[PATH_MAX], fpath[PATH_MAX], cpath[PATH_MAX];
+	const codec_rule_t *rule;
+	query_result_t *r;
+	query_box_t box;
+	struct stat st;
+	off_t size = 0;
+	int fd = -1, ret;
+
+	ret = query_parse(path, vpath, &box);
+	if (ret != 0)
+		return -ENOENT;
+
+	lazfs_fullpath(fpath, vpath);
+	rule = lazfs_exec_hooks(fpath, cpath);
+	if (rule == NULL || !(rule->codec->flags & CODEC_LAS))
+		return -ENOENT;
+
+	if (stat(cpath, &st) != 0)
+		return -errno;
+
+	LOCK(lock);
+again:
+	TAILQ_FOREACH(r, &results, link) {
+		if (strcmp(r->path, path) == 0)
+			break;
+	}
+
+	if (r != NULL && !r->ready) {
+		/* Somebody is making it, it might be stale once ready */
+		r->refs++;
+		while (!r->ready)
+			WAIT(r->cond, lock);
+		query_unref(r);
+		goto again;
+	}
+
+	if (r != NULL && query_unchanged(&r->cstat, &st)) {
+		r->refs++;
+		TAILQ_REMOVE(&results, r, link);
+		TAILQ_INSERT_HEAD(&results, r, link);
+		UNLOCK(lock);
+		*resultp = r;
+		return 0;
+	}
+
+	if (r != NULL)
+		query_detach(r);
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL || (r->path = strdup(path)) == NULL) {
+		free(r);
+		UNLOCK(lock);
+		return -ENOMEM;
+	}
+	r->cstat = st;
+	r->fd = -1;
+	r->refs = 1;
+	pthread_cond_init(&r->cond, NULL);
+	TAILQ_INSERT_HEAD(&results, r, link);
+	nresults++;
+	UNLOCK(lock);
+
+	log_debug("query_get: making \"%s\"\n", path);
+	ret = query_make(cpath, &box, &fd, &size);
+	if (ret != 0)
+		log_error("query_get: \"%s\": %s\n", path, strerror(-ret));
+
+	LOCK(lock);
+	r->fd = fd;
+	r->size = size;
+	r->ready = 1;
+	pthread_cond_broadcast(&r->cond);
+	if (ret != 0) {
+		query_detach(r);
+		query_unref(r);
+	} else
+		*resultp = r;
+	UNLOCK(lock);
+
+	return ret;
+}
+
+static void
+query_put(query_result_t *r)
+{
+	LOCK(lock);
+	query_unref(r);
+	UNLOCK(lock);
+}
+
+static void
+query_stat(const query_result_t *r, struct stat *statbuf)
+{
+	*statbuf = r->cstat;
+	statbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	statbuf->st_nlink = 1;
+	statbuf->st_size = r->size;
+	statbuf->st_blocks = (r->size + 511) / 512;
+}
+
+int
+query_getattr(const char *path, struct stat *statbuf)
+{
+	query_result_t *r;
+	int ret;
+
+	assert(statbuf != NULL);
+
+	ret = query_get(path, &r);
+	if (ret != 0)
+		return ret;
+
+	query_stat(r, statbuf);
+	query_put(r);
+
+	return 0;
+}
+
+int
+query_fgetattr(struct fuse_file_info *fi, struct stat *statbuf)
+{
+	assert(statbuf != NULL);
+
+	query_stat((query_result_t *) (uintptr_t) fi->fh, statbuf);
+
+	return 0;
+}
+
+int
+query_access(const char *path, int mask)
+{
+	char vpath[PATH_MAX], fpath[PATH_MAX], cpath[PATH_MAX];
+
+	if (mask & W_OK)
+		return -EACCES;
+
+	if (query_parse(path, vpath, NULL) != 0)
+		return -ENOENT;
+
+	lazfs_fullpath(fpath, vpath);
+	if (lazfs_exec_hooks(fpath, cpath) == NULL)
+		return -ENOENT;
+
+	return (access(cpath, mask) == 0) ? 0 : -errno;
+}
+
+int
+query_open(const char *path, struct fuse_file_info *fi)
+{
+	query_result_t *r;
+	int ret;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	ret = query_get(path, &r);
+	if (ret != 0)
+		return ret;
+
+	fi->fh = (uintptr_t) r;
+
+	return 0;
+}
+
+int
+query_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset)
+{
+	query_result_t *r = (query_result_t *) (uintptr_t) fi->fh;
+	ssize_t ret;
+
+	ret = pread(r->fd, buf, size, offset);
+
+	return (ret < 0) ? -errno : ret;
+}
+
+int
+query_release(struct fuse_file_info *fi)
+{
+	query_put((query_result_t *) (uintptr_t) fi->fh);
+
+	return 0;
+}
+
+void
+query_destroy(void)
+{
+	LOCK(lock);
+	while (!TAILQ_EMPTY(&results))
+		query_detach(TAILQ_FIRST(&results));
+	UNLOCK(lock);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _QUERY_H_
+#define _QUERY_H_
+
+#include "params.h"
+#include <sys/stat.h>
+
+/*
+ * Virtual read-only file "tile.las@bbox=x0,y0,x1,y1" is LAS file "tile.las"
+ * with only points whose X and Y lie within the box, "tile.las@lod=N" keeps
+ * every 4^N-th point (level of detail N, 1 - LAZFS_LOD_LEVELS, see
+ * reorder.h). Only LAS codecs are supported, the file is not listed by
+ * readdir.
+ */
+#define QUERY_BBOX "@bbox="
+#define QUERY_LOD "@lod="
+
+/* Returns non-zero if path is a query */
+int
+query_lookup(const char *path);
+
+/*
+ * Functions below implement FUSE operations of queries, they return 0 or
+ * -errno. Open query keeps its result in fi->fh.
+ */
+int
+query_getattr(const char *path, struct stat *statbuf);
+
+int
+query_fgetattr(struct fuse_file_info *fi, struct stat *statbuf);
+
+int
+query_access(const char *path, int mask);
+
+int
+query_open(const char *path, struct fuse_file_info *fi);
+
+/* Returns number of bytes read */
+int
+query_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset);
+
+int
+query_release(struct fuse_file_info *fi);
+
+/* Frees kept results, all queries must be released */
+void
+query_destroy(void);
+
+#endif
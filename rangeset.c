@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains set of byte ranges used to track modified parts of
+ * files.
+ */
+
+#include "rangeset.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Merges range i with range i + 1 */
+static void
+rangeset_merge(lazfs_rangeset_t *set, int i)
+{
+	assert(i + 1 < set->nranges);
+
+	if (set->ranges[i + 1].end > set->ranges[i].end)
+		set->ranges[i].end = set->ranges[i + 1].end;
+
+	memmove(&set->ranges[i + 1], &set->ranges[i + 2],
+		(set->nranges - i - 2) * sizeof(*set->ranges));
+	set->nranges--;
+}
+
+/* Merges two ranges with the smallest gap between them */
+static void
+rangeset_shrink(lazfs_rangeset_t *set)
+{
+	off_t gap, mingap = -1;
+	int i, mini = 0;
+
+	for (i = 0; i + 1 < set->nranges; i++) {
+		gap = set->ranges[i + 1].start - set->ranges[i].end;
+		if (mingap == -1 || gap < mingap) {
+			mingap = gap;
+			mini = i;
+		}
+	}
+
+	rangeset_merge(set, mini);
+}
+
+int
+rangeset_add(lazfs_rangeset_t *set, off_t start, off_t end)
+{
+	lazfs_range_t *ranges;
+	int i;
+
+	assert(set != NULL);
+	assert(start <= end);
+
+	if (start == end)
+		return 0;
+
+	if (set->nranges == set->allocated) {
+		i = set->allocated ? set->allocated * 2 : 8;
+		ranges = realloc(set->ranges, (i + 1) * sizeof(*ranges));
+		if (ranges == NULL)
+			return -ENOMEM;
+		set->ranges = ranges;
+		set->allocated = i;
+	}
+
+	/* Find first range which ends at or after start */
+	for (i = 0; i < set->nranges && set->ranges[i].end < start; i++)
+		;
+
+	if (i < set->nranges && set->ranges[i].start <= end) {
+		/* Overlaps or touches range i */
+		if (start < set->ranges[i].start)
+			set->ranges[i].start = start;
+		if (end > set->ranges[i].end)
+			set->ranges[i].end = end;
+	} else {
+		memmove(&set->ranges[i + 1], &set->ranges[i],
+			(set->nranges - i) * sizeof(*set->ranges));
+		set->ranges[i].start = start;
+		set->ranges[i].end = end;
+		set->nranges++;
+	}
+
+	/* New end can reach following ranges */
+	while (i + 1 < set->nranges &&
+	       set->ranges[i + 1].start <= set->ranges[i].end)
+		rangeset_merge(set, i);
+
+	if (set->nranges > RANGESET_MAX)
+		rangeset_shrink(set);
+
+	return 0;
+}
+
+off_t
+rangeset_end(const lazfs_rangeset_t *set)
+{
+	assert(set != NULL);
+
+	return set->nranges ? set->ranges[set->nranges - 1].end : 0;
+}
+
+char
+rangeset_intersects(const lazfs_rangeset_t *set, off_t start, off_t end)
+{
+	int i;
+
+	assert(set != NULL);
+
+	for (i = 0; i < set->nranges && set->ranges[i].start < end; i++) {
+		if (set->ranges[i].end > start)
+			return 1;
+	}
+
+	return 0;
+}
+
+void
+rangeset_clear(lazfs_rangeset_t *set)
+{
+	assert(set != NULL);
+
+	free(set->ranges);
+	set->ranges = NULL;
+	set->nranges = 0;
+	set->allocated = 0;
+}
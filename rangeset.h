@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _RANGESET_H_
+#define _RANGESET_H_
+
+#include <sys/types.h>
+
+/* Maximum number of ranges, closest ranges are merged when exceeded */
+#define RANGESET_MAX 256
+
+/* Half-open byte range [start, end) */
+typedef struct lazfs_range {
+	off_t start;
+	off_t end;
+} lazfs_range_t;
+
+/* Sorted set of non-overlapping ranges */
+typedef struct lazfs_rangeset {
+	lazfs_range_t *ranges;
+	int nranges;
+	int allocated;
+} lazfs_rangeset_t;
+
+#define LAZFS_RANGESET_INIT { NULL, 0, 0 }
+
+/*
+ * Adds range to the set. Set never holds more than RANGESET_MAX ranges, so
+ * it can cover more than what was added. Returns 0 or -errno.
+ */
+int
+rangeset_add(lazfs_rangeset_t *set, off_t start, off_t end);
+
+/* Returns end of the last range or zero for empty set */
+off_t
+rangeset_end(const lazfs_rangeset_t *set);
+
+/* Returns non-zero if set intersects range [start, end) */
+char
+rangeset_intersects(const lazfs_rangeset_t *set, off_t start, off_t end);
+
+/* Frees all ranges */
+void
+rangeset_clear(lazfs_rangeset_t *set);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains the raw directory, see raw.h. Paths are mapped to the
+ * backend directory, no codec is involved and nothing is cached by lazfs:
+ * reads are pread() of the backend file opened by raw_open(), so they are
+ * served from page cache of the backend filesystem shared with all other
+ * readers of the file. Only tiered files are decompressed by their tier
+ * codec into unlinked temporary file when opened, so they read as .laz.
+ */
+
+#include "params.h"
+#include "log.h"
+#include "raw.h"
+#include "tier.h"
+#include "util.h"
+#include <assert.h>
+#include <attr/xattr.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+int
+raw_lookup(const char *path, char bpath[PATH_MAX])
+{
+	size_t len = strlen(RAW_DIR);
+
+	if (!LAZFS_DATA->raw || strncmp(path, RAW_DIR, len) != 0 ||
+	    (path[len] != '\0' && path[len] != '/'))
+		return 0;
+
+	/* RAW_DIR itself is the backend root */
+	lazfs_fullpath(bpath, (path[len] != '\0') ? path + len : "/");
+
+	return 1;
+}
+
+int
+raw_getattr(const char *bpath, struct stat *statbuf)
+{
+	off_t size;
+
+	assert(statbuf != NULL);
+
+	if (lstat(bpath, statbuf) != 0)
+		return -errno;
+
+	/* Tiered file has size of the .laz it reads as, see raw_open() */
+	if (S_ISREG(statbuf->st_mode) &&
+	    lgetxattr(bpath, TIERATTR, NULL, 0) >= 0) {
+		if (lgetxattr(bpath, TIERSIZEATTR, &size, sizeof(size)) !=
+		    sizeof(size))
+			return -EIO;
+		statbuf->st_size = size;
+	}
+
+	return 0;
+}
+
+int
+raw_fgetattr(struct fuse_file_info *fi, struct stat *statbuf)
+{
+	assert(statbuf != NULL);
+
+	return (fstat(fi->fh, statbuf) == 0) ? 0 : -errno;
+}
+
+int
+raw_readlink(const char *bpath, char *link, size_t size)
+{
+	ssize_t len;
+
+	if (size == 0)
+		return -EINVAL;
+
+	len = readlink(bpath, link, size - 1);
+	if (len < 0)
+		return -errno;
+	link[len] = '\0';
+
+	return 0;
+}
+
+int
+raw_access(const char *bpath, int mask)
+{
+	if (mask & W_OK)
+		return -EROFS;
+
+	return (access(bpath, mask) == 0) ? 0 : -errno;
+}
+
+/*
+ * Replaces *fdp of tiered backend file bpath by its expanded copy, which
+ * gets mode and times of the backend file for raw_fgetattr(). Returns 0 or
+ * -errno.
+ */
+static int
+raw_expand(const char *bpath, int *fdp)
+{
+	struct timespec times[2];
+	struct stat st;
+	int newfd, ret;
+
+	ret = lazfs_tier_expand(bpath, *fdp, &newfd);
+	if (ret <= 0)
+		return ret;
+
+	if (fstat(*fdp, &st) != 0 || fchmod(newfd, st.st_mode & 07777) != 0) {
+		ret = -errno;
+		close(newfd);
+		return ret;
+	}
+
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (futimens(newfd, times) != 0)
+		log_debug("raw_expand: futimens failed: %s\n", strerror(errno));
+
+	close(*fdp);
+	*fdp = newfd;
+
+	return 0;
+}
+
+int
+raw_open(const char *bpath, struct fuse_file_info *fi)
+{
+	int fd, ret;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+		return -EROFS;
+
+	fd = open(bpath, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	/* Cold file is decompressed aside, it stays tiered */
+	ret = raw_expand(bpath, &fd);
+	if (ret != 0) {
+		close(fd);
+		return ret;
+	}
+
+	log_debug("raw_open: \"%s\" fd %d\n", bpath, fd);
+	fi->fh = fd;
+
+	return 0;
+}
+
+int
+raw_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset)
+{
+	ssize_t ret;
+
+	ret = pread(fi->fh, buf, size, offset);
+
+	return (ret < 0) ? -errno : ret;
+}
+
+int
+raw_release(struct fuse_file_info *fi)
+{
+	return (close(fi->fh) == 0) ? 0 : -errno;
+}
+
+int
+raw_statfs(const char *bpath, struct statvfs *statv)
+{
+	return (statvfs(bpath, statv) == 0) ? 0 : -errno;
+}
+
+int
+raw_getxattr(const char *bpath, const char *name, char *value, size_t size)
+{
+	ssize_t ret;
+
+	ret = lgetxattr(bpath, name, value, size);
+
+	return (ret < 0) ? -errno : ret;
+}
+
+int
+raw_listxattr(const char *bpath, char *list, size_t size)
+{
+	ssize_t ret;
+
+	ret = llistxattr(bpath, list, size);
+
+	return (ret < 0) ? -errno : ret;
+}
+
+int
+raw_opendir(const char *bpath, struct fuse_file_info *fi)
+{
+	DIR *dp;
+
+	dp = opendir(bpath);
+	if (dp == NULL)
+		return -errno;
+
+	fi->fh = (uintptr_t) dp;
+
+	return 0;
+}
+
+/* Lists backend names as they are, including spatial indexes */
+int
+raw_readdir(struct fuse_file_info *fi, void *buf, fuse_fill_dir_t filler)
+{
+	DIR *dp = (DIR *) (uintptr_t) fi->fh;
+	struct dirent *de;
+
+	errno = 0;
+	while ((de = readdir(dp)) != NULL) {
+		if (filler(buf, de->d_name, NULL, 0) != 0)
+			return -ENOMEM;
+	}
+
+	return (errno != 0) ? -errno : 0;
+}
+
+int
+raw_releasedir(struct fuse_file_info *fi)
+{
+	return (closedir((DIR *) (uintptr_t) fi->fh) == 0) ? 0 : -errno;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _RAW_H_
+#define _RAW_H_
+
+#include "params.h"
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+/*
+ * Virtual read-only directory in the root of the mount which shows the
+ * backend directory as it is, i.e. compressed files under their stored
+ * names, so tools which read LAZ themselves skip decompression. Tiered
+ * files (see tier.h) read as the .laz they were demoted from. It exists only
+ * with -o raw, is not listed by readdir and shadows directory of the same
+ * name in the backend.
+ */
+#define RAW_DIR "/.raw"
+
+/*
+ * Returns non-zero if path is in RAW_DIR and raw directory is enabled, bpath
+ * is set to the backend path then.
+ */
+int
+raw_lookup(const char *path, char bpath[PATH_MAX]);
+
+/*
+ * Functions below implement FUSE operations of bpath returned by
+ * raw_lookup(), they return 0 or -errno. Open file keeps the backend file
+ * descriptor in fi->fh, open directory its DIR.
+ */
+int
+raw_getattr(const char *bpath, struct stat *statbuf);
+
+int
+raw_fgetattr(struct fuse_file_info *fi, struct stat *statbuf);
+
+/* Returns 0 or -errno, link is terminated */
+int
+raw_readlink(const char *bpath, char *link, size_t size);
+
+int
+raw_access(const char *bpath, int mask);
+
+int
+raw_open(const char *bpath, struct fuse_file_info *fi);
+
+/* Returns number of bytes read */
+int
+raw_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset);
+
+int
+raw_release(struct fuse_file_info *fi);
+
+int
+raw_statfs(const char *bpath, struct statvfs *statv);
+
+/* Returns size of the value or -errno */
+int
+raw_getxattr(const char *bpath, const char *name, char *value, size_t size);
+
+/* Returns size of the list or -errno */
+int
+raw_listxattr(const char *bpath, char *list, size_t size);
+
+int
+raw_opendir(const char *bpath, struct fuse_file_info *fi);
+
+int
+raw_readdir(struct fuse_file_info *fi, void *buf, fuse_fill_dir_t filler);
+
+int
+raw_releasedir(struct fuse_file_info *fi);
+
+#endif
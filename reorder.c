@@ -0,0 +1,654 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains reordering of LAS points along a space filling curve,
+ * see reorder.h. Points are split into runs which fit into the memory limit,
+ * runs are sorted by a pool of threads and written to a temporary file, then
+ * they are merged into the destination. Single run is sorted directly into
+ * the destination.
+ *
+ * Sort key is computed from raw X and Y integers with flipped sign bit, so
+ * negative coordinates precede positive ones. Ties are resolved by position
+ * of the point in the source, so the sort is stable.
+ *
+ * Level of detail order is made by another pass over the destination, which
+ * permutes points of every chunk in place.
+ */
+
+#include "lasheader.h"
+#include "reorder.h"
+#include "stats.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Defaults of the options */
+#define REORDER_DEFTHREADS 4
+#define REORDER_DEFMEMORY 256 /* MiB */
+
+#define REORDER_MAXTHREADS 64
+#define REORDER_MAXMEMORY (64 * 1024)
+
+/* Points written to the destination at once by the merge */
+#define REORDER_BATCH 4096
+
+struct lazfs_reorderopts {
+	lazfs_order_t order;
+	char lod;
+	unsigned int threads;
+	size_t memory; /* Bytes */
+};
+
+static const lazfs_reorderopts_t reorder_defopts = {
+	LAZFS_ORDER_NONE, 0, REORDER_DEFTHREADS,
+	(size_t) REORDER_DEFMEMORY * 1024 * 1024
+};
+
+static const char *reorder_names[] = { "none", "morton", "hilbert" };
+
+#define REORDER_NORDERS (sizeof(reorder_names) / sizeof(reorder_names[0]))
+
+/* Sort key and position of one point within its run */
+typedef struct reorder_entry {
+	uint64_t key;
+	uint64_t idx;
+} reorder_entry_t;
+
+/* Runs sorted by pool of threads */
+typedef struct reorder_sort {
+	lazfs_order_t order;
+	const lasheader_t *hdr;
+	int sfd;
+	int dfd;
+	off_t doff;		/* Offset of the first run in dfd */
+	uint64_t runsize;	/* Points per run */
+	uint64_t nruns;
+	uint64_t next;		/* Next run to sort, claimed atomically */
+	int err;		/* The first error of workers */
+} reorder_sort_t;
+
+/* Run being merged, buffered part is buf[i..len) */
+typedef struct reorder_input {
+	unsigned char *buf;
+	uint64_t pos;		/* The next point to buffer */
+	uint64_t end;		/* The end of the run */
+	uint64_t len;
+	uint64_t i;
+	uint64_t key;		/* Key of buf[i] */
+} reorder_input_t;
+
+static int
+reorder_pread(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread(fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EINVAL; /* File is shorter than header says */
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int
+reorder_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int
+lazfs_reorder_setopt(lazfs_reorderopts_t **optsp, const char *name,
+		     const char *value)
+{
+	lazfs_reorderopts_t *opts;
+	unsigned long num;
+	unsigned int i;
+	char *end;
+
+	assert(optsp != NULL);
+
+	opts = *optsp;
+	if (opts == NULL) {
+		opts = malloc(sizeof(*opts));
+		if (opts == NULL)
+			return -ENOMEM;
+		*opts = reorder_defopts;
+		*optsp = opts;
+	}
+
+	if (strcmp(name, "order") == 0) {
+		for (i = 0; i < REORDER_NORDERS; i++)
+			if (strcmp(value, reorder_names[i]) == 0)
+				break;
+		if (i == REORDER_NORDERS)
+			return -EINVAL;
+		opts->order = i;
+		return 0;
+	}
+
+	if (strcmp(name, "lod") == 0) {
+		if (strcmp(value, "yes") == 0)
+			opts->lod = 1;
+		else if (strcmp(value, "no") == 0)
+			opts->lod = 0;
+		else
+			return -EINVAL;
+		return 0;
+	}
+
+	if (strcmp(name, "sortmem") != 0 && strcmp(name, "sortthreads") != 0)
+		return -ENOENT;
+
+	errno = 0;
+	num = strtoul(value, &end, 10);
+	if (errno != 0 || end == value || *end != '\0' || num < 1)
+		return -EINVAL;
+
+	if (strcmp(name, "sortmem") == 0) {
+		if (num > REORDER_MAXMEMORY)
+			return -EINVAL;
+		opts->memory = (size_t) num * 1024 * 1024;
+	} else {
+		if (num > REORDER_MAXTHREADS)
+			return -EINVAL;
+		opts->threads = num;
+	}
+
+	return 0;
+}
+
+void
+lazfs_reorder_freeopts(lazfs_reorderopts_t *opts)
+{
+	free(opts);
+}
+
+lazfs_order_t
+lazfs_reorder_order(const lazfs_reorderopts_t *opts)
+{
+	return (opts != NULL) ? opts->order : LAZFS_ORDER_NONE;
+}
+
+int
+lazfs_reorder_lod(const lazfs_reorderopts_t *opts)
+{
+	return opts != NULL && opts->lod;
+}
+
+const char *
+lazfs_reorder_name(lazfs_order_t order)
+{
+	assert(order < REORDER_NORDERS);
+
+	return reorder_names[order];
+}
+
+/* Spreads bits of v to even bits of the result */
+static uint64_t
+reorder_spread(uint32_t v)
+{
+	uint64_t x = v;
+
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+	x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x << 2)) & 0x3333333333333333ULL;
+	x = (x | (x << 1)) & 0x5555555555555555ULL;
+
+	return x;
+}
+
+/* Returns distance of point along the curve of 2^32 x 2^32 cells */
+static uint64_t
+reorder_hilbert(uint32_t x, uint32_t y)
+{
+	uint32_t s, rx, ry, t;
+	uint64_t d = 0;
+
+	for (s = 1U << 31; s > 0; s >>= 1) {
+		rx = (x & s) != 0;
+		ry = (y & s) != 0;
+		d += (uint64_t) s * s * ((3 * rx) ^ ry);
+
+		/* Rotate quadrant, only bits below s matter from now on */
+		if (ry == 0) {
+			if (rx == 1) {
+				x = ~x;
+				y = ~y;
+			}
+			t = x;
+			x = y;
+			y = t;
+		}
+	}
+
+	return d;
+}
+
+static uint64_t
+reorder_key(lazfs_order_t order, const unsigned char *p)
+{
+	uint32_t x, y;
+
+	x = le32(p) ^ 0x80000000U;
+	y = le32(p + 4) ^ 0x80000000U;
+
+	if (order == LAZFS_ORDER_HILBERT)
+		return reorder_hilbert(x, y);
+
+	return reorder_spread(x) | (reorder_spread(y) << 1);
+}
+
+static int
+reorder_cmp(const void *a, const void *b)
+{
+	const reorder_entry_t *ea = a, *eb = b;
+
+	if (ea->key != eb->key)
+		return (ea->key < eb->key) ? -1 : 1;
+
+	return (ea->idx < eb->idx) ? -1 : (ea->idx > eb->idx);
+}
+
+/* Sorts run, in and out hold runsize records */
+static int
+reorder_run(reorder_sort_t *s, uint64_t run, reorder_entry_t *entries,
+	    unsigned char *in, unsigned char *out)
+{
+	uint16_t reclen = s->hdr->record_length;
+	uint64_t first, n, j;
+	int ret;
+
+	first = run * s->runsize;
+	n = s->hdr->npoints - first;
+	if (n > s->runsize)
+		n = s->runsize;
+
+	ret = reorder_pread(s->sfd, in, n * reclen,
+			    s->hdr->data_offset + first * reclen);
+	if (ret != 0)
+		return ret;
+
+	for (j = 0; j < n; j++) {
+		entries[j].key = reorder_key(s->order, in + j * reclen);
+		entries[j].idx = j;
+	}
+	qsort(entries, n, sizeof(*entries), reorder_cmp);
+
+	for (j = 0; j < n; j++)
+		memcpy(out + j * reclen, in + entries[j].idx * reclen, reclen);
+
+	return reorder_pwrite(s->dfd, out, n * reclen,
+			      s->doff + first * reclen);
+}
+
+static void *
+reorder_worker(void *arg)
+{
+	reorder_sort_t *s = arg;
+	reorder_entry_t *entries;
+	unsigned char *in, *out;
+	uint64_t run, n;
+	int ret = 0;
+
+	n = (s->nruns == 1) ? s->hdr->npoints : s->runsize;
+	entries = malloc(n * sizeof(*entries));
+	in = malloc(n * s->hdr->record_length);
+	out = malloc(n * s->hdr->record_length);
+	if (entries == NULL || in == NULL || out == NULL)
+		ret = -ENOMEM;
+
+	while (ret == 0 && __sync_add_and_fetch(&s->err, 0) == 0) {
+		run = __sync_fetch_and_add(&s->next, 1);
+		if (run >= s->nruns)
+			break;
+		ret = reorder_run(s, run, entries, in, out);
+	}
+	if (ret != 0)
+		__sync_bool_compare_and_swap(&s->err, 0, ret);
+
+	free(out);
+	free(in);
+	free(entries);
+
+	return NULL;
+}
+
+/* Sorts all runs, the calling thread works too */
+static int
+reorder_sortruns(reorder_sort_t *s, unsigned int threads)
+{
+	pthread_t tids[REORDER_MAXTHREADS];
+	unsigned int i, started = 0;
+
+	if (threads > s->nruns)
+		threads = s->nruns;
+
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tids[started], NULL, reorder_worker,
+				   s) != 0)
+			break;
+		started++;
+	}
+
+	reorder_worker(s);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	return s->err;
+}
+
+/* Buffers the next part of run, in->pos must be below in->end */
+static int
+reorder_fill(const reorder_sort_t *s, reorder_input_t *in, uint64_t bufsize)
+{
+	uint16_t reclen = s->hdr->record_length;
+	int ret;
+
+	in->len = in->end - in->pos;
+	if (in->len > bufsize)
+		in->len = bufsize;
+
+	ret = reorder_pread(s->dfd, in->buf, in->len * reclen,
+			    s->doff + in->pos * reclen);
+	if (ret != 0)
+		return ret;
+
+	in->pos += in->len;
+	in->i = 0;
+	in->key = reorder_key(s->order, in->buf);
+
+	return 0;
+}
+
+/* Returns non-zero if run a precedes run b, ties keep order of runs */
+static int
+reorder_less(const reorder_input_t *inputs, uint64_t a, uint64_t b)
+{
+	if (inputs[a].key != inputs[b].key)
+		return inputs[a].key < inputs[b].key;
+
+	return a < b;
+}
+
+static void
+reorder_siftdown(const reorder_input_t *inputs, uint64_t *heap, uint64_t n,
+		 uint64_t i)
+{
+	uint64_t child, t;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n &&
+		    reorder_less(inputs, heap[child + 1], heap[child]))
+			child++;
+		if (!reorder_less(inputs, heap[child], heap[i]))
+			break;
+		t = heap[i];
+		heap[i] = heap[child];
+		heap[child] = t;
+		i = child;
+	}
+}
+
+/* Merges sorted runs of s->dfd into points of dfd */
+static int
+reorder_merge(const reorder_sort_t *s, size_t memory, int dfd)
+{
+	uint16_t reclen = s->hdr->record_length;
+	reorder_input_t *inputs = NULL, *in;
+	unsigned char *out = NULL;
+	uint64_t *heap = NULL, n, bufsize, i, len = 0;
+	off_t off = s->hdr->data_offset;
+	int ret = 0;
+
+	/* Half of the memory buffers runs */
+	bufsize = memory / 2 / s->nruns / reclen;
+	if (bufsize == 0)
+		bufsize = 1;
+
+	inputs = calloc(s->nruns, sizeof(*inputs));
+	heap = malloc(s->nruns * sizeof(*heap));
+	out = malloc((size_t) REORDER_BATCH * reclen);
+	if (inputs == NULL || heap == NULL || out == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	for (i = 0; i < s->nruns; i++) {
+		in = &inputs[i];
+		in->pos = i * s->runsize;
+		in->end = in->pos + s->runsize;
+		if (in->end > s->hdr->npoints)
+			in->end = s->hdr->npoints;
+		in->buf = malloc(bufsize * reclen);
+		if (in->buf == NULL) {
+			ret = -ENOMEM;
+			goto cleanup;
+		}
+		ret = reorder_fill(s, in, bufsize);
+		if (ret != 0)
+			goto cleanup;
+		heap[i] = i;
+	}
+
+	n = s->nruns;
+	for (i = n / 2; i-- > 0;)
+		reorder_siftdown(inputs, heap, n, i);
+
+	while (n > 0) {
+		in = &inputs[heap[0]];
+		memcpy(out + len * reclen, in->buf + in->i * reclen, reclen);
+		if (++len == REORDER_BATCH) {
+			ret = reorder_pwrite(dfd, out, len * reclen, off);
+			if (ret != 0)
+				goto cleanup;
+			off += len * reclen;
+			len = 0;
+		}
+
+		if (++in->i < in->len) {
+			in->key = reorder_key(s->order,
+					      in->buf + in->i * reclen);
+		} else if (in->pos < in->end) {
+			ret = reorder_fill(s, in, bufsize);
+			if (ret != 0)
+				goto cleanup;
+		} else {
+			heap[0] = heap[--n];
+		}
+		reorder_siftdown(inputs, heap, n, 0);
+	}
+
+	ret = reorder_pwrite(dfd, out, len * reclen, off);
+
+cleanup:
+	if (inputs != NULL)
+		for (i = 0; i < s->nruns; i++)
+			free(inputs[i].buf);
+	free(inputs);
+	free(heap);
+	free(out);
+
+	return ret;
+}
+
+/* Returns level of detail of point i of a chunk */
+static unsigned int
+reorder_level(uint64_t i)
+{
+	unsigned int level = 0;
+
+	if (i == 0)
+		return LAZFS_LOD_LEVELS;
+
+	while (level < LAZFS_LOD_LEVELS && (i & 3) == 0) {
+		i >>= 2;
+		level++;
+	}
+
+	return level;
+}
+
+/* Puts points of every chunk of dfd into level of detail order */
+static int
+reorder_lod(const lasheader_t *hdr, int dfd)
+{
+	uint16_t reclen = hdr->record_length;
+	unsigned char *in, *out;
+	uint64_t first, n, i, stride, len;
+	off_t off;
+	int level, ret = 0;
+
+	in = malloc((size_t) LAZFS_LOD_CHUNK * reclen);
+	out = malloc((size_t) LAZFS_LOD_CHUNK * reclen);
+	if (in == NULL || out == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	for (first = 0; first < hdr->npoints && ret == 0; first += n) {
+		n = hdr->npoints - first;
+		if (n > LAZFS_LOD_CHUNK)
+			n = LAZFS_LOD_CHUNK;
+		off = hdr->data_offset + first * reclen;
+
+		ret = reorder_pread(dfd, in, n * reclen, off);
+		if (ret != 0)
+			break;
+
+		/* Level L holds multiples of 4^L which aren't in level L + 1 */
+		len = 0;
+		for (level = LAZFS_LOD_LEVELS; level >= 0; level--) {
+			stride = (uint64_t) 1 << (2 * level);
+			for (i = 0; i < n; i += stride) {
+				if (reorder_level(i) != (unsigned int) level)
+					continue;
+				memcpy(out + len * reclen, in + i * reclen,
+				       reclen);
+				len++;
+			}
+		}
+		assert(len == n);
+
+		ret = reorder_pwrite(dfd, out, n * reclen, off);
+	}
+
+cleanup:
+	free(out);
+	free(in);
+
+	return ret;
+}
+
+int
+lazfs_reorder(const lazfs_reorderopts_t *opts, int sfd, int dfd)
+{
+	uint64_t start = stats_now();
+	struct stat statbuf;
+	reorder_sort_t s;
+	lasheader_t hdr;
+	off_t end;
+	int ret, runfd = -1;
+
+	assert(opts != NULL);
+
+	ret = lasheader_read(sfd, &hdr);
+	if (ret != 0)
+		goto cleanup;
+
+	/* Every point format begins with X and Y */
+	end = lasheader_lassize(&hdr);
+	if (hdr.compressed || hdr.record_length < 8 ||
+	    fstat(sfd, &statbuf) != 0 || statbuf.st_size < end) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	/* Header and VLRs, then extended VLRs after points */
+	ret = lazfs_copyrange(sfd, 0, dfd, 0, hdr.data_offset);
+	if (ret == 0 && statbuf.st_size > end)
+		ret = lazfs_copyrange(sfd, end, dfd, end, -1);
+	if (ret != 0)
+		goto cleanup;
+
+	if (opts->order == LAZFS_ORDER_NONE || hdr.npoints == 0) {
+		ret = lazfs_copyrange(sfd, hdr.data_offset, dfd,
+				      hdr.data_offset, end - hdr.data_offset);
+		goto lod;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.order = opts->order;
+	s.hdr = &hdr;
+	s.sfd = sfd;
+	s.runsize = opts->memory / opts->threads /
+		    (2 * hdr.record_length + sizeof(reorder_entry_t));
+	if (s.runsize == 0)
+		s.runsize = 1;
+	s.nruns = (hdr.npoints + s.runsize - 1) / s.runsize;
+
+	if (s.nruns == 1) {
+		s.dfd = dfd;
+		s.doff = hdr.data_offset;
+		ret = reorder_sortruns(&s, opts->threads);
+		goto lod;
+	}
+
+	runfd = lazfs_tmpfile();
+	if (runfd < 0) {
+		ret = runfd;
+		goto cleanup;
+	}
+	s.dfd = runfd;
+	s.doff = 0;
+
+	ret = reorder_sortruns(&s, opts->threads);
+	if (ret == 0)
+		ret = reorder_merge(&s, opts->memory, dfd);
+
+lod:
+	if (ret == 0 && opts->lod)
+		ret = reorder_lod(&hdr, dfd);
+
+cleanup:
+	if (runfd >= 0)
+		close(runfd);
+	stats_record(STATS_REORDER, stats_now() - start, ret != 0);
+
+	return ret;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _REORDER_H_
+#define _REORDER_H_
+
+/*
+ * Reordering of LAS points along a space filling curve before compression.
+ * Neighbouring points compress better and every LAZ chunk covers a compact
+ * area, so spatial queries decompress fewer chunks. Points are sorted by
+ * external merge sort, files larger than memory limit are sorted in runs.
+ *
+ * All lazfs_reorder_* functions return -errno as errors.
+ */
+
+typedef enum {
+	LAZFS_ORDER_NONE = 0,	/* Points are kept in order of the writer */
+	LAZFS_ORDER_MORTON,	/* Z-order of raw X and Y */
+	LAZFS_ORDER_HILBERT	/* Hilbert curve of raw X and Y */
+} lazfs_order_t;
+
+/* Options of the reordering, NULL means no reordering */
+typedef struct lazfs_reorderopts lazfs_reorderopts_t;
+
+/*
+ * Level of detail order. Points of every block of LAZFS_LOD_CHUNK points
+ * (chunk of laszip) are ordered by level, coarse levels first: point i of
+ * the block is in level L when i is a multiple of 4^L. So first
+ * ceil(n / 4^L) points of a chunk of n points are every 4^L-th point of the
+ * chunk in the order it had before, which is spatially uniform sample when
+ * the chunk is sorted along a curve. Levels go up to LAZFS_LOD_LEVELS.
+ */
+#define LAZFS_LOD_CHUNK 50000
+#define LAZFS_LOD_LEVELS 8
+
+/*
+ * Sets option, *optsp is allocated on first call. Options are
+ * order=none|morton|hilbert, lod=yes|no (level of detail order of chunks),
+ * sortmem=MiB (memory used by the sort) and sortthreads=N. Returns -ENOENT
+ * for unknown option.
+ */
+int
+lazfs_reorder_setopt(lazfs_reorderopts_t **optsp, const char *name,
+		     const char *value);
+
+void
+lazfs_reorder_freeopts(lazfs_reorderopts_t *opts);
+
+/* Returns order of opts */
+lazfs_order_t
+lazfs_reorder_order(const lazfs_reorderopts_t *opts);
+
+/* Returns non-zero if opts request level of detail order */
+int
+lazfs_reorder_lod(const lazfs_reorderopts_t *opts);
+
+/* Returns name of the order as accepted by order= option */
+const char *
+lazfs_reorder_name(lazfs_order_t order);
+
+/*
+ * Writes LAS file sfd to dfd with points sorted by opts and then put into
+ * level of detail order when requested, header, VLRs and data after points
+ * are copied unchanged. Points of equal position keep their order. Returns
+ * -EINVAL if sfd isn't uncompressed LAS.
+ */
+int
+lazfs_reorder(const lazfs_reorderopts_t *opts, int sfd, int dfd);
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains backend scanner which warms metadata after mount.
+ */
+
+#define _GNU_SOURCE /* O_NOATIME */
+
+#include "params.h"
+#include "lasheader.h"
+#include "lazfile.h"
+#include "log.h"
+#include "scan.h"
+#include "stats.h"
+#include "util.h"
+#include <assert.h>
+#include <attr/xattr.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of directory entries processed by one job */
+#define SCAN_BATCH 64
+
+/* How long to wait when foreground jobs are running (ms) */
+#define SCAN_BACKOFF 100
+
+typedef struct scan_dir scan_dir_t;
+struct scan_dir {
+	char *path;
+	STAILQ_ENTRY(scan_dir) link;
+};
+
+typedef struct scan {
+	lazfs_workq_t *workq;
+	lazfs_attrcache_t *ac;
+	unsigned int rate;
+	uint64_t nfiles; /* Files processed so far, used for throttling */
+	struct timespec start;
+
+	DIR *dp; /* Directory being read */
+	char *dpath;
+	STAILQ_HEAD(scan_dirs, scan_dir) dirs; /* Directories to visit */
+} scan_t;
+
+static void
+scan_task(void *arg);
+
+static int
+scan_pushdir(scan_t *scan, const char *path)
+{
+	scan_dir_t *dir;
+
+	dir = malloc(sizeof(*dir));
+	if (dir == NULL)
+		return -ENOMEM;
+
+	dir->path = strdup(path);
+	if (dir->path == NULL) {
+		free(dir);
+		return -ENOMEM;
+	}
+
+	STAILQ_INSERT_TAIL(&scan->dirs, dir, link);
+
+	return 0;
+}
+
+static void
+scan_destroy(scan_t *scan)
+{
+	scan_dir_t *dir;
+
+	while (!STAILQ_EMPTY(&scan->dirs)) {
+		dir = STAILQ_FIRST(&scan->dirs);
+		STAILQ_REMOVE_HEAD(&scan->dirs, link);
+		free(dir->path);
+		free(dir);
+	}
+
+	if (scan->dp != NULL)
+		closedir(scan->dp);
+	if (scan->dpath != NULL)
+		free(scan->dpath);
+
+	free(scan);
+}
+
+/* Queues next job of the scanner which starts after delay ms */
+static int
+scan_requeue(scan_t *scan, long delay)
+{
+	lazfs_workq_job_t *job;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL)
+		return -ENOMEM;
+
+	memset(job, 0, sizeof(*job));
+	job->task = &scan_task;
+	job->arg = scan;
+	job->lowprio = LAZFS_WORKQ_BACKGROUND;
+	lazfs_workq_runafter(scan->workq, job, delay);
+
+	return 0;
+}
+
+/* Repairs size xattr of compressed file which codec doesn't store LAS */
+static void
+scan_rawfile(scan_t *scan, const char *path, const codec_rule_t *rule,
+	     struct stat *st)
+{
+	off_t size;
+	int ret;
+
+	ret = getxattr(path, SIZEATTR, &size, sizeof(size));
+	if (ret != sizeof(size)) {
+		log_debug("    scan: repairing size xattr of \"%s\"\n", path);
+		if (codec_probesize(rule, path, &size) != 0 ||
+		    lazfs_setsize(path, size) != 0)
+			goto error;
+		stats_add(STATS_SCAN_REPAIRED, 1);
+
+		/* setxattr changed ctime */
+		if (lstat(path, st) != 0)
+			goto error;
+	}
+
+	attrcache_store(scan->ac, path, st, size, NULL);
+	stats_add(STATS_SCAN_FILES, 1);
+	return;
+
+error:
+	stats_add(STATS_SCAN_ERRORS, 1);
+}
+
+/* Validates and repairs metadata of one compressed file */
+static void
+scan_file(scan_t *scan, const char *path, const codec_rule_t *rule)
+{
+	unsigned char *prefix = NULL;
+	struct stat st;
+	lasheader_t hdr;
+	off_t size;
+	int fd, ret;
+
+	if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		goto error;
+
+	if (!(rule->codec->flags & CODEC_LAS)) {
+		scan_rawfile(scan, path, rule, &st);
+		return;
+	}
+
+	/* Header of tiered file is compressed, size is known from xattr only */
+	if (getxattr(path, TIERATTR, NULL, 0) >= 0) {
+		if (getxattr(path, SIZEATTR, &size, sizeof(size)) != sizeof(size))
+			goto error;
+		attrcache_store(scan->ac, path, &st, size, NULL);
+		stats_add(STATS_SCAN_FILES, 1);
+		return;
+	}
+
+	/* Don't touch atime, it tells which files are really used */
+	fd = open(path, O_RDONLY | O_NOATIME);
+	if (fd == -1 && errno == EPERM)
+		fd = open(path, O_RDONLY);
+	if (fd == -1)
+		goto error;
+
+	ret = lazfile_readprefix(fd, &hdr, &prefix);
+	close(fd);
+	if (ret != 0) {
+		log_error("    ERROR scan: \"%s\" has invalid LAS header\n", path);
+		goto error;
+	}
+
+	ret = getxattr(path, SIZEATTR, &size, sizeof(size));
+	if (ret != sizeof(size) || !lasheader_checksize(&hdr, size)) {
+		log_debug("    scan: repairing size xattr of \"%s\"\n", path);
+		size = lazfile_lassize(prefix, &hdr);
+		if (lazfs_setsize(path, size) != 0)
+			goto error;
+		stats_add(STATS_SCAN_REPAIRED, 1);
+
+		/* setxattr changed ctime */
+		if (lstat(path, &st) != 0)
+			goto error;
+	}
+
+	attrcache_store(scan->ac, path, &st, size, &hdr);
+	stats_add(STATS_SCAN_FILES, 1);
+	free(prefix);
+	return;
+
+error:
+	stats_add(STATS_SCAN_ERRORS, 1);
+	free(prefix);
+}
+
+/* Returns next directory entry or NULL when there is nothing to scan */
+static struct dirent *
+scan_nextentry(scan_t *scan)
+{
+	struct dirent *de;
+	scan_dir_t *dir;
+
+	while (1) {
+		while (scan->dp == NULL) {
+			if (STAILQ_EMPTY(&scan->dirs))
+				return NULL;
+
+			dir = STAILQ_FIRST(&scan->dirs);
+			STAILQ_REMOVE_HEAD(&scan->dirs, link);
+			scan->dpath = dir->path;
+			free(dir);
+
+			scan->dp = opendir(scan->dpath);
+			if (scan->dp == NULL) {
+				stats_add(STATS_SCAN_ERRORS, 1);
+				free(scan->dpath);
+				scan->dpath = NULL;
+			} else
+				stats_add(STATS_SCAN_DIRS, 1);
+		}
+
+		de = readdir(scan->dp);
+		if (de != NULL)
+			return de;
+
+		closedir(scan->dp);
+		scan->dp = NULL;
+		free(scan->dpath);
+		scan->dpath = NULL;
+	}
+}
+
+static void
+scan_task(void *arg)
+{
+	scan_t *scan = (scan_t *) arg;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX], vname[PATH_MAX];
+	const codec_rule_t *rule;
+	long delay = 0;
+	int i, ret;
+
+	/* Never compete with foreground decompression/compression */
+	if (lazfs_workq_busy(scan->workq)) {
+		delay = SCAN_BACKOFF;
+		goto requeue;
+	}
+
+	for (i = 0; i < SCAN_BATCH; i++) {
+		de = scan_nextentry(scan);
+		if (de == NULL)
+			goto finished;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		ret = snprintf(path, PATH_MAX, "%s/%s", scan->dpath, de->d_name);
+		if (ret >= PATH_MAX) {
+			stats_add(STATS_SCAN_ERRORS, 1);
+			continue;
+		}
+
+		if (de->d_type == DT_UNKNOWN) {
+			if (lstat(path, &st) != 0)
+				continue;
+			de->d_type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+
+		if (de->d_type == DT_DIR) {
+			if (scan_pushdir(scan, path) != 0)
+				stats_add(STATS_SCAN_ERRORS, 1);
+			continue;
+		}
+
+		if (de->d_type != DT_REG)
+			continue;
+		rule = codec_matchstored(de->d_name, vname);
+		if (rule == NULL)
+			continue;
+
+		scan_file(scan, path, rule);
+		scan->nfiles++;
+
+		/* Scanner is faster than requested rate */
+		delay = lazfs_throttle(&scan->start, scan->nfiles, scan->rate);
+		if (delay > 0)
+			break;
+	}
+
+requeue:
+	if (scan_requeue(scan, delay) == 0)
+		return;
+
+	log_error("    ERROR scan: failed to requeue scanner, stopping\n");
+
+finished:
+	log_debug("    scan: finished, %lld files, %lld repaired, %lld errors\n",
+		  (long long) stats_get(STATS_SCAN_FILES),
+		  (long long) stats_get(STATS_SCAN_REPAIRED),
+		  (long long) stats_get(STATS_SCAN_ERRORS));
+	stats_add(STATS_SCAN_RUNNING, -1);
+	scan_destroy(scan);
+}
+
+int
+lazfs_scan_start(const char *rootdir, lazfs_workq_t *workq,
+		 lazfs_attrcache_t *ac, unsigned int rate)
+{
+	scan_t *scan;
+	int ret;
+
+	assert(rootdir != NULL);
+	assert(workq != NULL);
+	assert(ac != NULL);
+
+	scan = malloc(sizeof(*scan));
+	if (scan == NULL)
+		return -ENOMEM;
+
+	memset(scan, 0, sizeof(*scan));
+	scan->workq = workq;
+	scan->ac = ac;
+	scan->rate = rate;
+	STAILQ_INIT(&scan->dirs);
+	clock_gettime(CLOCK_MONOTONIC, &scan->start);
+
+	ret = scan_pushdir(scan, rootdir);
+	if (ret != 0)
+		goto cleanup;
+
+	stats_add(STATS_SCAN_RUNNING, 1);
+	ret = scan_requeue(scan, 0);
+	if (ret != 0) {
+		stats_add(STATS_SCAN_RUNNING, -1);
+		goto cleanup;
+	}
+
+	return 0;
+
+cleanup:
+	scan_destroy(scan);
+	return ret;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include "attrcache.h"
+#include "workq.h"
+
+/*
+ * Starts background scan of the backend directory. Scanner walks rootdir as a
+ * low priority workq job, validates (and repairs) size xattrs of all files
+ * matching stored suffix of a codec rule and fills attribute cache. At most rate files are processed per
+ * second, zero means no limit. Progress is reported via STATS_SCAN_*
+ * counters.
+ *
+ * Returns 0 on success or -errno.
+ */
+int
+lazfs_scan_start(const char *rootdir, lazfs_workq_t *workq,
+		 lazfs_attrcache_t *ac, unsigned int rate);
+
+#endif
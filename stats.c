@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains counters and latency histograms which describe what
+ * lazfs is doing. Every thread updates its own copy without any locking or
+ * atomic read-modify-write, copies are summed only when values are read.
+ */
+
+#include "stats.h"
+#include "util.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct stats_thread {
+	int64_t counters[STATS_NCOUNTERS];
+	stats_histogram_t hists[STATS_NHISTS];
+	struct stats_thread *next;
+} stats_thread_t;
+
+/* Values of exited threads and of threads which failed to allocate own */
+static stats_thread_t retired;
+
+/* Live threads, protected by lock */
+static stats_thread_t *threads;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static const char *names[STATS_NCOUNTERS] = {
+	"attr_hits",
+	"attr_misses",
+	"scan_running",
+	"scan_dirs",
+	"scan_files",
+	"scan_repaired",
+	"scan_errors",
+	"workq_queued",
+	"workq_running",
+	"workq_completed",
+	"compress_points",
+	"compress_bytes",
+	"decompress_points",
+	"decompress_bytes",
+	"frames_fetched",
+	"frames_copied",
+	"tier_running",
+	"tier_demoted",
+	"tier_promoted",
+	"tier_saved_bytes",
+	"tier_errors",
+	"index_built",
+	"index_updated",
+	"query_chunks",
+	"query_skipped",
+	"view_chunks",
+	"prefetch_issued",
+	"prefetch_hits",
+	"prefetch_wasted",
+	"diskcache_kept_bytes",
+	"diskcache_hits",
+	"diskcache_recovered",
+};
+
+static const char *histnames[STATS_NHISTS] = {
+	"getattr",
+	"readlink",
+	"mknod",
+	"mkdir",
+	"unlink",
+	"rmdir",
+	"symlink",
+	"rename",
+	"link",
+	"chmod",
+	"chown",
+	"truncate",
+	"utime",
+	"open",
+	"read",
+	"write",
+	"statfs",
+	"flush",
+	"release",
+	"fsync",
+	"setxattr",
+	"getxattr",
+	"listxattr",
+	"removexattr",
+	"opendir",
+	"readdir",
+	"releasedir",
+	"fsyncdir",
+	"access",
+	"create",
+	"ftruncate",
+	"fgetattr",
+	"cache_wait",
+	"workq_wait",
+	"workq_run",
+	"compress",
+	"decompress",
+	"codec_header",
+	"codec_points",
+	"codec_flush",
+	"reorder",
+};
+
+/*
+ * Only owning thread writes its values so plain load and store is enough,
+ * relaxed atomics just guarantee readers don't see torn values.
+ */
+#define STATS_INC(var, n) \
+	__atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (n), \
+			 __ATOMIC_RELAXED)
+#define STATS_LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+/* Adds src to dst, dst can be updated by other threads concurrently */
+static void
+stats_mergehist(stats_histogram_t *dst, stats_histogram_t *src)
+{
+	uint64_t max;
+	int i;
+
+	if (STATS_LOAD(src->count) == 0)
+		return;
+
+	__sync_fetch_and_add(&dst->count, STATS_LOAD(src->count));
+	__sync_fetch_and_add(&dst->errors, STATS_LOAD(src->errors));
+	__sync_fetch_and_add(&dst->sum, STATS_LOAD(src->sum));
+	max = STATS_LOAD(src->max);
+	if (max > STATS_LOAD(dst->max))
+		__atomic_store_n(&dst->max, max, __ATOMIC_RELAXED);
+	for (i = 0; i < STATS_HBUCKETS; i++)
+		__sync_fetch_and_add(&dst->buckets[i],
+				     STATS_LOAD(src->buckets[i]));
+}
+
+static void
+stats_merge(stats_thread_t *dst, stats_thread_t *src)
+{
+	int i;
+
+	for (i = 0; i < STATS_NCOUNTERS; i++)
+		__sync_fetch_and_add(&dst->counters[i],
+				     STATS_LOAD(src->counters[i]));
+
+	for (i = 0; i < STATS_NHISTS; i++)
+		stats_mergehist(&dst->hists[i], &src->hists[i]);
+}
+
+/* Thread exit, its values are kept in retired */
+static void
+stats_threadexit(void *arg)
+{
+	stats_thread_t *st = arg, **stp;
+
+	LOCK(lock);
+	for (stp = &threads; *stp != st; stp = &(*stp)->next)
+		;
+	*stp = st->next;
+	stats_merge(&retired, st);
+	UNLOCK(lock);
+
+	free(st);
+}
+
+static void
+stats_initkey(void)
+{
+	if (pthread_key_create(&key, stats_threadexit) != 0)
+		abort();
+}
+
+/* Returns values of calling thread, NULL if they can't be allocated */
+static stats_thread_t *
+stats_thread(void)
+{
+	stats_thread_t *st;
+
+	pthread_once(&once, stats_initkey);
+
+	st = pthread_getspecific(key);
+	if (st != NULL)
+		return st;
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		return NULL;
+
+	if (pthread_setspecific(key, st) != 0) {
+		free(st);
+		return NULL;
+	}
+
+	LOCK(lock);
+	st->next = threads;
+	threads = st;
+	UNLOCK(lock);
+
+	return st;
+}
+
+void
+stats_add(lazfs_stat_t stat, int64_t n)
+{
+	stats_thread_t *st;
+
+	assert(stat < STATS_NCOUNTERS);
+
+	st = stats_thread();
+	if (st != NULL)
+		STATS_INC(st->counters[stat], n);
+	else
+		__sync_fetch_and_add(&retired.counters[stat], n);
+}
+
+int64_t
+stats_get(lazfs_stat_t stat)
+{
+	stats_thread_t *st;
+	int64_t value;
+
+	assert(stat < STATS_NCOUNTERS);
+
+	LOCK(lock);
+	value = STATS_LOAD(retired.counters[stat]);
+	for (st = threads; st != NULL; st = st->next)
+		value += STATS_LOAD(st->counters[stat]);
+	UNLOCK(lock);
+
+	return value;
+}
+
+const char *
+stats_name(lazfs_stat_t stat)
+{
+	assert(stat < STATS_NCOUNTERS);
+
+	return names[stat];
+}
+
+int
+stats_isgauge(lazfs_stat_t stat)
+{
+	assert(stat < STATS_NCOUNTERS);
+
+	return stat == STATS_SCAN_RUNNING || stat == STATS_TIER_RUNNING ||
+	       stat == STATS_WORKQ_QUEUED || stat == STATS_WORKQ_RUNNING ||
+	       stat == STATS_DISKCACHE_KEPT;
+}
+
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int
+stats_bucket(uint64_t value)
+{
+	unsigned int exp;
+
+	if (value < STATS_HLINEAR)
+		return value;
+
+	exp = 63 - __builtin_clzll(value);
+	if (exp >= STATS_HMAXEXP)
+		return STATS_HBUCKETS - 1;
+
+	return STATS_HLINEAR + ((exp - 4) << STATS_HSUBBITS) +
+	       ((value >> (exp - STATS_HSUBBITS)) &
+		((1 << STATS_HSUBBITS) - 1));
+}
+
+/* Returns the largest value which falls into bucket */
+static uint64_t
+stats_bucketmax(unsigned int bucket)
+{
+	unsigned int exp, sub;
+
+	if (bucket < STATS_HLINEAR)
+		return bucket;
+
+	exp = ((bucket - STATS_HLINEAR) >> STATS_HSUBBITS) + 4;
+	sub = (bucket - STATS_HLINEAR) & ((1 << STATS_HSUBBITS) - 1);
+
+	return (((uint64_t) (1 << STATS_HSUBBITS) + sub + 1) <<
+		(exp - STATS_HSUBBITS)) - 1;
+}
+
+void
+stats_record(lazfs_hist_t hist, uint64_t value, int error)
+{
+	stats_histogram_t *h;
+	stats_thread_t *st;
+
+	assert(hist < STATS_NHISTS);
+
+	st = stats_thread();
+	if (st == NULL) {
+		h = &retired.hists[hist];
+		__sync_fetch_and_add(&h->count, 1);
+		__sync_fetch_and_add(&h->errors, error ? 1 : 0);
+		__sync_fetch_and_add(&h->sum, value);
+		__sync_fetch_and_add(&h->buckets[stats_bucket(value)], 1);
+		return;
+	}
+
+	h = &st->hists[hist];
+	STATS_INC(h->count, 1);
+	if (error)
+		STATS_INC(h->errors, 1);
+	STATS_INC(h->sum, value);
+	if (value > h->max)
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+	STATS_INC(h->buckets[stats_bucket(value)], 1);
+}
+
+void
+stats_gethist(lazfs_hist_t hist, stats_histogram_t *out)
+{
+	stats_thread_t *st;
+
+	assert(hist < STATS_NHISTS);
+	assert(out != NULL);
+
+	memset(out, 0, sizeof(*out));
+
+	LOCK(lock);
+	stats_mergehist(out, &retired.hists[hist]);
+	for (st = threads; st != NULL; st = st->next)
+		stats_mergehist(out, &st->hists[hist]);
+	UNLOCK(lock);
+}
+
+const char *
+stats_histname(lazfs_hist_t hist)
+{
+	assert(hist < STATS_NHISTS);
+
+	return histnames[hist];
+}
+
+uint64_t
+stats_percentile(const stats_histogram_t *h, double q)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	assert(h != NULL);
+
+	if (h->count == 0)
+		return 0;
+
+	rank = q * h->count;
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < STATS_HBUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == STATS_HBUCKETS - 1 || i == STATS_HBUCKETS)
+		return h->max;
+
+	return stats_bucketmax(i) < h->max ? stats_bucketmax(i) : h->max;
+}
+
+uint64_t
+stats_countbelow(const stats_histogram_t *h, uint64_t value)
+{
+	uint64_t count = 0;
+	unsigned int i;
+
+	assert(h != NULL);
+
+	for (i = 0; i < STATS_HBUCKETS - 1 && stats_bucketmax(i) < value; i++)
+		count += h->buckets[i];
+
+	return count;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+/* Counters exported by lazfs */
+typedef enum {
+	STATS_ATTR_HITS,	/* getattr served from attribute cache */
+	STATS_ATTR_MISSES,	/* getattr which had to read size xattr */
+	STATS_SCAN_RUNNING,	/* Non-zero while backend scanner runs */
+	STATS_SCAN_DIRS,	/* Directories visited by scanner */
+	STATS_SCAN_FILES,	/* .laz files validated by scanner */
+	STATS_SCAN_REPAIRED,	/* Size xattrs repaired by scanner */
+	STATS_SCAN_ERRORS,	/* Files which scanner failed to process */
+	STATS_WORKQ_QUEUED,	/* Jobs waiting in workq */
+	STATS_WORKQ_RUNNING,	/* Jobs being executed by workq */
+	STATS_WORKQ_COMPLETED,	/* Jobs finished by workq */
+	STATS_COMPRESS_POINTS,	/* Points compressed */
+	STATS_COMPRESS_BYTES,	/* Decompressed bytes compressed */
+	STATS_DECOMPRESS_POINTS, /* Points decompressed */
+	STATS_DECOMPRESS_BYTES,	/* Decompressed bytes produced */
+	STATS_FRAMES_FETCHED,	/* Frames decompressed on demand */
+	STATS_FRAMES_COPIED,	/* Compressed frames kept on recompression */
+	STATS_TIER_RUNNING,	/* Non-zero while cold file pass runs */
+	STATS_TIER_DEMOTED,	/* Cold files stored by tier codec */
+	STATS_TIER_PROMOTED,	/* Tiered files restored on access */
+	STATS_TIER_SAVED,	/* Backend bytes saved by demotion */
+	STATS_TIER_ERRORS,	/* Files which failed to demote or promote */
+	STATS_INDEX_BUILT,	/* Spatial indexes built */
+	STATS_INDEX_UPDATED,	/* Indexes updated for recompressed chunks */
+	STATS_QUERY_CHUNKS,	/* Chunks decompressed by bbox queries */
+	STATS_QUERY_SKIPPED,	/* Chunks skipped by bbox queries via index */
+	STATS_VIEW_CHUNKS,	/* Chunks decompressed by column views */
+	STATS_PREFETCH_ISSUED,	/* Files decompressed ahead of sequential readers */
+	STATS_PREFETCH_HITS,	/* Prefetched files which were opened */
+	STATS_PREFETCH_WASTED,	/* Prefetched files dropped unused */
+	STATS_DISKCACHE_KEPT,	/* Bytes of files kept in cache_dir */
+	STATS_DISKCACHE_HITS,	/* Opens served by kept files */
+	STATS_DISKCACHE_RECOVERED, /* Dirty leftovers written back on mount */
+	STATS_NCOUNTERS
+} lazfs_stat_t;
+
+/* Latency histograms exported by lazfs, values are in nanoseconds */
+typedef enum {
+	STATS_OP_GETATTR,
+	STATS_OP_READLINK,
+	STATS_OP_MKNOD,
+	STATS_OP_MKDIR,
+	STATS_OP_UNLINK,
+	STATS_OP_RMDIR,
+	STATS_OP_SYMLINK,
+	STATS_OP_RENAME,
+	STATS_OP_LINK,
+	STATS_OP_CHMOD,
+	STATS_OP_CHOWN,
+	STATS_OP_TRUNCATE,
+	STATS_OP_UTIME,
+	STATS_OP_OPEN,
+	STATS_OP_READ,
+	STATS_OP_WRITE,
+	STATS_OP_STATFS,
+	STATS_OP_FLUSH,
+	STATS_OP_RELEASE,
+	STATS_OP_FSYNC,
+	STATS_OP_SETXATTR,
+	STATS_OP_GETXATTR,
+	STATS_OP_LISTXATTR,
+	STATS_OP_REMOVEXATTR,
+	STATS_OP_OPENDIR,
+	STATS_OP_READDIR,
+	STATS_OP_RELEASEDIR,
+	STATS_OP_FSYNCDIR,
+	STATS_OP_ACCESS,
+	STATS_OP_CREATE,
+	STATS_OP_FTRUNCATE,
+	STATS_OP_FGETATTR,
+	STATS_CACHE_WAIT,	/* Waiting for file being (de)compressed */
+	STATS_WORKQ_WAIT,	/* Time job spent in queue */
+	STATS_WORKQ_RUN,	/* Time job spent running */
+	STATS_COMPRESS,		/* Compression of a file */
+	STATS_DECOMPRESS,	/* Decompression of a file */
+	STATS_CODEC_HEADER,	/* Codec: reading and writing of the header */
+	STATS_CODEC_POINTS,	/* Codec: loop over points */
+	STATS_CODEC_FLUSH,	/* Codec: flush of the last chunk, chunk table */
+	STATS_REORDER,		/* Sort of points before compression */
+	STATS_NHISTS
+} lazfs_hist_t;
+
+/*
+ * Histogram buckets are log-linear: values below 16 have own bucket, then
+ * every power of two is split into 8 buckets so relative error is at most
+ * 12.5%. Values above 2^44 ns (~5 hours) fall into the last bucket.
+ */
+#define STATS_HSUBBITS 3
+#define STATS_HLINEAR 16
+#define STATS_HMAXEXP 44
+#define STATS_HBUCKETS \
+	(STATS_HLINEAR + (STATS_HMAXEXP - 4) * (1 << STATS_HSUBBITS))
+
+typedef struct stats_histogram {
+	uint64_t count;
+	uint64_t errors;	/* Operations which failed */
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[STATS_HBUCKETS];
+} stats_histogram_t;
+
+/* Adds n to the counter. Can be called from any thread. */
+void
+stats_add(lazfs_stat_t stat, int64_t n);
+
+/* Returns current value of the counter, summed over all threads */
+int64_t
+stats_get(lazfs_stat_t stat);
+
+/* Returns name of the counter */
+const char *
+stats_name(lazfs_stat_t stat);
+
+/* Returns non-zero if the counter can go down (current state, not total) */
+int
+stats_isgauge(lazfs_stat_t stat);
+
+/* Returns monotonic time in nanoseconds */
+uint64_t
+stats_now(void);
+
+/*
+ * Records value into histogram, error is non-zero if operation failed. Can
+ * be called from any thread.
+ */
+void
+stats_record(lazfs_hist_t hist, uint64_t value, int error);
+
+/* Sums histogram over all threads into out */
+void
+stats_gethist(lazfs_hist_t hist, stats_histogram_t *out);
+
+/* Returns name of the histogram */
+const char *
+stats_histname(lazfs_hist_t hist);
+
+/*
+ * Returns value below which fraction q (0 - 1) of recorded values lies,
+ * upper bound of the bucket is returned.
+ */
+uint64_t
+stats_percentile(const stats_histogram_t *h, double q);
+
+/*
+ * Returns number of recorded values lower than value. Result is exact when
+ * value is a power of two.
+ */
+uint64_t
+stats_countbelow(const stats_histogram_t *h, uint64_t value);
+
+#endif
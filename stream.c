@@ -0,0 +1,679 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains streaming compression of newly created files. Writers
+ * usually emit header, VLRs and points sequentially, so complete chunks of
+ * points can be compressed while the file is being written and removed from
+ * the decompressed file (hole is punched there). When compressed points are
+ * accessed again, they are decompressed back and the file is compressed on
+ * close as usual.
+ */
+
+#define _GNU_SOURCE /* fallocate() */
+
+#include "lazfile.h"
+#include "log.h"
+#include "pointstats.h"
+#include "rangeset.h"
+#include "stream.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Number of points in a chunk, LASzip default used by liblas */
+#define STREAM_CHUNK 50000
+
+/* Writer waits when more complete chunks wait for compression */
+#define STREAM_BACKLOG 4
+
+struct lazfs_stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* Broadcast when encoder stops */
+	lazfs_workq_t *workq;
+	lazfs_workq_job_t *job; /* Queued encoder, NULL once it runs */
+	char encoding; /* Encoder is queued or runs */
+	int nwaiting; /* Threads waiting for encoder to stop */
+	off_t contiguous; /* Bytes written from the beginning of lasfd */
+	off_t claimed; /* End of points compressed or being compressed */
+	int lasfd; /* Decompressed file being written */
+	int fd; /* Compressed output, -1 once handed over */
+	char path[PATH_MAX];
+	char *dir;
+	lazfs_rangeset_t written; /* Ranges written to lasfd */
+	char stopped; /* Streaming stopped, lasfd holds all points */
+	char lost; /* Compressed points couldn't be restored */
+	char finished; /* Output is complete .laz */
+	unsigned char *las; /* Header and VLRs of lasfd */
+	lasheader_t hdr;
+	unsigned char *zipvlr; /* laszip VLR produced by LASzip */
+	size_t zipsize;
+	off_t lazoffset; /* Offset of compressed points in the output */
+	lazfile_chunks_t chunks;
+	lazindex_chunk_t *entries; /* Index entry of every chunk */
+	uint32_t allocated; /* Size of chunks.starts and entries */
+	uint64_t npoints; /* Number of compressed points */
+	pointstats_t stats; /* Statistics of compressed points */
+};
+
+/* Creates temporary file in dir, returns fd or -errno */
+static int
+stream_mkstemp(const char *dir, char *path)
+{
+	int ret;
+
+	ret = snprintf(path, PATH_MAX, "%s/lazfs.XXXXXX", dir);
+	if (ret + 1 > PATH_MAX)
+		return -ENAMETOOLONG;
+
+	ret = mkstemp(path);
+
+	return (ret == -1) ? -errno : ret;
+}
+
+int
+lazfs_stream_create(lazfs_stream_t **streamp, int lasfd, const char *dir,
+		    lazfs_workq_t *workq)
+{
+	lazfs_stream_t *stream;
+	int err;
+
+	assert(streamp != NULL && *streamp == NULL);
+	assert(dir != NULL);
+	assert(workq != NULL);
+
+	stream = malloc(sizeof(*stream));
+	if (stream == NULL)
+		return -ENOMEM;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->lasfd = lasfd;
+	stream->workq = workq;
+	pointstats_init(&stream->stats);
+
+	stream->dir = strdup(dir);
+	if (stream->dir == NULL) {
+		free(stream);
+		return -ENOMEM;
+	}
+
+	stream->fd = stream_mkstemp(dir, stream->path);
+	if (stream->fd < 0) {
+		err = stream->fd;
+		free(stream->dir);
+		free(stream);
+		return err;
+	}
+
+	err = pthread_mutex_init(&stream->lock, NULL);
+	assert(err == 0); /* This shouldn't fail */
+	err = pthread_cond_init(&stream->cond, NULL);
+	assert(err == 0); /* This shouldn't fail */
+
+	*streamp = stream;
+
+	return 0;
+}
+
+static void
+stream_closeoutput(lazfs_stream_t *stream)
+{
+	if (stream->fd == -1)
+		return;
+
+	close(stream->fd);
+	unlink(stream->path);
+	stream->fd = -1;
+}
+
+/*
+ * Waits until encoder stops, fields it updates can be used afterwards. Must
+ * be called with stream locked. Encoder which didn't start is cancelled,
+ * waiting for it could deadlock when caller runs on the only free worker.
+ */
+static void
+stream_wait(lazfs_stream_t *stream)
+{
+	if (stream->job != NULL &&
+	    lazfs_workq_cancel(stream->workq, stream->job)) {
+		free(stream->job);
+		stream->job = NULL;
+		stream->encoding = 0;
+	}
+
+	stream->nwaiting++;
+	while (stream->encoding)
+		WAIT(stream->cond, stream->lock);
+	stream->nwaiting--;
+}
+
+void
+lazfs_stream_destroy(lazfs_stream_t **streamp)
+{
+	lazfs_stream_t *stream;
+	int err;
+
+	assert(streamp != NULL && *streamp != NULL);
+
+	stream = *streamp;
+
+	/* Encoder job refers to the stream */
+	LOCK(stream->lock);
+	stream_wait(stream);
+	UNLOCK(stream->lock);
+
+	stream_closeoutput(stream);
+	rangeset_clear(&stream->written);
+	lazfile_freechunks(&stream->chunks);
+	free(stream->entries);
+	free(stream->zipvlr);
+	free(stream->las);
+	free(stream->dir);
+
+	err = pthread_cond_destroy(&stream->cond);
+	assert(err == 0);
+	err = pthread_mutex_destroy(&stream->lock);
+	assert(err == 0);
+
+	free(stream);
+	*streamp = NULL;
+}
+
+/* Returns end of compressed points in lasfd */
+static inline off_t
+stream_compressedend(const lazfs_stream_t *stream)
+{
+	return (off_t) stream->hdr.data_offset +
+	       (off_t) stream->npoints * stream->hdr.record_length;
+}
+
+/* Moves compressed points in the output so they start at lazoffset */
+static int
+stream_move(lazfs_stream_t *stream, off_t lazoffset)
+{
+	char path[PATH_MAX];
+	off_t delta;
+	uint32_t i;
+	int fd, ret;
+
+	fd = stream_mkstemp(stream->dir, path);
+	if (fd < 0)
+		return fd;
+
+	ret = lazfs_copyrange(stream->fd, stream->lazoffset + 8, fd,
+			      lazoffset + 8,
+			      stream->chunks.starts[stream->chunks.nchunks] -
+			      (stream->lazoffset + 8));
+	if (ret != 0) {
+		close(fd);
+		unlink(path);
+		return ret;
+	}
+
+	delta = lazoffset - stream->lazoffset;
+	for (i = 0; i <= stream->chunks.nchunks; i++)
+		stream->chunks.starts[i] += delta;
+
+	stream_closeoutput(stream);
+	stream->fd = fd;
+	strcpy(stream->path, path);
+	stream->lazoffset = lazoffset;
+
+	return 0;
+}
+
+/*
+ * Writes header, VLRs and chunk table so output is valid .laz with
+ * compressed points. las is header and VLRs of lasfd whose points it holds.
+ */
+static int
+stream_writelaz(lazfs_stream_t *stream, const unsigned char *las,
+		const lasheader_t *hdr)
+{
+	unsigned char *prefix = NULL;
+	size_t len;
+	int ret;
+
+	ret = lazfile_makeprefix(las, hdr, stream->zipvlr, stream->zipsize,
+				 LAZFILE_FORMAT_COMPRESSED, &prefix, &len);
+	if (ret != 0)
+		return ret;
+
+	/* VLRs might have changed */
+	if (len != (size_t) stream->lazoffset) {
+		ret = stream_move(stream, len);
+		if (ret != 0)
+			goto cleanup;
+	}
+
+	if (pwrite(stream->fd, prefix, len, 0) != (ssize_t) len) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	ret = lazfile_writechunks(stream->fd, stream->lazoffset,
+				  &stream->chunks);
+
+cleanup:
+	free(prefix);
+
+	return ret;
+}
+
+/* Decompresses compressed points back to lasfd */
+static int
+stream_restore(lazfs_stream_t *stream)
+{
+	unsigned char *las;
+	lasheader_t hdr;
+	int rfd, ret;
+
+	if (stream->npoints == 0)
+		return 0;
+
+	/* Header of .laz with compressed points only */
+	las = malloc(stream->hdr.data_offset);
+	if (las == NULL)
+		return -ENOMEM;
+
+	memcpy(las, stream->las, stream->hdr.data_offset);
+	hdr = stream->hdr;
+	hdr.npoints = stream->npoints;
+	setle32(las + 107, stream->npoints);
+	if (hdr.header_size >= LASHEADER_MAXSIZE &&
+	    (hdr.version_major > 1 || hdr.version_minor >= 4))
+		setle64(las + 247, stream->npoints);
+
+	ret = stream_writelaz(stream, las, &hdr);
+	free(las);
+	if (ret != 0)
+		return ret;
+
+	rfd = lazfs_tmpfile();
+	if (rfd < 0)
+		return rfd;
+
+	ret = lazfs_decompress(stream->fd, rfd);
+	if (ret == 0)
+		ret = lasheader_read(rfd, &hdr);
+	if (ret == 0 && hdr.npoints != stream->npoints)
+		ret = -EINVAL;
+	if (ret == 0)
+		ret = lazfs_copyrange(rfd, hdr.data_offset, stream->lasfd,
+				      stream->hdr.data_offset,
+				      (off_t) stream->npoints *
+				      stream->hdr.record_length);
+
+	close(rfd);
+
+	return ret;
+}
+
+/*
+ * Stops streaming, lasfd must hold all points afterwards. Must be called
+ * with stream locked.
+ */
+static void
+stream_stop(lazfs_stream_t *stream, const char *reason)
+{
+	int ret;
+
+	stream_wait(stream);
+	if (stream->stopped)
+		return;
+
+	log_debug("stream: stopped: %s\n", reason);
+
+	ret = stream_restore(stream);
+	if (ret != 0) {
+		log_error("stream: restore of %llu points failed: %s\n",
+			  (unsigned long long) stream->npoints, strerror(-ret));
+		stream->lost = 1;
+	}
+
+	stream->stopped = 1;
+	stream_closeoutput(stream);
+}
+
+/* Appends chunk of size bytes with index entry to the chunk table */
+static int
+stream_addchunk(lazfs_stream_t *stream, uint32_t size,
+		const lazindex_chunk_t *entry)
+{
+	lazfile_chunks_t *chunks = &stream->chunks;
+	lazindex_chunk_t *entries;
+	uint32_t allocated;
+	off_t *starts;
+
+	if (chunks->nchunks + 1 >= stream->allocated) {
+		allocated = stream->allocated ? stream->allocated * 2 : 64;
+		starts = realloc(chunks->starts, allocated * sizeof(*starts));
+		if (starts == NULL)
+			return -ENOMEM;
+		chunks->starts = starts;
+		entries = realloc(stream->entries,
+				  allocated * sizeof(*entries));
+		if (entries == NULL)
+			return -ENOMEM;
+		stream->entries = entries;
+		stream->allocated = allocated;
+	}
+
+	stream->entries[chunks->nchunks] = *entry;
+
+	if (chunks->nchunks == 0)
+		chunks->starts[0] = stream->lazoffset + 8;
+	chunks->starts[chunks->nchunks + 1] = chunks->starts[chunks->nchunks] +
+					      size;
+	chunks->nchunks++;
+
+	return 0;
+}
+
+/*
+ * Compresses next count points of lasfd into a chunk. Caller is the encoder
+ * or it waited for the encoder to stop.
+ */
+static int
+stream_encode(lazfs_stream_t *stream, const unsigned char *las,
+	      const lasheader_t *hdr, uint32_t count)
+{
+	unsigned char *prefix = NULL;
+	lazindex_chunk_t entry;
+	uint32_t size;
+	size_t len;
+	off_t pos;
+	int tmpfd, ret;
+
+	/* Points are counted and indexed while they are still in page cache */
+	ret = lazindex_scanchunk(&entry, &stream->stats, stream->lasfd, hdr,
+				 stream->npoints, count);
+	if (ret != 0)
+		return ret;
+
+	if (stream->zipvlr == NULL) {
+		/* Position of the chunk depends on size of the laszip VLR */
+		tmpfd = lazfs_tmpfile();
+		if (tmpfd < 0)
+			return tmpfd;
+
+		ret = lazfile_encodechunk(stream->lasfd, las, hdr, 0, count,
+					  &stream->zipvlr, &stream->zipsize,
+					  tmpfd, 0, &size);
+		if (ret == 0)
+			ret = lazfile_makeprefix(las, hdr, stream->zipvlr,
+						 stream->zipsize,
+						 LAZFILE_FORMAT_COMPRESSED,
+						 &prefix, &len);
+		if (ret == 0) {
+			stream->lazoffset = len;
+			ret = lazfs_copyrange(tmpfd, 0, stream->fd, len + 8,
+					      size);
+		}
+
+		free(prefix);
+		close(tmpfd);
+		if (ret != 0) {
+			free(stream->zipvlr);
+			stream->zipvlr = NULL;
+		}
+	} else {
+		pos = stream->chunks.starts[stream->chunks.nchunks];
+		ret = lazfile_encodechunk(stream->lasfd, las, hdr,
+					  stream->npoints, count,
+					  &stream->zipvlr, &stream->zipsize,
+					  stream->fd, pos, &size);
+	}
+
+	if (ret == 0)
+		ret = stream_addchunk(stream, size, &entry);
+	if (ret != 0)
+		return ret;
+
+	/* Compressed points aren't needed in lasfd anymore */
+	fallocate(stream->lasfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  stream_compressedend(stream), (off_t) count * hdr->record_length);
+	stream->npoints += count;
+
+	return 0;
+}
+
+/* Returns non-zero if next complete chunk of points can be compressed */
+static inline int
+stream_chunkready(const lazfs_stream_t *stream)
+{
+	return stream->las != NULL && !stream->stopped &&
+	       stream->contiguous >= stream->claimed +
+				     (off_t) STREAM_CHUNK *
+				     stream->hdr.record_length;
+}
+
+/*
+ * Compresses complete chunks in the workq so writer doesn't wait for it. Only
+ * the chunk being compressed is touched without lock.
+ */
+static void
+stream_encodetask(void *arg)
+{
+	lazfs_stream_t *stream = arg;
+	int ret;
+
+	LOCK(stream->lock);
+	stream->job = NULL;
+
+	while (stream->nwaiting == 0 && stream_chunkready(stream)) {
+		stream->claimed += (off_t) STREAM_CHUNK *
+				   stream->hdr.record_length;
+		UNLOCK(stream->lock);
+
+		ret = stream_encode(stream, stream->las, &stream->hdr,
+				    STREAM_CHUNK);
+
+		LOCK(stream->lock);
+		/* Writer might wait for the backlog to shrink */
+		pthread_cond_broadcast(&stream->cond);
+		if (ret != 0) {
+			stream->encoding = 0;
+			stream_stop(stream, strerror(-ret));
+			break;
+		}
+	}
+
+	stream->encoding = 0;
+	pthread_cond_broadcast(&stream->cond);
+	UNLOCK(stream->lock);
+}
+
+void
+lazfs_stream_write(lazfs_stream_t *stream, off_t offset, off_t len)
+{
+	lazfs_workq_job_t *job;
+	int ret;
+
+	assert(stream != NULL);
+
+	LOCK(stream->lock);
+
+	if (stream->stopped)
+		goto unlock;
+
+	if (rangeset_add(&stream->written, offset, offset + len) != 0) {
+		stream_stop(stream, "out of memory");
+		goto unlock;
+	}
+
+	if (stream->written.nranges > 0 &&
+	    stream->written.ranges[0].start == 0)
+		stream->contiguous = stream->written.ranges[0].end;
+
+	if (stream->las == NULL) {
+		/* Wait for complete header and VLRs */
+		if (stream->contiguous < LASHEADER_MAXSIZE)
+			goto unlock;
+
+		ret = lasheader_read(stream->lasfd, &stream->hdr);
+		if (ret == 0 && stream->contiguous < stream->hdr.data_offset)
+			goto unlock;
+		if (ret == 0)
+			ret = lazfile_readprefix(stream->lasfd, &stream->hdr,
+						 &stream->las);
+		if (ret != 0 || stream->hdr.compressed) {
+			stream_stop(stream, "not a LAS file");
+			goto unlock;
+		}
+		stream->claimed = stream->hdr.data_offset;
+	}
+
+	if (!stream->encoding && stream_chunkready(stream)) {
+		job = malloc(sizeof(*job));
+		if (job == NULL) {
+			stream_stop(stream, "out of memory");
+			goto unlock;
+		}
+
+		memset(job, 0, sizeof(*job));
+		job->task = &stream_encodetask;
+		job->arg = stream;
+		stream->job = job;
+		stream->encoding = 1;
+		lazfs_workq_run(stream->workq, job);
+	}
+
+	/* Don't let writer outrun the encoder too much */
+	while (stream->encoding && !stream->stopped &&
+	       stream->contiguous - stream->claimed >
+	       (off_t) STREAM_BACKLOG * STREAM_CHUNK *
+	       stream->hdr.record_length)
+		WAIT(stream->cond, stream->lock);
+
+unlock:
+	UNLOCK(stream->lock);
+}
+
+void
+lazfs_stream_access(lazfs_stream_t *stream, off_t offset, off_t len)
+{
+	assert(stream != NULL);
+
+	LOCK(stream->lock);
+	if (!stream->stopped && stream->las != NULL &&
+	    offset < stream->claimed &&
+	    offset + len > stream->hdr.data_offset)
+		stream_stop(stream, "compressed points accessed");
+	UNLOCK(stream->lock);
+}
+
+void
+lazfs_stream_truncate(lazfs_stream_t *stream, off_t offset)
+{
+	assert(stream != NULL);
+
+	LOCK(stream->lock);
+	if (offset < rangeset_end(&stream->written))
+		stream_stop(stream, "truncated");
+	UNLOCK(stream->lock);
+}
+
+int
+lazfs_stream_finish(void *arg)
+{
+	lazfs_stream_t *stream = arg;
+	unsigned char *las = NULL;
+	struct stat statbuf;
+	lasheader_t hdr;
+	uint64_t count;
+	int ret = 1;
+
+	assert(stream != NULL);
+
+	LOCK(stream->lock);
+	stream_wait(stream);
+
+	if (stream->stopped)
+		goto unlock;
+
+	/* Final header, writers often rewrite it at the end */
+	if (stream->las == NULL ||
+	    lazfile_readprefix(stream->lasfd, &hdr, &las) != 0 ||
+	    fstat(stream->lasfd, &statbuf) != 0 ||
+	    hdr.compressed || hdr.data_offset != stream->hdr.data_offset ||
+	    hdr.point_format != stream->hdr.point_format ||
+	    hdr.record_length != stream->hdr.record_length ||
+	    hdr.npoints < stream->npoints || hdr.npoints == 0 ||
+	    statbuf.st_size != lasheader_lassize(&hdr)) {
+		stream_stop(stream, "header doesn't match points");
+		goto unlock;
+	}
+
+	while (stream->npoints < hdr.npoints) {
+		count = hdr.npoints - stream->npoints;
+		if (count > STREAM_CHUNK)
+			count = STREAM_CHUNK;
+
+		ret = stream_encode(stream, las, &hdr, count);
+		if (ret != 0) {
+			stream_stop(stream, strerror(-ret));
+			ret = 1;
+			goto unlock;
+		}
+	}
+
+	ret = stream_writelaz(stream, las, &hdr);
+	if (ret != 0) {
+		stream_stop(stream, strerror(-ret));
+		ret = 1;
+		goto unlock;
+	}
+
+	stream->finished = 1;
+
+unlock:
+	/* Streaming stopped but points couldn't be restored */
+	if (stream->lost)
+		ret = -EIO;
+	UNLOCK(stream->lock);
+	free(las);
+
+	return ret;
+}
+
+void
+lazfs_stream_output(lazfs_stream_t *stream, int *fdp, char *path)
+{
+	assert(stream != NULL && stream->finished);
+	assert(fdp != NULL);
+	assert(path != NULL);
+
+	*fdp = stream->fd;
+	strcpy(path, stream->path);
+	stream->fd = -1;
+}
+
+const pointstats_t *
+lazfs_stream_stats(const lazfs_stream_t *stream)
+{
+	assert(stream != NULL && stream->finished);
+
+	return &stream->stats;
+}
+
+const lazindex_chunk_t *
+lazfs_stream_index(const lazfs_stream_t *stream, uint32_t *np)
+{
+	assert(stream != NULL && stream->finished);
+	assert(np != NULL);
+
+	*np = stream->chunks.nchunks;
+
+	return stream->entries;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "lazindex.h"
+#include "pointstats.h"
+#include "workq.h"
+#include <sys/types.h>
+
+/*
+ * Streaming compression of newly created .las files. Points written
+ * sequentially are compressed into LAZ chunks as soon as a chunk is complete
+ * and removed from the decompressed file, so close has to compress only the
+ * last chunk.
+ */
+typedef struct lazfs_stream lazfs_stream_t;
+
+/*
+ * Creates stream which compresses decompressed file lasfd into new temporary
+ * file in directory dir. Chunks are compressed by jobs of workq. Returns 0 or
+ * -errno.
+ */
+int
+lazfs_stream_create(lazfs_stream_t **streamp, int lasfd, const char *dir,
+		    lazfs_workq_t *workq);
+
+/* Destroys stream, its temporary file is removed unless it was finished */
+void
+lazfs_stream_destroy(lazfs_stream_t **streamp);
+
+/*
+ * Must be called after len bytes were written to lasfd at offset. Chunks
+ * whose points were written completely are compressed in the background,
+ * writer waits only when too many of them are pending.
+ */
+void
+lazfs_stream_write(lazfs_stream_t *stream, off_t offset, off_t len);
+
+/*
+ * Must be called before lasfd is read or written. If compressed points are
+ * accessed, streaming stops and points are restored in lasfd.
+ */
+void
+lazfs_stream_access(lazfs_stream_t *stream, off_t offset, off_t len);
+
+/* Must be called before lasfd is truncated, streaming stops */
+void
+lazfs_stream_truncate(lazfs_stream_t *stream, off_t offset);
+
+/*
+ * Compresses remaining points and finishes the .laz, argument is the stream
+ * so it can be run via workq. Returns 0 on success, 1 if streaming stopped
+ * and lasfd must be compressed as usual or -errno.
+ */
+int
+lazfs_stream_finish(void *stream);
+
+/*
+ * Hands fd and path of the .laz finished by lazfs_stream_finish() over to
+ * caller which must close it and rename or unlink it.
+ */
+void
+lazfs_stream_output(lazfs_stream_t *stream, int *fdp, char *path);
+
+/* Returns statistics of all points of the .laz finished by the stream */
+const pointstats_t *
+lazfs_stream_stats(const lazfs_stream_t *stream);
+
+/*
+ * Returns index entries of chunks of the .laz finished by the stream for
+ * lazindex_merge(), their number is stored to *np.
+ */
+const lazindex_chunk_t *
+lazfs_stream_index(const lazfs_stream_t *stream, uint32_t *np);
+
+#endif
@@ -0,0 +1,632 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains demotion of cold files to the tier codec and their
+ * promotion back on access.
+ */
+
+#define _GNU_SOURCE /* O_NOATIME */
+
+#include "params.h"
+#include "log.h"
+#include "stats.h"
+#include "tier.h"
+#include "util.h"
+#include <assert.h>
+#include <attr/xattr.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of directory entries processed by one job */
+#define TIER_BATCH 64
+
+/* How long to wait when foreground jobs are running (ms) */
+#define TIER_BACKOFF 100
+
+/* Demoted file must save at least 1/TIER_MINGAIN of its size */
+#define TIER_MINGAIN 50
+
+typedef struct tier_dir tier_dir_t;
+struct tier_dir {
+	char *path;
+	STAILQ_ENTRY(tier_dir) link;
+};
+
+typedef struct tier {
+	char *rootdir;
+	lazfs_workq_t *workq;
+	laz_cache_t *cache;
+	const codec_rule_t *rule; /* Tier codec */
+	time_t cold; /* Files last used before are cold */
+	unsigned int iorate;
+	unsigned int cpu;
+	uint64_t nbytes; /* Bytes read and written so far, for throttling */
+	struct timespec start;
+
+	DIR *dp; /* Directory being read */
+	char *dpath;
+	STAILQ_HEAD(tier_dirs, tier_dir) dirs; /* Directories to visit */
+} tier_t;
+
+/* Non-zero while pass runs, only one pass runs at once */
+static int tier_running;
+
+static void
+tier_task(void *arg);
+
+/*
+ * Returns how long to wait so that pass doesn't exceed I/O budget and codec
+ * runs at most cpu percent of the time. Codec ran for busy ms.
+ */
+static long
+tier_throttle(tier_t *tier, long busy)
+{
+	long delay = 0, ahead;
+
+	if (tier->cpu < 100)
+		delay = busy * (100 - tier->cpu) / tier->cpu;
+
+	ahead = lazfs_throttle(&tier->start, tier->nbytes,
+			       (uint64_t) tier->iorate << 20);
+
+	return (ahead > delay) ? ahead : delay;
+}
+
+static int
+tier_pushdir(tier_t *tier, const char *path)
+{
+	tier_dir_t *dir;
+
+	dir = malloc(sizeof(*dir));
+	if (dir == NULL)
+		return -ENOMEM;
+
+	dir->path = strdup(path);
+	if (dir->path == NULL) {
+		free(dir);
+		return -ENOMEM;
+	}
+
+	STAILQ_INSERT_TAIL(&tier->dirs, dir, link);
+
+	return 0;
+}
+
+static void
+tier_destroy(tier_t *tier)
+{
+	tier_dir_t *dir;
+
+	while (!STAILQ_EMPTY(&tier->dirs)) {
+		dir = STAILQ_FIRST(&tier->dirs);
+		STAILQ_REMOVE_HEAD(&tier->dirs, link);
+		free(dir->path);
+		free(dir);
+	}
+
+	if (tier->dp != NULL)
+		closedir(tier->dp);
+	free(tier->dpath);
+	free(tier->rootdir);
+	free(tier);
+}
+
+/* Queues next job of the pass which starts after delay ms */
+static int
+tier_requeue(tier_t *tier, long delay)
+{
+	lazfs_workq_job_t *job;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL)
+		return -ENOMEM;
+
+	memset(job, 0, sizeof(*job));
+	job->task = &tier_task;
+	job->arg = tier;
+	job->lowprio = LAZFS_WORKQ_BACKGROUND;
+	lazfs_workq_runafter(tier->workq, job, delay);
+
+	return 0;
+}
+
+/*
+ * Gives new backend file newfd the same size, order and point statistics
+ * xattrs, owner, mode and times as st of sfd. Atime is set to now when atime
+ * is NULL.
+ */
+static int
+tier_copymeta(int sfd, int newfd, const struct stat *st,
+	      const struct timespec *atime)
+{
+	struct timespec times[2];
+	off_t size;
+	int ret;
+
+	if (fgetxattr(sfd, SIZEATTR, &size, sizeof(size)) == sizeof(size) &&
+	    fsetxattr(newfd, SIZEATTR, &size, sizeof(size), 0) != 0)
+		return -errno;
+
+	ret = lazfs_copyxattr(sfd, newfd, ORDERATTR);
+	if (ret == 0)
+		ret = lazfs_copyxattr(sfd, newfd, LODATTR);
+	if (ret == 0)
+		ret = lazfs_copyxattr(sfd, newfd, POINTSATTR);
+	if (ret != 0)
+		return ret;
+
+	/* Owner can't be changed by unprivileged daemon, it's not fatal */
+	if (fchown(newfd, st->st_uid, st->st_gid) != 0)
+		log_debug("    tier: fchown failed: %s\n", strerror(errno));
+
+	if (fchmod(newfd, st->st_mode & 07777) != 0)
+		return -errno;
+
+	if (atime != NULL) {
+		times[0] = *atime;
+	} else {
+		times[0].tv_sec = 0;
+		times[0].tv_nsec = UTIME_NOW;
+	}
+	times[1] = st->st_mtim;
+
+	return (futimens(newfd, times) == 0) ? 0 : -errno;
+}
+
+/* Returns non-zero if path is still the file described by st */
+static int
+tier_unchanged(const char *path, const struct stat *st)
+{
+	struct stat now;
+
+	return lstat(path, &now) == 0 && now.st_ino == st->st_ino &&
+	       now.st_dev == st->st_dev && now.st_size == st->st_size &&
+	       now.st_mtime == st->st_mtime && now.st_ctime == st->st_ctime;
+}
+
+/*
+ * Demotes backend file path of virtual file vpath if it's cold. Sets *tried
+ * when codec ran. Returns milliseconds spent in codec.
+ */
+static long
+tier_file(tier_t *tier, const char *path, const char *vpath, int *tried)
+{
+	const codec_rule_t *rule = tier->rule;
+	char tmppath[PATH_MAX];
+	struct stat st, newst;
+	struct timespec start;
+	long busy = 0;
+	int fd, newfd = -1, ret;
+	char busyfile;
+
+	*tried = 0;
+
+	/* Don't touch atime, it tells which files are cold */
+	fd = open(path, O_RDONLY | O_NOATIME);
+	if (fd == -1 && errno == EPERM)
+		fd = open(path, O_RDONLY);
+	if (fd == -1)
+		goto error;
+
+	/*
+	 * Hard links would be split by the rename. Size of tiered file can't
+	 * be read from its header, it must be in xattr.
+	 */
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+	    st.st_atime >= tier->cold || st.st_mtime >= tier->cold ||
+	    fgetxattr(fd, TIERATTR, NULL, 0) >= 0 ||
+	    fgetxattr(fd, SIZEATTR, NULL, 0) < 0)
+		goto cleanup;
+
+	cache_lock(tier->cache);
+	busyfile = cache_contains(tier->cache, vpath);
+	cache_unlock(tier->cache);
+	if (busyfile)
+		goto cleanup;
+
+	ret = snprintf(tmppath, PATH_MAX, "%s/lazfs.XXXXXX", tier->rootdir);
+	if (ret >= PATH_MAX)
+		goto error;
+
+	newfd = mkstemp(tmppath);
+	if (newfd == -1)
+		goto error;
+
+	log_debug("    tier: demoting \"%s\" by %s\n", path, rule->codec->name);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	*tried = 1;
+	ret = rule->codec->compress(rule, fd, newfd);
+	busy = lazfs_elapsed(&start);
+	if (ret != 0 || fstat(newfd, &newst) != 0)
+		goto error;
+	tier->nbytes += st.st_size + newst.st_size;
+
+	/* LAZ doesn't compress much, don't pay for decompression in vain */
+	if (newst.st_size > st.st_size - st.st_size / TIER_MINGAIN) {
+		log_debug("    tier: \"%s\" doesn't compress, skipped\n", path);
+		goto cleanup;
+	}
+
+	if (fsetxattr(newfd, TIERATTR, rule->codec->name,
+		      strlen(rule->codec->name), 0) != 0 ||
+	    fsetxattr(newfd, TIERSIZEATTR, &st.st_size, sizeof(st.st_size),
+		      0) != 0 ||
+	    tier_copymeta(fd, newfd, &st, &st.st_atim) != 0)
+		goto error;
+
+	/* Open holds the cache lock, so file can't be opened meanwhile */
+	cache_lock(tier->cache);
+	if (cache_contains(tier->cache, vpath) || !tier_unchanged(path, &st)) {
+		cache_unlock(tier->cache);
+		goto cleanup;
+	}
+	ret = rename(tmppath, path);
+	cache_unlock(tier->cache);
+	if (ret != 0)
+		goto error;
+
+	close(newfd);
+	close(fd);
+	stats_add(STATS_TIER_DEMOTED, 1);
+	stats_add(STATS_TIER_SAVED, st.st_size - newst.st_size);
+
+	return busy;
+
+error:
+	log_error("    ERROR tier: can't demote \"%s\"\n", path);
+	stats_add(STATS_TIER_ERRORS, 1);
+cleanup:
+	if (newfd != -1) {
+		unlink(tmppath);
+		close(newfd);
+	}
+	if (fd != -1)
+		close(fd);
+
+	return busy;
+}
+
+/* Returns next directory entry or NULL when there is nothing to process */
+static struct dirent *
+tier_nextentry(tier_t *tier)
+{
+	struct dirent *de;
+	tier_dir_t *dir;
+
+	while (1) {
+		while (tier->dp == NULL) {
+			if (STAILQ_EMPTY(&tier->dirs))
+				return NULL;
+
+			dir = STAILQ_FIRST(&tier->dirs);
+			STAILQ_REMOVE_HEAD(&tier->dirs, link);
+			tier->dpath = dir->path;
+			free(dir);
+
+			tier->dp = opendir(tier->dpath);
+			if (tier->dp == NULL) {
+				stats_add(STATS_TIER_ERRORS, 1);
+				free(tier->dpath);
+				tier->dpath = NULL;
+			}
+		}
+
+		de = readdir(tier->dp);
+		if (de != NULL)
+			return de;
+
+		closedir(tier->dp);
+		tier->dp = NULL;
+		free(tier->dpath);
+		tier->dpath = NULL;
+	}
+}
+
+static void
+tier_task(void *arg)
+{
+	tier_t *tier = (tier_t *) arg;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX], vname[PATH_MAX], vpath[PATH_MAX];
+	const codec_rule_t *rule;
+	long delay = 0;
+	int i, ret, tried;
+
+	/* Never compete with foreground decompression/compression */
+	if (lazfs_workq_busy(tier->workq)) {
+		delay = TIER_BACKOFF;
+		goto requeue;
+	}
+
+	for (i = 0; i < TIER_BATCH; i++) {
+		de = tier_nextentry(tier);
+		if (de == NULL)
+			goto finished;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		ret = snprintf(path, PATH_MAX, "%s/%s", tier->dpath, de->d_name);
+		if (ret >= PATH_MAX)
+			continue;
+
+		if (de->d_type == DT_UNKNOWN) {
+			if (lstat(path, &st) != 0)
+				continue;
+			de->d_type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+
+		if (de->d_type == DT_DIR) {
+			if (tier_pushdir(tier, path) != 0)
+				stats_add(STATS_TIER_ERRORS, 1);
+			continue;
+		}
+
+		if (de->d_type != DT_REG)
+			continue;
+		rule = codec_matchstored(de->d_name, vname);
+		if (rule == NULL || !(rule->codec->flags & CODEC_LAS))
+			continue;
+
+		/* Cache is keyed by path in the mount */
+		ret = snprintf(vpath, PATH_MAX, "%s/%s",
+			       tier->dpath + strlen(tier->rootdir), vname);
+		if (ret >= PATH_MAX)
+			continue;
+
+		/* One file per job, codec can run for long */
+		delay = tier_throttle(tier, tier_file(tier, path, vpath,
+						      &tried));
+		if (tried)
+			break;
+	}
+
+requeue:
+	if (tier_requeue(tier, delay) == 0)
+		return;
+
+	log_error("    ERROR tier: failed to requeue, stopping\n");
+
+finished:
+	log_debug("    tier: finished, %lld demoted, %lld bytes saved\n",
+		  (long long) stats_get(STATS_TIER_DEMOTED),
+		  (long long) stats_get(STATS_TIER_SAVED));
+	stats_add(STATS_TIER_RUNNING, -1);
+	tier_destroy(tier);
+	__sync_lock_release(&tier_running);
+}
+
+int
+lazfs_tier_start(const char *rootdir, lazfs_workq_t *workq,
+		 laz_cache_t *cache, unsigned int days, unsigned int iorate,
+		 unsigned int cpu)
+{
+	tier_t *tier;
+	int ret;
+
+	assert(rootdir != NULL);
+	assert(workq != NULL);
+	assert(cache != NULL);
+
+	if (codec_tier() == NULL || days == 0 || cpu == 0 || cpu > 100)
+		return -EINVAL;
+
+	if (__sync_lock_test_and_set(&tier_running, 1) != 0)
+		return -EBUSY;
+
+	tier = calloc(1, sizeof(*tier));
+	if (tier == NULL) {
+		__sync_lock_release(&tier_running);
+		return -ENOMEM;
+	}
+
+	tier->workq = workq;
+	tier->cache = cache;
+	tier->rule = codec_tier();
+	tier->cold = time(NULL) - (time_t) days * 24 * 3600;
+	tier->iorate = iorate;
+	tier->cpu = cpu;
+	STAILQ_INIT(&tier->dirs);
+	clock_gettime(CLOCK_MONOTONIC, &tier->start);
+
+	tier->rootdir = strdup(rootdir);
+	ret = (tier->rootdir != NULL) ? tier_pushdir(tier, rootdir) : -ENOMEM;
+	if (ret != 0)
+		goto cleanup;
+
+	stats_add(STATS_TIER_RUNNING, 1);
+	ret = tier_requeue(tier, 0);
+	if (ret != 0) {
+		stats_add(STATS_TIER_RUNNING, -1);
+		goto cleanup;
+	}
+
+	return 0;
+
+cleanup:
+	tier_destroy(tier);
+	__sync_lock_release(&tier_running);
+	return ret;
+}
+
+/*
+ * Sets *codecp to tier codec of backend file fd of cpath. Returns 1 if file
+ * is tiered, 0 if it isn't or -errno.
+ */
+static int
+tier_getcodec(const char *cpath, int fd, const codec_t **codecp)
+{
+	char name[PATH_MAX];
+	ssize_t len;
+
+	len = fgetxattr(fd, TIERATTR, name, sizeof(name) - 1);
+	if (len == -1)
+		return (errno == ENOATTR) ? 0 : -errno;
+	name[len] = '\0';
+
+	*codecp = codec_find(name);
+	if (*codecp == NULL) {
+		log_error("    ERROR tier: \"%s\" is stored by %s which isn't "
+			  "compiled in\n", cpath, name);
+		return -ENOTSUP;
+	}
+
+	return 1;
+}
+
+int
+lazfs_tier_prepare(const char *rootdir, const char *cpath,
+		   const codec_rule_t *rule, int fd, int tmpfd,
+		   lazfs_tierjob_t **jobp)
+{
+	const codec_t *codec;
+	lazfs_tierjob_t *tj;
+	int ret;
+
+	assert(jobp != NULL);
+
+	if (!(rule->codec->flags & CODEC_LAS))
+		return 0;
+
+	ret = tier_getcodec(cpath, fd, &codec);
+	if (ret <= 0)
+		return ret;
+
+	tj = malloc(sizeof(*tj));
+	if (tj == NULL)
+		return -ENOMEM;
+
+	tj->job.rule = rule;
+	tj->job.sfd = fd;
+	tj->job.dfd = tmpfd;
+	tj->codec = codec;
+	if (snprintf(tj->cpath, PATH_MAX, "%s", cpath) >= PATH_MAX ||
+	    snprintf(tj->tmppath, PATH_MAX, "%s/lazfs.XXXXXX",
+		     rootdir) >= PATH_MAX) {
+		free(tj);
+		return -ENAMETOOLONG;
+	}
+
+	*jobp = tj;
+
+	return 1;
+}
+
+/* Returns rule which decompresses files of tier codec, defrule is storage */
+static const codec_rule_t *
+tier_rule(const codec_t *codec, codec_rule_t *defrule)
+{
+	const codec_rule_t *tier;
+
+	/* Options matter for dictionaries, they are valid if codec is the same */
+	tier = codec_tier();
+	if (tier == NULL || tier->codec != codec) {
+		memset(defrule, 0, sizeof(*defrule));
+		defrule->codec = codec;
+		tier = defrule;
+	}
+
+	return tier;
+}
+
+/* Replaces tiered file by plain one, job.sfd is redirected to it */
+static int
+tier_restore(lazfs_tierjob_t *tj)
+{
+	const codec_rule_t *tier;
+	codec_rule_t defrule;
+	struct stat st;
+	int sfd = tj->job.sfd, newfd, ret;
+
+	tier = tier_rule(tj->codec, &defrule);
+
+	if (fstat(sfd, &st) != 0)
+		return -errno;
+
+	newfd = mkstemp(tj->tmppath);
+	if (newfd == -1)
+		return -errno;
+
+	log_debug("    tier: promoting \"%s\"\n", tj->cpath);
+	ret = tier->codec->decompress(tier, sfd, newfd);
+	if (ret == 0)
+		ret = tier_copymeta(sfd, newfd, &st, NULL);
+	if (ret == 0 && rename(tj->tmppath, tj->cpath) != 0)
+		ret = -errno;
+	if (ret != 0) {
+		unlink(tj->tmppath);
+		close(newfd);
+		return ret;
+	}
+
+	/* Cache entry keeps fd of the backend file */
+	if (dup2(newfd, sfd) == -1 || lseek(sfd, 0, SEEK_SET) == -1)
+		ret = -errno;
+	close(newfd);
+
+	return ret;
+}
+
+int
+lazfs_tier_promote(void *arg)
+{
+	lazfs_tierjob_t *tj = arg;
+	int ret;
+
+	ret = tier_restore(tj);
+	if (ret == 0) {
+		stats_add(STATS_TIER_PROMOTED, 1);
+		ret = codec_decompressjob(&tj->job);
+	} else {
+		log_error("    ERROR tier: can't promote \"%s\": %s\n",
+			  tj->cpath, strerror(-ret));
+		stats_add(STATS_TIER_ERRORS, 1);
+	}
+
+	free(tj);
+
+	return ret;
+}
+
+int
+lazfs_tier_expand(const char *cpath, int fd, int *fdp)
+{
+	const codec_rule_t *tier;
+	const codec_t *codec;
+	codec_rule_t defrule;
+	int newfd, ret;
+
+	assert(fdp != NULL);
+
+	ret = tier_getcodec(cpath, fd, &codec);
+	if (ret <= 0)
+		return ret;
+
+	newfd = lazfs_tmpfile();
+	if (newfd < 0)
+		return newfd;
+
+	tier = tier_rule(codec, &defrule);
+	ret = tier->codec->decompress(tier, fd, newfd);
+	if (ret == 0 && lseek(newfd, 0, SEEK_SET) == -1)
+		ret = -errno;
+	if (ret != 0) {
+		close(newfd);
+		return ret;
+	}
+
+	*fdp = newfd;
+
+	return 1;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _TIER_H_
+#define _TIER_H_
+
+#include "cache.h"
+#include "codec.h"
+#include "workq.h"
+#include <limits.h>
+
+/*
+ * Cold files of LAS codecs (i.e. .laz) are compressed once more by the tier
+ * codec (see codec_tier()) in place. Name of the tier codec is stored in
+ * TIERATTR xattr of such file. When tiered file is opened, it's restored to
+ * plain .laz before it's decompressed.
+ */
+
+/*
+ * Starts background pass over the backend directory which demotes files
+ * not accessed nor modified for days. Pass runs as a low priority workq job,
+ * reads and writes at most iorate MiB per second (zero means no limit) and
+ * compresses at most cpu percent of the time. Returns -EBUSY if pass is
+ * already running, 0 on success or -errno.
+ */
+int
+lazfs_tier_start(const char *rootdir, lazfs_workq_t *workq,
+		 laz_cache_t *cache, unsigned int days, unsigned int iorate,
+		 unsigned int cpu);
+
+/* Restoration of tiered file followed by its decompression */
+typedef struct lazfs_tierjob {
+	codec_job_t job;	/* Decompression of the restored file */
+	const codec_t *codec;	/* Tier codec of the file */
+	char cpath[PATH_MAX];	/* Backend file */
+	char tmppath[PATH_MAX];	/* Template of the restored file */
+} lazfs_tierjob_t;
+
+/*
+ * Checks whether backend file fd of cpath is tiered. If it is, returns 1 and
+ * allocates *jobp for lazfs_tier_promote() which replaces cpath by plain file
+ * and decompresses it by rule to tmpfd. Returns 0 if fd isn't tiered or
+ * -errno.
+ */
+int
+lazfs_tier_prepare(const char *rootdir, const char *cpath,
+		   const codec_rule_t *rule, int fd, int tmpfd,
+		   lazfs_tierjob_t **jobp);
+
+/*
+ * Job of lazfs_tier_prepare(), gets lazfs_tierjob_t and frees it. Job.sfd
+ * refers to the restored file afterwards.
+ */
+int
+lazfs_tier_promote(void *arg);
+
+/*
+ * Decompresses backend file fd of cpath into unlinked temporary file when
+ * it's tiered, so it can be read as plain .laz without promotion. Returns 1
+ * and sets *fdp if fd is tiered, 0 if it isn't or -errno.
+ */
+int
+lazfs_tier_expand(const char *cpath, int fd, int *fdp);
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains recorder of the binary trace of FUSE operations, see
+ * trace.h for the format. Records are collected in per-thread buffers and
+ * written when a buffer is full, when its thread exits and on unmount.
+ */
+
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Records buffered per thread */
+#define TRACE_BUFRECORDS 256
+
+/* Buckets of the path table */
+#define TRACE_HASHSIZE 4096
+
+typedef struct trace_buf {
+	pthread_mutex_t lock;
+	trace_record_t records[TRACE_BUFRECORDS];
+	unsigned int n;
+	uint16_t thread;
+	char inuse;	/* Owned by a thread, protected by trace_lock */
+	struct trace_buf *next;
+} trace_buf_t;
+
+typedef struct trace_path {
+	char *name;
+	uint32_t id;
+	struct trace_path *next;
+} trace_path_t;
+
+volatile int trace_enabled;
+
+/*
+ * trace_lock protects the file, path table and list of buffers. Buffers are
+ * reused by new threads when their thread exits and are never freed, so
+ * thread index is a slot of concurrently running FUSE threads.
+ */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int tracefd = -1;
+static uint64_t trace_start;
+static trace_buf_t *trace_bufs;
+static uint16_t trace_nbufs;
+static trace_path_t *trace_paths[TRACE_HASHSIZE];
+static uint32_t trace_npaths;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+/* Must be called with trace_lock held, errors are ignored */
+static void
+trace_write(const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+
+	while (tracefd != -1 && len > 0) {
+		ret = write(tracefd, p, len);
+		if (ret <= 0)
+			return;
+		p += ret;
+		len -= ret;
+	}
+}
+
+/* Must be called with buf->lock held */
+static void
+trace_flushbuf(trace_buf_t *buf)
+{
+	if (buf->n == 0)
+		return;
+
+	LOCK(trace_lock);
+	trace_write(buf->records, buf->n * sizeof(buf->records[0]));
+	UNLOCK(trace_lock);
+
+	buf->n = 0;
+}
+
+/* Thread exit, its buffer is flushed and can be taken by a new thread */
+static void
+trace_threadexit(void *arg)
+{
+	trace_buf_t *buf = arg;
+
+	LOCK(buf->lock);
+	trace_flushbuf(buf);
+	UNLOCK(buf->lock);
+
+	LOCK(trace_lock);
+	buf->inuse = 0;
+	UNLOCK(trace_lock);
+}
+
+static void
+trace_initkey(void)
+{
+	if (pthread_key_create(&trace_key, trace_threadexit) != 0)
+		abort();
+}
+
+/* Returns buffer of calling thread, NULL if it can't be allocated */
+static trace_buf_t *
+trace_buf(void)
+{
+	trace_buf_t *buf;
+
+	pthread_once(&trace_once, trace_initkey);
+
+	buf = pthread_getspecific(trace_key);
+	if (buf != NULL)
+		return buf;
+
+	LOCK(trace_lock);
+	for (buf = trace_bufs; buf != NULL && buf->inuse; buf = buf->next)
+		;
+	if (buf == NULL) {
+		buf = calloc(1, sizeof(*buf));
+		if (buf == NULL) {
+			UNLOCK(trace_lock);
+			return NULL;
+		}
+		pthread_mutex_init(&buf->lock, NULL);
+		buf->thread = trace_nbufs++;
+		buf->next = trace_bufs;
+		trace_bufs = buf;
+	}
+	buf->inuse = 1;
+	UNLOCK(trace_lock);
+
+	if (pthread_setspecific(trace_key, buf) != 0) {
+		LOCK(trace_lock);
+		buf->inuse = 0;
+		UNLOCK(trace_lock);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/* Returns id of the path, new paths are written to the trace */
+static uint32_t
+trace_pathid(const char *name)
+{
+	trace_record_t rec;
+	trace_path_t *p;
+	unsigned int hash = 2166136261U;
+	const char *c;
+	uint32_t id = 0;
+
+	if (name == NULL)
+		return 0;
+
+	for (c = name; *c != '\0'; c++)
+		hash = (hash ^ (unsigned char) *c) * 16777619U;
+	hash %= TRACE_HASHSIZE;
+
+	LOCK(trace_lock);
+	for (p = trace_paths[hash]; p != NULL; p = p->next) {
+		if (strcmp(p->name, name) == 0) {
+			id = p->id;
+			goto cleanup;
+		}
+	}
+
+	p = malloc(sizeof(*p));
+	if (p == NULL)
+		goto cleanup;
+	p->name = strdup(name);
+	if (p->name == NULL) {
+		free(p);
+		goto cleanup;
+	}
+	p->id = ++trace_npaths;
+	p->next = trace_paths[hash];
+	trace_paths[hash] = p;
+	id = p->id;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = TRACE_PATH;
+	rec.path = id;
+	rec.size = strlen(name);
+	trace_write(&rec, sizeof(rec));
+	trace_write(name, rec.size);
+
+cleanup:
+	UNLOCK(trace_lock);
+
+	return id;
+}
+
+int
+trace_open(const char *path)
+{
+	assert(path != NULL);
+	assert(tracefd == -1);
+
+	tracefd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tracefd == -1)
+		return -errno;
+
+	trace_write(TRACE_MAGIC, TRACE_MAGICLEN);
+	trace_start = stats_now();
+	trace_enabled = 1;
+
+	return 0;
+}
+
+void
+trace_record(int op, const char *path, uint64_t start, uint64_t duration,
+	     int ret, uint64_t fh, const trace_args_t *args)
+{
+	trace_record_t *rec;
+	trace_buf_t *buf;
+	uint32_t pathid, path2id;
+
+	assert(args != NULL);
+
+	buf = trace_buf();
+	if (buf == NULL)
+		return;
+
+	pathid = trace_pathid(path);
+	path2id = trace_pathid(args->path2);
+
+	LOCK(buf->lock);
+	rec = &buf->records[buf->n++];
+	memset(rec, 0, sizeof(*rec));
+	rec->type = TRACE_OP;
+	rec->op = op;
+	rec->time = (start > trace_start) ? start - trace_start : 0;
+	rec->duration = (duration > UINT32_MAX) ? UINT32_MAX : duration;
+	rec->offset = args->offset;
+	rec->size = args->size;
+	rec->fh = fh;
+	rec->path = pathid;
+	rec->path2 = path2id;
+	rec->flags = args->flags;
+	rec->mode = args->mode;
+	rec->ret = ret;
+	rec->thread = buf->thread;
+	if (buf->n == TRACE_BUFRECORDS)
+		trace_flushbuf(buf);
+	UNLOCK(buf->lock);
+}
+
+void
+trace_close(void)
+{
+	trace_buf_t *buf;
+	trace_path_t *p, *next;
+	int i;
+
+	if (!trace_enabled)
+		return;
+	trace_enabled = 0;
+
+	/* Buffers are never removed from the list so it can be walked */
+	LOCK(trace_lock);
+	buf = trace_bufs;
+	UNLOCK(trace_lock);
+
+	for (; buf != NULL; buf = buf->next) {
+		LOCK(buf->lock);
+		trace_flushbuf(buf);
+		UNLOCK(buf->lock);
+	}
+
+	LOCK(trace_lock);
+	close(tracefd);
+	tracefd = -1;
+
+	for (i = 0; i < TRACE_HASHSIZE; i++) {
+		for (p = trace_paths[i]; p != NULL; p = next) {
+			next = p->next;
+			free(p->name);
+			free(p);
+		}
+		trace_paths[i] = NULL;
+	}
+	UNLOCK(trace_lock);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Trace file starts with TRACE_MAGIC followed by records in host byte
+ * order. Every path (and xattr name) gets an id when it is seen for the
+ * first time, TRACE_PATH record with the id and the name is written before
+ * any TRACE_OP record refers to it. TRACE_OP records of different threads
+ * are not sorted by time.
+ */
+#define TRACE_MAGIC "LAZFSTR1"
+#define TRACE_MAGICLEN 8
+
+#define TRACE_OP 1
+#define TRACE_PATH 2
+
+typedef struct trace_record {
+	uint64_t time;		/* Start of the operation, ns since trace start */
+	uint64_t offset;	/* read/write/readdir offset, new size, uid */
+	uint64_t size;		/* read/write/xattr size, gid; length of path */
+	uint64_t fh;		/* fi->fh of the file, 0 if there is none */
+	uint32_t duration;	/* ns, saturated */
+	uint32_t path;		/* Path id, 0 is no path */
+	uint32_t path2;		/* Target of rename/link/symlink or xattr name */
+	uint32_t flags;		/* open/create flags, access mask, datasync */
+	uint32_t mode;		/* mode of mkdir/mknod/create/chmod */
+	int32_t ret;		/* Return value of the operation */
+	uint16_t thread;	/* Index of FUSE thread */
+	uint8_t type;		/* TRACE_OP or TRACE_PATH */
+	uint8_t op;		/* lazfs_hist_t of the operation */
+	uint32_t reserved;
+} trace_record_t;
+
+/* Arguments of an operation which are recorded */
+typedef struct trace_args {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t flags;
+	uint32_t mode;
+	const char *path2;
+} trace_args_t;
+
+/* Non-zero while trace is recorded */
+extern volatile int trace_enabled;
+
+/* Creates trace file, returns 0 or -errno */
+int
+trace_open(const char *path);
+
+/*
+ * Records operation op (lazfs_hist_t) which started at start (stats_now()).
+ * fh is fi->fh or 0.
+ */
+void
+trace_record(int op, const char *path, uint64_t start, uint64_t duration,
+	     int ret, uint64_t fh, const trace_args_t *args);
+
+/* Writes buffered records of all threads and closes the trace */
+void
+trace_close(void);
+
+#endif
@@ -9,45 +9,46 @@
 
 #include "params.h"
 #include "cache.h"
+#include "codec.h"
 #include "compress_laz.h"
-#include "compress_lrzip.h"
+#include "lasheader.h"
 #include "log.h"
+#include "stats.h"
 #include "util.h"
 #include <assert.h>
 #include <attr/xattr.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/fsuid.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-char
-lazfs_exec_hooks(const char *fpath, const char *suffix)
+const codec_rule_t *
+lazfs_exec_hooks(const char *fpath, char cpath[PATH_MAX])
 {
-	size_t len;
-	int ret;
-	const char *laz_suffix;
+	const codec_rule_t *rule;
 	struct stat stbuf;
-
-	assert(strlen(suffix) == 4);
+	int ret;
 
 	/* Don't exec hooks if requested file exists */
 	ret = lstat(fpath, &stbuf);
 	if (ret == 0)
-		return 0;
+		return NULL;
 
-	len = strlen(fpath);
-	if (len < 4)
-		return 0;
+	rule = codec_match(fpath);
+	if (rule == NULL)
+		return NULL;
 
-	laz_suffix = fpath + len - 4;
-	assert(laz_suffix >= fpath);
-	if (strncmp(laz_suffix, suffix, 4) == 0)
-		return 1;
+	if (cpath != NULL && codec_storedpath(rule, fpath, cpath) != 0)
+		return NULL;
 
-	return 0;
+	return rule;
 }
 
 /*
@@ -78,16 +79,146 @@ lazfs_error(const char *str)
 	return ret;
 }
 
+/* Accounts codec run which started at start, lasfd is the .las side */
+static void
+lazfs_codecstats(lazfs_hist_t hist, lazfs_stat_t points, lazfs_stat_t bytes,
+		 int lasfd, uint64_t start, int ret)
+{
+	lasheader_t hdr;
+
+	stats_record(hist, stats_now() - start, ret != 0);
+	if (ret != 0 || lasheader_read(lasfd, &hdr) != 0)
+		return;
+
+	stats_add(points, hdr.npoints);
+	stats_add(bytes, lasheader_lassize(&hdr));
+}
+
 int
 lazfs_decompress(int sfd, int dfd)
 {
-	return lazfs_laz_decompress(sfd, dfd);
+	uint64_t start = stats_now();
+	int ret;
+
+	ret = lazfs_laz_decompress(sfd, dfd);
+	lazfs_codecstats(STATS_DECOMPRESS, STATS_DECOMPRESS_POINTS,
+			 STATS_DECOMPRESS_BYTES, dfd, start, ret);
+
+	return ret;
 }
 
 int
 lazfs_compress(int sfd, int dfd)
 {
-	return lazfs_laz_compress(sfd, dfd);
+	uint64_t start = stats_now();
+	int ret;
+
+	ret = lazfs_laz_compress(sfd, dfd);
+	lazfs_codecstats(STATS_COMPRESS, STATS_COMPRESS_POINTS,
+			 STATS_COMPRESS_BYTES, sfd, start, ret);
+
+	return ret;
+}
+
+/* Buffer size used for file comparison and copying */
+#define LAZFS_COPYBUF (1024 * 1024)
+
+int
+lazfs_cmpfile(int sfd, int dfd)
+{
+	char *sbuf, *dbuf;
+	ssize_t slen, dlen;
+	off_t off = 0;
+	int ret = 0;
+
+	sbuf = malloc(2 * LAZFS_COPYBUF);
+	if (sbuf == NULL)
+		return -ENOMEM;
+	dbuf = sbuf + LAZFS_COPYBUF;
+
+	do {
+		slen = pread(sfd, sbuf, LAZFS_COPYBUF, off);
+		dlen = pread(dfd, dbuf, LAZFS_COPYBUF, off);
+		if (slen < 0 || dlen < 0) {
+			ret = -errno;
+			break;
+		}
+
+		if (slen != dlen || memcmp(sbuf, dbuf, slen) != 0) {
+			ret = 1;
+			break;
+		}
+		off += slen;
+	} while (slen > 0);
+
+	free(sbuf);
+
+	return ret;
+}
+
+int
+lazfs_copyrange(int sfd, off_t soff, int dfd, off_t doff, off_t len)
+{
+	char *buf;
+	ssize_t rlen = 0, wlen;
+	size_t count;
+	int ret = 0;
+
+	buf = malloc(LAZFS_COPYBUF);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	while (len != 0) {
+		count = (len < 0 || len > LAZFS_COPYBUF) ? LAZFS_COPYBUF : len;
+		rlen = pread(sfd, buf, count, soff);
+		if (rlen <= 0)
+			break;
+
+		wlen = pwrite(dfd, buf, rlen, doff);
+		if (wlen != rlen) {
+			ret = (wlen < 0) ? -errno : -EIO;
+			break;
+		}
+		soff += rlen;
+		doff += rlen;
+		if (len > 0)
+			len -= rlen;
+	}
+
+	if (rlen < 0)
+		ret = -errno;
+	else if (ret == 0 && len > 0)
+		ret = -EIO; /* Source is shorter than requested */
+
+	free(buf);
+
+	return ret;
+}
+
+int
+lazfs_clonefile(int sfd, int dfd)
+{
+#ifdef FICLONE
+	if (ioctl(dfd, FICLONE, sfd) == 0)
+		return 0;
+#endif
+
+	return lazfs_copyrange(sfd, 0, dfd, 0, -1);
+}
+
+int
+lazfs_tmpfile(void)
+{
+	char tmppath[] = "/tmp/lazfs.XXXXXX";
+	int fd;
+
+	fd = mkstemp(tmppath);
+	if (fd == -1)
+		return -errno;
+
+	unlink(tmppath);
+
+	return fd;
 }
 
 int
@@ -165,6 +296,30 @@ lazfs_finish_tmpfile(char *tmppath, int *fd, int *tmpfd)
 	assert(ret == 0); /* Ditto */
 }
 
+long
+lazfs_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+long
+lazfs_throttle(const struct timespec *start, uint64_t done, uint64_t rate)
+{
+	long ahead;
+
+	if (rate == 0)
+		return 0;
+
+	ahead = (long) (done * 1000 / rate) - lazfs_elapsed(start);
+
+	return (ahead > 0) ? ahead : 0;
+}
+
 void
 lazfs_setugid(lazfs_ugid_t *ugid)
 {
@@ -182,8 +337,6 @@ lazfs_restoreugid(const lazfs_ugid_t *ugid)
 	setfsgid(ugid->gid);
 }
 
-#define SIZEATTR "user.lazfssize"
-
 int
 lazfs_setsize(const char *path, off_t size)
 {
@@ -197,16 +350,55 @@ lazfs_setsize(const char *path, off_t size)
 }
 
 int
-lazfs_getsize(const char *path, off_t *size)
+lazfs_copyxattr(int sfd, int dfd, const char *name)
 {
-	int ret;
+	char *value;
+	ssize_t len;
+	int ret = 0;
 
-	ret = getxattr(path, SIZEATTR, size, sizeof(size));
-	if (ret == -1)
-		ret = lazfs_error("lazfs_getsize getxattr");
-	else
-		ret = 0;
+	len = fgetxattr(sfd, name, NULL, 0);
+	if (len == -1)
+		return (errno == ENOATTR) ? 0 : -errno;
+
+	value = malloc(len ? len : 1);
+	if (value == NULL)
+		return -ENOMEM;
+
+	len = fgetxattr(sfd, name, value, len);
+	if (len == -1 || fsetxattr(dfd, name, value, len, 0) != 0)
+		ret = -errno;
+	free(value);
 
 	return ret;
 }
 
+int
+lazfs_getsize(const char *path, const codec_rule_t *rule, off_t *size)
+{
+	int ret;
+
+	ret = getxattr(path, SIZEATTR, size, sizeof(*size));
+	if (ret != -1)
+		return 0;
+
+	if (errno != ENOATTR)
+		return lazfs_error("lazfs_getsize getxattr");
+
+	/*
+	 * Xattr is missing when file was copied to backend by tool which
+	 * doesn't preserve xattrs, ask the codec.
+	 */
+	ret = codec_probesize(rule, path, size);
+	if (ret != 0)
+		return ret;
+
+	/*
+	 * Repopulate xattr so next lookup is served from it. Failure isn't
+	 * fatal, size will be computed by codec again.
+	 */
+	log_debug("    lazfs_getsize: restoring size xattr of \"%s\"\n", path);
+	if (setxattr(path, SIZEATTR, size, sizeof(*size), 0) == -1)
+		log_debug("    lazfs_getsize: setxattr failed: %s\n", strerror(errno));
+
+	return 0;
+}
@@ -7,10 +7,13 @@
 
 #ifndef _UTIL_H_
 #define _UTIL_H_
+#include "codec.h"
 #include <limits.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 
 #define LOCK(mutex) \
 	do { \
@@ -34,24 +37,52 @@
 	} while (0)
 
 /*
- * Returns non-zero value if fpath should be handled specially (i.e.
- * decompressed to /tmp/ background file). Note that fpath _must_ be full path.
+ * Returns codec rule if fpath should be handled specially (i.e. decompressed
+ * to /tmp/ background file), NULL otherwise. Path of the compressed backend
+ * file is stored to cpath unless it's NULL. Note that fpath _must_ be full
+ * path.
  */
-char
-lazfs_exec_hooks(const char *fpath, const char *suffix);
+const codec_rule_t *
+lazfs_exec_hooks(const char *fpath, char cpath[PATH_MAX]);
 
 /* Returns full path of the file */
 void
 lazfs_fullpath(char fpath[PATH_MAX], const char *path);
 
-/* Decompresses file from source fd to destination fd */
+/* Decompresses .laz file from source fd to destination fd */
 int
 lazfs_decompress(int sfd, int dfd);
 
-/* Compresses file from source fd to destination fd */
+/* Compresses .las file from source fd to destination fd */
 int
 lazfs_compress(int sfd, int dfd);
 
+/*
+ * Compares content of two files. Returns 0 if they are equal, 1 if they
+ * differ or -errno. Has the same signature as lazfs_compress so it can be
+ * run via workq.
+ */
+int
+lazfs_cmpfile(int sfd, int dfd);
+
+/*
+ * Makes dfd copy of sfd. Shares extents (reflink) where filesystem supports
+ * it, copies data otherwise. Returns 0 on success or -errno.
+ */
+int
+lazfs_clonefile(int sfd, int dfd);
+
+/*
+ * Copies len bytes of sfd from soff into dfd at doff, len -1 copies up to the
+ * end of file. Returns 0 on success or -errno.
+ */
+int
+lazfs_copyrange(int sfd, off_t soff, int dfd, off_t doff, off_t len);
+
+/* Creates unlinked temporary file in /tmp. Returns fd or -errno */
+int
+lazfs_tmpfile(void);
+
 /*
  * Prepare background decompressed tmpfile
  * 1. Open compressed "path" and return it's fd in "fd"
@@ -74,6 +105,18 @@ lazfs_prepare_tmpfile(const char *path, char *tmppath, int flags, int mode, int
 void
 lazfs_finish_tmpfile(char *tmppath, int *fd, int *tmpfd);
 
+/* Returns milliseconds elapsed since start taken from CLOCK_MONOTONIC */
+long
+lazfs_elapsed(const struct timespec *start);
+
+/*
+ * Returns milliseconds background task, which began at start and processed
+ * done units since, must pause to stay at rate units per second. Zero rate
+ * means no limit.
+ */
+long
+lazfs_throttle(const struct timespec *start, uint64_t done, uint64_t rate);
+
 typedef struct {
 	uid_t	uid;
 	gid_t	gid;
@@ -86,10 +129,39 @@ lazfs_setugid(lazfs_ugid_t *ugid);
 void
 lazfs_restoreugid(const lazfs_ugid_t *ugid);
 
+/* Extended attribute of compressed file which holds decompressed size */
+#define SIZEATTR "user.lazfssize"
+
+/* Name of the tier codec of cold file, see tier.h */
+#define TIERATTR "user.lazfstier"
+
+/* Size of cold file before it was compressed by the tier codec */
+#define TIERSIZEATTR "user.lazfstiersize"
+
+/* Order of points of .laz compressed with reordering, see reorder.h */
+#define ORDERATTR "user.lazfsorder"
+
+/* Points per chunk of .laz in level of detail order, see reorder.h */
+#define LODATTR "user.lazfslod"
+
+/* Statistics of points of LAS files, see pointstats.h */
+#define POINTSATTR "user.lazfspoints"
+
+/*
+ * Copies xattr name of sfd to dfd, missing xattr isn't an error. Returns 0
+ * or -errno.
+ */
+int
+lazfs_copyxattr(int sfd, int dfd, const char *name);
+
 int
 lazfs_setsize(const char *path, off_t size);
 
+/*
+ * Gets decompressed size of compressed file from xattr. When xattr is
+ * missing, size is computed by codec and xattr is restored.
+ */
 int
-lazfs_getsize(const char *path, off_t *size);
+lazfs_getsize(const char *path, const codec_rule_t *rule, off_t *size);
 
 #endif
@@ -0,0 +1,716 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ *
+ * This file contains column views. Looking a view up is cheap, it reads only
+ * the header and chunk table of the .laz and makes sparse unlinked temporary
+ * file of the size of the column. Reads decompress only LAZ chunks which hold
+ * the points they touch, convert them into the column and keep the column
+ * while the backend file doesn't change, so sequential read or mmap() of the
+ * view costs one decompression of the file. Raw coordinates are gathered
+ * into blocks and scaled by loops which the compiler vectorizes.
+ */
+
+#define _GNU_SOURCE /* st_mtim */
+
+#include "params.h"
+#include "codec.h"
+#include "lazfile.h"
+#include "log.h"
+#include "stats.h"
+#include "tier.h"
+#include "util.h"
+#include "view.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+/* Number of views kept when no open file refers to them */
+#define VIEW_RESULTS 16
+
+/* Number of points converted at once */
+#define VIEW_BATCH 4096
+
+/* Points gathered into a column before they are scaled */
+#define VIEW_BLOCK 1024
+
+/* Width of the scaling kernel, four doubles fill AVX2 register */
+#define VIEW_LANES 4
+
+typedef enum {
+	VIEW_COORDS,
+	VIEW_INTENSITY,
+	VIEW_CLASS
+} view_column_t;
+
+typedef struct view_kind {
+	const char *suffix;
+	view_column_t column;
+	int axis; /* First coordinate of VIEW_COORDS */
+	int naxes; /* Number of interleaved coordinates */
+	unsigned int size; /* Bytes per point */
+} view_kind_t;
+
+static const view_kind_t kinds[] = {
+	{ ".xyz.f64", VIEW_COORDS, 0, 3, 3 * sizeof(double) },
+	{ ".x.f64", VIEW_COORDS, 0, 1, sizeof(double) },
+	{ ".y.f64", VIEW_COORDS, 1, 1, sizeof(double) },
+	{ ".z.f64", VIEW_COORDS, 2, 1, sizeof(double) },
+	{ ".intensity.u16", VIEW_INTENSITY, 0, 0, sizeof(uint16_t) },
+	{ ".classification.u8", VIEW_CLASS, 0, 0, sizeof(uint8_t) },
+	{ NULL, 0, 0, 0, 0 }
+};
+
+/* States of chunks of a view */
+#define VIEW_MISSING 0
+#define VIEW_BUSY 1 /* Being decompressed by a reader */
+#define VIEW_DONE 2
+
+typedef struct view view_t;
+struct view {
+	char *path; /* Virtual path */
+	const view_kind_t *kind;
+	struct stat cstat; /* Backend file the view is made of */
+	int fd; /* Unlinked temporary file with the column */
+	off_t size;
+	int lazfd; /* Compressed file, expanded when it's tiered */
+	unsigned char *laz; /* Header and VLRs of lazfd */
+	lasheader_t lazhdr;
+	lazfile_chunks_t chunks; /* Empty when lazfd is decompressed whole */
+	uint64_t chunk_size; /* Points per chunk */
+	uint32_t nchunks;
+	char *states; /* VIEW_MISSING, VIEW_BUSY or VIEW_DONE per chunk */
+	int refs; /* Open files and lookups in progress */
+	char ready; /* View is made, all fields are valid */
+	char detached; /* Not in views, freed by the last reference */
+	pthread_cond_t cond; /* Signalled when view or its chunk gets ready */
+	TAILQ_ENTRY(view) link;
+};
+
+/* Views, most recently used first, protected by lock */
+static TAILQ_HEAD(view_views, view) views = TAILQ_HEAD_INITIALIZER(views);
+static unsigned int nviews;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Splits view path into path of the LAS file and kind of the column. Returns
+ * 0 or -ENOENT if path isn't a view.
+ */
+static int
+view_parse(const char *path, char vpath[PATH_MAX], const view_kind_t **kindp)
+{
+	const view_kind_t *kind;
+	const char *name;
+	size_t len, slen;
+
+	name = strrchr(path, '/');
+	name = (name != NULL) ? name + 1 : path;
+	len = strlen(path);
+
+	for (kind = kinds; kind->suffix != NULL; kind++) {
+		slen = strlen(kind->suffix);
+		if (len - (name - path) <= slen ||
+		    strcmp(path + len - slen, kind->suffix) != 0)
+			continue;
+		if (len - slen >= PATH_MAX)
+			return -ENOENT;
+
+		memcpy(vpath, path, len - slen);
+		vpath[len - slen] = '\0';
+		if (kindp != NULL)
+			*kindp = kind;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+int
+view_lookup(const char *path)
+{
+	const codec_rule_t *rule;
+	char vpath[PATH_MAX];
+
+	if (view_parse(path, vpath, NULL) != 0)
+		return 0;
+
+	rule = codec_match(vpath);
+
+	return rule != NULL && (rule->codec->flags & CODEC_LAS);
+}
+
+/*
+ * Scales n raw coordinates into out. Points are processed in VIEW_LANES
+ * independent lanes, the inner loop maps to vector conversion, multiply and
+ * add.
+ */
+static void
+view_scale(const int32_t *raw, size_t n, double scale, double offset,
+	   double *out)
+{
+	size_t i, k;
+
+	for (i = 0; i + VIEW_LANES <= n; i += VIEW_LANES) {
+		for (k = 0; k < VIEW_LANES; k++)
+			out[i + k] = raw[i + k] * scale + offset;
+	}
+
+	for (; i < n; i++)
+		out[i] = raw[i] * scale + offset;
+}
+
+/* Converts n points of buf, records of LAS file with header hdr, into out */
+static void
+view_coords(const view_kind_t *kind, const lasheader_t *hdr,
+	    const unsigned char *buf, uint64_t n, double *out)
+{
+	int32_t raw[VIEW_BLOCK];
+	double col[VIEW_BLOCK];
+	const unsigned char *p;
+	uint16_t reclen = hdr->record_length;
+	uint64_t done, m, j;
+	int axis, k;
+
+	for (done = 0; done < n; done += m) {
+		m = n - done;
+		if (m > VIEW_BLOCK)
+			m = VIEW_BLOCK;
+		p = buf + done * reclen;
+
+		for (k = 0; k < kind->naxes; k++) {
+			axis = kind->axis + k;
+			for (j = 0; j < m; j++)
+				raw[j] = (int32_t) le32(p + j * reclen +
+							4 * axis);
+
+			/* Single coordinate is scaled in place */
+			if (kind->naxes == 1) {
+				view_scale(raw, m, hdr->scale[axis],
+					   hdr->offset[axis], out + done);
+				continue;
+			}
+
+			view_scale(raw, m, hdr->scale[axis], hdr->offset[axis],
+				   col);
+			for (j = 0; j < m; j++)
+				out[(done + j) * kind->naxes + k] = col[j];
+		}
+	}
+}
+
+static void
+view_column(const view_kind_t *kind, const lasheader_t *hdr,
+	    const unsigned char *buf, uint64_t n, unsigned char *out)
+{
+	uint16_t reclen = hdr->record_length, *out16;
+	unsigned int coff, cmask;
+	uint64_t j;
+
+	switch (kind->column) {
+	case VIEW_COORDS:
+		view_coords(kind, hdr, buf, n, (double *) out);
+		break;
+	case VIEW_INTENSITY:
+		out16 = (uint16_t *) out;
+		for (j = 0; j < n; j++)
+			out16[j] = le16(buf + j * reclen + 12);
+		break;
+	case VIEW_CLASS:
+		/* Formats 6 and later have whole byte after the flags */
+		coff = (hdr->point_format < 6) ? 15 : 16;
+		cmask = (hdr->point_format < 6) ? 0x1f : 0xff;
+		for (j = 0; j < n; j++)
+			out[j] = buf[j * reclen + coff] & cmask;
+		break;
+	}
+}
+
+/* Returns non-zero if records of hdr hold the column of kind */
+static int
+view_fits(const view_kind_t *kind, const lasheader_t *hdr)
+{
+	switch (kind->column) {
+	case VIEW_COORDS:
+		return hdr->record_length >= 12;
+	case VIEW_INTENSITY:
+		return hdr->record_length >= 14;
+	case VIEW_CLASS:
+		return hdr->record_length > ((hdr->point_format < 6) ? 15 : 16);
+	}
+
+	return 0;
+}
+
+/* Writes column of count points of lasfd starting at point first into v */
+static int
+view_convert(view_t *v, int lasfd, uint64_t first, uint64_t count)
+{
+	unsigned char *buf = NULL, *out = NULL;
+	unsigned int size = v->kind->size;
+	lasheader_t hdr;
+	uint64_t done, n;
+	ssize_t len;
+	int ret;
+
+	ret = lasheader_read(lasfd, &hdr);
+	if (ret != 0)
+		return ret;
+
+	if (hdr.npoints != count || !view_fits(v->kind, &hdr))
+		return -EINVAL;
+
+	buf = malloc((size_t) VIEW_BATCH * hdr.record_length);
+	out = malloc((size_t) VIEW_BATCH * size);
+	if (buf == NULL || out == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	for (done = 0; done < count; done += n) {
+		n = count - done;
+		if (n > VIEW_BATCH)
+			n = VIEW_BATCH;
+
+		len = pread(lasfd, buf, n * hdr.record_length,
+			    hdr.data_offset + done * hdr.record_length);
+		if (len < 0) {
+			ret = -errno;
+			goto cleanup;
+		}
+		if ((uint64_t) len != n * hdr.record_length) {
+			ret = -EINVAL;
+			goto cleanup;
+		}
+
+		view_column(v->kind, &hdr, buf, n, out);
+
+		if (pwrite(v->fd, out, n * size, (first + done) * size) !=
+		    (ssize_t) (n * size)) {
+			ret = -errno;
+			goto cleanup;
+		}
+	}
+
+cleanup:
+	free(out);
+	free(buf);
+
+	return ret;
+}
+
+/* Decompresses chunk i of v and writes its column */
+static int
+view_decode(view_t *v, uint32_t i)
+{
+	uint64_t first, count;
+	int lasfd, ret;
+
+	first = (uint64_t) i * v->chunk_size;
+	count = v->lazhdr.npoints - first;
+	if (count > v->chunk_size)
+		count = v->chunk_size;
+
+	lasfd = lazfs_tmpfile();
+	if (lasfd < 0)
+		return lasfd;
+
+	if (v->chunks.nchunks == 0) {
+		/* Only one reader decodes the only chunk, offset is its own */
+		if (lseek(v->lazfd, 0, SEEK_SET) == -1)
+			ret = -errno;
+		else
+			ret = lazfs_decompress(v->lazfd, lasfd);
+	} else
+		ret = lazfile_decodechunk(v->lazfd, v->laz, &v->lazhdr,
+					  &v->chunks, i, count, lasfd);
+	if (ret == 0)
+		ret = view_convert(v, lasfd, first, count);
+
+	close(lasfd);
+	stats_add(STATS_VIEW_CHUNKS, 1);
+
+	return ret;
+}
+
+/*
+ * Makes sure chunks first - last of v are in its column, decodes missing ones
+ * and waits for chunks decoded by other readers. Returns 0 or -errno.
+ */
+static int
+view_fetch(view_t *v, uint32_t first, uint32_t last)
+{
+	uint32_t i;
+	int ret;
+
+	for (i = first; i <= last; i++) {
+		LOCK(lock);
+		while (v->states[i] == VIEW_BUSY)
+			WAIT(v->cond, lock);
+		if (v->states[i] == VIEW_DONE) {
+			UNLOCK(lock);
+			continue;
+		}
+		v->states[i] = VIEW_BUSY;
+		UNLOCK(lock);
+
+		ret = view_decode(v, i);
+		if (ret != 0)
+			log_error("view_fetch: chunk %u of \"%s\": %s\n", i,
+				  v->path, strerror(-ret));
+
+		/* Failed chunk is tried again by the next read */
+		LOCK(lock);
+		v->states[i] = (ret == 0) ? VIEW_DONE : VIEW_MISSING;
+		pthread_cond_broadcast(&v->cond);
+		UNLOCK(lock);
+
+		if (ret != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens .laz cpath for view v and makes its empty column. Returns 0 or
+ * -errno, v is freed by view_free() in both cases.
+ */
+static int
+view_make(view_t *v, const char *cpath)
+{
+	lazfile_laszip_t zip;
+	int fd, ret;
+
+	fd = open(cpath, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	/* Cold file is decompressed aside, it stays tiered */
+	ret = lazfs_tier_expand(cpath, fd, &v->lazfd);
+	if (ret < 0)
+		goto cleanup;
+	if (ret == 0)
+		v->lazfd = dup(fd);
+	if (v->lazfd == -1) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	ret = lazfile_readprefix(v->lazfd, &v->lazhdr, &v->laz);
+	if (ret != 0)
+		goto cleanup;
+
+	if (!view_fits(v->kind, &v->lazhdr)) {
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	/* Files without chunk table are decompressed whole by the first read */
+	if (lazfile_findlaszip(v->laz, &v->lazhdr, &zip) != 0 ||
+	    lazfile_readchunks(v->lazfd, &zip, v->lazhdr.data_offset,
+			       &v->chunks) != 0 ||
+	    (uint64_t) v->chunks.nchunks * zip.chunk_size <
+	    v->lazhdr.npoints) {
+		lazfile_freechunks(&v->chunks);
+		v->chunk_size = v->lazhdr.npoints;
+		v->nchunks = (v->lazhdr.npoints != 0) ? 1 : 0;
+	} else {
+		v->chunk_size = zip.chunk_size;
+		v->nchunks = v->chunks.nchunks;
+	}
+
+	v->states = calloc(v->nchunks + 1, 1);
+	if (v->states == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	v->fd = lazfs_tmpfile();
+	if (v->fd < 0) {
+		ret = v->fd;
+		v->fd = -1;
+		goto cleanup;
+	}
+
+	v->size = v->lazhdr.npoints * v->kind->size;
+	if (ftruncate(v->fd, v->size) != 0)
+		ret = -errno;
+
+cleanup:
+	close(fd);
+
+	return ret;
+}
+
+static void
+view_free(view_t *v)
+{
+	if (v->fd != -1)
+		close(v->fd);
+	if (v->lazfd != -1)
+		close(v->lazfd);
+	lazfile_freechunks(&v->chunks);
+	free(v->states);
+	free(v->laz);
+	pthread_cond_destroy(&v->cond);
+	free(v->path);
+	free(v);
+}
+
+/* Removes view from views, it's freed when unused. Lock must be held */
+static void
+view_detach(view_t *v)
+{
+	TAILQ_REMOVE(&views, v, link);
+	nviews--;
+
+	if (v->refs == 0)
+		view_free(v);
+	else
+		v->detached = 1;
+}
+
+/* Drops reference and unused views over limit. Lock must be held */
+static void
+view_unref(view_t *v)
+{
+	view_t *prev;
+
+	assert(v->refs > 0);
+
+	if (--v->refs == 0 && v->detached)
+		view_free(v);
+
+	for (v = TAILQ_LAST(&views, view_views);
+	     v != NULL && nviews > VIEW_RESULTS; v = prev) {
+		prev = TAILQ_PREV(v, view_views, link);
+		if (v->refs == 0)
+			view_detach(v);
+	}
+}
+
+/* Returns non-zero if backend file is the one view was made of */
+static int
+view_unchanged(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	       a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Returns referenced view of path in *viewp, makes it if there is no valid
+ * one. Returns 0 or -errno.
+ */
+static int
+view_get(const char *path, view_t **viewp)
+{
+	char vpath[PATH_MAX], fpath[PATH_MAX], cpath[PATH_MAX];
+	const codec_rule_t *rule;
+	const view_kind_t *kind;
+	struct stat st;
+	view_t *v;
+	int ret;
+
+	if (view_parse(path, vpath, &kind) != 0)
+		return -ENOENT;
+
+	lazfs_fullpath(fpath, vpath);
+	rule = lazfs_exec_hooks(fpath, cpath);
+	if (rule == NULL || !(rule->codec->flags & CODEC_LAS))
+		return -ENOENT;
+
+	if (stat(cpath, &st) != 0)
+		return -errno;
+
+	LOCK(lock);
+again:
+	TAILQ_FOREACH(v, &views, link) {
+		if (strcmp(v->path, path) == 0)
+			break;
+	}
+
+	if (v != NULL && !v->ready) {
+		/* Somebody is making it, it might be stale once ready */
+		v->refs++;
+		while (!v->ready)
+			WAIT(v->cond, lock);
+		view_unref(v);
+		goto again;
+	}
+
+	if (v != NULL && view_unchanged(&v->cstat, &st)) {
+		v->refs++;
+		TAILQ_REMOVE(&views, v, link);
+		TAILQ_INSERT_HEAD(&views, v, link);
+		UNLOCK(lock);
+		*viewp = v;
+		return 0;
+	}
+
+	if (v != NULL)
+		view_detach(v);
+
+	v = calloc(1, sizeof(*v));
+	if (v == NULL || (v->path = strdup(path)) == NULL) {
+		free(v);
+		UNLOCK(lock);
+		return -ENOMEM;
+	}
+	v->kind = kind;
+	v->cstat = st;
+	v->fd = -1;
+	v->lazfd = -1;
+	v->refs = 1;
+	pthread_cond_init(&v->cond, NULL);
+	TAILQ_INSERT_HEAD(&views, v, link);
+	nviews++;
+	UNLOCK(lock);
+
+	log_debug("view_get: making \"%s\"\n", path);
+	ret = view_make(v, cpath);
+	if (ret != 0)
+		log_error("view_get: \"%s\": %s\n", path, strerror(-ret));
+
+	LOCK(lock);
+	v->ready = 1;
+	pthread_cond_broadcast(&v->cond);
+	if (ret != 0) {
+		view_detach(v);
+		view_unref(v);
+	} else
+		*viewp = v;
+	UNLOCK(lock);
+
+	return ret;
+}
+
+static void
+view_put(view_t *v)
+{
+	LOCK(lock);
+	view_unref(v);
+	UNLOCK(lock);
+}
+
+static void
+view_stat(const view_t *v, struct stat *statbuf)
+{
+	*statbuf = v->cstat;
+	statbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	statbuf->st_nlink = 1;
+	statbuf->st_size = v->size;
+	statbuf->st_blocks = (v->size + 511) / 512;
+}
+
+int
+view_getattr(const char *path, struct stat *statbuf)
+{
+	view_t *v;
+	int ret;
+
+	assert(statbuf != NULL);
+
+	ret = view_get(path, &v);
+	if (ret != 0)
+		return ret;
+
+	view_stat(v, statbuf);
+	view_put(v);
+
+	return 0;
+}
+
+int
+view_fgetattr(struct fuse_file_info *fi, struct stat *statbuf)
+{
+	assert(statbuf != NULL);
+
+	view_stat((view_t *) (uintptr_t) fi->fh, statbuf);
+
+	return 0;
+}
+
+int
+view_access(const char *path, int mask)
+{
+	char vpath[PATH_MAX], fpath[PATH_MAX], cpath[PATH_MAX];
+
+	if (mask & W_OK)
+		return -EACCES;
+
+	if (view_parse(path, vpath, NULL) != 0)
+		return -ENOENT;
+
+	lazfs_fullpath(fpath, vpath);
+	if (lazfs_exec_hooks(fpath, cpath) == NULL)
+		return -ENOENT;
+
+	return (access(cpath, mask) == 0) ? 0 : -errno;
+}
+
+int
+view_open(const char *path, struct fuse_file_info *fi)
+{
+	view_t *v;
+	int ret;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	ret = view_get(path, &v);
+	if (ret != 0)
+		return ret;
+
+	fi->fh = (uintptr_t) v;
+
+	return 0;
+}
+
+int
+view_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset)
+{
+	view_t *v = (view_t *) (uintptr_t) fi->fh;
+	uint64_t first, last;
+	ssize_t ret;
+
+	if (offset >= v->size || size == 0)
+		return 0;
+	if ((off_t) size > v->size - offset)
+		size = v->size - offset;
+
+	/* Points touched by the read, then chunks which hold them */
+	first = offset / v->kind->size;
+	last = (offset + size - 1) / v->kind->size;
+	ret = view_fetch(v, first / v->chunk_size, last / v->chunk_size);
+	if (ret != 0)
+		return ret;
+
+	ret = pread(v->fd, buf, size, offset);
+
+	return (ret < 0) ? -errno : ret;
+}
+
+int
+view_release(struct fuse_file_info *fi)
+{
+	view_put((view_t *) (uintptr_t) fi->fh);
+
+	return 0;
+}
+
+void
+view_destroy(void)
+{
+	LOCK(lock);
+	while (!TAILQ_EMPTY(&views))
+		view_detach(TAILQ_FIRST(&views));
+	UNLOCK(lock);
+}
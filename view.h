@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2013 Adam Tkac <vonsch@gmail.com>
+ *
+ * This program can be distributed under the terms of the GNU GPLv3.
+ * See the file COPYING.
+ */
+
+#ifndef _VIEW_H_
+#define _VIEW_H_
+
+#include "params.h"
+#include <sys/stat.h>
+
+/*
+ * Virtual read-only file "tile.las.COLUMN" is a dense array of one column of
+ * all points of LAS file "tile.las", in native byte order and without any
+ * header, so it can be mmap()ed directly. Columns are:
+ *
+ *   .xyz.f64             X, Y and Z of every point as three doubles
+ *   .x.f64 .y.f64 .z.f64 one coordinate as double
+ *   .intensity.u16       intensity as 16bit unsigned integer
+ *   .classification.u8   classification as byte
+ *
+ * Coordinates are scaled by the header of the LAS file. Only LAS codecs are
+ * supported, the file is not listed by readdir.
+ */
+
+/* Returns non-zero if path is a view */
+int
+view_lookup(const char *path);
+
+/*
+ * Functions below implement FUSE operations of views, they return 0 or
+ * -errno. Open view is kept in fi->fh.
+ */
+int
+view_getattr(const char *path, struct stat *statbuf);
+
+int
+view_fgetattr(struct fuse_file_info *fi, struct stat *statbuf);
+
+int
+view_access(const char *path, int mask);
+
+int
+view_open(const char *path, struct fuse_file_info *fi);
+
+/* Returns number of bytes read */
+int
+view_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset);
+
+int
+view_release(struct fuse_file_info *fi);
+
+/* Frees kept views, all views must be released */
+void
+view_destroy(void);
+
+#endif
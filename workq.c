@@ -5,6 +5,8 @@
  * See the file COPYING.
  */
 
+#include "probes.h"
+#include "stats.h"
 #include "util.h"
 #include "workq.h"
 #include <assert.h>
@@ -12,37 +14,188 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <sys/queue.h>
+#include <time.h>
+
+/* Number of low priority lanes, lane of a job is its lowprio less one */
+#define WORKQ_NLANES 2
+
+typedef struct workq_lane {
+	STAILQ_HEAD(jobs_t, lazfs_workq_job) jobs;
+	int nrunning; /* Number of workers executing a job of the lane */
+	int limit; /* Maximum of jobs of the lane running at once */
+} workq_lane_t;
 
 struct lazfs_workq {
 	pthread_mutex_t lock;
 	pthread_t *workers;
 	int nworkers;
-	STAILQ_HEAD(jobs_t, lazfs_workq_job) jobs;
+	int nrunning; /* Number of workers executing a job */
+	int nlowrunning; /* Number of workers executing a low priority job */
+	struct jobs_t jobs;
+	workq_lane_t lanes[WORKQ_NLANES];
+	struct jobs_t delayed; /* Sorted by due */
 	pthread_cond_t cond;
 };
 
+/* Returns lane of low priority job */
+static inline workq_lane_t *
+workq_lane(lazfs_workq_t *workq, const lazfs_workq_job_t *job)
+{
+	assert(job->lowprio >= 1 && job->lowprio <= WORKQ_NLANES);
+
+	return &workq->lanes[job->lowprio - 1];
+}
+
+/* Must be called with workq locked, returns non-zero if job was in list */
+static int
+workq_remove(struct jobs_t *list, lazfs_workq_job_t *job)
+{
+	lazfs_workq_job_t *j;
+
+	STAILQ_FOREACH(j, list, link) {
+		if (j == job) {
+			STAILQ_REMOVE(list, job, lazfs_workq_job, link);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Must be called with workq locked */
+static void
+workq_enqueue(lazfs_workq_t *workq, lazfs_workq_job_t *job)
+{
+	if (job->lowprio)
+		STAILQ_INSERT_TAIL(&workq_lane(workq, job)->jobs, job, link);
+	else
+		STAILQ_INSERT_TAIL(&workq->jobs, job, link);
+}
+
+/* Must be called with workq locked */
+static lazfs_workq_job_t *
+workq_nextjob(lazfs_workq_t *workq)
+{
+	lazfs_workq_job_t *job;
+	workq_lane_t *lane;
+	uint64_t now;
+	int i;
+
+	if (!STAILQ_EMPTY(&workq->delayed)) {
+		now = stats_now();
+		while ((job = STAILQ_FIRST(&workq->delayed)) != NULL &&
+		       job->due <= now) {
+			STAILQ_REMOVE_HEAD(&workq->delayed, link);
+			workq_enqueue(workq, job);
+		}
+	}
+
+	if (!STAILQ_EMPTY(&workq->jobs)) {
+		job = STAILQ_FIRST(&workq->jobs);
+		STAILQ_REMOVE_HEAD(&workq->jobs, link);
+		return job;
+	}
+
+	/* Last worker is kept for regular jobs */
+	if (workq->nworkers > 1 && workq->nlowrunning >= workq->nworkers - 1)
+		return NULL;
+
+	/* Prefetch lane goes first, somebody is about to open its files */
+	for (i = WORKQ_NLANES - 1; i >= 0; i--) {
+		lane = &workq->lanes[i];
+		if (!STAILQ_EMPTY(&lane->jobs) && lane->nrunning < lane->limit) {
+			job = STAILQ_FIRST(&lane->jobs);
+			STAILQ_REMOVE_HEAD(&lane->jobs, link);
+			lane->nrunning++;
+			workq->nlowrunning++;
+			return job;
+		}
+	}
+
+	return NULL;
+}
+
 static void*
 worker_thread(void *arg)
 {
 	lazfs_workq_t *workq = (lazfs_workq_t *) arg;
 	lazfs_workq_job_t *job;
+	workq_lane_t *lane;
+	struct timespec ts;
+	uint64_t start, due;
+	int err, i, ret = 0;
 
 	while (1) {
 		LOCK(workq->lock);
 
-		while (STAILQ_EMPTY(&workq->jobs)) {
-			WAIT(workq->cond, workq->lock);
+		while ((job = workq_nextjob(workq)) == NULL) {
+			if (STAILQ_EMPTY(&workq->delayed)) {
+				WAIT(workq->cond, workq->lock);
+				continue;
+			}
+
+			/* Wake up when the first delayed job is due */
+			due = STAILQ_FIRST(&workq->delayed)->due;
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			err = pthread_cond_timedwait(&workq->cond, &workq->lock,
+						     &ts);
+			assert(err == 0 || err == ETIMEDOUT);
 		}
 
-		job = STAILQ_FIRST(&workq->jobs);
-		STAILQ_REMOVE_HEAD(&workq->jobs, link);
+		workq->nrunning++;
 		UNLOCK(workq->lock);
 
-		*job->ret = job->routine(job->sfd, job->dfd);
-		*job->complete = 1;
-		pthread_cond_broadcast(job->signal);
+		start = stats_now();
+		stats_record(STATS_WORKQ_WAIT, start - job->queued, 0);
+		stats_add(STATS_WORKQ_QUEUED, -1);
+		stats_add(STATS_WORKQ_RUNNING, 1);
+		LAZFS_PROBE2(workq__job__start, job, start - job->queued);
+
+		/* Lane is decided now, boost can't move running job */
+		lane = job->lowprio ? workq_lane(workq, job) : NULL;
+		if (job->task != NULL) {
+			job->task(job->arg);
+		} else {
+			if (job->call != NULL)
+				ret = job->call(job->arg);
+			else
+				ret = job->routine(job->sfd, job->dfd);
+			/*
+			 * Waiter checks complete under the lock, without it
+			 * the broadcast could come between its check and wait.
+			 */
+			if (job->lock != NULL)
+				LOCK(*job->lock);
+			*job->ret = ret;
+			*job->complete = 1;
+			pthread_cond_broadcast(job->signal);
+			if (job->lock != NULL)
+				UNLOCK(*job->lock);
+		}
+		LAZFS_PROBE2(workq__job__done, job, ret);
 		free(job);
 		job = NULL;
+
+		stats_record(STATS_WORKQ_RUN, stats_now() - start, ret < 0);
+		stats_add(STATS_WORKQ_RUNNING, -1);
+		stats_add(STATS_WORKQ_COMPLETED, 1);
+		ret = 0;
+
+		LOCK(workq->lock);
+		workq->nrunning--;
+		if (lane != NULL) {
+			lane->nrunning--;
+			workq->nlowrunning--;
+			/* Job of any lane might wait for this slot */
+			for (i = 0; i < WORKQ_NLANES; i++) {
+				if (!STAILQ_EMPTY(&workq->lanes[i].jobs)) {
+					pthread_cond_signal(&workq->cond);
+					break;
+				}
+			}
+		}
+		UNLOCK(workq->lock);
 	}
 
 	return NULL;
@@ -52,6 +205,7 @@ int
 lazfs_workq_create(lazfs_workq_t **workqp, int threads)
 {
 	lazfs_workq_t *workq = NULL;
+	pthread_condattr_t attr;
 	int err, i;
 
 	assert(workqp != NULL && *workqp == NULL);
@@ -71,10 +225,21 @@ lazfs_workq_create(lazfs_workq_t **workqp, int threads)
 
 	err = pthread_mutex_init(&workq->lock, NULL);
 	assert(err == 0); /* This shouldn't fail */
-	err = pthread_cond_init(&workq->cond, NULL);
+	/* Due times of delayed jobs come from stats_now() */
+	err = pthread_condattr_init(&attr);
+	assert(err == 0); /* This shouldn't fail */
+	err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
 	assert(err == 0); /* This shouldn't fail */
+	err = pthread_cond_init(&workq->cond, &attr);
+	assert(err == 0); /* This shouldn't fail */
+	pthread_condattr_destroy(&attr);
 
 	STAILQ_INIT(&workq->jobs);
+	for (i = 0; i < WORKQ_NLANES; i++) {
+		STAILQ_INIT(&workq->lanes[i].jobs);
+		workq->lanes[i].limit = 1;
+	}
+	STAILQ_INIT(&workq->delayed);
 
 	for (i = 0; i < threads; i++) {
 		err = pthread_create(&workq->workers[i], NULL, &worker_thread, workq);
@@ -103,6 +268,9 @@ lazfs_workq_destroy(lazfs_workq_t **workqp)
 	workq = *workqp;
 
 	assert(STAILQ_EMPTY(&workq->jobs));
+	for (i = 0; i < WORKQ_NLANES; i++)
+		assert(STAILQ_EMPTY(&workq->lanes[i].jobs));
+	assert(STAILQ_EMPTY(&workq->delayed));
 
 	for (i = 0; i < workq->nworkers; i++) {
 		err = pthread_cancel(workq->workers[i]);
@@ -125,11 +293,144 @@ lazfs_workq_run(lazfs_workq_t *workq, lazfs_workq_job_t *job)
 	assert(workq != NULL);
 	assert(job != NULL);
 
+	job->queued = stats_now();
+	stats_add(STATS_WORKQ_QUEUED, 1);
+	LAZFS_PROBE2(workq__queue, job, job->lowprio);
+
 	LOCK(workq->lock);
-	STAILQ_INSERT_TAIL(&workq->jobs, job, link);
+	workq_enqueue(workq, job);
 
 	err = pthread_cond_signal(&workq->cond);
 	UNLOCK(workq->lock);
 	assert(err == 0);
 }
 
+void
+lazfs_workq_runafter(lazfs_workq_t *workq, lazfs_workq_job_t *job, long ms)
+{
+	lazfs_workq_job_t *j, *prev = NULL;
+	int err;
+
+	assert(workq != NULL);
+	assert(job != NULL);
+
+	if (ms <= 0) {
+		lazfs_workq_run(workq, job);
+		return;
+	}
+
+	/* Queue wait is measured from the due time */
+	job->due = stats_now() + (uint64_t) ms * 1000000;
+	job->queued = job->due;
+	stats_add(STATS_WORKQ_QUEUED, 1);
+	LAZFS_PROBE2(workq__queue, job, job->lowprio);
+
+	LOCK(workq->lock);
+	STAILQ_FOREACH(j, &workq->delayed, link) {
+		if (j->due > job->due)
+			break;
+		prev = j;
+	}
+	if (prev == NULL)
+		STAILQ_INSERT_HEAD(&workq->delayed, job, link);
+	else
+		STAILQ_INSERT_AFTER(&workq->delayed, prev, job, link);
+
+	/* Waiting workers might sleep past the new due time */
+	err = pthread_cond_broadcast(&workq->cond);
+	UNLOCK(workq->lock);
+	assert(err == 0);
+}
+
+void
+lazfs_workq_setlimit(lazfs_workq_t *workq, char lane, int limit)
+{
+	assert(workq != NULL);
+	assert(lane >= 1 && lane <= WORKQ_NLANES);
+
+	if (limit > workq->nworkers - 1)
+		limit = workq->nworkers - 1;
+	if (limit < 1)
+		limit = 1;
+
+	LOCK(workq->lock);
+	workq->lanes[lane - 1].limit = limit;
+	/* Queued jobs of the lane might start now */
+	pthread_cond_broadcast(&workq->cond);
+	UNLOCK(workq->lock);
+}
+
+void
+lazfs_workq_boost(lazfs_workq_t *workq, lazfs_workq_job_t *job)
+{
+	assert(workq != NULL);
+	assert(job != NULL);
+
+	LOCK(workq->lock);
+	if (job->lowprio &&
+	    workq_remove(&workq_lane(workq, job)->jobs, job)) {
+		job->lowprio = 0;
+		STAILQ_INSERT_TAIL(&workq->jobs, job, link);
+		pthread_cond_signal(&workq->cond);
+	}
+	UNLOCK(workq->lock);
+}
+
+int
+lazfs_workq_cancel(lazfs_workq_t *workq, lazfs_workq_job_t *job)
+{
+	int found;
+
+	assert(workq != NULL);
+	assert(job != NULL);
+
+	LOCK(workq->lock);
+	found = workq_remove(&workq->jobs, job) ||
+		(job->lowprio &&
+		 workq_remove(&workq_lane(workq, job)->jobs, job)) ||
+		workq_remove(&workq->delayed, job);
+	UNLOCK(workq->lock);
+
+	if (found)
+		stats_add(STATS_WORKQ_QUEUED, -1);
+
+	return found;
+}
+
+int
+lazfs_workq_busy(lazfs_workq_t *workq)
+{
+	int busy;
+
+	assert(workq != NULL);
+
+	LOCK(workq->lock);
+	busy = !STAILQ_EMPTY(&workq->jobs) ||
+	       workq->nrunning > workq->nlowrunning;
+	UNLOCK(workq->lock);
+
+	return busy;
+}
+
+void
+lazfs_workq_info(lazfs_workq_t *workq, int *nworkers, int *nrunning,
+		 int *nqueued)
+{
+	lazfs_workq_job_t *job;
+	int i, n = 0;
+
+	assert(workq != NULL);
+
+	LOCK(workq->lock);
+	STAILQ_FOREACH(job, &workq->jobs, link)
+		n++;
+	for (i = 0; i < WORKQ_NLANES; i++)
+		STAILQ_FOREACH(job, &workq->lanes[i].jobs, link)
+			n++;
+	STAILQ_FOREACH(job, &workq->delayed, link)
+		n++;
+	*nworkers = workq->nworkers;
+	*nrunning = workq->nrunning;
+	*nqueued = n;
+	UNLOCK(workq->lock);
+}
@@ -8,6 +8,7 @@
 #ifndef _WORKQ_H_
 #define _WORKQ_H_
 #include <pthread.h>
+#include <stdint.h>
 #include <sys/queue.h>
 
 typedef struct lazfs_workq lazfs_workq_t;
@@ -16,13 +17,32 @@ typedef struct lazfs_workq_job {
 	int (*routine)(int sfd, int dfd);
 	int sfd;
 	int dfd;
+	/* Executed instead of routine when set, gets arg */
+	int (*call)(void *arg);
 	int *ret;
 	char *complete;
 	pthread_cond_t *signal;
+	/* Held while complete is set and signal broadcast when set */
+	pthread_mutex_t *lock;
+	/* Generic task, executed instead of routine when set. No completion. */
+	void (*task)(void *arg);
+	void *arg; /* Argument of call or task */
+	char lowprio; /* Lane, job runs only when no regular job is pending */
+	uint64_t queued; /* Time when job was queued, set by workq */
+	uint64_t due; /* Job doesn't start before, set by workq */
 	STAILQ_ENTRY(lazfs_workq_job) link;
 } lazfs_workq_job_t;
 
-#define LAZFS_WORKQ_JOB_INIT { NULL, -1, -1, NULL, NULL, NULL }
+/*
+ * Lanes of low priority jobs, values of lowprio. Every lane runs at most its
+ * limit of jobs at once, so background passes and prefetch don't wait for
+ * each other.
+ */
+#define LAZFS_WORKQ_BACKGROUND 1 /* Scan and tier passes, one job at once */
+#define LAZFS_WORKQ_PREFETCH 2 /* Prefetch, see lazfs_workq_setlimit() */
+
+#define LAZFS_WORKQ_JOB_INIT \
+	{ NULL, -1, -1, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0 }
 
 int
 lazfs_workq_create(lazfs_workq_t **workqp, int threads);
@@ -33,4 +53,47 @@ lazfs_workq_destroy(lazfs_workq_t **workqp);
 void
 lazfs_workq_run(lazfs_workq_t *workq, lazfs_workq_job_t *job);
 
+/*
+ * Queues job which starts ms milliseconds later at the earliest. Background
+ * tasks use it to pause without blocking a worker.
+ */
+void
+lazfs_workq_runafter(lazfs_workq_t *workq, lazfs_workq_job_t *job, long ms);
+
+/*
+ * Sets how many jobs of low priority lane can run at once, limit is kept
+ * between one and number of workers less one. All lanes together also run
+ * at most number of workers less one jobs, so a worker stays free for
+ * regular jobs if there are more workers.
+ */
+void
+lazfs_workq_setlimit(lazfs_workq_t *workq, char lane, int limit);
+
+/*
+ * Moves job queued as low priority among regular jobs because somebody waits
+ * for it. Nothing happens when the job already runs, job must not be freed,
+ * i.e. it must not be complete.
+ */
+void
+lazfs_workq_boost(lazfs_workq_t *workq, lazfs_workq_job_t *job);
+
+/*
+ * Removes job which didn't start yet from the queue. Returns non-zero if it
+ * was removed, caller frees it then. Zero means job already runs or ran.
+ */
+int
+lazfs_workq_cancel(lazfs_workq_t *workq, lazfs_workq_job_t *job);
+
+/*
+ * Returns non-zero if regular (not low priority) jobs are queued or running.
+ * Background tasks use it to back off while foreground work is in progress.
+ */
+int
+lazfs_workq_busy(lazfs_workq_t *workq);
+
+/* Returns number of workers, running jobs and queued jobs */
+void
+lazfs_workq_info(lazfs_workq_t *workq, int *nworkers, int *nrunning,
+		 int *nqueued);
+
 #endif